@@ -11,6 +11,7 @@
 
 #include "CoreTypes.hpp"
 #include "QirContext.hpp"
+#include "QirRuntimeApi_I.hpp"
 #include "QirTypes.hpp"
 #include "QirRuntime.hpp"
 
@@ -56,10 +57,7 @@ QirArray::QirArray(int64_t qubits_count)
     if (this->count > 0)
     {
         QUBIT** qbuffer = new QUBIT*[count];
-        for (long i = 0; i < count; i++)
-        {
-            qbuffer[i] = quantum__rt__qubit_allocate();
-        }
+        GlobalContext()->GetDriver()->AllocateQubits(count, qbuffer);
         this->buffer = reinterpret_cast<char*>(qbuffer);
     }
     else
@@ -222,10 +220,9 @@ extern "C"
         assert(qa->ownsQubits);
         if (qa->ownsQubits)
         {
-            QUBIT** qubits = reinterpret_cast<QUBIT**>(qa->buffer);
-            for (long i = 0; i < qa->count; i++)
+            if (qa->count > 0)
             {
-                quantum__rt__qubit_release(qubits[i]);
+                GlobalContext()->GetDriver()->ReleaseQubits(qa->count, reinterpret_cast<QUBIT**>(qa->buffer));
             }
 
             qa->ownsQubits = false;
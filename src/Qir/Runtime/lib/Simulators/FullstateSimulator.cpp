@@ -209,6 +209,30 @@ namespace Quantum
             releaseQubit(this->simulatorId, GetQubitId(q));
         }
 
+        void AllocateQubits(long count, Qubit qubits[]) override
+        {
+            typedef void (*TAllocateQubits)(unsigned, unsigned, unsigned*);
+            static TAllocateQubits allocateQubits =
+                reinterpret_cast<TAllocateQubits>(this->GetProc("allocateQubits"));
+
+            std::vector<unsigned> ids(count);
+            for (long i = 0; i < count; i++)
+            {
+                ids[i] = this->nextQubitId++;
+                qubits[i] = reinterpret_cast<Qubit>(ids[i]);
+            }
+            allocateQubits(this->simulatorId, static_cast<unsigned>(count), ids.data());
+        }
+
+        void ReleaseQubits(long count, Qubit qubits[]) override
+        {
+            typedef void (*TReleaseQubits)(unsigned, unsigned, unsigned*);
+            static TReleaseQubits releaseQubits = reinterpret_cast<TReleaseQubits>(this->GetProc("releaseQubits"));
+
+            std::vector<unsigned> ids = GetQubitIds(count, qubits);
+            releaseQubits(this->simulatorId, static_cast<unsigned>(count), ids.data());
+        }
+
         Result Measure(long numBases, PauliId bases[], long numTargets, Qubit targets[]) override
         {
             assert(numBases == numTargets);
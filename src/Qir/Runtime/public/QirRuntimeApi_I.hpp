@@ -22,6 +22,23 @@ namespace Quantum
         virtual Qubit AllocateQubit() = 0;
         virtual void ReleaseQubit(Qubit qubit) = 0;
 
+        // Allocate/release `count` qubits at once. Drivers that can resize their state in a single step should override
+        // these, the defaults fall back to one qubit at a time.
+        virtual void AllocateQubits(long count, Qubit qubits[])
+        {
+            for (long i = 0; i < count; i++)
+            {
+                qubits[i] = AllocateQubit();
+            }
+        }
+        virtual void ReleaseQubits(long count, Qubit qubits[])
+        {
+            for (long i = 0; i < count; i++)
+            {
+                ReleaseQubit(qubits[i]);
+            }
+        }
+
         virtual void ReleaseResult(Result result) = 0;
         virtual bool AreEqualResults(Result r1, Result r2) = 0;
         virtual ResultValue GetResultValue(Result result) = 0;
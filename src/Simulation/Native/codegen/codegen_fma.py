@@ -108,7 +108,7 @@ def generate_kernel_core(N, n, kernelarray, blocks, only_one_matrix, unroll_loop
               add.append("store(")
             for i in range(avx_len):
               if avx_len > 1:
-                add.append("(double*)&")
+                add.append("&")
               add.append("psi[" + indices[avx_len*r+avx_len-i-1] + "], ")
             if avx_len == 1:
               add[-1] = add[-1][:-2] + " = "
@@ -131,7 +131,7 @@ def generate_kernel_core(N, n, kernelarray, blocks, only_one_matrix, unroll_loop
             add.append("store(")
           for i in range(avx_len):
             if avx_len > 1:
-              add.append("(double*)&")
+              add.append("&")
             add.append("psi[" + indices[avx_len*r+avx_len-i-1] + "], ")
           if avx_len == 1:
             add[-1] = add[-1][:-2] + " = "
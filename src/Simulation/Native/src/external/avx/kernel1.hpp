@@ -14,7 +14,7 @@ inline void kernel_core(V& psi, std::size_t I, std::size_t d0, M const& m, M con
 	v[0] = load1(&psi[I + d0]);
 
 	tmp[0] = fma(v[0], m[1], mt[1], tmp[0]);
-	store((double*)&psi[I + d0], (double*)&psi[I], tmp[0]);
+	store(&psi[I + d0], &psi[I], tmp[0]);
 
 }
 
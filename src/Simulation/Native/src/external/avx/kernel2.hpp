@@ -26,8 +26,8 @@ inline void kernel_core(V& psi, std::size_t I, std::size_t d0, std::size_t d1, M
 
 	tmp[0] = fma(v[0], m[6], mt[6], tmp[0]);
 	tmp[1] = fma(v[0], m[7], mt[7], tmp[1]);
-	store((double*)&psi[I + d0], (double*)&psi[I], tmp[0]);
-	store((double*)&psi[I + d0 + d1], (double*)&psi[I + d1], tmp[1]);
+	store(&psi[I + d0], &psi[I], tmp[0]);
+	store(&psi[I + d0 + d1], &psi[I + d1], tmp[1]);
 
 }
 
@@ -178,18 +178,18 @@ inline void kernel_core(V& psi, std::size_t I, std::size_t d0, std::size_t d1, s
 	tmp[1] = fma(v[0], m[121], mt[121], tmp[1]);
 	tmp[2] = fma(v[0], m[122], mt[122], tmp[2]);
 	tmp[3] = fma(v[0], m[123], mt[123], tmp[3]);
-	store((double*)&psi[I + d0], (double*)&psi[I], tmp[0]);
-	store((double*)&psi[I + d0 + d1], (double*)&psi[I + d1], tmp[1]);
-	store((double*)&psi[I + d0 + d2], (double*)&psi[I + d2], tmp[2]);
-	store((double*)&psi[I + d0 + d1 + d2], (double*)&psi[I + d1 + d2], tmp[3]);
+	store(&psi[I + d0], &psi[I], tmp[0]);
+	store(&psi[I + d0 + d1], &psi[I + d1], tmp[1]);
+	store(&psi[I + d0 + d2], &psi[I + d2], tmp[2]);
+	store(&psi[I + d0 + d1 + d2], &psi[I + d1 + d2], tmp[3]);
 	tmp[4] = fma(v[0], m[124], mt[124], tmp[4]);
 	tmp[5] = fma(v[0], m[125], mt[125], tmp[5]);
 	tmp[6] = fma(v[0], m[126], mt[126], tmp[6]);
 	tmp[7] = fma(v[0], m[127], mt[127], tmp[7]);
-	store((double*)&psi[I + d0 + d3], (double*)&psi[I + d3], tmp[4]);
-	store((double*)&psi[I + d0 + d1 + d3], (double*)&psi[I + d1 + d3], tmp[5]);
-	store((double*)&psi[I + d0 + d2 + d3], (double*)&psi[I + d2 + d3], tmp[6]);
-	store((double*)&psi[I + d0 + d1 + d2 + d3], (double*)&psi[I + d1 + d2 + d3], tmp[7]);
+	store(&psi[I + d0 + d3], &psi[I + d3], tmp[4]);
+	store(&psi[I + d0 + d1 + d3], &psi[I + d1 + d3], tmp[5]);
+	store(&psi[I + d0 + d2 + d3], &psi[I + d2 + d3], tmp[6]);
+	store(&psi[I + d0 + d1 + d2 + d3], &psi[I + d1 + d2 + d3], tmp[7]);
 
 }
 
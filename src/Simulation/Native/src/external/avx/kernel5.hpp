@@ -314,34 +314,34 @@ inline void kernel_core(V& psi, std::size_t I, std::size_t d0, std::size_t d1, s
 	tmp[1] = fma(v[0], m[482], mt[482], fma(v[1], m[483], mt[483], tmp[1]));
 	tmp[2] = fma(v[0], m[484], mt[484], fma(v[1], m[485], mt[485], tmp[2]));
 	tmp[3] = fma(v[0], m[486], mt[486], fma(v[1], m[487], mt[487], tmp[3]));
-	store((double*)&psi[I + d0], (double*)&psi[I], tmp[0]);
-	store((double*)&psi[I + d0 + d1], (double*)&psi[I + d1], tmp[1]);
-	store((double*)&psi[I + d0 + d2], (double*)&psi[I + d2], tmp[2]);
-	store((double*)&psi[I + d0 + d1 + d2], (double*)&psi[I + d1 + d2], tmp[3]);
+	store(&psi[I + d0], &psi[I], tmp[0]);
+	store(&psi[I + d0 + d1], &psi[I + d1], tmp[1]);
+	store(&psi[I + d0 + d2], &psi[I + d2], tmp[2]);
+	store(&psi[I + d0 + d1 + d2], &psi[I + d1 + d2], tmp[3]);
 	tmp[4] = fma(v[0], m[488], mt[488], fma(v[1], m[489], mt[489], tmp[4]));
 	tmp[5] = fma(v[0], m[490], mt[490], fma(v[1], m[491], mt[491], tmp[5]));
 	tmp[6] = fma(v[0], m[492], mt[492], fma(v[1], m[493], mt[493], tmp[6]));
 	tmp[7] = fma(v[0], m[494], mt[494], fma(v[1], m[495], mt[495], tmp[7]));
-	store((double*)&psi[I + d0 + d3], (double*)&psi[I + d3], tmp[4]);
-	store((double*)&psi[I + d0 + d1 + d3], (double*)&psi[I + d1 + d3], tmp[5]);
-	store((double*)&psi[I + d0 + d2 + d3], (double*)&psi[I + d2 + d3], tmp[6]);
-	store((double*)&psi[I + d0 + d1 + d2 + d3], (double*)&psi[I + d1 + d2 + d3], tmp[7]);
+	store(&psi[I + d0 + d3], &psi[I + d3], tmp[4]);
+	store(&psi[I + d0 + d1 + d3], &psi[I + d1 + d3], tmp[5]);
+	store(&psi[I + d0 + d2 + d3], &psi[I + d2 + d3], tmp[6]);
+	store(&psi[I + d0 + d1 + d2 + d3], &psi[I + d1 + d2 + d3], tmp[7]);
 	tmp[8] = fma(v[0], m[496], mt[496], fma(v[1], m[497], mt[497], tmp[8]));
 	tmp[9] = fma(v[0], m[498], mt[498], fma(v[1], m[499], mt[499], tmp[9]));
 	tmp[10] = fma(v[0], m[500], mt[500], fma(v[1], m[501], mt[501], tmp[10]));
 	tmp[11] = fma(v[0], m[502], mt[502], fma(v[1], m[503], mt[503], tmp[11]));
-	store((double*)&psi[I + d0 + d4], (double*)&psi[I + d4], tmp[8]);
-	store((double*)&psi[I + d0 + d1 + d4], (double*)&psi[I + d1 + d4], tmp[9]);
-	store((double*)&psi[I + d0 + d2 + d4], (double*)&psi[I + d2 + d4], tmp[10]);
-	store((double*)&psi[I + d0 + d1 + d2 + d4], (double*)&psi[I + d1 + d2 + d4], tmp[11]);
+	store(&psi[I + d0 + d4], &psi[I + d4], tmp[8]);
+	store(&psi[I + d0 + d1 + d4], &psi[I + d1 + d4], tmp[9]);
+	store(&psi[I + d0 + d2 + d4], &psi[I + d2 + d4], tmp[10]);
+	store(&psi[I + d0 + d1 + d2 + d4], &psi[I + d1 + d2 + d4], tmp[11]);
 	tmp[12] = fma(v[0], m[504], mt[504], fma(v[1], m[505], mt[505], tmp[12]));
 	tmp[13] = fma(v[0], m[506], mt[506], fma(v[1], m[507], mt[507], tmp[13]));
 	tmp[14] = fma(v[0], m[508], mt[508], fma(v[1], m[509], mt[509], tmp[14]));
 	tmp[15] = fma(v[0], m[510], mt[510], fma(v[1], m[511], mt[511], tmp[15]));
-	store((double*)&psi[I + d0 + d3 + d4], (double*)&psi[I + d3 + d4], tmp[12]);
-	store((double*)&psi[I + d0 + d1 + d3 + d4], (double*)&psi[I + d1 + d3 + d4], tmp[13]);
-	store((double*)&psi[I + d0 + d2 + d3 + d4], (double*)&psi[I + d2 + d3 + d4], tmp[14]);
-	store((double*)&psi[I + d0 + d1 + d2 + d3 + d4], (double*)&psi[I + d1 + d2 + d3 + d4], tmp[15]);
+	store(&psi[I + d0 + d3 + d4], &psi[I + d3 + d4], tmp[12]);
+	store(&psi[I + d0 + d1 + d3 + d4], &psi[I + d1 + d3 + d4], tmp[13]);
+	store(&psi[I + d0 + d2 + d3 + d4], &psi[I + d2 + d3 + d4], tmp[14]);
+	store(&psi[I + d0 + d1 + d2 + d3 + d4], &psi[I + d1 + d2 + d3 + d4], tmp[15]);
 
 }
 
@@ -62,10 +62,10 @@ inline void kernel_core(V& psi, std::size_t I, std::size_t d0, std::size_t d1, s
 	tmp[1] = fma(v[0], m[29], mt[29], tmp[1]);
 	tmp[2] = fma(v[0], m[30], mt[30], tmp[2]);
 	tmp[3] = fma(v[0], m[31], mt[31], tmp[3]);
-	store((double*)&psi[I + d0], (double*)&psi[I], tmp[0]);
-	store((double*)&psi[I + d0 + d1], (double*)&psi[I + d1], tmp[1]);
-	store((double*)&psi[I + d0 + d2], (double*)&psi[I + d2], tmp[2]);
-	store((double*)&psi[I + d0 + d1 + d2], (double*)&psi[I + d1 + d2], tmp[3]);
+	store(&psi[I + d0], &psi[I], tmp[0]);
+	store(&psi[I + d0 + d1], &psi[I + d1], tmp[1]);
+	store(&psi[I + d0 + d2], &psi[I + d2], tmp[2]);
+	store(&psi[I + d0 + d1 + d2], &psi[I + d1 + d2], tmp[3]);
 
 }
 
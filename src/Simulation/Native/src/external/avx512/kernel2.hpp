@@ -22,7 +22,7 @@ inline void kernel_core(V& psi, std::size_t I, std::size_t d0, std::size_t d1, M
 	v[0] = load1x4(&psi[I + d0 + d1]);
 
 	tmp[0] = fma(v[0], m[3], mt[3], tmp[0]);
-	store((double*)&psi[I + d0 + d1], (double*)&psi[I + d1], (double*)&psi[I + d0], (double*)&psi[I], tmp[0]);
+	store(&psi[I + d0 + d1], &psi[I + d1], &psi[I + d0], &psi[I], tmp[0]);
 
 }
 
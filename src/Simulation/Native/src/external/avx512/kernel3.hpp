@@ -46,8 +46,8 @@ inline void kernel_core(V& psi, std::size_t I, std::size_t d0, std::size_t d1, s
 
 	tmp[0] = fma(v[0], m[14], mt[14], tmp[0]);
 	tmp[1] = fma(v[0], m[15], mt[15], tmp[1]);
-	store((double*)&psi[I + d0 + d1], (double*)&psi[I + d1], (double*)&psi[I + d0], (double*)&psi[I], tmp[0]);
-	store((double*)&psi[I + d0 + d1 + d2], (double*)&psi[I + d1 + d2], (double*)&psi[I + d0 + d2], (double*)&psi[I + d2], tmp[1]);
+	store(&psi[I + d0 + d1], &psi[I + d1], &psi[I + d0], &psi[I], tmp[0]);
+	store(&psi[I + d0 + d1 + d2], &psi[I + d1 + d2], &psi[I + d0 + d2], &psi[I + d2], tmp[1]);
 
 }
 
@@ -118,10 +118,10 @@ inline void kernel_core(V& psi, std::size_t I, std::size_t d0, std::size_t d1, s
 	tmp[1] = fma(v[0], m[61], mt[61], tmp[1]);
 	tmp[2] = fma(v[0], m[62], mt[62], tmp[2]);
 	tmp[3] = fma(v[0], m[63], mt[63], tmp[3]);
-	store((double*)&psi[I + d0 + d1], (double*)&psi[I + d1], (double*)&psi[I + d0], (double*)&psi[I], tmp[0]);
-	store((double*)&psi[I + d0 + d1 + d2], (double*)&psi[I + d1 + d2], (double*)&psi[I + d0 + d2], (double*)&psi[I + d2], tmp[1]);
-	store((double*)&psi[I + d0 + d1 + d3], (double*)&psi[I + d1 + d3], (double*)&psi[I + d0 + d3], (double*)&psi[I + d3], tmp[2]);
-	store((double*)&psi[I + d0 + d1 + d2 + d3], (double*)&psi[I + d1 + d2 + d3], (double*)&psi[I + d0 + d2 + d3], (double*)&psi[I + d2 + d3], tmp[3]);
+	store(&psi[I + d0 + d1], &psi[I + d1], &psi[I + d0], &psi[I], tmp[0]);
+	store(&psi[I + d0 + d1 + d2], &psi[I + d1 + d2], &psi[I + d0 + d2], &psi[I + d2], tmp[1]);
+	store(&psi[I + d0 + d1 + d3], &psi[I + d1 + d3], &psi[I + d0 + d3], &psi[I + d3], tmp[2]);
+	store(&psi[I + d0 + d1 + d2 + d3], &psi[I + d1 + d2 + d3], &psi[I + d0 + d2 + d3], &psi[I + d2 + d3], tmp[3]);
 
 }
 
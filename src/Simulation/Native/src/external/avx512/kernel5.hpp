@@ -194,18 +194,18 @@ inline void kernel_core(V& psi, std::size_t I, std::size_t d0, std::size_t d1, s
 	tmp[1] = fma(v[0], m[242], mt[242], fma(v[1], m[243], mt[243], tmp[1]));
 	tmp[2] = fma(v[0], m[244], mt[244], fma(v[1], m[245], mt[245], tmp[2]));
 	tmp[3] = fma(v[0], m[246], mt[246], fma(v[1], m[247], mt[247], tmp[3]));
-	store((double*)&psi[I + d0 + d1], (double*)&psi[I + d1], (double*)&psi[I + d0], (double*)&psi[I], tmp[0]);
-	store((double*)&psi[I + d0 + d1 + d2], (double*)&psi[I + d1 + d2], (double*)&psi[I + d0 + d2], (double*)&psi[I + d2], tmp[1]);
-	store((double*)&psi[I + d0 + d1 + d3], (double*)&psi[I + d1 + d3], (double*)&psi[I + d0 + d3], (double*)&psi[I + d3], tmp[2]);
-	store((double*)&psi[I + d0 + d1 + d2 + d3], (double*)&psi[I + d1 + d2 + d3], (double*)&psi[I + d0 + d2 + d3], (double*)&psi[I + d2 + d3], tmp[3]);
+	store(&psi[I + d0 + d1], &psi[I + d1], &psi[I + d0], &psi[I], tmp[0]);
+	store(&psi[I + d0 + d1 + d2], &psi[I + d1 + d2], &psi[I + d0 + d2], &psi[I + d2], tmp[1]);
+	store(&psi[I + d0 + d1 + d3], &psi[I + d1 + d3], &psi[I + d0 + d3], &psi[I + d3], tmp[2]);
+	store(&psi[I + d0 + d1 + d2 + d3], &psi[I + d1 + d2 + d3], &psi[I + d0 + d2 + d3], &psi[I + d2 + d3], tmp[3]);
 	tmp[4] = fma(v[0], m[248], mt[248], fma(v[1], m[249], mt[249], tmp[4]));
 	tmp[5] = fma(v[0], m[250], mt[250], fma(v[1], m[251], mt[251], tmp[5]));
 	tmp[6] = fma(v[0], m[252], mt[252], fma(v[1], m[253], mt[253], tmp[6]));
 	tmp[7] = fma(v[0], m[254], mt[254], fma(v[1], m[255], mt[255], tmp[7]));
-	store((double*)&psi[I + d0 + d1 + d4], (double*)&psi[I + d1 + d4], (double*)&psi[I + d0 + d4], (double*)&psi[I + d4], tmp[4]);
-	store((double*)&psi[I + d0 + d1 + d2 + d4], (double*)&psi[I + d1 + d2 + d4], (double*)&psi[I + d0 + d2 + d4], (double*)&psi[I + d2 + d4], tmp[5]);
-	store((double*)&psi[I + d0 + d1 + d3 + d4], (double*)&psi[I + d1 + d3 + d4], (double*)&psi[I + d0 + d3 + d4], (double*)&psi[I + d3 + d4], tmp[6]);
-	store((double*)&psi[I + d0 + d1 + d2 + d3 + d4], (double*)&psi[I + d1 + d2 + d3 + d4], (double*)&psi[I + d0 + d2 + d3 + d4], (double*)&psi[I + d2 + d3 + d4], tmp[7]);
+	store(&psi[I + d0 + d1 + d4], &psi[I + d1 + d4], &psi[I + d0 + d4], &psi[I + d4], tmp[4]);
+	store(&psi[I + d0 + d1 + d2 + d4], &psi[I + d1 + d2 + d4], &psi[I + d0 + d2 + d4], &psi[I + d2 + d4], tmp[5]);
+	store(&psi[I + d0 + d1 + d3 + d4], &psi[I + d1 + d3 + d4], &psi[I + d0 + d3 + d4], &psi[I + d3 + d4], tmp[6]);
+	store(&psi[I + d0 + d1 + d2 + d3 + d4], &psi[I + d1 + d2 + d3 + d4], &psi[I + d0 + d2 + d3 + d4], &psi[I + d2 + d3 + d4], tmp[7]);
 
 }
 
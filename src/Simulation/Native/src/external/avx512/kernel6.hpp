@@ -150,22 +150,22 @@ inline void kernel_core(V& psi, std::size_t I, std::size_t d0, std::size_t d1, s
 		tmp[i] = fma(v[0], m[960 + i * 4 + 0], fma(v[1], m[960 + i * 4 + 1], fma(v[2], m[960 + i * 4 + 2], fma(v[3], m[960 + i * 4 + 3], tmp[i]))));
 	}
 
-	store((double*)&psi[I + d0 + d1], (double*)&psi[I + d1], (double*)&psi[I + d0], (double*)&psi[I], tmp[0]);
-	store((double*)&psi[I + d0 + d1 + d2], (double*)&psi[I + d1 + d2], (double*)&psi[I + d0 + d2], (double*)&psi[I + d2], tmp[1]);
-	store((double*)&psi[I + d0 + d1 + d3], (double*)&psi[I + d1 + d3], (double*)&psi[I + d0 + d3], (double*)&psi[I + d3], tmp[2]);
-	store((double*)&psi[I + d0 + d1 + d2 + d3], (double*)&psi[I + d1 + d2 + d3], (double*)&psi[I + d0 + d2 + d3], (double*)&psi[I + d2 + d3], tmp[3]);
-	store((double*)&psi[I + d0 + d1 + d4], (double*)&psi[I + d1 + d4], (double*)&psi[I + d0 + d4], (double*)&psi[I + d4], tmp[4]);
-	store((double*)&psi[I + d0 + d1 + d2 + d4], (double*)&psi[I + d1 + d2 + d4], (double*)&psi[I + d0 + d2 + d4], (double*)&psi[I + d2 + d4], tmp[5]);
-	store((double*)&psi[I + d0 + d1 + d3 + d4], (double*)&psi[I + d1 + d3 + d4], (double*)&psi[I + d0 + d3 + d4], (double*)&psi[I + d3 + d4], tmp[6]);
-	store((double*)&psi[I + d0 + d1 + d2 + d3 + d4], (double*)&psi[I + d1 + d2 + d3 + d4], (double*)&psi[I + d0 + d2 + d3 + d4], (double*)&psi[I + d2 + d3 + d4], tmp[7]);
-	store((double*)&psi[I + d0 + d1 + d5], (double*)&psi[I + d1 + d5], (double*)&psi[I + d0 + d5], (double*)&psi[I + d5], tmp[8]);
-	store((double*)&psi[I + d0 + d1 + d2 + d5], (double*)&psi[I + d1 + d2 + d5], (double*)&psi[I + d0 + d2 + d5], (double*)&psi[I + d2 + d5], tmp[9]);
-	store((double*)&psi[I + d0 + d1 + d3 + d5], (double*)&psi[I + d1 + d3 + d5], (double*)&psi[I + d0 + d3 + d5], (double*)&psi[I + d3 + d5], tmp[10]);
-	store((double*)&psi[I + d0 + d1 + d2 + d3 + d5], (double*)&psi[I + d1 + d2 + d3 + d5], (double*)&psi[I + d0 + d2 + d3 + d5], (double*)&psi[I + d2 + d3 + d5], tmp[11]);
-	store((double*)&psi[I + d0 + d1 + d4 + d5], (double*)&psi[I + d1 + d4 + d5], (double*)&psi[I + d0 + d4 + d5], (double*)&psi[I + d4 + d5], tmp[12]);
-	store((double*)&psi[I + d0 + d1 + d2 + d4 + d5], (double*)&psi[I + d1 + d2 + d4 + d5], (double*)&psi[I + d0 + d2 + d4 + d5], (double*)&psi[I + d2 + d4 + d5], tmp[13]);
-	store((double*)&psi[I + d0 + d1 + d3 + d4 + d5], (double*)&psi[I + d1 + d3 + d4 + d5], (double*)&psi[I + d0 + d3 + d4 + d5], (double*)&psi[I + d3 + d4 + d5], tmp[14]);
-	store((double*)&psi[I + d0 + d1 + d2 + d3 + d4 + d5], (double*)&psi[I + d1 + d2 + d3 + d4 + d5], (double*)&psi[I + d0 + d2 + d3 + d4 + d5], (double*)&psi[I + d2 + d3 + d4 + d5], tmp[15]);
+	store(&psi[I + d0 + d1], &psi[I + d1], &psi[I + d0], &psi[I], tmp[0]);
+	store(&psi[I + d0 + d1 + d2], &psi[I + d1 + d2], &psi[I + d0 + d2], &psi[I + d2], tmp[1]);
+	store(&psi[I + d0 + d1 + d3], &psi[I + d1 + d3], &psi[I + d0 + d3], &psi[I + d3], tmp[2]);
+	store(&psi[I + d0 + d1 + d2 + d3], &psi[I + d1 + d2 + d3], &psi[I + d0 + d2 + d3], &psi[I + d2 + d3], tmp[3]);
+	store(&psi[I + d0 + d1 + d4], &psi[I + d1 + d4], &psi[I + d0 + d4], &psi[I + d4], tmp[4]);
+	store(&psi[I + d0 + d1 + d2 + d4], &psi[I + d1 + d2 + d4], &psi[I + d0 + d2 + d4], &psi[I + d2 + d4], tmp[5]);
+	store(&psi[I + d0 + d1 + d3 + d4], &psi[I + d1 + d3 + d4], &psi[I + d0 + d3 + d4], &psi[I + d3 + d4], tmp[6]);
+	store(&psi[I + d0 + d1 + d2 + d3 + d4], &psi[I + d1 + d2 + d3 + d4], &psi[I + d0 + d2 + d3 + d4], &psi[I + d2 + d3 + d4], tmp[7]);
+	store(&psi[I + d0 + d1 + d5], &psi[I + d1 + d5], &psi[I + d0 + d5], &psi[I + d5], tmp[8]);
+	store(&psi[I + d0 + d1 + d2 + d5], &psi[I + d1 + d2 + d5], &psi[I + d0 + d2 + d5], &psi[I + d2 + d5], tmp[9]);
+	store(&psi[I + d0 + d1 + d3 + d5], &psi[I + d1 + d3 + d5], &psi[I + d0 + d3 + d5], &psi[I + d3 + d5], tmp[10]);
+	store(&psi[I + d0 + d1 + d2 + d3 + d5], &psi[I + d1 + d2 + d3 + d5], &psi[I + d0 + d2 + d3 + d5], &psi[I + d2 + d3 + d5], tmp[11]);
+	store(&psi[I + d0 + d1 + d4 + d5], &psi[I + d1 + d4 + d5], &psi[I + d0 + d4 + d5], &psi[I + d4 + d5], tmp[12]);
+	store(&psi[I + d0 + d1 + d2 + d4 + d5], &psi[I + d1 + d2 + d4 + d5], &psi[I + d0 + d2 + d4 + d5], &psi[I + d2 + d4 + d5], tmp[13]);
+	store(&psi[I + d0 + d1 + d3 + d4 + d5], &psi[I + d1 + d3 + d4 + d5], &psi[I + d0 + d3 + d4 + d5], &psi[I + d3 + d4 + d5], tmp[14]);
+	store(&psi[I + d0 + d1 + d2 + d3 + d4 + d5], &psi[I + d1 + d2 + d3 + d4 + d5], &psi[I + d0 + d2 + d3 + d4 + d5], &psi[I + d2 + d3 + d4 + d5], tmp[15]);
 
 }
 
@@ -103,8 +103,20 @@ inline __m256d loadb(U *p1, U *p2){
 }
 template <class U>
 inline void store(U* high, U* low, __m256d const& a){
-	_mm_store_pd(low, _mm256_castpd256_pd128(a));
-	_mm_store_pd(high, _mm256_extractf128_pd(a, 0x1));
+	_mm_store_pd((double*)low, _mm256_castpd256_pd128(a));
+	_mm_store_pd((double*)high, _mm256_extractf128_pd(a, 0x1));
+}
+
+// single-precision state vectors: amplitudes are widened to double on load and narrowed again on store, so the
+// kernels (and the fused matrices) compute in double precision regardless of the storage type
+inline __m256d load1(std::complex<float> *p){
+	auto const tmp = _mm_cvtps_pd(_mm_castpd_ps(_mm_load_sd((double const*)p)));
+	return _mm256_insertf128_pd(_mm256_castpd128_pd256(tmp), tmp, 0x1);
+}
+inline void store(std::complex<float>* high, std::complex<float>* low, __m256d const& a){
+	auto const tmp = _mm256_cvtpd_ps(a);
+	_mm_storel_pi((__m64*)low, tmp);
+	_mm_storeh_pi((__m64*)high, tmp);
 }
 
 
@@ -157,11 +169,15 @@ inline __m512d loadbm(U *p1, U *p2, U *p3, U *p4){
 template <class U>
 inline void store(U* hhigh, U* hlow, U* lhigh, U* llow, __m512d const& a){
         auto al = _mm512_castpd512_pd256(a);
-        _mm_storeu_pd(llow, _mm256_castpd256_pd128(al));
-        _mm_storeu_pd(lhigh, _mm256_extractf128_pd(al, 0x1));
+        _mm_storeu_pd((double*)llow, _mm256_castpd256_pd128(al));
+        _mm_storeu_pd((double*)lhigh, _mm256_extractf128_pd(al, 0x1));
         auto ah = _mm512_extractf64x4_pd(a, 0x1);
-        _mm_storeu_pd(hlow, _mm256_castpd256_pd128(ah));
-        _mm_storeu_pd(hhigh, _mm256_extractf128_pd(ah, 0x1));
+        _mm_storeu_pd((double*)hlow, _mm256_castpd256_pd128(ah));
+        _mm_storeu_pd((double*)hhigh, _mm256_extractf128_pd(ah, 0x1));
+}
+inline void store(std::complex<float>* hhigh, std::complex<float>* hlow, std::complex<float>* lhigh, std::complex<float>* llow, __m512d const& a){
+        store(lhigh, llow, _mm512_castpd512_pd256(a));
+        store(hhigh, hlow, _mm512_extractf64x4_pd(a, 0x1));
 }
 template <class U>
 inline __m512d load(U const*p1, U const*p2, U const*p3, U const*p4){
@@ -4,7 +4,19 @@
 
 #include "config.hpp"
 #include "external/fusion.hpp"
+#include "simulator/diagonalfusion.hpp"
+#include "simulator/permutationfusion.hpp"
+#include "simulator/fusionprofile.hpp"
 #include "simulator/kernels.hpp"
+#include "util/bititerator.hpp"
+#include "util/bitops.hpp"
+#include "util/environment.hpp"
+#include "util/openmp.hpp"
+#include "util/statevectoralloc.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
 #include <string>
 #include <thread>
 
@@ -22,6 +34,9 @@
 #endif
 #endif
 
+#define FUSED_STRINGIFY_(x) #x
+#define FUSED_STRINGIFY(x) FUSED_STRINGIFY_(x)
+
 namespace Microsoft
 {
 namespace Quantum
@@ -37,11 +52,14 @@ class Fused
         wfnCapacity     = 0u;   // used to optimize runtime parameters
         maxFusedSpan    = 4;    // determine span to use at runtime
         maxFusedDepth   = 999;  // determine max depth to use at runtime
+        preferredThreads = 0;   // determine number of threads to use at runtime
     }
 
     inline void reset()
     {
       fusedgates = Fusion();
+      fuseddiagonal.clear();
+      fusedpermutation.clear();
     }
 
     const Fusion& get_fusedgates() const {
@@ -60,9 +78,20 @@ class Fused
         return maxFusedDepth;
     }
 
+    /// Number of threads measured to be the fastest for the current size of the state, or 0 if there is none. It is
+    /// only a preference: the simulator running the kernels decides (see Simulator::threads).
+    int threads() const {
+        return preferredThreads;
+    }
+
     template <class T, class A>
     void flush(std::vector<T, A>& wfn) const
     {
+      // diagonal or permutation gates were inserted before the gates currently in the dense fusion (the two are
+      // never pending at the same time, see Wavefunction::flush)
+      flush_diagonal(wfn);
+      flush_permutation(wfn);
+
       if (fusedgates.size() == 0)
         return;
       
@@ -74,35 +103,94 @@ class Fused
       std::size_t cmask = 0;
       for (auto c : cs)
         cmask |= (1ull << c);
-      
-      switch (qs.size())
-      {
-        case 1:
-          ::kernel(wfn, qs[0], m, cmask);
-          break;
-        case 2:
-          ::kernel(wfn, qs[1], qs[0], m, cmask);
-          break;
-        case 3:
-          ::kernel(wfn, qs[2], qs[1], qs[0], m, cmask);
-          break;
-        case 4:
-          ::kernel(wfn, qs[3], qs[2], qs[1], qs[0], m, cmask);
-          break;
-        case 5:
-          ::kernel(wfn, qs[4], qs[3], qs[2], qs[1], qs[0], m, cmask);
-          break;
-        case 6:
-            ::kernel(wfn, qs[5], qs[4], qs[3], qs[2], qs[1], qs[0], m, cmask);
-            break;
-        case 7:
-            ::kernel(wfn, qs[6], qs[5], qs[4], qs[3], qs[2], qs[1], qs[0], m, cmask);
-            break;
-      }
+
+      apply_kernel(wfn, qs, m, cmask);
 
       fusedgates = Fusion();
     }
     
+    /// Dense gates that have been multiplied out, but not applied to the wave function yet.
+    struct Kernel
+    {
+        Fusion::Matrix m;
+        Fusion::IndexVector qs;
+        std::size_t cmask = 0;
+    };
+
+    /// Multiply out the pending dense gates without applying them (see Wavefunction::flush). Pending diagonal or
+    /// permutation gates were inserted before those and are applied to `wfn` right away.
+    template <class T, class A>
+    Kernel take(std::vector<T, A>& wfn) const
+    {
+      flush_diagonal(wfn);
+      flush_permutation(wfn);
+
+      Kernel k;
+      if (fusedgates.size() == 0)
+        return k;
+
+      Fusion::IndexVector cs;
+      fusedgates.perform_fusion(k.m, k.qs, cs);
+      for (auto c : cs)
+        k.cmask |= (1ull << c);
+
+      fusedgates = Fusion();
+      return k;
+    }
+
+    template <class T, class A>
+    static void apply(std::vector<T, A>& wfn, Kernel const& k)
+    {
+      if (!k.qs.empty())
+        apply_kernel(wfn, k.qs, k.m, k.cmask);
+    }
+
+    /// Apply `ks` in order to one block of 2^block_qubits consecutive amplitudes at a time, so that each block is
+    /// streamed from memory (or from the file backing the state) once for the whole group rather than once per kernel.
+    /// The kernels may only target qubits below block_qubits, their controls on higher qubits select whole blocks.
+    template <class T, class A>
+    static void apply_blocked(std::vector<T, A>& wfn, std::vector<Kernel> const& ks, unsigned block_qubits)
+    {
+      const std::size_t block = std::size_t(1) << block_qubits;
+      for (std::size_t offset = 0; offset < wfn.size(); offset += block)
+      {
+        Block<T> view(wfn.data() + offset, block);
+        for (const Kernel& k : ks)
+        {
+          const std::size_t outer = k.cmask & ~(block - 1);
+          if (!k.qs.empty() && (offset & outer) == outer)
+            apply_kernel(view, k.qs, k.m, k.cmask & (block - 1));
+        }
+      }
+    }
+
+    /// Same as apply_blocked for kernels that only target qubits below tile_qubits, with tiles small enough to stay
+    /// in the cache of a core: all the tiles are shared out among the threads of a single parallel region, and each
+    /// thread applies the whole group of kernels to its tiles on its own.
+    template <class T, class A>
+    static void apply_tiled(std::vector<T, A>& wfn, std::vector<Kernel> const& ks, unsigned tile_qubits)
+    {
+      const std::size_t tile = std::size_t(1) << tile_qubits;
+      const std::intptr_t tiles = static_cast<std::intptr_t>(wfn.size() >> tile_qubits);
+#pragma omp parallel
+      {
+        // the parallel loops of the kernels run on the calling thread only
+        openmp::num_threads_guard serial(1);
+#pragma omp for schedule(static)
+        for (std::intptr_t t = 0; t < tiles; ++t)
+        {
+          const std::size_t offset = static_cast<std::size_t>(t) << tile_qubits;
+          Block<T> view(wfn.data() + offset, tile);
+          for (const Kernel& k : ks)
+          {
+            const std::size_t outer = k.cmask & ~(tile - 1);
+            if (!k.qs.empty() && (offset & outer) == outer)
+              apply_kernel(view, k.qs, k.m, k.cmask & (tile - 1));
+          }
+        }
+      }
+    }
+
     template <class M>
     Fusion::Matrix convertMatrix(M const& m) const
     {
@@ -120,6 +208,47 @@ class Fused
         fusedgates.insert(convertMatrix(mat), qs, cs);
     }
 
+    // Diagonal gates bypass the dense fusion and are merged into a single phase table, which is applied to the
+    // wave function on the next flush (or flush_diagonal).
+    bool can_fuse_diagonal(std::vector<unsigned> const& qs) const
+    {
+        return fuseddiagonal.can_insert(qs);
+    }
+
+    template <class M>
+    void apply_diagonal(M const& mat, std::vector<unsigned> const& cs, unsigned q) const
+    {
+        assert(mat(0, 1) == 0. && mat(1, 0) == 0.);
+        DiagMatrix<ComplexType, 2> d;
+        d(0, 0) = mat(0, 0);
+        d(1, 1) = mat(1, 1);
+        fuseddiagonal.insert(d, cs, q);
+    }
+
+    template <class T, class A>
+    void flush_diagonal(std::vector<T, A>& wfn) const
+    {
+        fuseddiagonal.apply(wfn);
+    }
+
+    // Likewise, (multi-)controlled X gates are composed into a single basis permutation that is applied by moving
+    // amplitudes around, without multiplications.
+    bool can_fuse_permutation(std::vector<unsigned> const& qs) const
+    {
+        return fusedpermutation.can_insert(qs);
+    }
+
+    void apply_permutation(std::vector<unsigned> const& cs, unsigned q) const
+    {
+        fusedpermutation.insert_x(cs, q);
+    }
+
+    template <class T, class A>
+    void flush_permutation(std::vector<T, A>& wfn) const
+    {
+        fusedpermutation.apply(wfn);
+    }
+
     template <class T, class A, class M>
     void apply(std::vector<T, A>& wfn, M const& mat, unsigned q) const
     {
@@ -130,73 +259,213 @@ class Fused
     template <class T, class A>
     bool shouldFlush(std::vector<T, A>& wfn, std::vector<unsigned> const& cs, unsigned q)
     {
-        // Major runtime logic change here
-
           // Have to update capacity as the WFN grows
         if (wfnCapacity != wfn.capacity()) {
             wfnCapacity = wfn.capacity();
-            char* envNT = NULL;
-            size_t len;
-#ifdef _MSC_VER
-            errno_t err = _dupenv_s(&envNT, &len, "OMP_NUM_THREADS");
-#else
-            envNT = getenv("OMP_NUM_THREADS");
-#endif
-            if (envNT == NULL) { // If the user didn't force the number of threads, make an intelligent guess
-                int nMaxThrds = std::thread::hardware_concurrency();        // Logical HW threads
-                if (nMaxThrds > 4) nMaxThrds/= 2;                           // Assume we have hyperthreading (no consistent/concise way to do this)
-                if (wfnCapacity < 1ul << 14)      nMaxThrds = 1;
-                else if (wfnCapacity < 1ul << 16) nMaxThrds = 2;
-                else if (wfnCapacity < 1ul << 20)
-                {
-                    if (nMaxThrds > 8) nMaxThrds = 8;                       // Small problem, never use too many
-                    else if (nMaxThrds > 3) nMaxThrds = 3;                  // Small problem on a small machine
-                }
-                omp_set_num_threads(nMaxThrds);
-            }
+            const FusionSettings& settings = profile().settings(wfnCapacity);
+
+            // If the user didn't force the number of threads, use the measured one (see threads())
+            preferredThreads = env_set("OMP_NUM_THREADS") ? 0 : settings.threads;
 
             // Set the max fused depth
-            char* envFD = NULL;
-            maxFusedDepth = 999;
-#ifdef _MSC_VER
-            err = _dupenv_s(&envFD, &len, "QDK_SIM_FUSEDEPTH");
-            if (envFD != NULL && len > 0) {
-                maxFusedDepth = atoi(envFD);
-        }
-#else
-            envFD = getenv("QDK_SIM_FUSEDEPTH");
-            if (envFD != NULL && strlen(envFD) > 0) {
-                maxFusedDepth = atoi(envFD);
-            }
-#endif
-            // Set the fused span limit
-            char* envFS = NULL;
-            maxFusedSpan = 4;                               // General sweet spot
-            if (wfnCapacity < 1u << 20) maxFusedSpan = 2;   // Don't pre-fuse small problems
-#ifdef _MSC_VER
-            err = _dupenv_s(&envFS, &len, "QDK_SIM_FUSESPAN");
-            if (envFS != NULL && len > 0) {
-                maxFusedSpan = atoi(envFS);
-                if (maxFusedSpan > 7) maxFusedSpan = 7;     // Highest we can handle
-        }
-#else
-            envFS = getenv("QDK_SIM_FUSESPAN");
-            if (envFS != NULL && strlen(envFS) > 0) {
-                maxFusedSpan = atoi(envFS);
-            }
-#endif
+            maxFusedDepth = settings.depth;
+            if (env_set("QDK_SIM_FUSEDEPTH"))
+                maxFusedDepth = std::atoi(env_value("QDK_SIM_FUSEDEPTH").c_str());
 
+            // Set the fused span limit
+            maxFusedSpan = settings.span;
+            if (env_set("QDK_SIM_FUSESPAN"))
+                maxFusedSpan = std::min(std::atoi(env_value("QDK_SIM_FUSESPAN").c_str()), FusionProfile::max_span);
         }
         return false;
     }
 
+    /// Fusion parameters measured for this machine and instruction set, see FusionProfile.
+    static const FusionProfile& profile()
+    {
+        static const FusionProfile measured = FusionProfile::load_or_calibrate(
+            FUSED_STRINGIFY(SIMULATOR), &benchmark_kernel, &benchmark_fusion);
+        return measured;
+    }
+
   private:
+    /// Contiguous slice of a state vector, which the kernels see as a state vector of its own.
+    template <class T>
+    class Block
+    {
+      public:
+        Block(T* data, std::size_t size)
+            : data_(data)
+            , size_(size)
+        {
+        }
+
+        std::size_t size() const
+        {
+            return size_;
+        }
+
+        T& operator[](std::size_t i)
+        {
+            return data_[i];
+        }
+
+        T* data()
+        {
+            return data_;
+        }
+
+      private:
+        T* data_;
+        std::size_t size_;
+    };
+
+    /// The amplitudes of the basis states in which all bits of `cmask` are set, which the kernels see as a state
+    /// vector over the remaining qubits. A controlled kernel applied to it only visits the 2^(n-c) states it changes
+    /// instead of testing the controls of all 2^n.
+    template <class T>
+    class Subspace
+    {
+      public:
+        Subspace(T* data, std::size_t size, std::size_t cmask)
+            : data_(data)
+            , size_(size >> popcnt(cmask))
+            , index_(cmask, cmask)
+        {
+        }
+
+        std::size_t size() const
+        {
+            return size_;
+        }
+
+        T& operator[](std::size_t i)
+        {
+            return data_[index_(i)];
+        }
+
+      private:
+        T* data_;
+        std::size_t size_;
+        subspace_index index_;
+    };
+
+    /// Kernels with at least this many controls run on the Subspace of their controls; with fewer, skipping the
+    /// states that fail the control test is cheaper than mapping every index.
+    static constexpr unsigned min_subspace_controls = 2;
+
+    static bool env_set(const char* name)
+    {
+        return !env_value(name).empty();
+    }
+
+    template <class V>
+    static void apply_kernel(V& wfn, Fusion::IndexVector const& qs, Fusion::Matrix const& m, std::size_t cmask)
+    {
+      if (popcnt(cmask) < min_subspace_controls)
+      {
+        dispatch_kernel(wfn, qs, m, cmask);
+        return;
+      }
+
+      // the targets move down by the number of controls below them
+      Fusion::IndexVector targets(qs);
+      for (auto& q : targets)
+        q -= popcnt(cmask & ((1ull << q) - 1));
+      using T = typename std::remove_reference<decltype(wfn[0])>::type;
+      Subspace<T> view(wfn.data(), wfn.size(), cmask);
+      dispatch_kernel(view, targets, m, 0);
+    }
+
+    template <class V>
+    static void dispatch_kernel(V& wfn, Fusion::IndexVector const& qs, Fusion::Matrix const& m, std::size_t cmask)
+    {
+      switch (qs.size())
+      {
+        case 1:
+          ::kernel(wfn, qs[0], m, cmask);
+          break;
+        case 2:
+          ::kernel(wfn, qs[1], qs[0], m, cmask);
+          break;
+        case 3:
+          ::kernel(wfn, qs[2], qs[1], qs[0], m, cmask);
+          break;
+        case 4:
+          ::kernel(wfn, qs[3], qs[2], qs[1], qs[0], m, cmask);
+          break;
+        case 5:
+          ::kernel(wfn, qs[4], qs[3], qs[2], qs[1], qs[0], m, cmask);
+          break;
+        case 6:
+            ::kernel(wfn, qs[5], qs[4], qs[3], qs[2], qs[1], qs[0], m, cmask);
+            break;
+        case 7:
+            ::kernel(wfn, qs[6], qs[5], qs[4], qs[3], qs[2], qs[1], qs[0], m, cmask);
+            break;
+      }
+    }
+
+    /// Repeat `f` for at least `min_seconds` and return the average time of one call.
+    template <class F>
+    static double time_per_call(F&& f, double min_seconds)
+    {
+        using clock = std::chrono::steady_clock;
+        f(); // warm up
+        std::size_t calls = 0;
+        const auto start = clock::now();
+        std::chrono::duration<double> elapsed;
+        do {
+            f();
+            ++calls;
+            elapsed = clock::now() - start;
+        } while (elapsed.count() < min_seconds);
+        return elapsed.count() / calls;
+    }
+
+    static double benchmark_kernel(unsigned log2size, unsigned span, int threads)
+    {
+        std::vector<ComplexType, StateVectorAlloc<ComplexType, 64>> wfn(std::size_t(1) << log2size, ComplexType(1.));
+        Fusion::Matrix m(1ull << span, Fusion::Matrix::value_type(1ull << span));
+        for (std::size_t i = 0; i < m.size(); ++i)
+            m[i][i] = 1.;
+        // spread the qubits over the state, so that the kernel sees both short and long strides
+        Fusion::IndexVector qs(span);
+        for (unsigned i = 0; i < span; ++i)
+            qs[i] = span > 1 ? i * (log2size - 1) / (span - 1) : 0;
+
+        openmp::num_threads_guard guard(threads);
+        return time_per_call([&] { apply_kernel(wfn, qs, m, 0); }, 0.01);
+    }
+
+    static double benchmark_fusion(unsigned span)
+    {
+        const double r = std::sqrt(0.5);
+        Fusion::Matrix h(2, Fusion::Matrix::value_type(2, Fusion::Complex(r)));
+        h[1][1] = -r;
+        const unsigned gates = 2 * span;
+        return time_per_call(
+                   [&] {
+                       Fusion fusion;
+                       for (unsigned g = 0; g < gates; ++g)
+                           fusion.insert(h, Fusion::IndexVector(1, g % span));
+                       Fusion::Matrix m;
+                       Fusion::IndexVector qs, cs;
+                       fusion.perform_fusion(m, qs, cs);
+                   },
+                   0.001) /
+               gates;
+    }
+
     mutable Fusion fusedgates;
+    mutable DiagonalFusion fuseddiagonal;
+    mutable PermutationFusion fusedpermutation;
 
     //: New runtime optimizatin settings
     mutable size_t wfnCapacity;
     mutable int    maxFusedSpan;
     mutable int    maxFusedDepth;
+    mutable int    preferredThreads;
   };
   
   
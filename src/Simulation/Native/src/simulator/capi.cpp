@@ -15,6 +15,26 @@ extern "C"
         return Microsoft::Quantum::Simulator::create();
     }
 
+    MICROSOFT_QUANTUM_DECL unsigned initSinglePrecision()
+    {
+        return Microsoft::Quantum::Simulator::create(0u, Precision::Single);
+    }
+
+    MICROSOFT_QUANTUM_DECL unsigned initSparse()
+    {
+        return Microsoft::Quantum::Simulator::create(0u, Precision::Double, Representation::Sparse);
+    }
+
+    MICROSOFT_QUANTUM_DECL unsigned initStabilizer()
+    {
+        return Microsoft::Quantum::Simulator::create(0u, Precision::Double, Representation::Stabilizer);
+    }
+
+    MICROSOFT_QUANTUM_DECL unsigned Clone(_In_ unsigned id)
+    {
+        return Microsoft::Quantum::Simulator::clone(id);
+    }
+
     MICROSOFT_QUANTUM_DECL void destroy(_In_ unsigned id)
     {
         Microsoft::Quantum::Simulator::destroy(id);
@@ -25,6 +45,11 @@ extern "C"
         Microsoft::Quantum::Simulator::get(id)->seed(s);
     }
 
+    MICROSOFT_QUANTUM_DECL void SetThreads(_In_ unsigned id, _In_ unsigned n)
+    {
+        Microsoft::Quantum::Simulator::get(id)->setThreads(n);
+    }
+
     // non-quantum
     MICROSOFT_QUANTUM_DECL std::size_t random_choice(_In_ unsigned id, _In_ std::size_t n, _In_reads_(n) double* p)
     {
@@ -45,6 +70,27 @@ extern "C"
         return Microsoft::Quantum::Simulator::get(id)->JointEnsembleProbability(bv, qv);
     }
 
+    MICROSOFT_QUANTUM_DECL double ExpectationPauliSum(
+        _In_ unsigned id,
+        _In_ unsigned nterms,
+        _In_reads_(nterms) unsigned* lengths,
+        _In_ int* b,
+        _In_ unsigned* q,
+        _In_reads_(nterms) double* coefficients)
+    {
+        std::vector<std::vector<Gates::Basis>> bv(nterms);
+        std::vector<std::vector<unsigned>> qv(nterms);
+        for (unsigned k = 0; k < nterms; ++k)
+        {
+            for (unsigned i = 0; i < lengths[k]; ++i)
+                bv[k].push_back(static_cast<Gates::Basis>(*(b++)));
+            qv[k].assign(q, q + lengths[k]);
+            q += lengths[k];
+        }
+        std::vector<double> cv(coefficients, coefficients + nterms);
+        return Microsoft::Quantum::Simulator::get(id)->ExpectationPauliSum(bv, cv, qv);
+    }
+
     MICROSOFT_QUANTUM_DECL bool InjectState(
         _In_ unsigned sid,
         _In_ unsigned n,
@@ -64,6 +110,32 @@ extern "C"
         return Microsoft::Quantum::Simulator::get(sid)->InjectState(qubits, amplitudes);
     }
 
+    MICROSOFT_QUANTUM_DECL bool SaveState(_In_ unsigned sid, _In_ const char* path)
+    {
+        try
+        {
+            Microsoft::Quantum::Simulator::get(sid)->saveState(path);
+            return true;
+        }
+        catch (const std::runtime_error&)
+        {
+            return false;
+        }
+    }
+
+    MICROSOFT_QUANTUM_DECL bool LoadState(_In_ unsigned sid, _In_ const char* path)
+    {
+        try
+        {
+            Microsoft::Quantum::Simulator::get(sid)->loadState(path);
+            return true;
+        }
+        catch (const std::runtime_error&)
+        {
+            return false;
+        }
+    }
+
     MICROSOFT_QUANTUM_DECL void allocateQubit(_In_ unsigned id, _In_ unsigned q)
     {
         Microsoft::Quantum::Simulator::get(id)->allocateQubit(q);
@@ -74,6 +146,18 @@ extern "C"
         Microsoft::Quantum::Simulator::get(id)->release(q);
     }
 
+    MICROSOFT_QUANTUM_DECL void allocateQubits(_In_ unsigned id, _In_ unsigned n, _In_reads_(n) unsigned* q)
+    {
+        std::vector<unsigned> qv(q, q + n);
+        Microsoft::Quantum::Simulator::get(id)->allocateQubit(qv);
+    }
+
+    MICROSOFT_QUANTUM_DECL void releaseQubits(_In_ unsigned id, _In_ unsigned n, _In_reads_(n) unsigned* q)
+    {
+        std::vector<unsigned> qv(q, q + n);
+        Microsoft::Quantum::Simulator::get(id)->release(qv);
+    }
+
     MICROSOFT_QUANTUM_DECL unsigned num_qubits(_In_ unsigned id)
     {
         return Microsoft::Quantum::Simulator::get(id)->num_qubits();
@@ -159,11 +243,35 @@ extern "C"
         Microsoft::Quantum::Simulator::get(id)->CExp(bv, phi, cv, qv);
     }
 
+    MICROSOFT_QUANTUM_DECL bool ApplyBatch(_In_ unsigned id, _In_reads_(n) const GateRecord* ops, _In_ std::size_t n)
+    {
+        try
+        {
+            Microsoft::Quantum::Simulator::get(id)->applyBatch(ops, n);
+            return true;
+        }
+        catch (const std::runtime_error&)
+        {
+            return false;
+        }
+    }
+
     // measurements
     MICROSOFT_QUANTUM_DECL unsigned M(_In_ unsigned id, _In_ unsigned q)
     {
         return (unsigned)Microsoft::Quantum::Simulator::get(id)->M(q);
     }
+    MICROSOFT_QUANTUM_DECL void MultiM(
+        _In_ unsigned id,
+        _In_ unsigned n,
+        _In_reads_(n) unsigned* q,
+        _In_ unsigned* results)
+    {
+        std::vector<unsigned> qv(q, q + n);
+        std::vector<bool> rv = Microsoft::Quantum::Simulator::get(id)->MultiM(qv);
+        for (unsigned i = 0; i < n; ++i)
+            results[i] = rv[i] ? 1u : 0u;
+    }
     MICROSOFT_QUANTUM_DECL unsigned Measure(
         _In_ unsigned id,
         _In_ unsigned n,
@@ -177,8 +285,50 @@ extern "C"
         return (unsigned)Microsoft::Quantum::Simulator::get(id)->Measure(bv, qv);
     }
 
+    MICROSOFT_QUANTUM_DECL void Sample(
+        _In_ unsigned id,
+        _In_ unsigned n,
+        _In_reads_(n) unsigned* q,
+        _In_ std::size_t nshots,
+        _In_ std::size_t* results)
+    {
+        std::vector<unsigned> qv(q, q + n);
+        std::vector<std::size_t> samples = Microsoft::Quantum::Simulator::get(id)->Sample(qv, nshots);
+        std::copy(samples.begin(), samples.end(), results);
+    }
+
+    // quantum Fourier transform of a register
+    MICROSOFT_QUANTUM_DECL void QFT(_In_ unsigned id, _In_ unsigned n, _In_reads_(n) unsigned* q, _In_ bool adjoint)
+    {
+        const std::vector<unsigned> qs(q, q + n);
+        Microsoft::Quantum::Simulator::get(id)->QFT(qs, adjoint);
+    }
+
+    // reflections about a state of a register
+    MICROSOFT_QUANTUM_DECL void ReflectAboutUniform(_In_ unsigned id, _In_ unsigned n, _In_reads_(n) unsigned* q)
+    {
+        const std::vector<unsigned> qs(q, q + n);
+        Microsoft::Quantum::Simulator::get(id)->ReflectAboutUniform(qs);
+    }
+    MICROSOFT_QUANTUM_DECL void ReflectAboutState(
+        _In_ unsigned id,
+        _In_ unsigned n,
+        _In_reads_(n) unsigned* q,
+        _In_ double* re,
+        _In_ double* im)
+    {
+        const std::size_t N = static_cast<std::size_t>(1) << n;
+        std::vector<ComplexType> amplitudes;
+        amplitudes.reserve(N);
+        for (std::size_t i = 0; i < N; ++i)
+            amplitudes.push_back({re[i], im[i]});
+        const std::vector<unsigned> qs(q, q + n);
+        Microsoft::Quantum::Simulator::get(id)->ReflectAboutState(qs, amplitudes);
+    }
+
     // apply permutation of basis states to the wave function
-    MICROSOFT_QUANTUM_DECL void PermuteBasis(
+
+    MICROSOFT_QUANTUM_DECL bool PermuteBasis(
         _In_ unsigned id,
         _In_ unsigned n,
         _In_reads_(n) unsigned* q,
@@ -186,9 +336,17 @@ extern "C"
         _In_reads_(table_size) std::size_t* permutation_table)
     {
         const std::vector<unsigned> qs(q, q + n);
-        Microsoft::Quantum::Simulator::get(id)->permuteBasis(qs, table_size, permutation_table, false);
+        try
+        {
+            Microsoft::Quantum::Simulator::get(id)->permuteBasis(qs, table_size, permutation_table, false);
+            return true;
+        }
+        catch (const std::runtime_error&)
+        {
+            return false;
+        }
     }
-    MICROSOFT_QUANTUM_DECL void AdjPermuteBasis(
+    MICROSOFT_QUANTUM_DECL bool AdjPermuteBasis(
         _In_ unsigned id,
         _In_ unsigned n,
         _In_reads_(n) unsigned* q,
@@ -196,7 +354,53 @@ extern "C"
         _In_reads_(table_size) std::size_t* permutation_table)
     {
         const std::vector<unsigned> qs(q, q + n);
-        Microsoft::Quantum::Simulator::get(id)->permuteBasis(qs, table_size, permutation_table, true);
+        try
+        {
+            Microsoft::Quantum::Simulator::get(id)->permuteBasis(qs, table_size, permutation_table, true);
+            return true;
+        }
+        catch (const std::runtime_error&)
+        {
+            return false;
+        }
+    }
+    MICROSOFT_QUANTUM_DECL bool PermuteBasisWith(
+        _In_ unsigned id,
+        _In_ unsigned n,
+        _In_reads_(n) unsigned* q,
+        _In_ TPermutationCallback permutation,
+        _In_ void* context)
+    {
+        const std::vector<unsigned> qs(q, q + n);
+        try
+        {
+            Microsoft::Quantum::Simulator::get(id)->permuteBasis(
+                qs, [permutation, context](std::size_t x) { return permutation(x, context); }, false);
+            return true;
+        }
+        catch (const std::runtime_error&)
+        {
+            return false;
+        }
+    }
+    MICROSOFT_QUANTUM_DECL bool AdjPermuteBasisWith(
+        _In_ unsigned id,
+        _In_ unsigned n,
+        _In_reads_(n) unsigned* q,
+        _In_ TPermutationCallback permutation,
+        _In_ void* context)
+    {
+        const std::vector<unsigned> qs(q, q + n);
+        try
+        {
+            Microsoft::Quantum::Simulator::get(id)->permuteBasis(
+                qs, [permutation, context](std::size_t x) { return permutation(x, context); }, true);
+            return true;
+        }
+        catch (const std::runtime_error&)
+        {
+            return false;
+        }
     }
 
     // dump wavefunction to given callback until callback returns false
@@ -238,4 +442,67 @@ extern "C"
     {
         Microsoft::Quantum::Simulator::get(id)->dumpIds(callback);
     }
+
+    MICROSOFT_QUANTUM_DECL std::size_t ExportState(
+        _In_ unsigned id,
+        _In_ unsigned n,
+        _In_reads_(n) unsigned* q,
+        _In_ std::size_t offset,
+        _In_ std::size_t count,
+        _Out_writes_(count) double* re,
+        _Out_writes_(count) double* im)
+    {
+        std::vector<unsigned> qs(q, q + n);
+        try
+        {
+            return Microsoft::Quantum::Simulator::get(id)->exportState(qs, offset, count, re, im);
+        }
+        catch (const std::runtime_error&)
+        {
+            return SIZE_MAX;
+        }
+    }
+
+    MICROSOFT_QUANTUM_DECL std::size_t ExportNonzero(
+        _In_ unsigned id,
+        _In_ unsigned n,
+        _In_reads_(n) unsigned* q,
+        _In_ double threshold,
+        _Inout_ std::size_t* cursor,
+        _In_ std::size_t capacity,
+        _Out_writes_(capacity) std::size_t* indices,
+        _Out_writes_(capacity) double* re,
+        _Out_writes_(capacity) double* im)
+    {
+        std::vector<unsigned> qs(q, q + n);
+        try
+        {
+            return Microsoft::Quantum::Simulator::get(id)->exportNonzero(
+                qs, threshold, *cursor, capacity, indices, re, im);
+        }
+        catch (const std::runtime_error&)
+        {
+            return SIZE_MAX;
+        }
+    }
+
+    MICROSOFT_QUANTUM_DECL const double* StateView(
+        _In_ unsigned id,
+        _In_ unsigned n,
+        _In_reads_(n) unsigned* q,
+        _Out_writes_(n) unsigned* positions)
+    {
+        try
+        {
+            auto sim = Microsoft::Quantum::Simulator::get(id);
+            const double* view = reinterpret_cast<const double*>(sim->data());
+            std::vector<unsigned> ps = sim->qubitPositions(std::vector<unsigned>(q, q + n));
+            std::copy(ps.begin(), ps.end(), positions);
+            return view;
+        }
+        catch (const std::runtime_error&)
+        {
+            return nullptr;
+        }
+    }
 }
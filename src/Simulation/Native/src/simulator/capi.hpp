@@ -13,14 +13,33 @@
 // NOLINTNEXTLINE
 #define _In_reads_(n)
 #endif
+#ifndef _Out_writes_
+// NOLINTNEXTLINE
+#define _Out_writes_(n)
+// NOLINTNEXTLINE
+#define _Inout_
+#endif
 
 extern "C"
 {
     // non-quantum
 
     MICROSOFT_QUANTUM_DECL unsigned init(); // NOLINT
+    // Same as init() but the simulator stores its state in single precision, which halves its memory footprint.
+    MICROSOFT_QUANTUM_DECL unsigned initSinglePrecision(); // NOLINT
+    // Same as init() but the simulator keeps large states with few non-zero amplitudes in a sparse map, which allows many
+    // more qubits than a dense state vector. Dump only reports the non-zero amplitudes of such states.
+    MICROSOFT_QUANTUM_DECL unsigned initSparse(); // NOLINT
+    // Same as init() but the simulator keeps the state as a stabilizer tableau until the first non-Clifford gate, which
+    // simulates Clifford circuits on thousands of qubits.
+    MICROSOFT_QUANTUM_DECL unsigned initStabilizer(); // NOLINT
+    // New simulator with a copy of the state of simulator sid (and of its random number generator), both continue
+    // independently.
+    MICROSOFT_QUANTUM_DECL unsigned Clone(_In_ unsigned sid);
     MICROSOFT_QUANTUM_DECL void destroy(_In_ unsigned sid); // NOLINT
     MICROSOFT_QUANTUM_DECL void seed(_In_ unsigned sid, _In_ unsigned s); // NOLINT
+    // Limit the number of threads used by simulator sid to n (0 for no limit), without affecting other simulators.
+    MICROSOFT_QUANTUM_DECL void SetThreads(_In_ unsigned sid, _In_ unsigned n);
     MICROSOFT_QUANTUM_DECL void Dump(_In_ unsigned sid, _In_ bool (*callback)(size_t, double, double));
     MICROSOFT_QUANTUM_DECL bool DumpQubits(
         _In_ unsigned sid,
@@ -52,6 +71,40 @@ extern "C"
 
     MICROSOFT_QUANTUM_DECL void DumpIds(_In_ unsigned sid, _In_ void (*callback)(unsigned));
 
+    // Bulk alternatives to Dump, in the basis where bit k of a basis state is the value of q[k] (q has to list every
+    // allocated qubit once). ExportState copies the amplitudes of the basis states [offset, offset + count) to re and
+    // im and returns how many were copied, fewer than count at the end of the state. ExportNonzero copies the basis
+    // states and amplitudes of up to `capacity` amplitudes whose magnitude is above `threshold`, starting at basis
+    // state *cursor; it advances *cursor past the basis states it examined, to 2^n at the end of the state, so that a
+    // large state can be streamed through a small buffer by calling it until it returns 0. Both return SIZE_MAX, and
+    // copy nothing, if q doesn't list every allocated qubit exactly once.
+    MICROSOFT_QUANTUM_DECL std::size_t ExportState(
+        _In_ unsigned sid,
+        _In_ unsigned n,
+        _In_reads_(n) unsigned* q,
+        _In_ std::size_t offset,
+        _In_ std::size_t count,
+        _Out_writes_(count) double* re,
+        _Out_writes_(count) double* im);
+    MICROSOFT_QUANTUM_DECL std::size_t ExportNonzero(
+        _In_ unsigned sid,
+        _In_ unsigned n,
+        _In_reads_(n) unsigned* q,
+        _In_ double threshold,
+        _Inout_ std::size_t* cursor,
+        _In_ std::size_t capacity,
+        _Out_writes_(capacity) std::size_t* indices,
+        _Out_writes_(capacity) double* re,
+        _Out_writes_(capacity) double* im);
+    // Read-only view of the state of a double-precision simulator: 2^num_qubits amplitudes as interleaved real and
+    // imaginary parts, where qubit q[k] is bit positions[k] of a basis state. The view is valid until the next call on
+    // the simulator. Returns nullptr for single-precision simulators, or if q lists a qubit that isn't allocated.
+    MICROSOFT_QUANTUM_DECL const double* StateView(
+        _In_ unsigned sid,
+        _In_ unsigned n,
+        _In_reads_(n) unsigned* q,
+        _Out_writes_(n) unsigned* positions);
+
     MICROSOFT_QUANTUM_DECL std::size_t random_choice(_In_ unsigned sid, _In_ std::size_t n, _In_reads_(n) double* p); // NOLINT
 
     MICROSOFT_QUANTUM_DECL double JointEnsembleProbability(
@@ -60,6 +113,16 @@ extern "C"
         _In_reads_(n) int* b,
         _In_reads_(n) unsigned* q);
 
+    // Expectation value of a weighted sum of Pauli strings; doesn't change the state of the system. Term k consists of
+    // lengths[k] Paulis, the bases and qubits of all terms are concatenated in b and q.
+    MICROSOFT_QUANTUM_DECL double ExpectationPauliSum(
+        _In_ unsigned sid,
+        _In_ unsigned nterms,
+        _In_reads_(nterms) unsigned* lengths,
+        _In_ int* b,
+        _In_ unsigned* q,
+        _In_reads_(nterms) double* coefficients);
+
     MICROSOFT_QUANTUM_DECL bool InjectState(
         _In_ unsigned sid,
         _In_ unsigned n,
@@ -68,9 +131,19 @@ extern "C"
         _In_ double* im  // 2^n imaginary parts of the amplitudes
     );
 
+    // Checkpoint the simulator to the file at `path`, including the gates that haven't been applied yet and the state of
+    // the random number generator, and restore it from there (into the same kind of simulator, the previous state of
+    // the target is discarded). Sparse and stabilizer simulators can only be checkpointed while their state is dense.
+    // Both return false if the file couldn't be written or read, in which case the simulator is left unchanged.
+    MICROSOFT_QUANTUM_DECL bool SaveState(_In_ unsigned sid, _In_ const char* path);
+    MICROSOFT_QUANTUM_DECL bool LoadState(_In_ unsigned sid, _In_ const char* path);
+
     // allocate and release
     MICROSOFT_QUANTUM_DECL void allocateQubit(_In_ unsigned sid, _In_ unsigned qid); // NOLINT
     MICROSOFT_QUANTUM_DECL void release(_In_ unsigned sid, _In_ unsigned q); // NOLINT
+    // Same as calling allocateQubit/release for each of the n qubits, but the state is resized only once.
+    MICROSOFT_QUANTUM_DECL void allocateQubits(_In_ unsigned sid, _In_ unsigned n, _In_reads_(n) unsigned* q); // NOLINT
+    MICROSOFT_QUANTUM_DECL void releaseQubits(_In_ unsigned sid, _In_ unsigned n, _In_reads_(n) unsigned* q); // NOLINT
     MICROSOFT_QUANTUM_DECL unsigned num_qubits(_In_ unsigned sid); // NOLINT
 
     // single-qubit gates
@@ -122,26 +195,115 @@ extern "C"
         _In_reads_(nc) unsigned* cs,
         _In_reads_(n) unsigned* q);
 
+    // Batched gates, applied in order under a single lookup and lock of the simulator. Any of the gates above can be
+    // described by a GateRecord, its `kind` selects which one:
+    //   BatchX...BatchAdjT  the single-qubit gate on `target`
+    //   BatchR              the rotation by `angle` about Pauli `basis` (as for R) on `target`
+    //   BatchExp            the exponential of the Pauli string paulis[0..nqubits) on qubits[0..nqubits) (as for Exp)
+    // Each of them is controlled on controls[0..ncontrols), if there are any. The pointers are only read during the
+    // call to ApplyBatch. It returns false, without applying any of the gates, if a record has an unknown `kind` or
+    // Pauli basis.
+    enum BatchGate
+    {
+        BatchX = 0,
+        BatchY = 1,
+        BatchZ = 2,
+        BatchH = 3,
+        BatchS = 4,
+        BatchT = 5,
+        BatchAdjS = 6,
+        BatchAdjT = 7,
+        BatchR = 8,
+        BatchExp = 9,
+    };
+
+    typedef struct GateRecord
+    {
+        unsigned kind;
+        unsigned target;
+        unsigned basis;
+        unsigned ncontrols;
+        unsigned nqubits;
+        double angle;
+        const unsigned* controls;
+        const unsigned* paulis;
+        const unsigned* qubits;
+    } GateRecord;
+
+    MICROSOFT_QUANTUM_DECL bool ApplyBatch(_In_ unsigned sid, _In_reads_(n) const GateRecord* ops, _In_ std::size_t n); // NOLINT
+
     // measurements
     MICROSOFT_QUANTUM_DECL unsigned M(_In_ unsigned sid, _In_ unsigned q);
+    // Measure each of the n qubits in the computational basis, results[i] is the outcome of q[i]. Same as calling M for
+    // each of them, but the whole register is measured in a couple of passes over the state.
+    MICROSOFT_QUANTUM_DECL void MultiM(
+        _In_ unsigned sid,
+        _In_ unsigned n,
+        _In_reads_(n) unsigned* q,
+        _In_ unsigned* results);
     MICROSOFT_QUANTUM_DECL unsigned Measure(
         _In_ unsigned sid,
         _In_ unsigned n,
         _In_reads_(n) unsigned* b,
         _In_reads_(n) unsigned* q);
 
-    // permutation oracle emulation
-    MICROSOFT_QUANTUM_DECL void PermuteBasis(
+    // Sample the joint measurement of the n qubits nshots times from the current state, without collapsing it. Bit i of
+    // each of the nshots results is the outcome of q[i] (n <= 64).
+    MICROSOFT_QUANTUM_DECL void Sample(
+        _In_ unsigned sid,
+        _In_ unsigned n,
+        _In_reads_(n) unsigned* q,
+        _In_ std::size_t nshots, // NOLINT
+        _In_ std::size_t* results); // NOLINT
+
+    // Quantum Fourier transform of the register q, with q[0] as its least significant bit:
+    // |x> -> 2^(-n/2) sum_y exp(2 pi i x y / 2^n) |y> (exp(-2 pi i x y / 2^n) for the adjoint). It is applied as an FFT
+    // with a pass over the state per two bits of the register, rather than gate by gate.
+    MICROSOFT_QUANTUM_DECL void QFT(_In_ unsigned sid, _In_ unsigned n, _In_reads_(n) unsigned* q, _In_ bool adjoint);
+
+    // Reflections of the register q about a state |s>: psi -> psi - 2 <s|psi> s, applied with one pass over the state
+    // to compute the overlap and one to update the amplitudes. ReflectAboutUniform reflects about the uniform
+    // superposition, the same as the Grover diffusion operator H X (controlled Z) X H on q. ReflectAboutState reflects
+    // about the normalized state with the 2^n amplitudes re + i im, where bit k of the index is the value of q[k].
+    MICROSOFT_QUANTUM_DECL void ReflectAboutUniform(_In_ unsigned sid, _In_ unsigned n, _In_reads_(n) unsigned* q);
+    MICROSOFT_QUANTUM_DECL void ReflectAboutState(
+        _In_ unsigned sid,
+        _In_ unsigned n,
+        _In_reads_(n) unsigned* q,
+        _In_ double* re,
+        _In_ double* im);
+
+    // permutation oracle emulation, both return false and leave the state unchanged if the table isn't a permutation
+    MICROSOFT_QUANTUM_DECL bool PermuteBasis(
         _In_ unsigned sid,
         _In_ unsigned n,
         _In_reads_(n) unsigned* q,
         _In_ std::size_t table_size, // NOLINT
         _In_reads_(table_size) std::size_t* permutation_table); // NOLINT
-    MICROSOFT_QUANTUM_DECL void AdjPermuteBasis(
+    MICROSOFT_QUANTUM_DECL bool AdjPermuteBasis(
         _In_ unsigned sid,
         _In_ unsigned n,
         _In_reads_(n) unsigned* q,
         _In_ std::size_t table_size, // NOLINT
         _In_reads_(table_size) std::size_t* permutation_table); // NOLINT
 
+    // Same as PermuteBasis and AdjPermuteBasis, but the image of each basis state of the qubits q is computed by
+    // `permutation(state, context)` instead of read from a table, so no table of 2^n entries has to be built. The
+    // amplitudes are still permuted in place. The function has to be a permutation of [0, 2^n); it is called a few
+    // times per amplitude, from several threads at once. Both return false if the function turns out not to be a
+    // permutation, in which case the cycles of the permutation found until then may already have been applied.
+    typedef std::size_t (*TPermutationCallback)(std::size_t, void*);
+    MICROSOFT_QUANTUM_DECL bool PermuteBasisWith(
+        _In_ unsigned sid,
+        _In_ unsigned n,
+        _In_reads_(n) unsigned* q,
+        _In_ TPermutationCallback permutation,
+        _In_ void* context);
+    MICROSOFT_QUANTUM_DECL bool AdjPermuteBasisWith(
+        _In_ unsigned sid,
+        _In_ unsigned n,
+        _In_reads_(n) unsigned* q,
+        _In_ TPermutationCallback permutation,
+        _In_ void* context);
+
 }
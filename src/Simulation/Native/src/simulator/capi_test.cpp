@@ -6,6 +6,8 @@
 #include <cassert>
 #include <cmath>
 #include <complex>
+#include <cstdint>
+#include <cstdio>
 #include <iostream>
 #include <vector>
 
@@ -150,6 +152,47 @@ void test_allocate()
     assert(num_qubits(sim_id) == 0);
     destroy(sim_id);
 }
+void test_allocate_bulk()
+{
+    auto sim_id = init();
+
+    unsigned qs[] = {0, 1, 2, 3, 4, 5};
+    allocateQubits(sim_id, 6, qs);
+    assert(num_qubits(sim_id) == 6);
+
+    // Bell pair on 0 and 2, |+> on 5, classical values on 1, 3 and 4
+    H(sim_id, 0);
+    CX(sim_id, 0, 2);
+    H(sim_id, 5);
+    X(sim_id, 1);
+    X(sim_id, 4);
+
+    unsigned released[] = {4, 1, 3};
+    releaseQubits(sim_id, 3, released);
+    assert(num_qubits(sim_id) == 3);
+
+    // the remaining qubits are unaffected
+    int zz[] = {3, 3};
+    unsigned bell[] = {0, 2};
+    assert(std::abs(JointEnsembleProbability(sim_id, 2, zz, bell) - 1.) < 1e-10);
+    int z[] = {3};
+    unsigned plus[] = {5};
+    assert(std::abs(JointEnsembleProbability(sim_id, 1, z, plus) - 0.5) < 1e-10);
+
+    // released ids can be allocated again and start in |0>
+    unsigned reallocated[] = {1, 3};
+    allocateQubits(sim_id, 2, reallocated);
+    assert(num_qubits(sim_id) == 5);
+    assert(M(sim_id, 1) == 0 && M(sim_id, 3) == 0);
+
+    CX(sim_id, 0, 2);
+    H(sim_id, 0);
+    H(sim_id, 5);
+    unsigned all[] = {0, 1, 2, 3, 5};
+    releaseQubits(sim_id, 5, all);
+    assert(num_qubits(sim_id) == 0);
+    destroy(sim_id);
+}
 /*
 // We can't use a lambda with captures to pass to a callback with __stdcall signature,
 // so we use a global variable/function for the check_state callback:
@@ -410,10 +453,466 @@ void test_permute_basis_adjoint()
     destroy(sim_id);
 }
 
+std::size_t affine(std::size_t x, void* context)
+{
+    return (*static_cast<std::size_t*>(context) * x + 7) % 64;
+}
+
+std::size_t beyond(std::size_t x, void*)
+{
+    return x + 64;
+}
+
+void test_permute_basis_with()
+{
+    for (bool sparse : {false, true})
+    {
+        auto with_table = sparse ? initSparse() : init();
+        auto with_function = sparse ? initSparse() : init();
+        unsigned qs[] = {0, 1, 2, 3, 4, 5, 6};
+        for (auto sim_id : {with_table, with_function})
+        {
+            allocateQubits(sim_id, 7, qs);
+            H(sim_id, 0);
+            H(sim_id, 3);
+            T(sim_id, 3);
+            X(sim_id, 5);
+        }
+
+        // x -> 5x + 7 mod 64 on a register in mixed order
+        unsigned reg[] = {6, 1, 4, 0, 3, 5};
+        std::size_t factor = 5;
+        std::vector<std::size_t> table(64);
+        for (std::size_t x = 0; x < table.size(); ++x)
+            table[x] = affine(x, &factor);
+
+        auto same_state = [&]() {
+            double re1[128], im1[128], re2[128], im2[128];
+            ExportState(with_table, 7, qs, 0, 128, re1, im1);
+            ExportState(with_function, 7, qs, 0, 128, re2, im2);
+            for (std::size_t i = 0; i < 128; ++i)
+                assert(std::abs(re1[i] - re2[i]) < 1e-12 && std::abs(im1[i] - im2[i]) < 1e-12);
+        };
+        PermuteBasis(with_table, 6, reg, table.size(), table.data());
+        assert(PermuteBasisWith(with_function, 6, reg, affine, &factor));
+        same_state();
+        AdjPermuteBasis(with_table, 6, reg, table.size(), table.data());
+        AdjPermuteBasis(with_table, 6, reg, table.size(), table.data());
+        assert(AdjPermuteBasisWith(with_function, 6, reg, affine, &factor));
+        assert(AdjPermuteBasisWith(with_function, 6, reg, affine, &factor));
+        same_state();
+
+        // tables that aren't permutations are rejected before the state is touched
+        std::vector<std::size_t> repeated = table;
+        repeated[1] = repeated[0];
+        assert(!PermuteBasis(with_table, 6, reg, repeated.size(), repeated.data()));
+        assert(!AdjPermuteBasis(with_table, 6, reg, repeated.size(), repeated.data()));
+        same_state();
+
+        // functions that aren't permutations are reported rather than applied: images out of range, and an adjoint
+        // whose walks don't return to their start
+        std::size_t two = 2;
+        assert(!PermuteBasisWith(with_function, 6, reg, beyond, nullptr));
+        assert(!AdjPermuteBasisWith(with_function, 6, reg, beyond, nullptr));
+        same_state();
+        assert(!AdjPermuteBasisWith(with_function, 6, reg, affine, &two));
+
+        destroy(with_table);
+        destroy(with_function);
+    }
+}
+
+void test_reflect_about_uniform()
+{
+    for (bool sparse : {false, true})
+    {
+        auto with_gates = sparse ? initSparse() : init();
+        auto fused = sparse ? initSparse() : init();
+        auto with_state = sparse ? initSparse() : init();
+        unsigned qs[] = {0, 1, 2, 3, 4, 5};
+        for (auto sim_id : {with_gates, fused, with_state})
+        {
+            allocateQubits(sim_id, 6, qs);
+            H(sim_id, 0);
+            T(sim_id, 0);
+            H(sim_id, 2);
+            MCX(sim_id, 1, qs + 2, 5);
+            X(sim_id, 3);
+        }
+
+        // H X (controlled Z) X H on a register in mixed order
+        unsigned reg[] = {4, 1, 3, 0};
+        for (unsigned q : reg)
+        {
+            H(with_gates, q);
+            X(with_gates, q);
+        }
+        MCZ(with_gates, 3, reg, reg[3]);
+        for (unsigned q : reg)
+        {
+            X(with_gates, q);
+            H(with_gates, q);
+        }
+        ReflectAboutUniform(fused, 4, reg);
+        std::vector<double> re(16, 0.25), im(16, 0.);
+        ReflectAboutState(with_state, 4, reg, re.data(), im.data());
+
+        double re1[64], im1[64], re2[64], im2[64];
+        ExportState(with_gates, 6, qs, 0, 64, re1, im1);
+        for (auto sim_id : {fused, with_state})
+        {
+            ExportState(sim_id, 6, qs, 0, 64, re2, im2);
+            for (std::size_t i = 0; i < 64; ++i)
+                assert(std::abs(re1[i] - re2[i]) < 1e-12 && std::abs(im1[i] - im2[i]) < 1e-12);
+        }
+
+        destroy(with_gates);
+        destroy(fused);
+        destroy(with_state);
+    }
+}
+
+void test_qft_dump()
+{
+    // the amplitudes are dumped in the order of the ids listed by DumpIds, also right after a QFT
+    for (unsigned n : {2u, 40u})
+    {
+        auto sim_id = n > 2 ? initSparse() : init();
+        std::vector<unsigned> qs(n);
+        for (unsigned q = 0; q < n; ++q)
+            qs[q] = q;
+        allocateQubits(sim_id, n, qs.data());
+        X(sim_id, 0);
+        QFT(sim_id, 2, qs.data(), false);
+
+        static std::vector<std::pair<size_t, std::complex<double>>> dumped;
+        dumped.clear();
+        Dump(sim_id, [](size_t idx, double r, double i) {
+            if (std::abs(r) + std::abs(i) > 1e-10) dumped.emplace_back(idx, std::complex<double>(r, i));
+            return true;
+        });
+        const std::complex<double> expected[] = {{0.5, 0.}, {0., 0.5}, {-0.5, 0.}, {0., -0.5}};
+        assert(dumped.size() == 4);
+        for (size_t k = 0; k < 4; ++k)
+            assert(dumped[k].first == k && std::abs(dumped[k].second - expected[k]) < 1e-10);
+        destroy(sim_id);
+    }
+}
+
+void test_expectation_pauli_sum()
+{
+    auto sim_id = init();
+    allocateQubit(sim_id, 0);
+    allocateQubit(sim_id, 1);
+
+    // Bell state (|00> + |11>)/sqrt(2): <ZZ> = <XX> = 1, <YY> = -1, <Z> = 0
+    H(sim_id, 0);
+    CX(sim_id, 0, 1);
+
+    unsigned lengths[] = {2, 2, 2, 1};
+    int b[] = {2, 2, 1, 1, 3, 3, 2};
+    unsigned q[] = {0, 1, 0, 1, 0, 1, 0};
+    double coefficients[] = {1.0, 0.5, 0.25, 3.0};
+    double e = ExpectationPauliSum(sim_id, 4, lengths, b, q, coefficients);
+    assert(std::abs(e - 1.25) < 1e-10);
+
+    H(sim_id, 0);
+    H(sim_id, 1);
+    release(sim_id, 0);
+    release(sim_id, 1);
+    destroy(sim_id);
+}
+
+void test_sample()
+{
+    auto sim_id = init();
+    allocateQubit(sim_id, 0);
+    allocateQubit(sim_id, 1);
+
+    // q0 is |1> and q1 is |0>, so every sample of (q1, q0) is 0b10
+    X(sim_id, 0);
+
+    std::size_t results[16];
+    unsigned q[] = {1, 0};
+    Sample(sim_id, 2, q, 16, results);
+    for (std::size_t r : results)
+        assert(r == 2);
+
+    X(sim_id, 0);
+    release(sim_id, 0);
+    release(sim_id, 1);
+    destroy(sim_id);
+}
+
+std::vector<std::complex<double>> amplitudes(unsigned sim_id)
+{
+    static std::vector<std::complex<double>> collected;
+    collected.clear();
+    Dump(sim_id, [](size_t idx, double r, double i) {
+        collected.emplace_back(r, i);
+        return true;
+    });
+    return collected;
+}
+
+void test_single_precision()
+{
+    const unsigned n = 6;
+    unsigned sims[] = {init(), initSinglePrecision()};
+    for (unsigned sim_id : sims)
+    {
+        for (unsigned q = 0; q < n; ++q)
+            allocateQubit(sim_id, q);
+        for (unsigned q = 0; q < n; ++q)
+        {
+            H(sim_id, q);
+            Ry(sim_id, 0.1 + 0.3 * q, q);
+        }
+        for (unsigned q = 0; q + 1 < n; ++q)
+        {
+            CX(sim_id, q, q + 1);
+            CRz(sim_id, 0.7, q + 1, q);
+            T(sim_id, q);
+        }
+    }
+
+    // both precisions produce the same state, up to single-precision rounding
+    std::vector<std::complex<double>> expected = amplitudes(sims[0]);
+    std::vector<std::complex<double>> actual = amplitudes(sims[1]);
+    assert(expected.size() == (1u << n) && actual.size() == expected.size());
+    for (size_t i = 0; i < expected.size(); ++i)
+        assert(std::abs(expected[i] - actual[i]) < 1e-5);
+
+    for (unsigned sim_id : sims)
+        destroy(sim_id);
+}
+
+void test_sparse()
+{
+    // a GHZ state on 40 qubits has two non-zero amplitudes out of 2^40
+    const unsigned n = 40;
+    auto sim_id = initSparse();
+    std::vector<unsigned> qs(n);
+    for (unsigned q = 0; q < n; ++q)
+        qs[q] = q;
+    allocateQubits(sim_id, n, qs.data());
+    H(sim_id, 0);
+    for (unsigned q = 1; q < n; ++q)
+        CX(sim_id, q - 1, q);
+
+    int zz[] = {2, 2};
+    unsigned ends[] = {0, n - 1};
+    assert(std::abs(JointEnsembleProbability(sim_id, 2, zz, ends)) < 1e-10);
+
+    // only the non-zero amplitudes are dumped
+    static std::vector<size_t> indices;
+    indices.clear();
+    Dump(sim_id, [](size_t idx, double r, double i) {
+        indices.push_back(idx);
+        return true;
+    });
+    assert(indices.size() == 2 && indices[0] == 0 && indices[1] == (1ull << n) - 1);
+
+    const unsigned result = M(sim_id, 7);
+    for (unsigned q = 0; q < n; ++q)
+        assert(M(sim_id, q) == result);
+    if (result)
+    {
+        for (unsigned q = 0; q < n; ++q)
+            X(sim_id, q);
+    }
+    releaseQubits(sim_id, n, qs.data());
+    assert(num_qubits(sim_id) == 0);
+    destroy(sim_id);
+}
+
+void test_checkpoint()
+{
+    auto sim_id = init();
+    seed(sim_id, 7);
+    unsigned qs[] = {0, 1, 2};
+    allocateQubits(sim_id, 3, qs);
+    H(sim_id, 0);
+    CX(sim_id, 0, 1);
+    assert(SaveState(sim_id, "capi_test_checkpoint.qsc"));
+
+    auto restored = init();
+    assert(LoadState(restored, "capi_test_checkpoint.qsc"));
+    assert(num_qubits(restored) == 3);
+    const unsigned result = M(sim_id, 1);
+    assert(M(restored, 1) == result);
+    assert(M(restored, 0) == result);
+    assert(!LoadState(restored, "no_such_checkpoint.qsc"));
+    assert(num_qubits(restored) == 3);
+
+    std::remove("capi_test_checkpoint.qsc");
+    destroy(restored);
+    destroy(sim_id);
+}
+
+void test_clone()
+{
+    auto sim_id = init();
+    unsigned qs[] = {0, 1};
+    allocateQubits(sim_id, 2, qs);
+    H(sim_id, 0);
+    CX(sim_id, 0, 1);
+
+    auto fork = Clone(sim_id);
+    assert(fork != sim_id && num_qubits(fork) == 2);
+    X(fork, 1);
+    int zz[] = {2, 2};
+    assert(std::abs(JointEnsembleProbability(fork, 2, zz, qs) - 1.) < 1e-10);
+    assert(std::abs(JointEnsembleProbability(sim_id, 2, zz, qs)) < 1e-10);
+
+    destroy(sim_id);
+    assert(M(fork, 0) != M(fork, 1));
+    destroy(fork);
+}
+
+void test_multim()
+{
+    auto sim_id = init();
+    unsigned qs[] = {0, 1, 2, 3};
+    allocateQubits(sim_id, 4, qs);
+    X(sim_id, 1);
+    H(sim_id, 2);
+    CX(sim_id, 2, 3);
+    unsigned results[4];
+    MultiM(sim_id, 4, qs, results);
+    assert(results[0] == 0 && results[1] == 1 && results[2] == results[3]);
+    destroy(sim_id);
+}
+
+void test_batch()
+{
+    // the same circuit, gate by gate and as a single batch
+    auto gates = init();
+    auto batch = init();
+    unsigned qs[] = {0, 1, 2};
+    allocateQubits(gates, 3, qs);
+    allocateQubits(batch, 3, qs);
+
+    unsigned c0[] = {0};
+    unsigned c01[] = {0, 1};
+    unsigned xy[] = {1, 3};
+    unsigned q12[] = {1, 2};
+    H(gates, 0);
+    MCX(gates, 1, c0, 1);
+    R(gates, 3, 0.3, 2);
+    MCT(gates, 2, c01, 2);
+    MCExp(gates, 2, xy, 0.7, 1, c0, q12);
+    AdjS(gates, 1);
+    MCR(gates, 1, 1.1, 2, c01, 2);
+
+    std::vector<GateRecord> ops(7, GateRecord{});
+    ops[0].kind = BatchH;
+    ops[0].target = 0;
+    ops[1].kind = BatchX;
+    ops[1].target = 1;
+    ops[1].ncontrols = 1;
+    ops[1].controls = c0;
+    ops[2].kind = BatchR;
+    ops[2].basis = 3;
+    ops[2].angle = 0.3;
+    ops[2].target = 2;
+    ops[3].kind = BatchT;
+    ops[3].target = 2;
+    ops[3].ncontrols = 2;
+    ops[3].controls = c01;
+    ops[4].kind = BatchExp;
+    ops[4].nqubits = 2;
+    ops[4].paulis = xy;
+    ops[4].qubits = q12;
+    ops[4].angle = 0.7;
+    ops[4].ncontrols = 1;
+    ops[4].controls = c0;
+    ops[5].kind = BatchAdjS;
+    ops[5].target = 1;
+    ops[6].kind = BatchR;
+    ops[6].basis = 1;
+    ops[6].angle = 1.1;
+    ops[6].target = 2;
+    ops[6].ncontrols = 2;
+    ops[6].controls = c01;
+    assert(ApplyBatch(batch, ops.data(), ops.size()));
+
+    int bases[][3] = {{2, 0, 0}, {1, 2, 0}, {3, 3, 1}, {0, 1, 3}};
+    for (auto& b : bases)
+        assert(std::abs(JointEnsembleProbability(gates, 3, b, qs) - JointEnsembleProbability(batch, 3, b, qs)) < 1e-10);
+
+    // a batch with an invalid record is rejected before any of its gates is applied
+    unsigned unknown[] = {1, 4};
+    ops[1].kind = 42;
+    assert(!ApplyBatch(batch, ops.data(), ops.size()));
+    ops[1].kind = BatchX;
+    ops[4].paulis = unknown;
+    assert(!ApplyBatch(batch, ops.data(), ops.size()));
+    for (auto& b : bases)
+        assert(std::abs(JointEnsembleProbability(gates, 3, b, qs) - JointEnsembleProbability(batch, 3, b, qs)) < 1e-10);
+
+    destroy(batch);
+    destroy(gates);
+}
+
+void test_export()
+{
+    for (unsigned sim_id : {init(), initSinglePrecision(), initSparse(), initStabilizer()})
+    {
+        unsigned qs[] = {0, 1, 2};
+        allocateQubits(sim_id, 3, qs);
+        H(sim_id, 0);
+        X(sim_id, 2);
+
+        // bit 0 of a basis state is qubit 2, bit 1 qubit 0
+        unsigned order[] = {2, 0, 1};
+        double re[8], im[8];
+        assert(ExportState(sim_id, 3, order, 0, 8, re, im) == 8);
+        for (std::size_t i = 0; i < 8; ++i)
+        {
+            const double expected = (i == 1 || i == 3) ? 1. / std::sqrt(2.) : 0.;
+            assert(std::abs(re[i] - expected) < 1e-6 && std::abs(im[i]) < 1e-6);
+        }
+        assert(ExportState(sim_id, 3, order, 6, 8, re, im) == 2);
+
+        // the qubits have to be listed once each, ids past the allocated ones included
+        unsigned missing[] = {2, 0, 0};
+        unsigned beyond[] = {2, 0, 100};
+        std::size_t start = 0;
+        std::size_t indices[8];
+        for (unsigned* invalid : {missing, beyond})
+        {
+            assert(ExportState(sim_id, 3, invalid, 0, 8, re, im) == SIZE_MAX);
+            assert(ExportNonzero(sim_id, 3, invalid, 1e-6, &start, 8, indices, re, im) == SIZE_MAX && start == 0);
+        }
+        unsigned unallocated[3];
+        assert(StateView(sim_id, 3, beyond, unallocated) == nullptr);
+
+        // stream the non-zero amplitudes one at a time
+        std::size_t cursor = 0;
+        std::size_t index;
+        std::vector<std::size_t> found;
+        while (ExportNonzero(sim_id, 3, order, 1e-6, &cursor, 1, &index, re, im) == 1)
+            found.push_back(index);
+        assert(found == std::vector<std::size_t>({1, 3}) && cursor == 8);
+
+        unsigned positions[3];
+        const double* view = StateView(sim_id, 3, order, positions);
+        if (view != nullptr)
+        {
+            const std::size_t i = (1ull << positions[0]) | (1ull << positions[1]);
+            assert(std::abs(view[2 * i] - 1. / std::sqrt(2.)) < 1e-6);
+        }
+        destroy(sim_id);
+    }
+}
+
 int main()
 {
     std::cerr << "Testing allocate\n";
     test_allocate();
+    std::cerr << "Testing bulk allocate\n";
+    test_allocate_bulk();
     std::cerr << "Testing gates\n";
     test_gates();
     std::cerr << "Testing teleport\n";
@@ -421,6 +920,28 @@ int main()
     std::cerr << "Testing basis state permutation\n";
     test_permute_basis();
     test_permute_basis_adjoint();
+    test_permute_basis_with();
+    test_reflect_about_uniform();
+    std::cerr << "Testing dump after QFT\n";
+    test_qft_dump();
+    std::cerr << "Testing expectation of Pauli sums\n";
+    test_expectation_pauli_sum();
+    std::cerr << "Testing sample\n";
+    test_sample();
+    std::cerr << "Testing single precision\n";
+    test_single_precision();
+    std::cerr << "Testing sparse\n";
+    test_sparse();
+    std::cerr << "Testing checkpoint\n";
+    test_checkpoint();
+    std::cerr << "Testing clone\n";
+    test_clone();
+    std::cerr << "Testing MultiM\n";
+    test_multim();
+    std::cerr << "Testing batch\n";
+    test_batch();
+
+    test_export();
     std::cerr << "Testing dump\n";
     // test_dump();
     // test_dump_qubits();
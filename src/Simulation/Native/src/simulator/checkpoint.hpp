@@ -0,0 +1,332 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <io.h>
+// keep the min/max macros of windows.h out of the code that includes this header, as catch.hpp does
+#if !defined(NOMINMAX)
+#define CHECKPOINT_DEFINED_NOMINMAX
+#define NOMINMAX
+#endif
+#if !defined(WIN32_LEAN_AND_MEAN)
+#define CHECKPOINT_DEFINED_WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#ifdef CHECKPOINT_DEFINED_NOMINMAX
+#undef NOMINMAX
+#undef CHECKPOINT_DEFINED_NOMINMAX
+#endif
+#ifdef CHECKPOINT_DEFINED_WIN32_LEAN_AND_MEAN
+#undef WIN32_LEAN_AND_MEAN
+#undef CHECKPOINT_DEFINED_WIN32_LEAN_AND_MEAN
+#endif
+#endif
+
+#include "util/environment.hpp"
+
+namespace Microsoft
+{
+namespace Quantum
+{
+namespace SIMULATOR
+{
+///
+/// Checkpoint files of a simulator. A file starts with a fixed header, followed by the metadata of the wave function
+/// (qubit map, pending gates, random number generator...) and then by the amplitudes as a single raw block. The block
+/// starts at a multiple of `alignment`, so the file can be mapped directly and the block written with O_DIRECT.
+///
+///   magic[8] | version u32 | reserved u32 | metadata size u64 | data offset u64 | data size u64 | metadata | data
+///
+/// The amplitudes are written by all threads in parallel, each with its own slice of the block. Set
+/// QDK_SIM_CHECKPOINT_DIRECT=1 to bypass the page cache (Linux), when the state and the block are suitably aligned.
+///
+namespace checkpoint
+{
+constexpr std::size_t alignment = 4096;
+constexpr char magic[8] = {'Q', 'D', 'K', 'S', 'I', 'M', 'C', 'P'};
+constexpr std::uint32_t version = 1;
+constexpr std::size_t header_size = 8 + 4 + 4 + 3 * 8;
+/// Each thread writes (or reads) slices of this many bytes.
+constexpr std::size_t chunk = std::size_t(1) << 26;
+
+/// Appends trivially copyable values to the metadata of a checkpoint.
+class Writer
+{
+  public:
+    template <class V>
+    void put(V const& value)
+    {
+        static_assert(std::is_trivially_copyable<V>::value, "only plain values can be written");
+        bytes_.append(reinterpret_cast<const char*>(&value), sizeof(V));
+    }
+
+    void put(std::string const& s)
+    {
+        put<std::uint64_t>(s.size());
+        bytes_.append(s);
+    }
+
+    std::string const& bytes() const
+    {
+        return bytes_;
+    }
+
+  private:
+    std::string bytes_;
+};
+
+/// Reads back the values appended by Writer, in the same order.
+class Reader
+{
+  public:
+    explicit Reader(std::string bytes)
+        : bytes_(std::move(bytes))
+    {
+    }
+
+    template <class V>
+    V get()
+    {
+        static_assert(std::is_trivially_copyable<V>::value, "only plain values can be read");
+        V value;
+        std::memcpy(&value, take(sizeof(V)), sizeof(V));
+        return value;
+    }
+
+    std::string get_string()
+    {
+        const std::size_t n = static_cast<std::size_t>(get<std::uint64_t>());
+        return std::string(take(n), n);
+    }
+
+  private:
+    const char* take(std::size_t n)
+    {
+        if (n > bytes_.size() - pos_) throw std::runtime_error("the checkpoint is truncated");
+        pos_ += n;
+        return bytes_.data() + pos_ - n;
+    }
+
+    std::string bytes_;
+    std::size_t pos_ = 0;
+};
+
+namespace detail
+{
+inline std::size_t data_offset(std::size_t metadata_size)
+{
+    return (header_size + metadata_size + alignment - 1) / alignment * alignment;
+}
+
+inline std::string header(std::size_t metadata_size, std::size_t data_size)
+{
+    Writer h;
+    for (char c : magic)
+        h.put(c);
+    h.put(version);
+    h.put(std::uint32_t(0));
+    h.put<std::uint64_t>(metadata_size);
+    h.put<std::uint64_t>(data_offset(metadata_size));
+    h.put<std::uint64_t>(data_size);
+    return h.bytes();
+}
+
+inline bool direct_requested()
+{
+    const std::string env = env_value("QDK_SIM_CHECKPOINT_DIRECT");
+    return !env.empty() && std::atoi(env.c_str()) != 0;
+}
+
+#if !defined(_WIN32)
+/// Write all of [data, data+size) at `offset`, retrying short writes.
+inline bool write_at(int fd, const char* data, std::size_t size, std::size_t offset)
+{
+    while (size > 0)
+    {
+        const ssize_t n = pwrite(fd, data, size, static_cast<off_t>(offset));
+        if (n <= 0) return false;
+        data += n;
+        size -= static_cast<std::size_t>(n);
+        offset += static_cast<std::size_t>(n);
+    }
+    return true;
+}
+
+/// Write the block with all threads, each one writing whole chunks.
+inline bool write_parallel(int fd, const char* data, std::size_t size, std::size_t offset)
+{
+    const std::intptr_t chunks = static_cast<std::intptr_t>((size + chunk - 1) / chunk);
+    bool ok = true;
+#pragma omp parallel for schedule(static) reduction(&& : ok)
+    for (std::intptr_t c = 0; c < chunks; ++c)
+    {
+        const std::size_t begin = static_cast<std::size_t>(c) * chunk;
+        ok = ok && write_at(fd, data + begin, std::min(chunk, size - begin), offset + begin);
+    }
+    return ok;
+}
+
+/// fsync the directory holding `path`, so that a rename into it is durable.
+inline bool sync_directory(std::string const& path)
+{
+    const std::size_t slash = path.find_last_of('/');
+    const std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    const int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return false;
+    const bool ok = fsync(fd) == 0;
+    return close(fd) == 0 && ok;
+}
+#endif
+} // namespace detail
+
+///
+/// Write a checkpoint with the given metadata and amplitudes to `path`, replacing the file if it exists. The file is
+/// written as `path + ".tmp"` and renamed over `path` only once it is complete and synced, so a save that fails or is
+/// interrupted leaves the previous checkpoint intact.
+///
+inline void save(std::string const& path, std::string const& metadata, const void* data, std::size_t size)
+{
+    const std::string head = detail::header(metadata.size(), size) + metadata;
+    const std::size_t offset = detail::data_offset(metadata.size());
+    const std::string tmp = path + ".tmp";
+#if !defined(_WIN32)
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) throw std::runtime_error("cannot create the checkpoint " + tmp);
+    bool ok = ftruncate(fd, static_cast<off_t>(offset + size)) == 0 && detail::write_at(fd, head.data(), head.size(), 0);
+
+    // O_DIRECT needs the buffer, the offsets and the lengths to be multiples of the (logical) block size
+    int data_fd = fd;
+#ifdef O_DIRECT
+    if (ok && detail::direct_requested() && reinterpret_cast<std::uintptr_t>(data) % alignment == 0 &&
+        size % alignment == 0)
+    {
+        const int direct = open(tmp.c_str(), O_WRONLY | O_DIRECT | O_CLOEXEC);
+        if (direct >= 0) data_fd = direct;
+    }
+#endif
+    ok = ok && detail::write_parallel(data_fd, static_cast<const char*>(data), size, offset);
+    if (data_fd != fd) close(data_fd);
+    ok = fsync(fd) == 0 && ok;
+    ok = close(fd) == 0 && ok;
+    ok = ok && std::rename(tmp.c_str(), path.c_str()) == 0;
+    if (!ok)
+    {
+        unlink(tmp.c_str());
+        throw std::runtime_error("cannot write the checkpoint " + path);
+    }
+    if (!detail::sync_directory(path)) throw std::runtime_error("cannot sync the directory of the checkpoint " + path);
+#else
+    std::FILE* out = std::fopen(tmp.c_str(), "wb");
+    if (out == nullptr) throw std::runtime_error("cannot create the checkpoint " + tmp);
+    const std::string pad(offset - head.size(), '\0');
+    bool ok = std::fwrite(head.data(), 1, head.size(), out) == head.size() &&
+              std::fwrite(pad.data(), 1, pad.size(), out) == pad.size() &&
+              std::fwrite(data, 1, size, out) == size && std::fflush(out) == 0 && _commit(_fileno(out)) == 0;
+    ok = std::fclose(out) == 0 && ok;
+    ok = ok && MoveFileExA(tmp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+    if (!ok)
+    {
+        std::remove(tmp.c_str());
+        throw std::runtime_error("cannot write the checkpoint " + path);
+    }
+#endif
+}
+
+///
+/// A checkpoint opened for reading: the header and metadata are read right away, the amplitudes are copied out of a
+/// read-only mapping of the file (by all threads, so that the page faults are served in parallel).
+///
+class File
+{
+  public:
+    explicit File(std::string const& path)
+        : path_(path)
+    {
+        std::ifstream in(path, std::ios::binary);
+        std::string head(header_size, '\0');
+        if (!in.read(&head[0], head.size())) throw std::runtime_error("cannot read the checkpoint " + path);
+        Reader h(head);
+        for (char c : magic)
+        {
+            if (h.get<char>() != c) throw std::runtime_error(path + " is not a simulator checkpoint");
+        }
+        if (h.get<std::uint32_t>() != version) throw std::runtime_error("unsupported checkpoint version in " + path);
+        h.get<std::uint32_t>();
+        const std::size_t metadata_size = static_cast<std::size_t>(h.get<std::uint64_t>());
+        offset_ = static_cast<std::size_t>(h.get<std::uint64_t>());
+        size_ = static_cast<std::size_t>(h.get<std::uint64_t>());
+        if (offset_ != detail::data_offset(metadata_size)) throw std::runtime_error("the checkpoint is corrupt");
+
+        metadata_.resize(metadata_size);
+        if (!in.read(&metadata_[0], metadata_size)) throw std::runtime_error("the checkpoint is truncated");
+        in.seekg(0, std::ios::end);
+        if (static_cast<std::size_t>(in.tellg()) < offset_ + size_) throw std::runtime_error("the checkpoint is truncated");
+    }
+
+    std::string const& metadata() const
+    {
+        return metadata_;
+    }
+
+    /// Size of the amplitude block in bytes.
+    std::size_t data_size() const
+    {
+        return size_;
+    }
+
+    /// Copy the amplitude block into `out`, which must hold data_size() bytes.
+    void read_data(void* out) const
+    {
+        if (size_ == 0) return;
+#if !defined(_WIN32)
+        int fd = open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+        void* p = fd < 0 ? MAP_FAILED : mmap(nullptr, offset_ + size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (fd >= 0) close(fd);
+        if (p == MAP_FAILED) throw std::runtime_error("cannot map the checkpoint " + path_);
+
+        const char* data = static_cast<const char*>(p) + offset_;
+        char* dst = static_cast<char*>(out);
+        const std::intptr_t chunks = static_cast<std::intptr_t>((size_ + chunk - 1) / chunk);
+#pragma omp parallel for schedule(static)
+        for (std::intptr_t c = 0; c < chunks; ++c)
+        {
+            const std::size_t begin = static_cast<std::size_t>(c) * chunk;
+            std::memcpy(dst + begin, data + begin, std::min(chunk, size_ - begin));
+        }
+        munmap(p, offset_ + size_);
+#else
+        std::ifstream in(path_, std::ios::binary);
+        in.seekg(offset_);
+        if (!in.read(static_cast<char*>(out), size_)) throw std::runtime_error("the checkpoint is truncated");
+#endif
+    }
+
+  private:
+    std::string path_;
+    std::string metadata_;
+    std::size_t offset_ = 0;
+    std::size_t size_ = 0;
+};
+} // namespace checkpoint
+
+} // namespace SIMULATOR
+} // namespace Quantum
+} // namespace Microsoft
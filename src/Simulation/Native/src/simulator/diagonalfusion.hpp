@@ -0,0 +1,125 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include "simulator/kernels.hpp"
+#include "types.hpp"
+#include "util/diagmatrix.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <vector>
+
+namespace Microsoft
+{
+namespace Quantum
+{
+namespace SIMULATOR
+{
+
+///
+/// Accumulates (multi-)controlled diagonal gates into a single phase table over the union of their qubits. Diagonal
+/// gates commute with each other, so any number of them can be merged regardless of the order in which they are
+/// inserted, and the whole table is applied to the wave function with one streaming multiplication.
+///
+class DiagonalFusion
+{
+  public:
+    using IndexVector = std::vector<unsigned>;
+
+    /// The table has 2^max_qubits entries at most, which keeps it resident in the cache while the state is streamed.
+    static constexpr unsigned max_qubits = 12;
+
+    DiagonalFusion()
+        : phases_(1, 1.)
+    {
+    }
+
+    bool empty() const
+    {
+        return qubits_.empty();
+    }
+
+    /// Positional ids of the qubits the phase table is defined over, in ascending order.
+    const IndexVector& qubits() const
+    {
+        return qubits_;
+    }
+
+    const std::vector<ComplexType>& phases() const
+    {
+        return phases_;
+    }
+
+    /// Returns true if a gate on the given positions can be merged without growing the table beyond max_qubits.
+    bool can_insert(const IndexVector& positions) const
+    {
+        unsigned added = 0;
+        for (unsigned p : positions)
+            if (!std::binary_search(qubits_.begin(), qubits_.end(), p)) ++added;
+        return qubits_.size() + added <= max_qubits;
+    }
+
+    /// Merge the diagonal gate `d` on qubit `q` controlled by qubits `cs` (all positional ids) into the table.
+    void insert(const DiagMatrix<ComplexType, 2>& d, const IndexVector& cs, unsigned q)
+    {
+        for (unsigned c : cs)
+            add_qubit(c);
+        add_qubit(q);
+
+        std::size_t cmask = 0;
+        for (unsigned c : cs)
+            cmask |= table_bit(c);
+        const std::size_t qbit = table_bit(q);
+        const ComplexType d0 = d(0, 0);
+        const ComplexType d1 = d(1, 1);
+
+        for (std::size_t t = 0; t < phases_.size(); ++t)
+            if ((t & cmask) == cmask) phases_[t] *= (t & qbit) ? d1 : d0;
+    }
+
+    template <class T, class A>
+    void apply(std::vector<T, A>& wfn)
+    {
+        if (empty()) return;
+        kernels::apply_diagonal(wfn, qubits_, phases_);
+        clear();
+    }
+
+    void clear()
+    {
+        qubits_.clear();
+        phases_.assign(1, 1.);
+    }
+
+  private:
+    std::size_t table_bit(unsigned q) const
+    {
+        auto it = std::lower_bound(qubits_.begin(), qubits_.end(), q);
+        assert(it != qubits_.end() && *it == q);
+        return 1ull << (it - qubits_.begin());
+    }
+
+    /// Extend the table to a new qubit by duplicating every entry along the new index bit.
+    void add_qubit(unsigned q)
+    {
+        auto it = std::lower_bound(qubits_.begin(), qubits_.end(), q);
+        if (it != qubits_.end() && *it == q) return;
+
+        const std::size_t low = (1ull << (it - qubits_.begin())) - 1;
+        qubits_.insert(it, q);
+
+        std::vector<ComplexType> grown(2 * phases_.size());
+        for (std::size_t t = 0; t < grown.size(); ++t)
+            grown[t] = phases_[(t & low) | ((t >> 1) & ~low)];
+        phases_.swap(grown);
+    }
+
+    IndexVector qubits_;
+    std::vector<ComplexType> phases_;
+};
+
+} // namespace SIMULATOR
+} // namespace Quantum
+} // namespace Microsoft
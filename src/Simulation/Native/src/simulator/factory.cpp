@@ -13,19 +13,19 @@ namespace Quantum
 {
 namespace SimulatorGeneric
 {
-Microsoft::Quantum::Simulator::SimulatorInterface* createSimulator(unsigned);
+Microsoft::Quantum::Simulator::SimulatorInterface* createSimulator(unsigned, Simulator::Precision, Simulator::Representation);
 }
 namespace SimulatorAVX
 {
-Microsoft::Quantum::Simulator::SimulatorInterface* createSimulator(unsigned);
+Microsoft::Quantum::Simulator::SimulatorInterface* createSimulator(unsigned, Simulator::Precision, Simulator::Representation);
 }
 namespace SimulatorAVX2
 {
-Microsoft::Quantum::Simulator::SimulatorInterface* createSimulator(unsigned);
+Microsoft::Quantum::Simulator::SimulatorInterface* createSimulator(unsigned, Simulator::Precision, Simulator::Representation);
 }
 namespace SimulatorAVX512
 {
-Microsoft::Quantum::Simulator::SimulatorInterface* createSimulator(unsigned);
+Microsoft::Quantum::Simulator::SimulatorInterface* createSimulator(unsigned, Simulator::Precision, Simulator::Representation);
 }
 } // namespace Quantum
 } // namespace Microsoft
@@ -39,30 +39,29 @@ namespace Simulator
 std::shared_mutex _mutex;
 std::vector<std::shared_ptr<SimulatorInterface>> _psis;
 
-SimulatorInterface* createSimulator(unsigned maxlocal)
+SimulatorInterface* createSimulator(unsigned maxlocal, Precision precision, Representation representation)
 {
     if (haveAVX512())
     {
-        return SimulatorAVX512::createSimulator(maxlocal);
+        return SimulatorAVX512::createSimulator(maxlocal, precision, representation);
     }
     else if (haveFMA() && haveAVX2())
     {
-        return SimulatorAVX2::createSimulator(maxlocal);
+        return SimulatorAVX2::createSimulator(maxlocal, precision, representation);
     }
     else if (haveAVX())
     {
-        return SimulatorAVX::createSimulator(maxlocal);
+        return SimulatorAVX::createSimulator(maxlocal, precision, representation);
     }
     else
     {
-        return SimulatorGeneric::createSimulator(maxlocal);
+        return SimulatorGeneric::createSimulator(maxlocal, precision, representation);
     }
 }
 
-MICROSOFT_QUANTUM_DECL unsigned create(unsigned maxlocal)
+/// Store `psi` in the first free slot and return its index, the caller must hold the lock.
+unsigned add(SimulatorInterface* psi)
 {
-    std::lock_guard<std::shared_mutex> lock(_mutex);
-
     size_t emptySlot = -1;
     for (auto const& s : _psis)
     {
@@ -75,17 +74,40 @@ MICROSOFT_QUANTUM_DECL unsigned create(unsigned maxlocal)
 
     if (emptySlot == -1)
     {
-        _psis.push_back(std::shared_ptr<SimulatorInterface>(createSimulator(maxlocal)));
+        _psis.push_back(std::shared_ptr<SimulatorInterface>(psi));
         emptySlot = _psis.size() - 1;
     }
     else
     {
-        _psis[emptySlot] = std::shared_ptr<SimulatorInterface>(createSimulator(maxlocal));
+        _psis[emptySlot] = std::shared_ptr<SimulatorInterface>(psi);
     }
 
     return static_cast<unsigned>(emptySlot);
 }
 
+MICROSOFT_QUANTUM_DECL unsigned create(
+    unsigned maxlocal,
+    Precision precision,
+    Representation representation,
+    unsigned threads)
+{
+    SimulatorInterface* psi = createSimulator(maxlocal, precision, representation);
+    psi->setThreads(threads);
+
+    std::lock_guard<std::shared_mutex> lock(_mutex);
+    return add(psi);
+}
+
+MICROSOFT_QUANTUM_DECL unsigned clone(unsigned id)
+{
+    // the state is copied without holding the lock, which would block all other simulators for as long
+    std::shared_ptr<SimulatorInterface> original = get(id);
+    SimulatorInterface* copy = original->clone();
+
+    std::lock_guard<std::shared_mutex> lock(_mutex);
+    return add(copy);
+}
+
 MICROSOFT_QUANTUM_DECL void destroy(unsigned id)
 {
     std::lock_guard<std::shared_mutex> lock(_mutex);
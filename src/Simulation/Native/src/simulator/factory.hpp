@@ -10,7 +10,15 @@ namespace Quantum
 {
 namespace Simulator
 {
-MICROSOFT_QUANTUM_DECL unsigned create(unsigned = 0u);
+/// Create a simulator and return its id. `threads` limits the number of threads it uses (see
+/// SimulatorInterface::setThreads), 0 for no limit.
+MICROSOFT_QUANTUM_DECL unsigned create(
+    unsigned = 0u,
+    Precision = Precision::Double,
+    Representation = Representation::Dense,
+    unsigned threads = 0u);
+/// Register a copy of simulator `id` (see SimulatorInterface::clone) and return its id.
+MICROSOFT_QUANTUM_DECL unsigned clone(unsigned id);
 MICROSOFT_QUANTUM_DECL void destroy(unsigned);
 MICROSOFT_QUANTUM_DECL std::shared_ptr<SimulatorInterface>& get(unsigned);
 } // namespace Simulator
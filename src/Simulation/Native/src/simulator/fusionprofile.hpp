@@ -0,0 +1,231 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include "config.hpp"
+#include "util/environment.hpp"
+#include "util/openmp.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Microsoft
+{
+namespace Quantum
+{
+namespace SIMULATOR
+{
+
+/// Runtime parameters of the gate fusion for a given state size.
+struct FusionSettings
+{
+    int threads; // OpenMP threads used by the kernels
+    int span;    // maximum number of qubits of a fused cluster (1..7)
+    int depth;   // maximum number of gates in a fused cluster
+};
+
+///
+/// Machine profile of the fusion parameters, indexed by the size of the state vector. The profile is measured once per
+/// machine (and instruction set) by timing the fused kernels over a range of state sizes, spans and thread counts, and
+/// cached in a file so that later processes only have to read it. It is measured (or read) when the first wave function
+/// of the process is created, not by its first gates.
+///
+/// Environment variables:
+///   QDK_SIM_AUTOTUNE=0          don't measure, use the built-in defaults
+///   QDK_SIM_TUNING_PROFILE=path read/write the profile at `path` instead of the user's cache directory
+///
+class FusionProfile
+{
+  public:
+    /// States are measured at 2^min_log2size, 2^(min_log2size+2), ..., 2^max_log2size amplitudes. At the largest size
+    /// the state is well outside of the caches, so the settings carry over to any larger state.
+    static constexpr unsigned min_log2size = 10;
+    static constexpr unsigned max_log2size = 20;
+    static constexpr unsigned log2size_step = 2;
+    static constexpr int max_span = 7;
+    static constexpr int unlimited_depth = 999;
+
+    /// Settings for a state vector with the given capacity (number of amplitudes).
+    const FusionSettings& settings(std::size_t capacity) const
+    {
+        unsigned log2size = 0;
+        while (log2size < 63 && (std::size_t(1) << (log2size + 1)) <= capacity)
+            ++log2size;
+        if (log2size < min_log2size) return entries_.front();
+        return entries_[std::min<std::size_t>((log2size - min_log2size) / log2size_step, entries_.size() - 1)];
+    }
+
+    /// The fixed heuristics used before the simulator measured its machine.
+    static FusionProfile defaults()
+    {
+        FusionProfile profile;
+        for (unsigned log2size = min_log2size; log2size <= max_log2size; log2size += log2size_step)
+        {
+            int threads = static_cast<int>(std::thread::hardware_concurrency());
+            if (threads > 4) threads /= 2; // assume hyperthreading
+            if (log2size < 14) threads = 1;
+            else if (log2size < 16) threads = 2;
+            else if (log2size < 20) threads = threads > 8 ? 8 : (threads > 3 ? 3 : threads);
+            profile.entries_.push_back({std::max(threads, 1), log2size < 20 ? 2 : 4, unlimited_depth});
+        }
+        return profile;
+    }
+
+    ///
+    /// Measure the profile. `kernel_time(log2size, span, threads)` returns the seconds taken by one application of a
+    /// dense `span`-qubit kernel to a state of 2^log2size amplitudes, and `fusion_time(span)` the seconds it takes to
+    /// fuse one gate into a `span`-qubit matrix. Fusing up to `span` gates into one kernel costs about
+    ///     kernel_time / span + fusion_time
+    /// per gate, which picks the span and thread count. Clusters aren't limited in depth unless fusing a single gate
+    /// is slower than applying it directly, in which case they aren't fused at all.
+    ///
+    template <class KernelTime, class FusionTime>
+    static FusionProfile calibrate(KernelTime&& kernel_time, FusionTime&& fusion_time)
+    {
+        std::vector<double> fuse(max_span + 1);
+        for (int span = 1; span <= max_span; ++span)
+            fuse[span] = fusion_time(span);
+
+        FusionProfile profile;
+        for (unsigned log2size = min_log2size; log2size <= max_log2size; log2size += log2size_step)
+        {
+            FusionSettings best{1, 1, unlimited_depth};
+            double best_cost = std::numeric_limits<double>::max();
+            double best_single = 0.;
+            for (int threads : thread_counts())
+            {
+                const double single = kernel_time(log2size, 1, threads);
+                for (int span = 1; span <= max_span && span <= static_cast<int>(log2size); ++span)
+                {
+                    const double cost = (span == 1 ? single : kernel_time(log2size, span, threads)) / span + fuse[span];
+                    if (cost < best_cost)
+                    {
+                        best_cost = cost;
+                        best = {threads, span, unlimited_depth};
+                        best_single = single;
+                    }
+                }
+            }
+            if (fuse[best.span] > best_single) best = {best.threads, 1, 1};
+            profile.entries_.push_back(best);
+        }
+        return profile;
+    }
+
+    /// Load the profile from the cache, or measure and cache it if there is none (or it was measured on a machine with a
+    /// different number of hardware threads).
+    template <class KernelTime, class FusionTime>
+    static FusionProfile load_or_calibrate(const char* isa, KernelTime&& kernel_time, FusionTime&& fusion_time)
+    {
+        if (env_value("QDK_SIM_AUTOTUNE") == "0") return defaults();
+
+        const std::string path = profile_path(isa);
+        FusionProfile profile;
+        if (!path.empty() && profile.load(path)) return profile;
+
+        profile = calibrate(kernel_time, fusion_time);
+        if (!path.empty()) profile.save(path);
+        return profile;
+    }
+
+    bool load(const std::string& path)
+    {
+        std::ifstream in(path);
+        std::string header;
+        if (!std::getline(in, header) || header != signature()) return false;
+
+        std::vector<FusionSettings> entries;
+        unsigned log2size = 0;
+        FusionSettings s;
+        while (in >> log2size >> s.threads >> s.span >> s.depth)
+        {
+            if (log2size != min_log2size + entries.size() * log2size_step) return false;
+            if (s.threads < 1 || s.span < 1 || s.span > max_span || s.depth < 1) return false;
+            entries.push_back(s);
+        }
+        if (entries.size() != (max_log2size - min_log2size) / log2size_step + 1) return false;
+
+        entries_.swap(entries);
+        return true;
+    }
+
+    /// Failing to write the profile isn't an error, the next process will measure it again. The profile is written to
+    /// a file of its own and renamed over `path`, so processes that measure it at the same time don't mix their lines.
+    void save(const std::string& path) const
+    {
+        std::error_code ec;
+        std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+        const std::string tmp = path + ".tmp" + std::to_string(std::random_device{}());
+        {
+            std::ofstream out(tmp);
+            out << signature() << "\n";
+            unsigned log2size = min_log2size;
+            for (const FusionSettings& s : entries_)
+            {
+                out << log2size << " " << s.threads << " " << s.span << " " << s.depth << "\n";
+                log2size += log2size_step;
+            }
+            if (!out.flush())
+            {
+                out.close();
+                std::filesystem::remove(tmp, ec);
+                return;
+            }
+        }
+        std::filesystem::rename(tmp, path, ec);
+        if (ec) std::filesystem::remove(tmp, ec);
+    }
+
+  private:
+    static std::string signature()
+    {
+        std::ostringstream s;
+        s << "qdk-sim fusion profile v1, hardware threads " << std::thread::hardware_concurrency();
+        return s.str();
+    }
+
+    static std::string profile_path(const char* isa)
+    {
+        if (std::string path = env_value("QDK_SIM_TUNING_PROFILE"); !path.empty()) return path;
+
+        std::filesystem::path dir;
+#ifdef _WIN32
+        if (const std::string local = env_value("LOCALAPPDATA"); !local.empty())
+            dir = std::filesystem::path(local) / "qdk-sim";
+#else
+        if (const std::string cache = env_value("XDG_CACHE_HOME"); !cache.empty())
+            dir = std::filesystem::path(cache) / "qdk-sim";
+        else if (const std::string home = env_value("HOME"); !home.empty())
+            dir = std::filesystem::path(home) / ".cache" / "qdk-sim";
+#endif
+        if (dir.empty()) return std::string();
+        return (dir / (std::string("fusion-") + isa + ".profile")).string();
+    }
+
+    /// Powers of two up to the number of hardware threads, and the number of hardware threads itself.
+    static std::vector<int> thread_counts()
+    {
+        const int hw = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+        std::vector<int> counts;
+        for (int t = 1; t < hw; t *= 2)
+            counts.push_back(t);
+        counts.push_back(hw);
+        return counts;
+    }
+
+    std::vector<FusionSettings> entries_;
+};
+
+} // namespace SIMULATOR
+} // namespace Quantum
+} // namespace Microsoft
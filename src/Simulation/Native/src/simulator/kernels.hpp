@@ -10,8 +10,11 @@
 #include "util/diagmatrix.hpp"
 #include "util/tinymatrix.hpp"
 
+#include <algorithm>
 #include <atomic>
 #include <complex>
+#include <numeric>
+
 namespace Microsoft
 {
 namespace Quantum
@@ -182,6 +185,83 @@ double probability(std::vector<std::complex<T>, A> const& wfn, unsigned q)
     return prob;
 }
 
+/// Registers measured by a single pass of `marginal` have at most this many qubits (the per-thread tables of the pass
+/// have 2^max_marginal_qubits entries).
+constexpr unsigned max_marginal_qubits = 12;
+
+/// Probabilities of the basis states of the qubits at `positions` (ascending, the lowest position maps to the least
+/// significant bit of the table index), in one pass over the state. The table index of an amplitude is assembled from
+/// per-byte lookup tables, indices that only differ below the lowest position share it and are summed as a run.
+template <class T, class A>
+std::vector<double> marginal(std::vector<std::complex<T>, A> const& wfn, std::vector<unsigned> const& positions)
+{
+    assert(!positions.empty() && positions.size() <= max_marginal_qubits);
+    assert(std::is_sorted(positions.begin(), positions.end()));
+
+    unsigned const nbytes = positions.back() / 8 + 1;
+    std::vector<std::size_t> lut(256 * nbytes, 0);
+    for (unsigned r = 0; r < positions.size(); ++r)
+    {
+        for (unsigned v = 0; v < 256; ++v)
+            if ((v >> (positions[r] % 8)) & 1) lut[256 * (positions[r] / 8) + v] |= 1ull << r;
+    }
+
+    // runs of at least a byte share the table index, shorter ones take the low byte from the first lookup table
+    std::intptr_t const n = static_cast<std::intptr_t>(wfn.size());
+    std::intptr_t const run = std::min<std::intptr_t>(n, 1ll << std::max(positions.front(), 8u));
+    bool const low = positions.front() < 8;
+    std::vector<double> table(1ull << positions.size(), 0.);
+#pragma omp parallel
+    {
+        std::vector<double> local(table.size(), 0.);
+#pragma omp for schedule(static)
+        for (std::intptr_t base = 0; base < n; base += run)
+        {
+            std::size_t t = 0;
+            for (unsigned byte = 1; byte < nbytes; ++byte)
+                t |= lut[256 * byte + ((base >> (8 * byte)) & 255)];
+            if (low)
+            {
+                for (std::intptr_t i = 0; i < run; ++i)
+                    local[t | lut[i]] += std::norm(wfn[base + i]);
+            }
+            else
+            {
+                double sum = 0.;
+                for (std::intptr_t i = base; i < base + run; ++i)
+                    sum += std::norm(wfn[i]);
+                local[t] += sum;
+            }
+        }
+#pragma omp critical
+        for (std::size_t t = 0; t < table.size(); ++t)
+            table[t] += local[t];
+    }
+    return table;
+}
+
+/// Keep the amplitudes whose bits at `positions` (ordered as for `marginal`) spell `outcome`, multiplied by `scale`,
+/// and zero all others: the collapse and the normalization of a measurement in one pass.
+template <class T, class A>
+void collapse_scaled(
+    std::vector<std::complex<T>, A>& wfn,
+    std::vector<unsigned> const& positions,
+    std::size_t outcome,
+    double scale)
+{
+    std::size_t mask = 0;
+    std::size_t state = 0;
+    for (unsigned r = 0; r < positions.size(); ++r)
+    {
+        mask |= 1ull << positions[r];
+        state |= ((outcome >> r) & 1) << positions[r];
+    }
+    T const f = static_cast<T>(scale);
+#pragma omp parallel for schedule(static)
+    for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(wfn.size()); ++i)
+        wfn[i] = (static_cast<std::size_t>(i) & mask) == state ? wfn[i] * f : std::complex<T>(0.);
+}
+
 inline bool isDiagonal(std::vector<Gates::Basis> const& b)
 {
     for (auto x : b)
@@ -210,6 +290,144 @@ inline ComplexType iExp(int power)
     return 0;
 }
 
+/// A Pauli string P over positional qubits in the bit-mask form used by the Pauli kernels: P = i^y_count * X^xy_bits *
+/// Z^yz_bits, so that P|x> = i^y_count * (-1)^parity(x & yz_bits) |x ^ xy_bits>.
+struct PauliMask
+{
+    std::size_t xy_bits = 0;
+    std::size_t yz_bits = 0;
+    int y_count = 0;
+};
+
+inline PauliMask make_pauli_mask(std::vector<Gates::Basis> const& b, std::vector<unsigned> const& qs)
+{
+    assert(b.size() == qs.size());
+    PauliMask p;
+    for (unsigned i = 0; i < b.size(); ++i)
+    {
+        switch (b[i])
+        {
+        case Gates::PauliX:
+            p.xy_bits |= (1ull << qs[i]);
+            break;
+        case Gates::PauliY:
+            p.xy_bits |= (1ull << qs[i]);
+            p.yz_bits |= (1ull << qs[i]);
+            ++p.y_count;
+            break;
+        case Gates::PauliZ:
+            p.yz_bits |= (1ull << qs[i]);
+            break;
+        case Gates::PauliI:
+            break;
+        default:
+            assert(false);
+        }
+    }
+    return p;
+}
+
+/// The rotation exp(i phi P) by the Pauli string of `mask`.
+struct PauliRotation
+{
+    PauliMask mask;
+    double phi = 0.;
+};
+
+/// Apply the rotations in order to the basis states where all the bits of `cmask` are set. All Pauli strings have to
+/// flip the same qubits (the same xy_bits), so that every rotation only mixes the amplitudes of the pairs
+/// x <-> x ^ xy_bits: the whole sequence is applied to one pair at a time, in registers, in a single sweep over the
+/// state (see Exp-implementation-details.txt for the 2x2 blocks). The sweep enumerates each pair with all controls set
+/// once, from its member with a 0 at the highest flipped position, and uses real arithmetic throughout so that the
+/// compiler vectorizes it for the instruction set of the simulator. Diagonal strings (no flipped qubits) multiply each
+/// amplitude by a phase.
+template <class T, class A>
+void apply_pauli_rotations(
+    std::vector<std::complex<T>, A>& wfn,
+    std::vector<PauliRotation> const& rotations,
+    std::size_t cmask)
+{
+    assert(!rotations.empty());
+    std::size_t const xy_bits = rotations.front().mask.xy_bits;
+    std::size_t const n = rotations.size();
+
+    // cos(phi), and the off-diagonal coefficients of the rotations for an even parity (negated for an odd one)
+    std::vector<std::size_t> yz(n);
+    std::vector<T> cosine(n), sine(n), beta_re(n), beta_im(n), gamma_re(n), gamma_im(n);
+    for (std::size_t k = 0; k < n; ++k)
+    {
+        PauliRotation const& r = rotations[k];
+        assert(r.mask.xy_bits == xy_bits);
+        yz[k] = r.mask.yz_bits;
+        cosine[k] = static_cast<T>(std::cos(r.phi));
+        sine[k] = static_cast<T>(std::sin(r.phi));
+        ComplexType const beta = std::sin(r.phi) * iExp(3 * r.mask.y_count + 1);
+        ComplexType const gamma = std::sin(r.phi) * iExp(r.mask.y_count + 1);
+        beta_re[k] = static_cast<T>(beta.real());
+        beta_im[k] = static_cast<T>(beta.imag());
+        gamma_re[k] = static_cast<T>(gamma.real());
+        gamma_im[k] = static_cast<T>(gamma.imag());
+    }
+
+    if (xy_bits == 0)
+    {
+        // exp(i phi Z...Z) is exp(i phi) for an even parity and exp(-i phi) for an odd one
+        subspace_index const index(cmask, cmask);
+        std::intptr_t const states = static_cast<std::intptr_t>(wfn.size() >> popcnt(cmask));
+#pragma omp parallel for schedule(static)
+        for (std::intptr_t j = 0; j < states; ++j)
+        {
+            std::size_t const x = index(j);
+            T re = wfn[x].real();
+            T im = wfn[x].imag();
+            for (std::size_t k = 0; k < n; ++k)
+            {
+                T const s = poppar(x & yz[k]) ? -sine[k] : sine[k];
+                T const r = re * cosine[k] - im * s;
+                im = re * s + im * cosine[k];
+                re = r;
+            }
+            wfn[x] = std::complex<T>(re, im);
+        }
+        return;
+    }
+
+    unsigned high = 0;
+    while (xy_bits >> (high + 1))
+        ++high;
+    subspace_index const index(cmask | (1ull << high), cmask);
+    std::intptr_t const pairs = static_cast<std::intptr_t>(wfn.size() >> (popcnt(cmask) + 1));
+#pragma omp parallel for schedule(static)
+    for (std::intptr_t j = 0; j < pairs; ++j)
+    {
+        std::size_t const x = index(j);
+        std::size_t const t = x ^ xy_bits;
+        T ar = wfn[x].real();
+        T ai = wfn[x].imag();
+        T br = wfn[t].real();
+        T bi = wfn[t].imag();
+        for (std::size_t k = 0; k < n; ++k)
+        {
+            T const sign = poppar(x & yz[k]) ? T(-1) : T(1);
+            T const c = cosine[k];
+            T const pr = sign * beta_re[k];
+            T const pi = sign * beta_im[k];
+            T const gr = sign * gamma_re[k];
+            T const gi = sign * gamma_im[k];
+            T const xr = c * ar + pr * br - pi * bi;
+            T const xi = c * ai + pr * bi + pi * br;
+            T const tr = c * br + gr * ar - gi * ai;
+            T const ti = c * bi + gr * ai + gi * ar;
+            ar = xr;
+            ai = xi;
+            br = tr;
+            bi = ti;
+        }
+        wfn[x] = std::complex<T>(ar, ai);
+        wfn[t] = std::complex<T>(br, bi);
+    }
+}
+
 template <class T, class A>
 void apply_controlled_exp(
     std::vector<std::complex<T>, A>& wfn,
@@ -219,66 +437,60 @@ void apply_controlled_exp(
     std::vector<unsigned> const& qs)
 {
     assert(qs.size() > 1);
-    unsigned lowest = *std::min_element(qs.begin(), qs.end());
+    apply_pauli_rotations(wfn, {PauliRotation{make_pauli_mask(b, qs), phi}}, make_mask(cs));
+}
 
-    std::size_t offset = 1ull << lowest;
-    std::size_t cmask = make_mask(cs);
-    std::size_t cmasku = cmask & (~(offset - 1));
+/// Computes sum_k coefficients[k] * <psi|P_k|psi> without modifying the state. Terms that share the same X/Y support
+/// (the same `xy_bits`, e.g. all qubit-wise commuting terms of a measurement group) pair the same amplitudes
+/// x <-> x ^ xy_bits, so they are grouped and evaluated together, and all groups are accumulated in a single sweep
+/// over the wave function.
+template <class T, class A>
+double expectation_pauli_sum(
+    std::vector<std::complex<T>, A> const& wfn,
+    std::vector<PauliMask> const& terms,
+    std::vector<double> const& coefficients)
+{
+    assert(terms.size() == coefficients.size());
 
-    if (isDiagonal(b))
+    // For every distinct xy_bits mask, keep the yz_bits masks of its terms along with their weights
+    // coefficient * i^y_count (only the real and imaginary parts of i^y_count * (-1)^parity survive, and only one of
+    // them is non-zero).
+    std::vector<std::size_t> group_xy;
+    std::vector<std::vector<std::size_t>> group_yz;
+    std::vector<std::vector<std::complex<double>>> group_weights;
+    for (std::size_t k = 0; k < terms.size(); ++k)
     {
-        std::size_t mask = make_mask(qs);
-        ComplexType phase = std::exp(ComplexType(0., -phi));
-
-#pragma omp parallel for schedule(static)
-        for (std::intptr_t x = 0; x < static_cast<std::intptr_t>(wfn.size()); x++)
-            if ((x & cmask) == cmask) wfn[x] *= (poppar(x & mask) ? phase : std::conj(phase));
-    }
-    else
-    { // see Exp-implementation-details.txt for the explanation of the algorithm below
-        std::size_t xy_bits = 0;
-        std::size_t yz_bits = 0;
-        int y_count = 0;
-        for (unsigned i = 0; i < b.size(); ++i)
+        auto it = std::find(group_xy.begin(), group_xy.end(), terms[k].xy_bits);
+        std::size_t g = it - group_xy.begin();
+        if (it == group_xy.end())
         {
-            switch (b[i])
-            {
-            case Gates::PauliX:
-                xy_bits |= (1ull << qs[i]);
-                break;
-            case Gates::PauliY:
-                xy_bits |= (1ull << qs[i]);
-                yz_bits |= (1ull << qs[i]);
-                ++y_count;
-                break;
-            case Gates::PauliZ:
-                yz_bits |= (1ull << qs[i]);
-                break;
-            case Gates::PauliI:
-                break;
-            default:
-                assert(false);
-            }
+            group_xy.push_back(terms[k].xy_bits);
+            group_yz.emplace_back();
+            group_weights.emplace_back();
         }
+        group_yz[g].push_back(terms[k].yz_bits);
+        group_weights[g].push_back(coefficients[k] * std::complex<double>(iExp(terms[k].y_count)));
+    }
 
-        T alpha = std::cos(phi);
-        ComplexType beta = std::sin(phi) * iExp(3 * y_count + 1);
-        ComplexType gamma = std::sin(phi) * iExp(y_count + 1);
-
-#pragma omp parallel for schedule(static)
-        for (std::intptr_t x = 0; x < static_cast<std::intptr_t>(wfn.size()); x++)
+    double sum = 0.;
+#pragma omp parallel for schedule(static) reduction(+ : sum)
+    for (std::intptr_t x = 0; x < static_cast<std::intptr_t>(wfn.size()); x++)
+    {
+        std::complex<double> const amp = wfn[x];
+        for (std::size_t g = 0; g < group_xy.size(); ++g)
         {
-            std::intptr_t t = x ^ xy_bits;
-            if (x < t && ((x & cmask) == cmask))
+            // <psi|P|psi> = sum_x conj(psi[x ^ xy]) * i^y_count * (-1)^parity(x & yz) * psi[x]
+            std::complex<double> const prod = std::conj(std::complex<double>(wfn[x ^ group_xy[g]])) * amp;
+            std::vector<std::size_t> const& yz = group_yz[g];
+            std::vector<std::complex<double>> const& w = group_weights[g];
+            for (std::size_t k = 0; k < yz.size(); ++k)
             {
-                auto parity = poppar(x & yz_bits);
-                auto a = wfn[x];
-                auto b = wfn[t];
-                wfn[x] = alpha * a + (parity ? -beta : beta) * b;
-                wfn[t] = alpha * b + (parity ? -gamma : gamma) * a;
+                double const contribution = w[k].real() * prod.real() - w[k].imag() * prod.imag();
+                sum += poppar(x & yz[k]) ? -contribution : contribution;
             }
         }
     }
+    return sum;
 }
 
 template <class T, class A>
@@ -351,6 +563,552 @@ double jointprobability(
     return prob;
 }
 
+/// Draws one basis state per entry of `uniforms` (random numbers in [0, 1)) from the distribution |wfn[i]|^2, without
+/// modifying the state. The wave function is split into per-thread chunks: the first sweep computes the total weight of
+/// each chunk, the second sweep walks the running sum of each chunk once and resolves all (sorted) random numbers that
+/// fall into it, so all samples cost two passes over the state regardless of their number.
+template <class T, class A>
+std::vector<std::size_t> sample(std::vector<std::complex<T>, A> const& wfn, std::vector<double> const& uniforms)
+{
+    std::vector<std::size_t> chunks =
+        split_interval_in_chunks(wfn.size(), static_cast<std::size_t>(omp_get_max_threads()));
+    const std::intptr_t nchunks = static_cast<std::intptr_t>(chunks.size() - 1);
+
+    std::vector<double> offsets(nchunks + 1, 0.);
+#pragma omp parallel for schedule(static)
+    for (std::intptr_t c = 0; c < nchunks; ++c)
+    {
+        double sum = 0.;
+        for (std::size_t i = chunks[c]; i < chunks[c + 1]; ++i)
+            sum += std::norm(wfn[i]);
+        offsets[c + 1] = sum;
+    }
+    for (std::intptr_t c = 0; c < nchunks; ++c)
+        offsets[c + 1] += offsets[c];
+
+    // sort the scaled random numbers, but remember which sample each of them belongs to
+    std::vector<std::size_t> order(uniforms.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&uniforms](std::size_t a, std::size_t b) { return uniforms[a] < uniforms[b]; });
+    std::vector<double> targets(uniforms.size());
+    for (std::size_t j = 0; j < order.size(); ++j)
+        targets[j] = uniforms[order[j]] * offsets[nchunks];
+
+    // random numbers that round up to the total weight are resolved by the last chunk with a non-zero weight, so they
+    // don't end up on a zero amplitude of the chunks after it
+    std::intptr_t lastchunk = nchunks - 1;
+    while (lastchunk > 0 && offsets[lastchunk + 1] == offsets[lastchunk])
+        --lastchunk;
+
+    std::vector<std::size_t> samples(uniforms.size(), 0);
+#pragma omp parallel for schedule(static)
+    for (std::intptr_t c = 0; c <= lastchunk; ++c)
+    {
+        std::size_t j = std::lower_bound(targets.begin(), targets.end(), offsets[c]) - targets.begin();
+        const std::size_t end = (c == lastchunk)
+                                    ? targets.size()
+                                    : std::lower_bound(targets.begin(), targets.end(), offsets[c + 1]) - targets.begin();
+        if (j == end) continue;
+
+        double acc = offsets[c];
+        std::size_t last = chunks[c];
+        for (std::size_t i = chunks[c]; i < chunks[c + 1] && j < end; ++i)
+        {
+            const double p = std::norm(wfn[i]);
+            if (p == 0.) continue;
+            last = i;
+            acc += p;
+            while (j < end && targets[j] < acc)
+                samples[order[j++]] = i;
+        }
+        // random numbers that fell past the accumulated sum because of rounding go to the last non-zero state
+        while (j < end)
+            samples[order[j++]] = last;
+    }
+    return samples;
+}
+
+/// Multiply each amplitude by the entry of `phases` selected by the bits of its index at `positions` (ascending, the
+/// lowest position maps to the least significant bit of the table index). Indices differing only below the lowest
+/// position share a phase, so the state is streamed in runs of constant phase; the table index of a run is assembled
+/// from per-byte lookup tables rather than bit by bit. Runs are split into halves until there is one for every thread,
+/// so that phases on the highest qubits still keep all threads busy.
+template <class T, class A>
+void apply_diagonal(
+    std::vector<std::complex<T>, A>& wfn,
+    std::vector<unsigned> const& positions,
+    std::vector<ComplexType> const& phases)
+{
+    assert(!positions.empty() && std::is_sorted(positions.begin(), positions.end()));
+    assert(phases.size() == (1ull << positions.size()));
+
+    unsigned const nbytes = positions.back() / 8 + 1;
+    std::vector<std::size_t> lut(256 * nbytes, 0);
+    for (unsigned r = 0; r < positions.size(); ++r)
+    {
+        unsigned const byte = positions[r] / 8;
+        unsigned const shift = positions[r] % 8;
+        for (unsigned v = 0; v < 256; ++v)
+            if ((v >> shift) & 1) lut[256 * byte + v] |= 1ull << r;
+    }
+
+    std::vector<std::complex<T>> table(phases.begin(), phases.end());
+
+    std::intptr_t const n = static_cast<std::intptr_t>(wfn.size());
+    std::intptr_t run = 1ll << positions.front();
+    while (run > 1 && n / run < static_cast<std::intptr_t>(omp_get_max_threads()))
+        run >>= 1;
+#pragma omp parallel for schedule(static)
+    for (std::intptr_t base = 0; base < n; base += run)
+    {
+        std::size_t t = 0;
+        for (unsigned byte = 0; byte < nbytes; ++byte)
+            t |= lut[256 * byte + ((base >> (8 * byte)) & 255)];
+        T const pr = table[t].real();
+        T const pi = table[t].imag();
+        for (std::intptr_t i = base; i < base + run; ++i)
+        {
+            T const ar = wfn[i].real();
+            T const ai = wfn[i].imag();
+            wfn[i] = std::complex<T>(ar * pr - ai * pi, ar * pi + ai * pr);
+        }
+    }
+}
+
+/// Permute the basis states of the qubits at `positions` (ascending, the lowest position maps to the least significant
+/// bit of a table index): the amplitude of table index t moves to table index table[t], for every assignment of the
+/// remaining qubits. The amplitudes are moved in place along the cycles of the permutation, fixed points are skipped.
+/// Cycles longer than `segment` are split into segments, which only hand the amplitude of their last element over to
+/// the first element of the next one, in a second pass. Every (assignment, segment) pair is then an independent task,
+/// so registers spanning most of the state are still permuted by all threads, even along a single long cycle (as for an
+/// increment). Besides the state, this needs O(table.size()) memory. `table` has to be a permutation, or the walk along
+/// a cycle doesn't end.
+template <class T, class A>
+void apply_permutation(
+    std::vector<T, A>& wfn,
+    std::vector<unsigned> const& positions,
+    std::vector<std::size_t> const& table)
+{
+    assert(!positions.empty() && std::is_sorted(positions.begin(), positions.end()));
+    assert(table.size() == (1ull << positions.size()));
+
+    // offset of each table index in the wave function
+    std::vector<std::size_t> offsets(table.size(), 0);
+    for (std::size_t t = 0; t < table.size(); ++t)
+        for (unsigned r = 0; r < positions.size(); ++r)
+            offsets[t] |= ((t >> r) & 1) << positions[r];
+
+    // the segments of the non-trivial cycles, a whole cycle hands its last amplitude over to its own first element
+    struct Segment
+    {
+        std::size_t first;
+        std::size_t length;
+        std::size_t next;
+    };
+    constexpr std::size_t segment = std::size_t(1) << 12;
+    std::vector<Segment> segments;
+    std::vector<std::size_t> split;
+    std::vector<bool> visited(table.size(), false);
+    for (std::size_t t = 0; t < table.size(); ++t)
+    {
+        if (visited[t] || table[t] == t) continue;
+        std::size_t const cycle = segments.size();
+        std::size_t length = 0;
+        for (std::size_t u = t; !visited[u]; u = table[u], ++length)
+        {
+            if (length % segment == 0) segments.push_back({u, 0, t});
+            ++segments.back().length;
+            visited[u] = true;
+        }
+        if (segments.size() - cycle == 1) continue;
+        for (std::size_t s = cycle; s < segments.size(); ++s)
+        {
+            if (s + 1 < segments.size()) segments[s].next = segments[s + 1].first;
+            split.push_back(s);
+        }
+    }
+    if (segments.empty()) return;
+
+    std::intptr_t const nbases = static_cast<std::intptr_t>(wfn.size() >> positions.size());
+    std::intptr_t const nsegments = static_cast<std::intptr_t>(segments.size());
+    std::intptr_t const nsplit = static_cast<std::intptr_t>(split.size());
+    subspace_index const index(make_mask(positions), 0);
+    // the amplitudes handed over between the segments of split cycles, per assignment
+    std::vector<T> handed(static_cast<std::size_t>(nbases * nsplit));
+    std::vector<std::intptr_t> slot(segments.size(), -1);
+    for (std::intptr_t k = 0; k < nsplit; ++k)
+        slot[split[k]] = k;
+#pragma omp parallel for schedule(guided)
+    for (std::intptr_t task = 0; task < nbases * nsegments; ++task)
+    {
+        // the bits of the assignment are spread over the positions not in the permutation
+        std::size_t const base = index(task / nsegments);
+        Segment const& s = segments[task % nsegments];
+        T carried = wfn[base + offsets[s.first]];
+        std::size_t t = s.first;
+        for (std::size_t k = 1; k < s.length; ++k)
+        {
+            t = table[t];
+            std::swap(carried, wfn[base + offsets[t]]);
+        }
+        // a whole cycle ends at its own first element, which nothing else touches; the first element of a segment of a
+        // split cycle is only read by its own task here and written by the second pass
+        if (slot[task % nsegments] < 0)
+            wfn[base + offsets[s.next]] = carried;
+        else
+            handed[(task / nsegments) * nsplit + slot[task % nsegments]] = carried;
+    }
+    if (nsplit == 0) return;
+#pragma omp parallel for schedule(static)
+    for (std::intptr_t task = 0; task < nbases * nsplit; ++task)
+    {
+        std::size_t const base = index(task / nsplit);
+        wfn[base + offsets[segments[split[task % nsplit]].next]] = handed[task];
+    }
+}
+
+/// Per-byte lookup tables that move bit k of an index to bit positions[k]: entry 256 * b + v holds the bits of the
+/// byte value v at byte b of the index, moved to their positions. Use with scatter_bits.
+inline std::vector<std::size_t> scatter_table(std::vector<unsigned> const& positions)
+{
+    unsigned const nbytes = static_cast<unsigned>(positions.size() + 7) / 8;
+    std::vector<std::size_t> lut(256 * std::max(nbytes, 1u), 0);
+    for (unsigned k = 0; k < positions.size(); ++k)
+    {
+        for (unsigned v = 0; v < 256; ++v)
+            if ((v >> (k % 8)) & 1) lut[256 * (k / 8) + v] |= 1ull << positions[k];
+    }
+    return lut;
+}
+
+inline std::size_t scatter_bits(std::vector<std::size_t> const& lut, std::size_t index)
+{
+    std::size_t moved = 0;
+    for (std::size_t b = 0; b < lut.size(); b += 256, index >>= 8)
+        moved |= lut[b + (index & 255)];
+    return moved;
+}
+
+/// Copy the amplitudes of the basis states [offset, offset + count) of the state in which bit k is the qubit at
+/// positions[k] (a permutation of all positions) into re and im, in parallel.
+template <class T, class A>
+void export_amplitudes(
+    std::vector<std::complex<T>, A> const& wfn,
+    std::vector<unsigned> const& positions,
+    std::size_t offset,
+    std::size_t count,
+    double* re,
+    double* im)
+{
+    assert(wfn.size() == (1ull << positions.size()) && offset + count <= wfn.size());
+
+    std::vector<std::size_t> const lut = scatter_table(positions);
+#pragma omp parallel for schedule(static)
+    for (std::intptr_t j = 0; j < static_cast<std::intptr_t>(count); ++j)
+    {
+        std::complex<T> const a = wfn[scatter_bits(lut, offset + j)];
+        re[j] = a.real();
+        im[j] = a.imag();
+    }
+}
+
+/// Same as export_amplitudes but only for the amplitudes with a magnitude above `threshold`: starting at basis state
+/// `cursor`, write the basis states and amplitudes of up to `capacity` of them. Returns how many were written and
+/// advances `cursor` past the last basis state examined (to wfn.size() at the end of the state).
+template <class T, class A>
+std::size_t export_nonzero(
+    std::vector<std::complex<T>, A> const& wfn,
+    std::vector<unsigned> const& positions,
+    double threshold,
+    std::size_t& cursor,
+    std::size_t capacity,
+    std::size_t* indices,
+    double* re,
+    double* im)
+{
+    assert(wfn.size() == (1ull << positions.size()));
+
+    std::vector<std::size_t> const lut = scatter_table(positions);
+    double const cutoff = threshold * threshold;
+    std::size_t written = 0;
+    for (; cursor < wfn.size() && written < capacity; ++cursor)
+    {
+        std::complex<T> const a = wfn[scatter_bits(lut, cursor)];
+        if (std::norm(a) <= cutoff) continue;
+        indices[written] = cursor;
+        re[written] = a.real();
+        im[written] = a.imag();
+        ++written;
+    }
+    return written;
+}
+
+/// Same as apply_permutation, but the image of table index t is f(t), computed on the fly rather than read from a
+/// table, so no table of the 2^positions.size() images is needed. With `inverse`, the amplitude of table index f(t)
+/// moves to t instead. The cycles are found with a bitmap of the table indices visited so far and applied in batches:
+/// every (assignment, cycle) pair of a batch is an independent task, which walks its cycle by calling f again. So f is
+/// called concurrently, about twice per amplitude, and apart from the state this needs 2^positions.size() bits.
+/// Returns false as soon as f is found not to be a permutation of the table indices (an image out of range, or a walk
+/// that doesn't return to its start); the batches before were already applied by then.
+template <class T, class A, class F>
+bool apply_permutation(std::vector<T, A>& wfn, std::vector<unsigned> const& positions, F const& f, bool inverse)
+{
+    assert(!positions.empty() && std::is_sorted(positions.begin(), positions.end()));
+
+    std::vector<std::size_t> const lut = scatter_table(positions);
+    subspace_index const index(make_mask(positions), 0);
+    std::intptr_t const nbases = static_cast<std::intptr_t>(wfn.size() >> positions.size());
+    auto apply = [&](std::vector<std::size_t> const& leaders) {
+        std::intptr_t const ncycles = static_cast<std::intptr_t>(leaders.size());
+#pragma omp parallel for schedule(guided)
+        for (std::intptr_t task = 0; task < nbases * ncycles; ++task)
+        {
+            std::size_t const base = index(task / ncycles);
+            std::size_t const t0 = leaders[task % ncycles];
+            if (inverse)
+            {
+                T const first = wfn[base + scatter_bits(lut, t0)];
+                std::size_t t = t0;
+                for (std::size_t u = f(t0); u != t0; t = u, u = f(u))
+                    wfn[base + scatter_bits(lut, t)] = wfn[base + scatter_bits(lut, u)];
+                wfn[base + scatter_bits(lut, t)] = first;
+            }
+            else
+            {
+                T carried = wfn[base + scatter_bits(lut, t0)];
+                for (std::size_t t = f(t0); t != t0; t = f(t))
+                    std::swap(carried, wfn[base + scatter_bits(lut, t)]);
+                wfn[base + scatter_bits(lut, t0)] = carried;
+            }
+        }
+    };
+
+    // a batch holds cycles of at least this many table indices in total, unless it is the last one
+    constexpr std::size_t batch = std::size_t(1) << 16;
+    std::size_t const size = std::size_t(1) << positions.size();
+    std::vector<bool> visited(size, false);
+    std::vector<std::size_t> leaders;
+    std::size_t batched = 0;
+    for (std::size_t t0 = 0; t0 < size; ++t0)
+    {
+        if (visited[t0]) continue;
+        std::size_t length = 0;
+        std::size_t t = t0;
+        do
+        {
+            visited[t] = true;
+            ++length;
+            t = f(t);
+            if (t >= size) return false;
+        } while (!visited[t]);
+        if (t != t0) return false;
+        if (length == 1) continue;
+
+        leaders.push_back(t0);
+        batched += length;
+        if (batched >= batch)
+        {
+            apply(leaders);
+            leaders.clear();
+            batched = 0;
+        }
+    }
+    if (!leaders.empty()) apply(leaders);
+    return true;
+}
+
+/// Per-byte lookup tables that collect the bits of an index at positions[k] into bit k, for k < count. Use with
+/// scatter_bits, which combines the entries of the bytes the same way.
+inline std::vector<std::size_t> gather_table(std::vector<unsigned> const& positions, unsigned count)
+{
+    unsigned nbytes = 1;
+    for (unsigned k = 0; k < count; ++k)
+        nbytes = std::max(nbytes, positions[k] / 8 + 1);
+    std::vector<std::size_t> lut(256 * nbytes, 0);
+    for (unsigned k = 0; k < count; ++k)
+    {
+        for (unsigned v = 0; v < 256; ++v)
+            if ((v >> (positions[k] % 8)) & 1) lut[256 * (positions[k] / 8) + v] |= 1ull << k;
+    }
+    return lut;
+}
+
+/// The twiddle factors exp(i pi sign l / 2^j) for l < 2^bits, from two tables of about 2^(bits/2) entries each.
+class Twiddles
+{
+  public:
+    Twiddles(unsigned j, unsigned bits, double sign)
+        : low_bits_(bits / 2)
+        , low_(std::size_t(1) << low_bits_)
+        , high_(std::size_t(1) << (bits - low_bits_))
+    {
+        const double angle = sign * M_PI / std::ldexp(1., static_cast<int>(j));
+        for (std::size_t l = 0; l < low_.size(); ++l)
+            low_[l] = std::polar(1., angle * l);
+        for (std::size_t h = 0; h < high_.size(); ++h)
+            high_[h] = std::polar(1., angle * std::ldexp(static_cast<double>(h), static_cast<int>(low_bits_)));
+    }
+
+    ComplexType operator()(std::size_t l) const
+    {
+        return high_[l >> low_bits_] * low_[l & (low_.size() - 1)];
+    }
+
+  private:
+    unsigned low_bits_;
+    std::vector<ComplexType> low_;
+    std::vector<ComplexType> high_;
+};
+
+/// Quantum Fourier transform of the register whose bit k is the qubit at positions[k] (in any order), for every
+/// assignment of the other qubits: |x> -> 2^(-n/2) sum_y exp(2 pi i x y / 2^n) |y>, or exp(-2 pi i x y / 2^n) for the
+/// adjoint. This is a decimation-in-frequency FFT done in place on the state: stage j combines the pairs that differ
+/// in register bit j (from the highest), with twiddles that depend on the lower register bits, so the transform takes
+/// one parallel pass over the state per two stages (radix 4) instead of one per gate of the QFT circuit. The result
+/// is left in bit-reversed order: register bit k holds bit n-1-k of y, the caller swaps the qubits by relabeling them.
+template <class T, class A>
+void qft(std::vector<std::complex<T>, A>& wfn, std::vector<unsigned> const& positions, bool adjoint)
+{
+    const unsigned n = static_cast<unsigned>(positions.size());
+    const double sign = adjoint ? -1. : 1.;
+    unsigned j = n;
+    for (; j >= 2; j -= 2)
+    {
+        // stages j-1 and j-2 on the quadruples x, x + b1, x + b0, x + b1 + b0 with both bits 0 in x; l are the register
+        // bits below both, the twiddles are w = exp(i pi l / 2^(j-1)) for the first stage, w * (sign i) for its pairs
+        // with bit b0 set and w^2 for the second stage
+        const std::size_t b1 = 1ull << positions[j - 1];
+        const std::size_t b0 = 1ull << positions[j - 2];
+        const std::vector<std::size_t> lut = gather_table(positions, j - 2);
+        const Twiddles twiddles(j - 1, j - 2, sign);
+        const subspace_index index(b1 | b0, 0);
+        const T half = T(0.5);
+        const T quarter_re = T(0.);
+        const T quarter_im = static_cast<T>(sign);
+        const std::intptr_t quadruples = static_cast<std::intptr_t>(wfn.size() >> 2);
+#pragma omp parallel for schedule(static)
+        for (std::intptr_t i = 0; i < quadruples; ++i)
+        {
+            const std::size_t x = index(i);
+            const ComplexType w = twiddles(scatter_bits(lut, x));
+            const T wr = static_cast<T>(w.real());
+            const T wi = static_cast<T>(w.imag());
+            // w * (sign i) and w^2
+            const T vr = wr * quarter_re - wi * quarter_im;
+            const T vi = wr * quarter_im + wi * quarter_re;
+            const T ur = wr * wr - wi * wi;
+            const T ui = 2 * wr * wi;
+
+            const std::complex<T> a = wfn[x];
+            const std::complex<T> b = wfn[x | b1];
+            const std::complex<T> c = wfn[x | b0];
+            const std::complex<T> d = wfn[x | b1 | b0];
+            // first stage
+            const T a1r = a.real() + b.real(), a1i = a.imag() + b.imag();
+            const T c1r = c.real() + d.real(), c1i = c.imag() + d.imag();
+            const T br = a.real() - b.real(), bi = a.imag() - b.imag();
+            const T dr = c.real() - d.real(), di = c.imag() - d.imag();
+            const T b1r = br * wr - bi * wi, b1i = br * wi + bi * wr;
+            const T d1r = dr * vr - di * vi, d1i = dr * vi + di * vr;
+            // second stage
+            const T cr = a1r - c1r, ci = a1i - c1i;
+            const T er = b1r - d1r, ei = b1i - d1i;
+            wfn[x] = std::complex<T>(half * (a1r + c1r), half * (a1i + c1i));
+            wfn[x | b0] = std::complex<T>(half * (cr * ur - ci * ui), half * (cr * ui + ci * ur));
+            wfn[x | b1] = std::complex<T>(half * (b1r + d1r), half * (b1i + d1i));
+            wfn[x | b1 | b0] = std::complex<T>(half * (er * ur - ei * ui), half * (er * ui + ei * ur));
+        }
+    }
+    if (j == 1)
+    {
+        // the last stage has no lower bits and no twiddles: a Hadamard on register bit 0
+        const std::size_t b = 1ull << positions[0];
+        const subspace_index index(b, 0);
+        const T r = static_cast<T>(1. / std::sqrt(2.));
+        const std::intptr_t pairs = static_cast<std::intptr_t>(wfn.size() >> 1);
+#pragma omp parallel for schedule(static)
+        for (std::intptr_t i = 0; i < pairs; ++i)
+        {
+            const std::size_t x = index(i);
+            const std::complex<T> a = wfn[x];
+            const std::complex<T> c = wfn[x | b];
+            wfn[x] = std::complex<T>(r * (a.real() + c.real()), r * (a.imag() + c.imag()));
+            wfn[x | b] = std::complex<T>(r * (a.real() - c.real()), r * (a.imag() - c.imag()));
+        }
+    }
+}
+
+/// Reflect the register whose bit k is the qubit at positions[k] about the (normalized) state phi(x), for every
+/// assignment of the other qubits: psi -> psi - 2 <phi|psi> phi, the same as the circuit that unprepares phi, flips the
+/// phase of |0...0> and prepares phi again. The overlap with each assignment of the other qubits is subtracted right
+/// after it is computed (for small registers, while their amplitudes are still in cache), so no overlaps are stored.
+/// The loop runs over the assignments of the other qubits when there are enough of them to keep the threads busy and
+/// over the register otherwise.
+template <class T, class A, class F>
+void reflect_about_state(std::vector<std::complex<T>, A>& wfn, std::vector<unsigned> const& positions, F const& phi)
+{
+    const std::size_t dim = std::size_t(1) << positions.size();
+    const std::size_t rest = wfn.size() / dim;
+    std::vector<unsigned> others;
+    const std::size_t mask = make_mask(positions);
+    for (unsigned p = 0; (std::size_t(1) << p) < wfn.size(); ++p)
+    {
+        if (!((mask >> p) & 1)) others.push_back(p);
+    }
+    const std::vector<std::size_t> lut = scatter_table(positions);
+    const std::vector<std::size_t> others_lut = scatter_table(others);
+    const bool outer = rest >= static_cast<std::size_t>(omp_get_max_threads());
+
+#pragma omp parallel for schedule(static) if (outer)
+    for (std::intptr_t r = 0; r < static_cast<std::intptr_t>(rest); ++r)
+    {
+        const std::size_t base = scatter_bits(others_lut, r);
+        double re = 0., im = 0.;
+#pragma omp parallel for schedule(static) reduction(+ : re, im) if (!outer)
+        for (std::intptr_t x = 0; x < static_cast<std::intptr_t>(dim); ++x)
+        {
+            const ComplexType c = std::conj(phi(x)) * ComplexType(wfn[base | scatter_bits(lut, x)]);
+            re += c.real();
+            im += c.imag();
+        }
+        const ComplexType overlap(-2. * re, -2. * im);
+#pragma omp parallel for schedule(static) if (!outer)
+        for (std::intptr_t x = 0; x < static_cast<std::intptr_t>(dim); ++x)
+            wfn[base | scatter_bits(lut, x)] += std::complex<T>(overlap * phi(x));
+    }
+}
+
+/// Reflect the register about its uniform superposition, see reflect_about_state: psi -> psi - 2 <s|psi> s, which is
+/// the Grover diffusion operator H X (controlled Z) X H applied in one sweep over the state instead of 4n+1 gates.
+template <class T, class A>
+void reflect_about_uniform(std::vector<std::complex<T>, A>& wfn, std::vector<unsigned> const& positions)
+{
+    const ComplexType amplitude = std::sqrt(std::ldexp(1., -static_cast<int>(positions.size())));
+    reflect_about_state(wfn, positions, [amplitude](std::size_t) { return amplitude; });
+}
+
+/// Remove the qubits at `positions` (ascending) from the state, where bit r of `values` is the classical value of the
+/// qubit at positions[r]. The remaining amplitudes are gathered into a state of the reduced size in a single pass.
+template <class T, class A>
+void remove_qubits(std::vector<T, A>& wfn, std::vector<unsigned> const& positions, std::size_t values)
+{
+    assert(std::is_sorted(positions.begin(), positions.end()));
+
+    std::vector<T, A> compacted(wfn.size() >> positions.size());
+#pragma omp parallel for schedule(static)
+    for (std::intptr_t j = 0; j < static_cast<std::intptr_t>(compacted.size()); ++j)
+    {
+        std::size_t i = j;
+        for (unsigned r = 0; r < positions.size(); ++r)
+        {
+            unsigned const p = positions[r];
+            i = ((i >> p) << (p + 1)) | (i & ((1ull << p) - 1)) | (((values >> r) & 1) << p);
+        }
+        compacted[j] = wfn[i];
+    }
+    std::swap(wfn, compacted);
+}
+
 // get the 2-norm
 template <class T, class A>
 double nrm2(std::vector<std::complex<T>, A> const& x)
@@ -10,6 +10,8 @@
 #include <bitset>
 #include <chrono>
 #include <cmath>
+#include <cstdio>
+#include <fstream>
 
 using namespace Microsoft::Quantum::SIMULATOR;
 
@@ -367,7 +369,8 @@ TEST_CASE("set_register", "[local_test]")
     CHECK(174 == detail::set_register({6, 3, 2}, 76 /*mask*/, 6 /*|011>*/, 226 /*|11100010>*/));
 }
 
-void CheckWaveFunction(const std::vector<ComplexType>& expected, const WavefunctionStorage& wfn)
+template <class A>
+void CheckWaveFunction(const std::vector<ComplexType>& expected, const std::vector<ComplexType, A>& wfn)
 {
     REQUIRE(expected.size() == wfn.size());
     for (size_t i = 0; i < expected.size(); i++)
@@ -966,3 +969,1153 @@ TEST_CASE("test_extract_qubits_state", "[local_test]")
     test_extract_qubits_cat_state(6, {0, 1, 3}, {0, 1});
     test_extract_qubits_cat_state(10, {0, 5}, {5, 6});
 }
+
+TEST_CASE("ExpectationPauliSum matches JointEnsembleProbability", "[local_test]")
+{
+    using namespace Gates;
+    SimulatorType sim;
+
+    // prepare an entangled state with non-trivial phases
+    auto qs = sim.allocate(4);
+    for (unsigned i = 0; i < qs.size(); ++i)
+        sim.R(PauliY, 0.3 + 0.4 * i, qs[i]);
+    sim.CX(qs[0], qs[1]);
+    sim.CX(qs[2], qs[3]);
+    sim.R(PauliX, 1.1, qs[1]);
+    sim.T(qs[3]);
+    sim.H(qs[2]);
+    sim.CZ(qs[1], qs[2]);
+
+    std::vector<std::vector<Basis>> terms = {{PauliZ, PauliZ},         {PauliX, PauliI, PauliX, PauliY},
+                                             {PauliY},                 {PauliX, PauliX},
+                                             {PauliI},                 {PauliZ, PauliX, PauliY, PauliZ},
+                                             {PauliY, PauliY, PauliY}, {PauliZ}};
+    std::vector<std::vector<logical_qubit_id>> qubits = {{qs[0], qs[3]}, {qs[0], qs[1], qs[2], qs[3]},
+                                                         {qs[2]},        {qs[1], qs[3]},
+                                                         {qs[0]},        {qs[0], qs[1], qs[2], qs[3]},
+                                                         {qs[1], qs[2], qs[3]}, {qs[2]}};
+    std::vector<double> coefficients = {0.5, -1.25, 0.75, 2.0, 0.125, -0.5, 1.5, 0.25};
+
+    double expected = 0.;
+    for (std::size_t k = 0; k < terms.size(); ++k)
+    {
+        double const p = sim.JointEnsembleProbability(terms[k], qubits[k]);
+        bool const identity = std::all_of(terms[k].begin(), terms[k].end(), [](Basis b) { return b == PauliI; });
+        expected += coefficients[k] * (identity ? 1. : 1. - 2. * p);
+    }
+
+    double const actual = sim.ExpectationPauliSum(terms, coefficients, qubits);
+    CHECK(std::abs(actual - expected) < 1e-10);
+
+    // the state must not have been disturbed
+    CHECK(std::abs(sim.ExpectationPauliSum(terms, coefficients, qubits) - expected) < 1e-10);
+}
+
+TEST_CASE("Sample draws from the final state without collapsing it", "[local_test]")
+{
+    using namespace Gates;
+    SimulatorType sim;
+    sim.seed(42);
+
+    // q0 is |1>, (q1, q2) is a Bell pair and q3 has P(1) = sin^2(0.6)
+    auto qs = sim.allocate(4);
+    sim.X(qs[0]);
+    sim.H(qs[1]);
+    sim.CX(qs[1], qs[2]);
+    sim.R(PauliY, 1.2, qs[3]);
+
+    std::size_t const nshots = 20000;
+    std::vector<std::size_t> samples = sim.Sample({qs[0], qs[1], qs[2], qs[3]}, nshots);
+    REQUIRE(samples.size() == nshots);
+
+    std::size_t ones1 = 0, ones3 = 0;
+    for (std::size_t s : samples)
+    {
+        CHECK((s & 1) == 1);
+        CHECK(((s >> 1) & 1) == ((s >> 2) & 1));
+        ones1 += (s >> 1) & 1;
+        ones3 += (s >> 3) & 1;
+    }
+    CHECK(std::abs(ones1 / double(nshots) - 0.5) < 0.02);
+    CHECK(std::abs(ones3 / double(nshots) - std::sin(0.6) * std::sin(0.6)) < 0.02);
+
+    // bit i of a sample corresponds to the i-th requested qubit
+    for (std::size_t s : sim.Sample({qs[2], qs[0]}, 100))
+        CHECK(((s >> 1) & 1) == 1);
+
+    // the state is untouched
+    CHECK(std::abs(sim.JointEnsembleProbability({PauliZ}, {qs[3]}) - std::sin(0.6) * std::sin(0.6)) < 1e-10);
+
+    // samples are reproducible under the same seed
+    sim.seed(7);
+    std::vector<std::size_t> first = sim.Sample({qs[1], qs[3]}, 64);
+    sim.seed(7);
+    CHECK(first == sim.Sample({qs[1], qs[3]}, 64));
+}
+
+TEST_CASE("Samples never land on zero amplitudes, even when the random number rounds up", "[local_test]")
+{
+    // all the weight is in the first chunk, the chunks after it only hold zeros
+    WavefunctionStorage wfn(1u << 12);
+    wfn[1] = ComplexType(0.6, 0.);
+    wfn[2] = ComplexType(0., 0.8);
+    for (std::size_t s : kernels::sample(wfn, {0., 0.5, 1. - 1e-17, 1.}))
+        CHECK((s == 1 || s == 2));
+}
+
+TEST_CASE("Single-precision simulator tracks the double-precision one", "[local_test]")
+{
+    using namespace Gates;
+    SimulatorType sim;
+    SinglePrecisionSimulatorType simf;
+
+    auto qs = sim.allocate(5);
+    auto qsf = simf.allocate(5);
+    for (unsigned i = 0; i < qs.size(); ++i)
+    {
+        sim.H(qs[i]);
+        simf.H(qsf[i]);
+        sim.R(PauliX, 0.2 + 0.5 * i, qs[i]);
+        simf.R(PauliX, 0.2 + 0.5 * i, qsf[i]);
+    }
+    sim.Exp({PauliX, PauliY, PauliZ}, 0.9, {qs[0], qs[2], qs[4]});
+    simf.Exp({PauliX, PauliY, PauliZ}, 0.9, {qsf[0], qsf[2], qsf[4]});
+    sim.CZ(qs[1], qs[3]);
+    simf.CZ(qsf[1], qsf[3]);
+
+    for (unsigned i = 0; i < qs.size(); ++i)
+    {
+        CHECK(std::abs(sim.JointEnsembleProbability({PauliZ}, {qs[i]}) -
+                       simf.JointEnsembleProbability({PauliZ}, {qsf[i]})) < 1e-5);
+        CHECK(std::abs(sim.JointEnsembleProbability({PauliX, PauliY}, {qs[i], qs[(i + 1) % 5]}) -
+                       simf.JointEnsembleProbability({PauliX, PauliY}, {qsf[i], qsf[(i + 1) % 5]})) < 1e-5);
+    }
+
+    // the raw state is only exposed in double precision
+    CHECK_THROWS(simf.data());
+
+    // subsystem extraction works with single-precision rounding
+    SinglePrecisionSimulatorType product;
+    auto q = product.allocate(2);
+    product.H(q[0]);
+    product.X(q[1]);
+    WavefunctionStorage wfn(2);
+    REQUIRE(product.subsytemwavefunction({q[0]}, wfn, 1e-10));
+    CHECK(std::abs(std::abs(wfn[0]) - std::sqrt(0.5)) < 1e-6);
+    CHECK(std::abs(std::abs(wfn[1]) - std::sqrt(0.5)) < 1e-6);
+}
+
+TEST_CASE("Phase gates are fused into a single diagonal", "[local_test]")
+{
+    using namespace Gates;
+    const unsigned n = 7;
+    SimulatorType sim;
+    auto qs = sim.allocate(n);
+    for (auto q : qs)
+        sim.H(q);
+
+    // a QFT-like layer of controlled rotations together with single- and multi-qubit phase gates
+    auto phases = [&](double scale, bool adjoint) {
+        for (unsigned i = 0; i < n; ++i)
+        {
+            for (unsigned j = i + 1; j < n; ++j)
+                sim.CR(PauliZ, (adjoint ? -scale : scale) / (1 + j - i), {qs[i]}, qs[j]);
+            if (adjoint)
+                sim.AdjT(qs[i]);
+            else
+                sim.T(qs[i]);
+        }
+        sim.CZ(std::vector<logical_qubit_id>{qs[0], qs[3]}, qs[5]);
+    };
+
+    phases(1.3, false);
+
+    // the amplitude of |x> is 2^(-n/2) times the phase accumulated by x
+    auto const& psi = sim.data();
+    for (std::size_t x = 0; x < (1ull << n); ++x)
+    {
+        double angle = 0.;
+        for (unsigned i = 0; i < n; ++i)
+        {
+            if (((x >> i) & 1) == 0) continue;
+            angle += M_PI / 4;
+            for (unsigned j = i + 1; j < n; ++j)
+                angle += (((x >> j) & 1) ? 0.5 : -0.5) * 1.3 / (1 + j - i);
+        }
+        if (((x >> 0) & 1) && ((x >> 3) & 1) && ((x >> 5) & 1)) angle += M_PI;
+
+        std::complex<double> expected = std::polar(std::pow(2., -0.5 * n), angle);
+        CHECK(std::abs(psi[x] - expected) < 1e-12);
+    }
+
+    // interleave diagonal layers with dense gates and undo everything
+    sim.H(qs[2]);
+    phases(0.4, false);
+    sim.CX(qs[1], qs[4]);
+    phases(0.7, false);
+    phases(0.7, true);
+    sim.CX(qs[1], qs[4]);
+    phases(0.4, true);
+    sim.H(qs[2]);
+    phases(1.3, true);
+    for (auto q : qs)
+        sim.H(q);
+
+    for (auto q : qs)
+        CHECK(sim.isclassical(q));
+    CHECK(std::abs(std::abs(sim.data()[0]) - 1.) < 1e-12);
+}
+
+TEST_CASE("Reversible gates are composed into a single permutation", "[local_test]")
+{
+    using namespace Gates;
+    // |a>|b>|c> -> |a>|a+b mod 8>|c ^ carry>: a 3-bit ripple-carry adder out of X, CNOT and Toffoli gates
+    const unsigned n = 3;
+    SimulatorType sim;
+    auto a = sim.allocate(n);
+    auto b = sim.allocate(n);
+    auto carry = sim.allocate(n);
+    auto add = [&](bool adjoint) {
+        std::vector<std::pair<std::vector<logical_qubit_id>, logical_qubit_id>> gates;
+        for (unsigned i = 0; i < n; ++i)
+        {
+            // carry[i] holds the carry into bit i + 1
+            gates.push_back({{a[i], b[i]}, carry[i]});
+            gates.push_back({{a[i]}, b[i]});
+            if (i > 0)
+            {
+                gates.push_back({{carry[i - 1], b[i]}, carry[i]});
+                gates.push_back({{carry[i - 1]}, b[i]});
+            }
+        }
+        if (adjoint) std::reverse(gates.begin(), gates.end());
+        for (auto const& g : gates)
+            sim.CX(g.first, g.second);
+    };
+
+    for (unsigned i = 0; i < n; ++i)
+        sim.H(a[i]);
+    sim.X(b[0]);
+    sim.X(b[2]); // b = 5
+    add(false);
+
+    // the state is the uniform superposition of |a, a + 5 mod 8, carries>
+    std::vector<ComplexType> psi(sim.data(), sim.data() + (1ull << (3 * n)));
+    for (std::size_t x = 0; x < psi.size(); ++x)
+    {
+        std::size_t const va = x & 7;
+        std::size_t const vb = (x >> 3) & 7;
+        std::size_t const vc = x >> 6;
+        std::size_t expected_carries = 0;
+        for (unsigned i = 0, c = 0; i < n; ++i)
+        {
+            c = (((va >> i) & 1) + ((5 >> i) & 1) + c) >> 1;
+            expected_carries |= c << i;
+        }
+        bool const populated = vb == ((va + 5) & 7) && vc == expected_carries;
+        CHECK(std::abs(psi[x] - (populated ? std::sqrt(0.125) : 0.)) < 1e-12);
+    }
+
+    // mixed with dense and diagonal gates, the permutations stay in order
+    sim.T(b[1]);
+    sim.H(carry[0]);
+    add(false);
+    sim.H(a[1]);
+    sim.S(carry[2]);
+    sim.X(b[0]);
+    sim.X(b[0]);
+    sim.AdjS(carry[2]);
+    sim.H(a[1]);
+    add(true);
+    sim.H(carry[0]);
+    sim.AdjT(b[1]);
+
+    for (std::size_t x = 0; x < psi.size(); ++x)
+        CHECK(std::abs(sim.data()[x] - psi[x]) < 1e-12);
+}
+
+TEST_CASE("Fusion profile picks settings by state size and round-trips through its file", "[local_test]")
+{
+    // fake timings: kernels cost the same up to span 3 (memory bound) and grow quickly beyond, fusing a gate costs more
+    // than applying it to the smallest state
+    auto kernel_time = [](unsigned log2size, unsigned span, int threads) {
+        return double(1ull << log2size) * (span <= 3 ? 1. : double(1ull << (2 * span))) / threads;
+    };
+    auto fusion_time = [](unsigned span) { return 1500. * span; };
+    FusionProfile profile = FusionProfile::calibrate(kernel_time, fusion_time);
+
+    REQUIRE(profile.settings(1).span == 1); // 2^10: fusing a gate is slower than applying it
+    REQUIRE(profile.settings(1).depth == 1);
+    REQUIRE(profile.settings(1ull << 12).span == 2);
+    REQUIRE(profile.settings(1ull << 12).depth == FusionProfile::unlimited_depth);
+    REQUIRE(profile.settings(1ull << 16).span == 3);
+    REQUIRE(profile.settings(1ull << 30).span == 3); // beyond the largest measured size
+
+    const std::string path = "fusion-test.profile";
+    profile.save(path);
+    FusionProfile loaded;
+    REQUIRE(loaded.load(path));
+    for (unsigned log2size = 0; log2size < 24; ++log2size)
+    {
+        const FusionSettings& a = profile.settings(1ull << log2size);
+        const FusionSettings& b = loaded.settings(1ull << log2size);
+        REQUIRE((a.threads == b.threads && a.span == b.span && a.depth == b.depth));
+    }
+    std::remove(path.c_str());
+}
+
+TEST_CASE("Sparse simulator runs oracles on more qubits than a dense state can hold", "[local_test]")
+{
+    using namespace Gates;
+    const unsigned n = 45;
+    SparseSimulatorType sim;
+    auto qs = sim.allocate(n);
+
+    // copy a 3-qubit superposition onto all other qubits: 8 basis states out of 2^45
+    for (unsigned i = 0; i < 3; ++i)
+        sim.H(qs[i]);
+    for (unsigned i = 3; i < n; ++i)
+        sim.CX(qs[i % 3], qs[i]);
+    sim.CZ(std::vector<logical_qubit_id>{qs[40], qs[41]}, qs[44]);
+
+    for (unsigned i = 0; i < n; ++i)
+        CHECK(std::abs(sim.JointEnsembleProbability({PauliZ}, {qs[i]}) - 0.5) < 1e-10);
+    CHECK(std::abs(sim.JointEnsembleProbability({PauliZ, PauliZ}, {qs[0], qs[30]})) < 1e-10);
+    CHECK(std::abs(sim.JointEnsembleProbability({PauliX, PauliX, PauliX}, {qs[1], qs[4], qs[43]}) - 0.5) < 1e-10);
+    CHECK(std::abs(sim.ExpectationPauliSum({{PauliZ, PauliZ}}, {1.}, {{qs[2], qs[44]}}) - 1.) < 1e-10);
+
+    // a rotation that entangles the copies and is undone again
+    sim.Exp({PauliX, PauliY, PauliZ}, 0.7, {qs[0], qs[20], qs[31]});
+    sim.Exp({PauliX, PauliY, PauliZ}, -0.7, {qs[0], qs[20], qs[31]});
+    CHECK(std::abs(sim.JointEnsembleProbability({PauliZ, PauliZ}, {qs[1], qs[22]})) < 1e-10);
+
+    for (std::size_t s : sim.Sample({qs[0], qs[3], qs[42]}, 50))
+        CHECK((s == 0 || s == 7));
+
+    const bool first = sim.M(qs[0]);
+    for (unsigned i = 0; i < n; i += 3)
+        CHECK(sim.M(qs[i]) == first);
+
+    // uncompute and release everything
+    sim.CZ(std::vector<logical_qubit_id>{qs[40], qs[41]}, qs[44]);
+    for (unsigned i = n - 1; i >= 3; --i)
+        sim.CX(qs[i % 3], qs[i]);
+    for (unsigned i = 1; i < 3; ++i)
+        sim.H(qs[i]);
+    if (first) sim.X(qs[0]);
+    CHECK(sim.release(qs));
+    CHECK(sim.num_qubits() == 0);
+}
+
+TEST_CASE("QFT and reflections on small registers of a large sparse state stay sparse", "[local_test]")
+{
+    using namespace Gates;
+    // qubits 0..3, 40 and 49 of the sparse state are qubits 0..5 of the dense one, the others stay |0>
+    SimulatorType dense;
+    SparseSimulatorType sparse;
+    auto qd = dense.allocate(6);
+    auto all = sparse.allocate(50);
+    std::vector<logical_qubit_id> qs = {all[0], all[1], all[2], all[3], all[40], all[49]};
+
+    auto both = [&](auto&& op) {
+        op(dense, qd);
+        op(sparse, qs);
+    };
+    both([](auto& sim, auto const& q) {
+        sim.R(PauliY, 0.4, q[0]);
+        sim.R(PauliX, 0.7, q[3]);
+        sim.CX(q[3], q[1]);
+        sim.H(q[4]);
+        sim.CX(q[4], q[5]);
+    });
+    const std::vector<ComplexType> amplitudes = {{0.5, 0.}, {0., 0.5}, {-0.5, 0.}, {0.5, 0.}};
+    both([&](auto& sim, auto const& q) {
+        sim.QFT({q[1], q[0], q[2]}, false);
+        sim.ReflectAboutUniform({q[2], q[0]});
+        sim.ReflectAboutState({q[1], q[3]}, amplitudes);
+        sim.QFT({q[0], q[1], q[2]}, true);
+    });
+
+    for (unsigned i = 0; i < 6; ++i)
+    {
+        for (Basis b : {PauliX, PauliY, PauliZ})
+            CHECK(std::abs(dense.JointEnsembleProbability({b}, {qd[i]}) -
+                           sparse.JointEnsembleProbability({b}, {qs[i]})) < 1e-10);
+    }
+    CHECK(std::abs(dense.JointEnsembleProbability({PauliX, PauliY, PauliZ}, {qd[0], qd[1], qd[4]}) -
+                   sparse.JointEnsembleProbability({PauliX, PauliY, PauliZ}, {qs[0], qs[1], qs[4]})) < 1e-10);
+
+    // a register too large for the sparse map needs the dense state, which doesn't fit
+    std::vector<logical_qubit_id> large(all.begin() + 4, all.begin() + 40);
+    CHECK_THROWS_AS(sparse.QFT(large, false), std::runtime_error);
+}
+
+TEST_CASE("Sparse simulator tracks the dense one while switching representations", "[local_test]")
+{
+    using namespace Gates;
+    const unsigned n = 21;
+    SimulatorType dense;
+    SparseSimulatorType sparse;
+    dense.seed(11);
+    sparse.seed(11);
+    auto qd = dense.allocate(n);
+    auto qs = sparse.allocate(n);
+
+    auto compare = [&]() {
+        for (unsigned i = 0; i < n; ++i)
+            CHECK(std::abs(dense.JointEnsembleProbability({PauliZ}, {qd[i]}) -
+                           sparse.JointEnsembleProbability({PauliZ}, {qs[i]})) < 1e-10);
+        CHECK(std::abs(dense.JointEnsembleProbability({PauliX, PauliY}, {qd[0], qd[n - 1]}) -
+                       sparse.JointEnsembleProbability({PauliX, PauliY}, {qs[0], qs[n - 1]})) < 1e-10);
+        CHECK(dense.Sample({qd[0], qd[5], qd[n - 1]}, 32) == sparse.Sample({qs[0], qs[5], qs[n - 1]}, 32));
+    };
+
+    // a few non-zero amplitudes keep the state sparse
+    for (unsigned i = 0; i < 3; ++i)
+    {
+        dense.R(PauliY, 0.3 + 0.2 * i, qd[i]);
+        sparse.R(PauliY, 0.3 + 0.2 * i, qs[i]);
+    }
+    for (unsigned i = 3; i < n; ++i)
+    {
+        dense.CX(qd[i % 3], qd[i]);
+        sparse.CX(qs[i % 3], qs[i]);
+        dense.T(qd[i]);
+        sparse.T(qs[i]);
+    }
+    compare();
+
+    // a uniform superposition fills the state and moves it into a dense vector
+    for (unsigned i = 0; i < n; ++i)
+    {
+        dense.H(qd[i]);
+        sparse.H(qs[i]);
+    }
+    compare();
+
+    // measurements collapse it back into a sparse map
+    for (unsigned i = 0; i < n - 2; ++i)
+        CHECK(dense.M(qd[i]) == sparse.M(qs[i]));
+    compare();
+
+    WavefunctionStorage wd(4), ws(4);
+    REQUIRE(dense.subsytemwavefunction({qd[n - 1], qd[n - 2]}, wd, 1e-10));
+    REQUIRE(sparse.subsytemwavefunction({qs[n - 1], qs[n - 2]}, ws, 1e-10));
+    for (unsigned i = 0; i < 4; ++i)
+        CHECK(std::abs(wd[i] - ws[i]) < 1e-10);
+}
+
+TEST_CASE("Stabilizer simulator runs Clifford circuits on a thousand qubits", "[local_test]")
+{
+    using namespace Gates;
+    const unsigned n = 1000;
+    StabilizerSimulatorType sim;
+    auto qs = sim.allocate(n);
+
+    sim.H(qs[0]);
+    for (unsigned i = 1; i < n; ++i)
+        sim.CX(qs[i - 1], qs[i]);
+
+    CHECK(sim.JointEnsembleProbability({PauliZ, PauliZ}, {qs[0], qs[n - 1]}) == 0.);
+    CHECK(sim.JointEnsembleProbability({PauliX, PauliX}, {qs[3], qs[700]}) == 0.5);
+    CHECK(sim.ExpectationPauliSum({std::vector<Basis>(n, PauliX)}, {2.}, {qs}) == 2.);
+
+    std::set<std::size_t> seen;
+    for (std::size_t s : sim.Sample({qs[0], qs[500], qs[n - 1]}, 100))
+    {
+        CHECK((s == 0 || s == 7));
+        seen.insert(s);
+    }
+    CHECK(seen.size() == 2);
+
+    const bool first = sim.M(qs[n / 2]);
+    for (unsigned i = 0; i < n; i += 37)
+        CHECK(sim.M(qs[i]) == first);
+
+    // uncompute and release everything, the columns are reused by the next allocation
+    for (unsigned i = n - 1; i > 0; --i)
+        sim.CX(qs[i - 1], qs[i]);
+    if (first) sim.X(qs[0]);
+    CHECK(sim.release(qs));
+    CHECK(sim.num_qubits() == 0);
+    auto again = sim.allocate(n);
+    CHECK(sim.JointEnsembleProbability({PauliZ}, {again[n - 1]}) == 0.);
+    CHECK(sim.release(again));
+}
+
+TEST_CASE("Stabilizer simulator tracks the dense one and converts on the first non-Clifford gate", "[local_test]")
+{
+    using namespace Gates;
+    const unsigned n = 5;
+    SimulatorType dense;
+    StabilizerSimulatorType stab;
+    dense.seed(5);
+    stab.seed(5);
+    auto qd = dense.allocate(n);
+    auto qs = stab.allocate(n);
+
+    // the states agree up to a global phase
+    auto compare = [&]() {
+        ComplexType const* a = dense.data();
+        ComplexType const* b = stab.data();
+        ComplexType overlap = 0.;
+        for (std::size_t i = 0; i < (1u << n); ++i)
+            overlap += std::conj(a[i]) * b[i];
+        CHECK(std::abs(std::abs(overlap) - 1.) < 1e-10);
+        for (unsigned i = 0; i + 1 < n; ++i)
+            CHECK(std::abs(dense.JointEnsembleProbability({PauliY, PauliX}, {qd[i], qd[i + 1]}) -
+                           stab.JointEnsembleProbability({PauliY, PauliX}, {qs[i], qs[i + 1]})) < 1e-10);
+    };
+    auto both = [&](auto&& gate) {
+        gate(dense, qd);
+        gate(stab, qs);
+    };
+
+    both([](auto& sim, auto& q) {
+        sim.H(q[0]);
+        sim.S(q[0]);
+        sim.CX(q[0], q[1]);
+        sim.HY(q[2]);
+        sim.CY(q[1], q[2]);
+        sim.CZ(q[2], q[3]);
+        sim.AdjS(q[3]);
+        sim.H(q[4]);
+        sim.Y(q[4]);
+        sim.R(PauliX, M_PI / 2, q[1]);
+        sim.CR(PauliZ, M_PI, {q[4]}, q[0]);
+        sim.Exp({PauliX, PauliY, PauliZ}, M_PI / 4, {q[0], q[2], q[4]});
+        sim.Exp({PauliZ, PauliZ}, -3 * M_PI / 4, {q[1], q[3]});
+    });
+    CHECK(stab.JointEnsembleProbability({PauliZ}, {qs[0]}) == 0.5);
+    compare();
+
+    bool d = dense.M(qd[2]);
+    CHECK(stab.M(qs[2]) == d);
+    compare();
+
+    both([](auto& sim, auto& q) {
+        sim.T(q[1]);
+        sim.CX(q[1], q[3]);
+        sim.H(q[2]);
+    });
+    CHECK(std::abs(stab.JointEnsembleProbability({PauliZ}, {qs[0]}) - 0.5) < 1e-10);
+    compare();
+    for (unsigned i = 0; i < n; ++i)
+        CHECK(dense.M(qd[i]) == stab.M(qs[i]));
+}
+
+// Set an environment variable that the simulators created afterwards read, an empty value unsets it.
+void set_env(const char* name, const char* value)
+{
+#ifdef _MSC_VER
+    _putenv_s(name, value);
+#else
+    setenv(name, value, 1);
+#endif
+}
+
+TEST_CASE("Flushing large states block by block matches flushing gate by gate", "[local_test]")
+{
+    using namespace Gates;
+    // one qubit more than a block of 2^20 amplitudes, states held in memory are only flushed by blocks on request
+    const unsigned n = 21;
+    set_env("QDK_SIM_BLOCK_QUBITS", "20");
+    SimulatorType blocked;
+    set_env("QDK_SIM_BLOCK_QUBITS", "");
+    SimulatorType reference;
+    blocked.seed(3);
+    reference.seed(3);
+    auto qb = blocked.allocate(n);
+    auto qr = reference.allocate(n);
+
+    auto both = [&](auto&& gate) {
+        gate(blocked, qb);
+        gate(reference, qr);
+        // every query flushes the pending gates
+        reference.JointEnsembleProbability({PauliZ}, {qr[0]});
+    };
+    for (unsigned layer = 0; layer < 3; ++layer)
+    {
+        for (unsigned i = 0; i < n; ++i)
+        {
+            both([i, layer](auto& sim, auto& q) { sim.R(PauliY, 0.1 * (i + layer + 1), q[i]); });
+            both([i](auto& sim, auto& q) { sim.CX(q[i], q[(i + 7) % n]); });
+            // the highest qubit is used all the time and is moved into the block
+            both([i](auto& sim, auto& q) { sim.R(PauliX, 0.05 * i, q[n - 1]); });
+            if (i % 4 == 0) both([i](auto& sim, auto& q) { sim.CZ(q[n - 1], q[i]); });
+            if (i % 5 == 0) both([i](auto& sim, auto& q) { sim.T(q[i]); });
+        }
+    }
+
+    for (unsigned i = 0; i < n; ++i)
+        CHECK(std::abs(blocked.JointEnsembleProbability({PauliZ}, {qb[i]}) -
+                       reference.JointEnsembleProbability({PauliZ}, {qr[i]})) < 1e-10);
+    for (unsigned i = 0; i + 1 < n; i += 3)
+        CHECK(std::abs(blocked.JointEnsembleProbability({PauliX, PauliY}, {qb[i], qb[n - 1]}) -
+                       reference.JointEnsembleProbability({PauliX, PauliY}, {qr[i], qr[n - 1]})) < 1e-10);
+    // the qubits aren't in the same positions anymore, so only the measurements (not the samples) see the same draws
+    for (unsigned i = 0; i < n; i += 2)
+        CHECK(blocked.M(qb[i]) == reference.M(qr[i]));
+
+    // the qubits are moved back before the state is handed out, also after some of them are released
+    for (auto* sim : {&blocked, &reference})
+    {
+        auto& q = sim == &blocked ? qb : qr;
+        sim->release(q[0]);
+        sim->release({q[4], q[n - 1]});
+    }
+    ComplexType const* b = blocked.data();
+    ComplexType const* r = reference.data();
+    std::size_t differ = 0;
+    for (std::size_t i = 0; i < (std::size_t(1) << (n - 3)); ++i)
+        differ += std::abs(b[i] - r[i]) > 1e-10;
+    CHECK(differ == 0);
+}
+
+TEST_CASE("Flushing runs of low-qubit clusters tile by tile matches flushing gate by gate", "[local_test]")
+{
+    using namespace Gates;
+    // a few qubits more than a (default) tile of 2^14 amplitudes, but less than a block
+    const unsigned n = 17;
+    SimulatorType tiled;
+    SimulatorType reference;
+    auto qt = tiled.allocate(n);
+    auto qr = reference.allocate(n);
+
+    auto both = [&](auto&& gate) {
+        gate(tiled, qt);
+        gate(reference, qr);
+        reference.JointEnsembleProbability({PauliZ}, {qr[0]});
+    };
+    for (unsigned layer = 0; layer < 4; ++layer)
+    {
+        // clusters on the qubits of the tile, some of them controlled by the qubits above it
+        for (unsigned i = 0; i < 14; ++i)
+        {
+            both([i, layer](auto& sim, auto& q) { sim.R(PauliY, 0.1 * (i + layer + 1), q[i]); });
+            both([i](auto& sim, auto& q) { sim.CX(q[i], q[(i + 5) % 14]); });
+            if (i % 3 == 0) both([i](auto& sim, auto& q) { sim.CH(q[14 + i % 3], q[i]); });
+            if (i % 4 == 0) both([i](auto& sim, auto& q) { sim.CR(PauliX, 0.3, {q[15], q[16]}, q[i]); });
+        }
+        // a cluster above the tile ends the run
+        both([layer](auto& sim, auto& q) { sim.H(q[14 + layer % 3]); });
+    }
+
+    for (unsigned i = 0; i < n; ++i)
+        CHECK(std::abs(tiled.JointEnsembleProbability({PauliZ}, {qt[i]}) -
+                       reference.JointEnsembleProbability({PauliZ}, {qr[i]})) < 1e-10);
+    for (unsigned i = 0; i + 1 < n; i += 3)
+        CHECK(std::abs(tiled.JointEnsembleProbability({PauliX, PauliY}, {qt[i], qt[n - 1 - i]}) -
+                       reference.JointEnsembleProbability({PauliX, PauliY}, {qr[i], qr[n - 1 - i]})) < 1e-10);
+}
+
+TEST_CASE("Checkpoints restore the state, the pending gates and the random generator", "[local_test]")
+{
+    using namespace Gates;
+    const std::string path = "local_test_checkpoint.qsc";
+    SimulatorType sim;
+    sim.seed(17);
+    auto qs = sim.allocate(6);
+    for (unsigned i = 0; i < 6; ++i)
+        sim.R(PauliY, 0.4 + 0.3 * i, qs[i]);
+    sim.CX(qs[0], qs[5]);
+    sim.release(qs[2]);
+    sim.T(qs[3]);
+    sim.saveState(path);
+
+    // a different state, with other qubits, is replaced
+    SimulatorType restored;
+    auto other = restored.allocate(3);
+    restored.H(other[1]);
+    restored.loadState(path);
+    REQUIRE(restored.num_qubits() == 5);
+
+    ComplexType const* a = sim.data();
+    ComplexType const* b = restored.data();
+    for (std::size_t i = 0; i < (1u << 5); ++i)
+        CHECK(a[i] == b[i]);
+    for (unsigned i : {0u, 1u, 3u, 4u, 5u})
+        CHECK(sim.M(qs[i]) == restored.M(qs[i]));
+
+    SinglePrecisionSimulatorType single;
+    CHECK_THROWS(single.loadState(path));
+    StabilizerSimulatorType stabilizer;
+    stabilizer.allocate(2);
+    CHECK_THROWS(stabilizer.saveState(path));
+    CHECK_THROWS(restored.loadState("no_such_checkpoint.qsc"));
+    std::remove(path.c_str());
+}
+
+TEST_CASE("Corrupt checkpoints are rejected without changing the state", "[local_test]")
+{
+    using namespace Gates;
+    const std::string path = "local_test_corrupt.qsc";
+    SimulatorType sim;
+    auto qs = sim.allocate(3);
+    sim.H(qs[0]);
+    sim.CX(qs[0], qs[2]);
+    sim.saveState(path);
+    CHECK(!std::ifstream(path + ".tmp"));
+
+    // the metadata starts after the 40-byte header with the precision, the number of qubits, the size of the qubit
+    // map and its entries
+    auto corrupt = [&](std::size_t offset, std::uint32_t value) {
+        std::fstream f(path, std::ios::in | std::ios::out | std::ios::binary);
+        f.seekp(40 + offset);
+        f.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    };
+    SimulatorType restored;
+    auto other = restored.allocate(2);
+    restored.H(other[1]);
+    const double p = restored.JointEnsembleProbability({PauliX}, {other[1]});
+
+    corrupt(4, 70);
+    CHECK_THROWS(restored.loadState(path));
+    sim.saveState(path);
+    corrupt(16, 2); // two qubits at position 2
+    CHECK_THROWS(restored.loadState(path));
+    sim.saveState(path);
+    corrupt(16, 3); // beyond the state
+    CHECK_THROWS(restored.loadState(path));
+    CHECK(restored.num_qubits() == 2);
+    CHECK(std::abs(restored.JointEnsembleProbability({PauliX}, {other[1]}) - p) < 1e-12);
+
+    sim.saveState(path);
+    restored.loadState(path);
+    CHECK(restored.num_qubits() == 3);
+    std::remove(path.c_str());
+}
+
+TEST_CASE("Clones continue independently from the state of the original", "[local_test]")
+{
+    using namespace Gates;
+    SimulatorType sim;
+    sim.seed(23);
+    auto qs = sim.allocate(4);
+    sim.H(qs[0]);
+    for (unsigned i = 1; i < 4; ++i)
+        sim.CX(qs[0], qs[i]);
+
+    std::unique_ptr<Microsoft::Quantum::Simulator::SimulatorInterface> fork(sim.clone());
+    CHECK(fork->num_qubits() == 4);
+    CHECK(std::abs(fork->JointEnsembleProbability({PauliX, PauliX, PauliX, PauliX}, qs)) < 1e-10);
+
+    // measuring the fork in another basis leaves the original GHZ state alone
+    fork->H(qs[3]);
+    const bool x = fork->M(qs[3]);
+    CHECK(std::abs(fork->JointEnsembleProbability({PauliZ, PauliZ}, {qs[0], qs[1]})) < 1e-10);
+    CHECK(std::abs(sim.JointEnsembleProbability({PauliX, PauliX, PauliX, PauliX}, qs)) < 1e-10);
+
+    // with the same random number sequence, the same measurement gives the same result
+    sim.H(qs[3]);
+    CHECK(sim.M(qs[3]) == x);
+
+    SparseSimulatorType sparse;
+    auto ss = sparse.allocate(30);
+    sparse.H(ss[0]);
+    sparse.CX(ss[0], ss[29]);
+    std::unique_ptr<Microsoft::Quantum::Simulator::SimulatorInterface> sparse_fork(sparse.clone());
+    CHECK(sparse_fork->M(ss[0]) == sparse_fork->M(ss[29]));
+    CHECK(std::abs(sparse.JointEnsembleProbability({PauliZ}, {ss[0]}) - 0.5) < 1e-10);
+}
+
+TEST_CASE("Thread limits of simulators don't leak into the caller", "[local_test]")
+{
+    using namespace Gates;
+    const int before = omp_get_max_threads();
+    SimulatorType limited;
+    SimulatorType unlimited;
+    limited.setThreads(2);
+    auto ql = limited.allocate(18);
+    auto qu = unlimited.allocate(18);
+    for (unsigned i = 0; i < 18; ++i)
+    {
+        limited.H(ql[i]);
+        unlimited.H(qu[i]);
+    }
+    CHECK(std::abs(limited.JointEnsembleProbability({PauliX}, {ql[5]})) < 1e-10);
+    CHECK(std::abs(unlimited.JointEnsembleProbability({PauliX}, {qu[5]})) < 1e-10);
+    CHECK(omp_get_max_threads() == before);
+
+    std::unique_ptr<Microsoft::Quantum::Simulator::SimulatorInterface> fork(limited.clone());
+    fork->H(ql[0]);
+    CHECK(omp_get_max_threads() == before);
+}
+
+TEST_CASE("Marginal probabilities and the scaled collapse of a register", "[local_test]")
+{
+    const unsigned n = 12;
+    WavefunctionStorage wfn(1u << n);
+    double norm = 0.;
+    for (std::size_t i = 0; i < wfn.size(); ++i)
+    {
+        wfn[i] = ComplexType(std::sin(0.37 * i + 1.), std::cos(0.11 * i * i));
+        norm += std::norm(wfn[i]);
+    }
+
+    // positions below and above the first byte of the index
+    const std::vector<unsigned> positions = {1, 4, 9, 11};
+    std::vector<double> marginal = kernels::marginal(wfn, positions);
+    std::vector<double> expected(16, 0.);
+    for (std::size_t i = 0; i < wfn.size(); ++i)
+        expected[detail::get_register(positions, i)] += std::norm(wfn[i]);
+    for (std::size_t t = 0; t < 16; ++t)
+        CHECK(std::abs(marginal[t] - expected[t]) < 1e-9 * norm);
+
+    kernels::collapse_scaled(wfn, positions, 5, 1. / std::sqrt(marginal[5]));
+    CHECK(std::abs(kernels::nrm2(wfn) - 1.) < 1e-12);
+    for (std::size_t i = 0; i < wfn.size(); ++i)
+        if (detail::get_register(positions, i) != 5) CHECK(wfn[i] == ComplexType(0.));
+}
+
+TEST_CASE("MultiM measures registers jointly with the statistics of measuring qubit by qubit", "[local_test]")
+{
+    using namespace Gates;
+    // a GHZ state over more qubits than one joint pass measures
+    const unsigned n = kernels::max_marginal_qubits + 3;
+    SimulatorType sim;
+    sim.seed(29);
+    auto qs = sim.allocate(n);
+    sim.H(qs[0]);
+    for (unsigned i = 1; i < n; ++i)
+        sim.CX(qs[i - 1], qs[i]);
+    std::vector<logical_qubit_id> shuffled(qs.rbegin(), qs.rend());
+    std::vector<bool> results = sim.MultiM(shuffled);
+    for (unsigned i = 0; i < n; ++i)
+        CHECK(results[i] == results[0]);
+    CHECK(std::abs(sim.JointEnsembleProbability({PauliZ}, {qs[3]}) - (results[0] ? 1. : 0.)) < 1e-10);
+
+    // P(11) = 0.3 * 0.6, P(10) = 0.3 * 0.4, P(01) = 0.7 * 0.6
+    const unsigned shots = 4000;
+    std::vector<unsigned> counts(4, 0);
+    auto pair = sim.allocate(2);
+    for (unsigned s = 0; s < shots; ++s)
+    {
+        sim.R(PauliY, 2. * std::asin(std::sqrt(0.3)), pair[0]);
+        sim.R(PauliY, 2. * std::asin(std::sqrt(0.6)), pair[1]);
+        std::vector<bool> r = sim.MultiM(pair);
+        counts[r[0] + 2 * r[1]]++;
+        if (r[0]) sim.X(pair[0]);
+        if (r[1]) sim.X(pair[1]);
+    }
+    CHECK(std::abs(counts[3] / double(shots) - 0.18) < 0.03);
+    CHECK(std::abs(counts[1] / double(shots) - 0.12) < 0.03);
+    CHECK(std::abs(counts[2] / double(shots) - 0.42) < 0.04);
+}
+
+TEST_CASE("Pauli rotations on the same flipped qubits are applied in one sweep", "[local_test]")
+{
+    using namespace Gates;
+    const unsigned n = 8;
+    WavefunctionStorage wfn(1u << n);
+    for (std::size_t i = 0; i < wfn.size(); ++i)
+        wfn[i] = ComplexType(std::sin(0.37 * i + 1.), std::cos(0.11 * i * i));
+    kernels::normalize(wfn);
+
+    // exp(i phi P) psi = cos(phi) psi + i sin(phi) P psi, with P|x> = i^y_count (-1)^parity(x & yz_bits) |x ^ xy_bits>
+    auto reference = [](WavefunctionStorage const& psi, kernels::PauliRotation const& r, std::size_t cmask) {
+        WavefunctionStorage out(psi);
+        for (std::size_t x = 0; x < psi.size(); ++x)
+        {
+            if ((x & cmask) != cmask) continue;
+            const double sign = Microsoft::Quantum::poppar(x & r.mask.yz_bits) ? -1. : 1.;
+            const ComplexType p = kernels::iExp(r.mask.y_count) * sign * psi[x];
+            out[x ^ r.mask.xy_bits] = std::cos(r.phi) * psi[x ^ r.mask.xy_bits] +
+                                      ComplexType(0., std::sin(r.phi)) * p;
+        }
+        return out;
+    };
+
+    const std::vector<std::vector<kernels::PauliRotation>> groups = {
+        {{kernels::make_pauli_mask({PauliX, PauliX}, {1, 5}), 0.3},
+         {kernels::make_pauli_mask({PauliY, PauliY, PauliZ}, {1, 5, 2}), -0.8},
+         {kernels::make_pauli_mask({PauliX, PauliY}, {1, 5}), 1.9}},
+        {{kernels::make_pauli_mask({PauliZ, PauliZ}, {0, 6}), 0.4},
+         {kernels::make_pauli_mask({PauliZ, PauliZ, PauliZ}, {1, 2, 3}), -1.2}}};
+    for (std::size_t cmask : {std::size_t(0), std::size_t(1) << 7})
+    {
+        for (auto const& rotations : groups)
+        {
+            WavefunctionStorage expected(wfn);
+            for (auto const& r : rotations)
+                expected = reference(expected, r, cmask);
+            WavefunctionStorage fused(wfn);
+            kernels::apply_pauli_rotations(fused, rotations, cmask);
+            for (std::size_t i = 0; i < wfn.size(); ++i)
+                CHECK(std::abs(fused[i] - expected[i]) < 1e-12);
+        }
+    }
+
+    // the simulator queues a Trotter step and applies it the same as rotation by rotation
+    SimulatorType queued, stepped;
+    auto q1 = queued.allocate(5);
+    auto q2 = stepped.allocate(5);
+    auto step = [](SimulatorType& sim, std::vector<logical_qubit_id> const& q, bool flush) {
+        for (auto qubit : q)
+            sim.H(qubit);
+        sim.T(q[2]);
+        const std::vector<std::pair<std::vector<Basis>, double>> terms = {
+            {{PauliX, PauliX, PauliI}, 0.2}, {{PauliY, PauliY, PauliZ}, 0.5}, {{PauliZ, PauliZ, PauliZ}, -0.7},
+            {{PauliZ, PauliI, PauliZ}, 0.1}, {{PauliX, PauliY, PauliI}, 1.3}};
+        for (auto const& term : terms)
+        {
+            sim.Exp(term.first, term.second, {q[0], q[3], q[4]});
+            if (flush) sim.data();
+        }
+        sim.CExp({PauliX, PauliZ}, 0.6, {q[1]}, {q[0], q[2]});
+        sim.CExp({PauliY, PauliZ}, -0.4, {q[1]}, {q[0], q[3]});
+    };
+    step(queued, q1, false);
+    step(stepped, q2, true);
+    const ComplexType* a = queued.data();
+    const ComplexType* b = stepped.data();
+    for (std::size_t i = 0; i < 32; ++i)
+        CHECK(std::abs(a[i] - b[i]) < 1e-12);
+}
+
+TEST_CASE("Gates with many controls only change the states with all controls set", "[local_test]")
+{
+    using namespace Gates;
+    const unsigned n = 10;
+    SimulatorType sim;
+    auto qs = sim.allocate(n);
+    for (unsigned i = 0; i < n; ++i)
+    {
+        sim.H(qs[i]);
+        sim.R(PauliZ, 0.3 * (i + 1), qs[i]);
+    }
+    const ComplexType* data = sim.data();
+    std::vector<ComplexType> before(data, data + (1u << n));
+
+    // a controlled Hadamard with controls on both sides of its target
+    const std::vector<logical_qubit_id> cs = {qs[0], qs[1], qs[2], qs[5], qs[7], qs[9]};
+    sim.CH(cs, qs[3]);
+    data = sim.data();
+    const std::size_t cmask = 0x2a7;
+    const double r = 1. / std::sqrt(2.);
+    for (std::size_t x = 0; x < before.size(); ++x)
+    {
+        ComplexType expected = before[x];
+        if ((x & cmask) == cmask)
+        {
+            const ComplexType low = before[x & ~std::size_t(8)];
+            const ComplexType high = before[x | 8];
+            expected = (x & 8) ? r * (low - high) : r * (low + high);
+        }
+        CHECK(std::abs(data[x] - expected) < 1e-12);
+    }
+}
+
+TEST_CASE("permute_basis on a register spanning the whole state matches the permuted amplitudes", "[local_test]")
+{
+    const unsigned n = 8;
+    SimulatorType sim;
+    auto qs = sim.allocate(n);
+    for (unsigned i = 0; i < n; ++i)
+    {
+        sim.H(qs[i]);
+        sim.R(Gates::PauliZ, 0.2 * (i + 1), qs[i]);
+    }
+    const ComplexType* data = sim.data();
+    std::vector<ComplexType> before(data, data + (1u << n));
+
+    // x -> 5x + 3 mod 256 on the qubits in reverse order, a single long cycle and no fixed points
+    std::vector<logical_qubit_id> reversed(qs.rbegin(), qs.rend());
+    std::vector<std::size_t> table(1u << n);
+    for (std::size_t x = 0; x < table.size(); ++x)
+        table[x] = (5 * x + 3) % table.size();
+    auto reverse = [n](std::size_t x) {
+        std::size_t r = 0;
+        for (unsigned k = 0; k < n; ++k)
+            r |= ((x >> k) & 1) << (n - 1 - k);
+        return r;
+    };
+
+    sim.permuteBasis(reversed, table.size(), table.data());
+    data = sim.data();
+    for (std::size_t x = 0; x < table.size(); ++x)
+        CHECK(std::abs(data[reverse(table[reverse(x)])] - before[x]) < 1e-12);
+
+    sim.permuteBasis(reversed, table.size(), table.data(), true);
+    data = sim.data();
+    for (std::size_t x = 0; x < table.size(); ++x)
+        CHECK(std::abs(data[x] - before[x]) < 1e-12);
+}
+
+TEST_CASE("Permutation cycles longer than a segment are moved piecewise", "[local_test]")
+{
+    // x -> 5x + 3 mod 2^13 is a single cycle of two segments, on a register that leaves out two qubits of the state
+    std::vector<unsigned> positions;
+    for (unsigned p = 0; p < 15; ++p)
+        if (p != 3 && p != 9) positions.push_back(p);
+    std::vector<std::size_t> table(std::size_t(1) << positions.size());
+    for (std::size_t x = 0; x < table.size(); ++x)
+        table[x] = (5 * x + 3) % table.size();
+
+    std::vector<ComplexType> wfn(std::size_t(1) << 15);
+    for (std::size_t i = 0; i < wfn.size(); ++i)
+        wfn[i] = ComplexType(static_cast<double>(i), -1.);
+    std::vector<ComplexType> expected(wfn.size());
+    for (std::size_t i = 0; i < wfn.size(); ++i)
+    {
+        std::size_t t = 0;
+        std::size_t moved = i;
+        for (unsigned r = 0; r < positions.size(); ++r)
+        {
+            t |= ((i >> positions[r]) & 1) << r;
+            moved &= ~(std::size_t(1) << positions[r]);
+        }
+        for (unsigned r = 0; r < positions.size(); ++r)
+            moved |= ((table[t] >> r) & 1) << positions[r];
+        expected[moved] = wfn[i];
+    }
+
+    kernels::apply_permutation(wfn, positions, table);
+    CHECK(wfn == expected);
+}
+
+TEST_CASE("permute_basis rejects tables that aren't permutations before touching the state", "[local_test]")
+{
+    SimulatorType sim;
+    SparseSimulatorType sparse;
+    StabilizerSimulatorType stabilizer;
+    auto qs = sim.allocate(2);
+    auto ps = sparse.allocate(2);
+    auto ss = stabilizer.allocate(2);
+    sim.H(qs[0]);
+    sim.T(qs[1]);
+
+    const std::size_t repeated[] = {1, 1, 2, 3};
+    const std::size_t outside[] = {0, 1, 2, 4};
+    const std::size_t valid[] = {1, 0, 3, 2};
+    for (std::size_t const* table : {repeated, outside})
+    {
+        CHECK_THROWS(sim.permuteBasis(qs, 4, table));
+        CHECK_THROWS(sim.permuteBasis(qs, 4, table, true));
+        CHECK_THROWS(sparse.permuteBasis(ps, 4, table));
+        CHECK_THROWS(stabilizer.permuteBasis(ss, 4, table));
+    }
+    CHECK_THROWS(sim.permuteBasis(qs, 2, valid));
+    CHECK(std::abs(sim.JointEnsembleProbability({Gates::PauliX}, {qs[0]})) < 1e-12);
+
+    sim.permuteBasis(qs, 4, valid);
+    CHECK(std::abs(sim.JointEnsembleProbability({Gates::PauliX}, {qs[0]})) < 1e-12);
+}
+
+TEST_CASE("Permutations given by a function are applied in place in batches of cycles", "[local_test]")
+{
+    // the Gray code of 17 bits has cycles in more than one batch
+    const unsigned n = 17;
+    WavefunctionStorage wfn(1u << n);
+    for (std::size_t i = 0; i < wfn.size(); ++i)
+        wfn[i] = ComplexType(double(i), 0.);
+    std::vector<unsigned> positions(n);
+    std::iota(positions.begin(), positions.end(), 0u);
+    auto gray = [](std::size_t x) { return x ^ (x >> 1); };
+
+    CHECK(kernels::apply_permutation(wfn, positions, gray, false));
+    for (std::size_t i = 0; i < wfn.size(); ++i)
+        CHECK(wfn[gray(i)] == ComplexType(double(i), 0.));
+    CHECK(kernels::apply_permutation(wfn, positions, gray, true));
+    for (std::size_t i = 0; i < wfn.size(); ++i)
+        CHECK(wfn[i] == ComplexType(double(i), 0.));
+}
+
+TEST_CASE("QFT of a register matches the discrete Fourier transform of its amplitudes", "[local_test]")
+{
+    std::mt19937 gen(7);
+    for (unsigned m : {1u, 4u, 7u})
+    {
+        SimulatorType sim;
+        auto qs = sim.allocate(m + 2);
+        for (unsigned i = 0; i < qs.size(); ++i)
+        {
+            sim.H(qs[i]);
+            sim.R(Gates::PauliZ, 0.3 * (i + 1), qs[i]);
+            sim.R(Gates::PauliY, 0.2 * i, qs[i]);
+        }
+        for (unsigned i = 1; i < qs.size(); ++i)
+            sim.CX(qs[i - 1], qs[i]);
+
+        // the register is a random selection of the qubits in random order; the others are exported last
+        std::vector<logical_qubit_id> order = qs;
+        std::shuffle(order.begin(), order.end(), gen);
+        std::vector<logical_qubit_id> reg(order.begin(), order.begin() + m);
+
+        const std::size_t size = std::size_t(1) << qs.size();
+        const std::size_t dim = std::size_t(1) << m;
+        std::vector<double> re(size), im(size);
+        sim.exportState(order, 0, size, re.data(), im.data());
+        std::vector<ComplexType> before(size);
+        for (std::size_t i = 0; i < size; ++i)
+            before[i] = ComplexType(re[i], im[i]);
+
+        auto check = [&](double sign) {
+            sim.exportState(order, 0, size, re.data(), im.data());
+            for (std::size_t i = 0; i < size; ++i)
+            {
+                const std::size_t y = i % dim;
+                ComplexType expected = 0.;
+                for (std::size_t x = 0; x < dim; ++x)
+                    expected += std::polar(1. / std::sqrt(double(dim)), sign * 2. * M_PI * double(x * y) / double(dim)) *
+                                before[i - y + x];
+                CHECK(std::abs(ComplexType(re[i], im[i]) - expected) < 1e-10);
+            }
+        };
+
+        sim.QFT(reg, false);
+        check(1.);
+        sim.QFT(reg, true);
+        sim.exportState(order, 0, size, re.data(), im.data());
+        for (std::size_t i = 0; i < size; ++i)
+            CHECK(std::abs(ComplexType(re[i], im[i]) - before[i]) < 1e-10);
+        sim.QFT(reg, true);
+        check(-1.);
+    }
+}
+
+TEST_CASE("Reflection about a state subtracts twice the projection on it", "[local_test]")
+{
+    SimulatorType sim;
+    auto qs = sim.allocate(7);
+    for (unsigned i = 0; i < qs.size(); ++i)
+    {
+        sim.H(qs[i]);
+        sim.R(Gates::PauliZ, 0.4 * (i + 1), qs[i]);
+    }
+    sim.CX(qs[0], qs[6]);
+    sim.CX(qs[3], qs[1]);
+
+    // the register is the first three qubits of the export order, the other qubits follow
+    std::vector<logical_qubit_id> order = {qs[5], qs[0], qs[3], qs[1], qs[2], qs[4], qs[6]};
+    std::vector<logical_qubit_id> reg(order.begin(), order.begin() + 3);
+    std::vector<ComplexType> phi(8);
+    double norm = 0.;
+    for (std::size_t x = 0; x < phi.size(); ++x)
+    {
+        phi[x] = std::polar(1. + x, 0.7 * x);
+        norm += std::norm(phi[x]);
+    }
+    for (auto& a : phi)
+        a /= std::sqrt(norm);
+
+    const std::size_t size = std::size_t(1) << qs.size();
+    std::vector<double> re(size), im(size);
+    sim.exportState(order, 0, size, re.data(), im.data());
+    std::vector<ComplexType> expected(size);
+    for (std::size_t i = 0; i < size; ++i)
+        expected[i] = ComplexType(re[i], im[i]);
+    for (std::size_t r = 0; r < size; r += phi.size())
+    {
+        ComplexType overlap = 0.;
+        for (std::size_t x = 0; x < phi.size(); ++x)
+            overlap += std::conj(phi[x]) * expected[r + x];
+        for (std::size_t x = 0; x < phi.size(); ++x)
+            expected[r + x] -= 2. * overlap * phi[x];
+    }
+
+    sim.ReflectAboutState(reg, phi);
+    sim.exportState(order, 0, size, re.data(), im.data());
+    for (std::size_t i = 0; i < size; ++i)
+        CHECK(std::abs(ComplexType(re[i], im[i]) - expected[i]) < 1e-12);
+}
@@ -0,0 +1,126 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include "simulator/kernels.hpp"
+#include "types.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <vector>
+
+namespace Microsoft
+{
+namespace Quantum
+{
+namespace SIMULATOR
+{
+
+///
+/// Composes (multi-)controlled X gates into a single permutation of the computational basis states of the union of
+/// their qubits. The composed map is applied by moving amplitudes along its cycles, without any arithmetic.
+///
+class PermutationFusion
+{
+  public:
+    using IndexVector = std::vector<unsigned>;
+
+    /// Every group of 2^max_qubits amplitudes is permuted independently, so this bounds the working set of a move.
+    static constexpr unsigned max_qubits = 10;
+
+    PermutationFusion()
+        : table_(1, 0)
+    {
+    }
+
+    bool empty() const
+    {
+        return qubits_.empty();
+    }
+
+    /// Positional ids of the qubits the permutation acts on, in ascending order.
+    const IndexVector& qubits() const
+    {
+        return qubits_;
+    }
+
+    /// The basis state t of the qubits is mapped to table()[t].
+    const std::vector<std::size_t>& table() const
+    {
+        return table_;
+    }
+
+    /// Returns true if a gate on the given positions can be composed without growing the map beyond max_qubits.
+    bool can_insert(const IndexVector& positions) const
+    {
+        unsigned added = 0;
+        for (unsigned p : positions)
+            if (!std::binary_search(qubits_.begin(), qubits_.end(), p)) ++added;
+        return qubits_.size() + added <= max_qubits;
+    }
+
+    /// Compose X on qubit `q` controlled by qubits `cs` (all positional ids) after the current map.
+    void insert_x(const IndexVector& cs, unsigned q)
+    {
+        for (unsigned c : cs)
+            add_qubit(c);
+        add_qubit(q);
+
+        std::size_t cmask = 0;
+        for (unsigned c : cs)
+            cmask |= table_bit(c);
+        const std::size_t qbit = table_bit(q);
+
+        for (std::size_t& v : table_)
+            if ((v & cmask) == cmask) v ^= qbit;
+    }
+
+    template <class T, class A>
+    void apply(std::vector<T, A>& wfn)
+    {
+        if (empty()) return;
+        kernels::apply_permutation(wfn, qubits_, table_);
+        clear();
+    }
+
+    void clear()
+    {
+        qubits_.clear();
+        table_.assign(1, 0);
+    }
+
+  private:
+    std::size_t table_bit(unsigned q) const
+    {
+        auto it = std::lower_bound(qubits_.begin(), qubits_.end(), q);
+        assert(it != qubits_.end() && *it == q);
+        return 1ull << (it - qubits_.begin());
+    }
+
+    /// Extend the map to a new qubit, which the gates composed so far leave unchanged.
+    void add_qubit(unsigned q)
+    {
+        auto it = std::lower_bound(qubits_.begin(), qubits_.end(), q);
+        if (it != qubits_.end() && *it == q) return;
+
+        const unsigned r = static_cast<unsigned>(it - qubits_.begin());
+        const std::size_t low = (1ull << r) - 1;
+        qubits_.insert(it, q);
+
+        std::vector<std::size_t> grown(2 * table_.size());
+        for (std::size_t t = 0; t < grown.size(); ++t)
+        {
+            const std::size_t v = table_[(t & low) | ((t >> 1) & ~low)];
+            grown[t] = (v & low) | ((v & ~low) << 1) | (t & (1ull << r));
+        }
+        table_.swap(grown);
+    }
+
+    IndexVector qubits_;
+    std::vector<std::size_t> table_;
+};
+
+} // namespace SIMULATOR
+} // namespace Quantum
+} // namespace Microsoft
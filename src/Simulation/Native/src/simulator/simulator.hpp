@@ -6,9 +6,12 @@
 #include "config.hpp"
 #include "gates.hpp"
 #include "simulatorinterface.hpp"
+#include "sparsewavefunction.hpp"
+#include "stabilizerwavefunction.hpp"
 #include "util/openmp.hpp"
 #include "wavefunction.hpp"
 
+#include <algorithm>
 #include <map>
 #include <numeric>
 
@@ -32,7 +35,7 @@ class Simulator : public Microsoft::Quantum::Simulator::SimulatorInterface
 
     std::size_t random(std::vector<double> const& d)
     {
-        recursive_lock_type l(mutex());
+        auto l = session();
         std::discrete_distribution<std::size_t> dist(d.begin(), d.end());
         return dist(psi.rng());
     }
@@ -40,7 +43,7 @@ class Simulator : public Microsoft::Quantum::Simulator::SimulatorInterface
     std::size_t random(std::size_t n, double* d)
     {
         std::discrete_distribution<std::size_t> dist(d, d + n);
-        recursive_lock_type l(mutex());
+        auto l = session();
         return dist(psi.rng());
     }
 
@@ -52,61 +55,88 @@ class Simulator : public Microsoft::Quantum::Simulator::SimulatorInterface
             return 0.0;
         }
 
-        recursive_lock_type l(mutex());
+        auto l = session();
         changebasis(bs, qs, true);
         double p = psi.jointprobability(qs);
         changebasis(bs, qs, false);
         return p;
     }
 
+    double ExpectationPauliSum(
+        std::vector<std::vector<Gates::Basis>> terms,
+        std::vector<double> const& coefficients,
+        std::vector<std::vector<logical_qubit_id>> qs)
+    {
+        assert(terms.size() == coefficients.size() && terms.size() == qs.size());
+
+        // identity terms contribute their coefficient, the rest is evaluated by the wave function in a single sweep
+        double identity = 0.;
+        std::vector<double> cs;
+        std::vector<std::vector<Gates::Basis>> bs;
+        std::vector<std::vector<logical_qubit_id>> ps;
+        for (std::size_t k = 0; k < terms.size(); ++k)
+        {
+            removeIdentities(terms[k], qs[k]);
+            if (terms[k].empty())
+            {
+                identity += coefficients[k];
+            }
+            else
+            {
+                cs.push_back(coefficients[k]);
+                bs.push_back(std::move(terms[k]));
+                ps.push_back(std::move(qs[k]));
+            }
+        }
+        if (bs.empty())
+        {
+            return identity;
+        }
+
+        auto l = session();
+        return identity + psi.expectation_pauli_sum(bs, cs, ps);
+    }
+
     bool InjectState(const std::vector<logical_qubit_id>& qubits, const std::vector<ComplexType>& amplitudes)
     {
-        recursive_lock_type l(mutex());
+        auto l = session();
         return psi.inject_state(qubits, amplitudes);
     }
 
     bool isclassical(logical_qubit_id q)
     {
-        recursive_lock_type l(mutex());
+        auto l = session();
         return psi.isclassical(q);
     }
 
     // allocate and release
     logical_qubit_id allocate()
     {
-        recursive_lock_type l(mutex());
+        auto l = session();
         return psi.allocate_qubit();
     }
 
     std::vector<logical_qubit_id> allocate(unsigned n)
     {
-        std::vector<logical_qubit_id> qubits;
-        qubits.reserve(n);
-        recursive_lock_type l(mutex());
-
-        for (unsigned i = 0; i < n; ++i)
-        {
-            qubits.push_back(psi.allocate_qubit());
-        }
-        return qubits;
+        auto l = session();
+        return psi.allocate_qubits(n);
     }
 
     void allocateQubit(logical_qubit_id q)
     {
-        recursive_lock_type l(mutex());
+        auto l = session();
         psi.allocate_qubit(q);
     }
 
     void allocateQubit(std::vector<logical_qubit_id> const& qubits)
     {
-        recursive_lock_type l(mutex());
-        for (auto q : qubits)
-            psi.allocate_qubit(q);
+        auto l = session();
+        psi.allocate_qubits(qubits);
     }
 
     bool release(logical_qubit_id q)
     {
-        recursive_lock_type l(mutex());
+        auto l = session();
         flush();
         bool allok = isclassical(q);
         if (allok)
@@ -119,10 +149,20 @@ class Simulator : public Microsoft::Quantum::Simulator::SimulatorInterface
 
     bool release(std::vector<logical_qubit_id> const& qs)
     {
-        recursive_lock_type l(mutex());
+        auto l = session();
+        flush();
         bool allok = true;
         for (auto q : qs)
-            allok = release(q) && allok;
+        {
+            if (isclassical(q))
+                allok = (psi.getvalue(q) == false) && allok;
+            else
+            {
+                M(q);
+                allok = false;
+            }
+        }
+        psi.release(qs);
         return allok;
     }
 
@@ -131,19 +171,19 @@ class Simulator : public Microsoft::Quantum::Simulator::SimulatorInterface
 #define GATE1IMPL(OP)                                                                                                  \
     void OP(logical_qubit_id q)                                                                                        \
     {                                                                                                                  \
-        recursive_lock_type l(mutex());                                                                                \
+        auto l = session();                                                                                            \
         psi.apply(Gates::OP(q));                                                                                       \
     }
 #define GATE1CIMPL(OP)                                                                                                 \
     void C##OP(logical_qubit_id c, logical_qubit_id q)                                                                 \
     {                                                                                                                  \
-        recursive_lock_type l(mutex());                                                                                \
+        auto l = session();                                                                                            \
         psi.apply_controlled(c, Gates::OP(q));                                                                         \
     }
 #define GATE1MCIMPL(OP)                                                                                                \
     void C##OP(std::vector<logical_qubit_id> const& c, logical_qubit_id q)                                             \
     {                                                                                                                  \
-        recursive_lock_type l(mutex());                                                                                \
+        auto l = session();                                                                                            \
         psi.apply_controlled(c, Gates::OP(q));                                                                         \
     }
 #define GATE1(OP) GATE1IMPL(OP) GATE1CIMPL(OP) GATE1MCIMPL(OP)
@@ -167,19 +207,19 @@ class Simulator : public Microsoft::Quantum::Simulator::SimulatorInterface
 #define GATE1IMPL(OP)                                                                                                  \
     void OP(double phi, logical_qubit_id q)                                                                            \
     {                                                                                                                  \
-        recursive_lock_type l(mutex());                                                                                \
+        auto l = session();                                                                                            \
         psi.apply(Gates::OP(phi, q));                                                                                  \
     }
 #define GATE1CIMPL(OP)                                                                                                 \
     void C##OP(double phi, logical_qubit_id c, logical_qubit_id q)                                                     \
     {                                                                                                                  \
-        recursive_lock_type l(mutex());                                                                                \
+        auto l = session();                                                                                            \
         psi.apply_controlled(c, Gates::OP(phi, q));                                                                    \
     }
 #define GATE1MCIMPL(OP)                                                                                                \
     void C##OP(double phi, std::vector<logical_qubit_id> const& c, logical_qubit_id q)                                 \
     {                                                                                                                  \
-        recursive_lock_type l(mutex());                                                                                \
+        auto l = session();                                                                                            \
         psi.apply_controlled(c, Gates::OP(phi, q));                                                                    \
     }
 #define GATE1(OP) GATE1IMPL(OP) GATE1CIMPL(OP) GATE1MCIMPL(OP)
@@ -196,14 +236,14 @@ class Simulator : public Microsoft::Quantum::Simulator::SimulatorInterface
     // rotations
     void R(Gates::Basis b, double phi, logical_qubit_id q)
     {
-        recursive_lock_type l(mutex());
+        auto l = session();
         psi.apply(Gates::R(b, phi, q));
     }
 
     // multi-controlled rotations
     void CR(Gates::Basis b, double phi, std::vector<logical_qubit_id> const& c, logical_qubit_id q)
     {
-        recursive_lock_type l(mutex());
+        auto l = session();
         psi.apply_controlled(c, Gates::R(b, phi, q));
     }
 
@@ -219,7 +259,7 @@ class Simulator : public Microsoft::Quantum::Simulator::SimulatorInterface
         logical_qubit_id somequbit = qs.front();
         removeIdentities(bs, qs);
 
-        recursive_lock_type l(mutex());
+        auto l = session();
         if (bs.size() == 0)
             CR(Gates::PauliI, -2. * phi, cs, somequbit);
         else if (bs.size() == 1)
@@ -230,31 +270,104 @@ class Simulator : public Microsoft::Quantum::Simulator::SimulatorInterface
 
     void Exp(std::vector<Gates::Basis> const& bs, double phi, std::vector<logical_qubit_id> const& qs)
     {
-        recursive_lock_type l(mutex());
+        auto l = session();
         CExp(bs, phi, std::vector<logical_qubit_id>(), qs);
     }
 
+    void applyBatch(GateRecord const* ops, std::size_t n)
+    {
+        // a batch is either applied in full or not at all
+        for (GateRecord const* op = ops; op != ops + n; ++op)
+        {
+            if (op->kind > BatchExp) throw std::runtime_error("unknown gate kind in a batch");
+            if (op->kind == BatchR && op->basis > Gates::PauliY)
+                throw std::runtime_error("unknown Pauli basis in a batch");
+            if (op->kind == BatchExp &&
+                std::any_of(op->paulis, op->paulis + op->nqubits, [](unsigned b) { return b > Gates::PauliY; }))
+                throw std::runtime_error("unknown Pauli basis in a batch");
+        }
+
+        auto l = session();
+        std::vector<logical_qubit_id> cs;
+        // the Pauli strings of BatchExp without their identities, as in CExp
+        std::vector<Gates::Basis> bs;
+        std::vector<logical_qubit_id> qs;
+        for (GateRecord const* op = ops; op != ops + n; ++op)
+        {
+            cs.assign(op->controls, op->controls + op->ncontrols);
+            switch (op->kind)
+            {
+            case BatchX:
+                apply_batched(cs, Gates::X(op->target));
+                break;
+            case BatchY:
+                apply_batched(cs, Gates::Y(op->target));
+                break;
+            case BatchZ:
+                apply_batched(cs, Gates::Z(op->target));
+                break;
+            case BatchH:
+                apply_batched(cs, Gates::H(op->target));
+                break;
+            case BatchS:
+                apply_batched(cs, Gates::S(op->target));
+                break;
+            case BatchT:
+                apply_batched(cs, Gates::T(op->target));
+                break;
+            case BatchAdjS:
+                apply_batched(cs, Gates::AdjS(op->target));
+                break;
+            case BatchAdjT:
+                apply_batched(cs, Gates::AdjT(op->target));
+                break;
+            case BatchR:
+                apply_batched(cs, Gates::R(static_cast<Gates::Basis>(op->basis), op->angle, op->target));
+                break;
+            case BatchExp:
+                if (op->nqubits == 0) break;
+                bs.clear();
+                qs.clear();
+                for (unsigned i = 0; i < op->nqubits; ++i)
+                {
+                    if (op->paulis[i] == Gates::PauliI) continue;
+                    bs.push_back(static_cast<Gates::Basis>(op->paulis[i]));
+                    qs.push_back(op->qubits[i]);
+                }
+                if (bs.empty())
+                    apply_batched(cs, Gates::R(Gates::PauliI, -2. * op->angle, op->qubits[0]));
+                else if (bs.size() == 1)
+                    apply_batched(cs, Gates::R(bs.front(), -2. * op->angle, qs.front()));
+                else
+                    psi.apply_controlled_exp(bs, op->angle, cs, qs);
+                break;
+            }
+        }
+    }
+
     // measurements
 
     bool M(logical_qubit_id q)
     {
-        recursive_lock_type l(mutex());
+        auto l = session();
         return psi.measure(q);
     }
 
     std::vector<bool> MultiM(std::vector<logical_qubit_id> const& qs)
     {
-        // ***TODO*** optimized implementation
-        recursive_lock_type l(mutex());
-        std::vector<bool> res;
-        for (auto q : qs)
-            res.push_back(psi.measure(q));
-        return res;
+        auto l = session();
+        return psi.multimeasure(qs);
+    }
+
+    std::vector<std::size_t> Sample(std::vector<logical_qubit_id> const& qs, std::size_t nshots)
+    {
+        auto l = session();
+        return psi.sample(qs, nshots);
     }
 
     bool Measure(std::vector<Gates::Basis> bs, std::vector<logical_qubit_id> qs)
     {
-        recursive_lock_type l(mutex());
+        auto l = session();
         removeIdentities(bs, qs);
         // ***TODO*** optimized kernels
         changebasis(bs, qs, true);
@@ -265,57 +378,60 @@ class Simulator : public Microsoft::Quantum::Simulator::SimulatorInterface
 
     void seed(unsigned s)
     {
-        recursive_lock_type l(mutex());
+        auto l = session();
         psi.seed(s);
     }
     void reset()
     {
-        recursive_lock_type l(mutex());
+        auto l = session();
         psi.reset();
     }
 
     unsigned num_qubits() const
     {
-        recursive_lock_type l(mutex());
+        auto l = session();
         return psi.num_qubits();
     }
     void flush()
     {
-        recursive_lock_type l(mutex());
+        auto l = session();
         psi.flush();
     }
     ComplexType const* data() const
     {
-        recursive_lock_type l(mutex());
-        return psi.data().data();
+        if constexpr (std::is_same<typename WaveFunctionType::value_type, ComplexType>::value)
+        {
+            auto l = session();
+            return psi.data().data();
+        }
+        else
+        {
+            throw std::runtime_error("direct access to the state is only supported by double-precision simulators");
+        }
     }
 
     void dump(bool (*callback)(size_t, double, double))
     {
-        recursive_lock_type l(mutex());
+        auto l = session();
         flush();
 
-        auto wfn = psi.data();
-        for (std::size_t i = 0; i < wfn.size(); i++)
-        {
-            if (!callback(i, wfn[i].real(), wfn[i].imag())) return;
-        }
+        psi.for_each_amplitude([callback](std::size_t i, typename WaveFunctionType::value_type a) {
+            return callback(i, a.real(), a.imag());
+        });
     }
 
     void dump(TDumpToLocationCallback callback, TDumpLocation location) override
     {
         flush();
 
-        auto wfn = psi.data();
-        for (std::size_t i = 0; i < wfn.size(); i++)
-        {
-            if (!callback(i, wfn[i].real(), wfn[i].imag(), location)) return;
-        }
+        psi.for_each_amplitude([callback, location](std::size_t i, typename WaveFunctionType::value_type a) {
+            return callback(i, a.real(), a.imag(), location);
+        });
     }
 
     void dumpIds(void (*callback)(logical_qubit_id))
     {
-        recursive_lock_type l(mutex());
+        auto l = session();
         flush();
 
         std::vector<logical_qubit_id> qubits = psi.get_qubit_ids();
@@ -365,6 +481,66 @@ class Simulator : public Microsoft::Quantum::Simulator::SimulatorInterface
         }
     }
 
+    std::size_t exportState(
+        std::vector<logical_qubit_id> const& qs,
+        std::size_t offset,
+        std::size_t count,
+        double* re,
+        double* im) override
+    {
+        auto l = session();
+        auto const& wfn = psi.data();
+        if (offset >= wfn.size()) return 0;
+        count = std::min(count, wfn.size() - offset);
+        kernels::export_amplitudes(wfn, export_positions(qs), offset, count, re, im);
+        return count;
+    }
+
+    std::size_t exportNonzero(
+        std::vector<logical_qubit_id> const& qs,
+        double threshold,
+        std::size_t& cursor,
+        std::size_t capacity,
+        std::size_t* indices,
+        double* re,
+        double* im) override
+    {
+        auto l = session();
+        auto const& wfn = psi.data();
+        return kernels::export_nonzero(wfn, export_positions(qs), threshold, cursor, capacity, indices, re, im);
+    }
+
+    std::vector<unsigned> qubitPositions(std::vector<logical_qubit_id> const& qs) override
+    {
+        auto l = session();
+        psi.data();
+        const std::vector<logical_qubit_id> allocated = psi.get_qubit_ids();
+        for (logical_qubit_id q : qs)
+        {
+            if (!std::binary_search(allocated.begin(), allocated.end(), q))
+                throw std::runtime_error("only allocated qubits have a position in the state");
+        }
+        return psi.get_qubit_positions(qs);
+    }
+
+    void QFT(std::vector<logical_qubit_id> const& qs, bool adjoint) override
+    {
+        auto l = session();
+        psi.qft(qs, adjoint);
+    }
+
+    void ReflectAboutUniform(std::vector<logical_qubit_id> const& qs) override
+    {
+        auto l = session();
+        psi.reflect_about_uniform(qs);
+    }
+
+    void ReflectAboutState(std::vector<logical_qubit_id> const& qs, std::vector<ComplexType> const& amplitudes) override
+    {
+        auto l = session();
+        psi.reflect_about_state(qs, amplitudes);
+    }
+
     // apply permutation of basis states to the wave function
     void permuteBasis(
         std::vector<logical_qubit_id> const& qs,
@@ -373,26 +549,75 @@ class Simulator : public Microsoft::Quantum::Simulator::SimulatorInterface
         bool adjoint = false)
 
     {
-#ifndef NDEBUG
-        // check the permute function is bijective
-        auto test = std::vector<bool>(table_size, false);
-        for (size_t i = 0; i < table_size; ++i)
-            test.at(permutation_table[i]) = true;
-        assert(std::accumulate(test.begin(), test.end(), 0u) == table_size);
-#endif
-
-        recursive_lock_type l(mutex());
+        auto l = session();
         psi.permute_basis(qs, table_size, permutation_table, adjoint);
     }
 
+    void permuteBasis(
+        std::vector<logical_qubit_id> const& qs,
+        std::function<std::size_t(std::size_t)> const& permutation,
+        bool adjoint = false) override
+    {
+        auto l = session();
+        psi.permute_basis_with(qs, permutation, adjoint);
+    }
+
     bool subsytemwavefunction(std::vector<logical_qubit_id> const& qs, WavefunctionStorage& qubitswfn, double tolerance)
     {
-        recursive_lock_type l(mutex());
+        auto l = session();
         flush();
         return psi.subsytemwavefunction(qs, qubitswfn, tolerance);
     }
 
+    Microsoft::Quantum::Simulator::SimulatorInterface* clone() const override
+    {
+        auto l = session();
+        return new Simulator(*this);
+    }
+
+    void saveState(std::string const& path) override
+    {
+        auto l = session();
+        psi.save(path);
+    }
+
+    void loadState(std::string const& path) override
+    {
+        auto l = session();
+        psi.load(path);
+    }
+
   private:
+    // Threads for the kernels: the limit of this simulator, or fewer if the kernels were measured to run faster with
+    // fewer on a state of this size (see FusionProfile).
+    Session session() const
+    {
+        return Session(mutex(), [this] {
+            const int preferred = psi.preferred_threads();
+            const int limit = static_cast<int>(thread_limit());
+            return limit > 0 && (preferred == 0 || preferred > limit) ? limit : preferred;
+        });
+    }
+
+    // positions of qs after the pending gates were applied, which have to be a permutation of all the qubits
+    std::vector<positional_qubit_id> export_positions(std::vector<logical_qubit_id> const& qs) const
+    {
+        std::vector<logical_qubit_id> sorted = qs;
+        std::sort(sorted.begin(), sorted.end());
+        if (sorted != psi.get_qubit_ids())
+            throw std::runtime_error("the qubits of an export have to list every allocated qubit once");
+        return psi.get_qubit_positions(qs);
+    }
+
+    template <class Gate>
+    void apply_batched(std::vector<logical_qubit_id> const& cs, Gate const& g)
+    {
+        if (cs.empty())
+            psi.apply(g);
+        else
+            psi.apply_controlled(cs, g);
+    }
+
     void changebasis(Gates::Basis b, logical_qubit_id q, bool back)
     {
         if (b == Gates::PauliX)
@@ -434,7 +659,19 @@ class Simulator : public Microsoft::Quantum::Simulator::SimulatorInterface
 using WavefunctionType = Wavefunction<ComplexType>;
 using SimulatorType = Simulator<WavefunctionType>;
 
-MICROSOFT_QUANTUM_DECL Microsoft::Quantum::Simulator::SimulatorInterface* createSimulator(unsigned = 0u);
+using SinglePrecisionWavefunctionType = Wavefunction<std::complex<float>>;
+using SinglePrecisionSimulatorType = Simulator<SinglePrecisionWavefunctionType>;
+
+using SparseSimulatorType = Simulator<SparseWavefunction<ComplexType>>;
+using SinglePrecisionSparseSimulatorType = Simulator<SparseWavefunction<std::complex<float>>>;
+
+using StabilizerSimulatorType = Simulator<StabilizerWavefunction<ComplexType>>;
+using SinglePrecisionStabilizerSimulatorType = Simulator<StabilizerWavefunction<std::complex<float>>>;
+
+MICROSOFT_QUANTUM_DECL Microsoft::Quantum::Simulator::SimulatorInterface* createSimulator(
+    unsigned = 0u,
+    Microsoft::Quantum::Simulator::Precision = Microsoft::Quantum::Simulator::Precision::Double,
+    Microsoft::Quantum::Simulator::Representation = Microsoft::Quantum::Simulator::Representation::Dense);
 
 } // namespace SIMULATOR
 } // namespace Quantum
@@ -8,7 +8,31 @@
 
 namespace sim = Microsoft::Quantum::SimulatorAVX2;
 
-MICROSOFT_QUANTUM_DECL Microsoft::Quantum::Simulator::SimulatorInterface* sim::createSimulator(unsigned maxlocal)
+MICROSOFT_QUANTUM_DECL Microsoft::Quantum::Simulator::SimulatorInterface* sim::createSimulator(
+    unsigned maxlocal,
+    Microsoft::Quantum::Simulator::Precision precision,
+    Microsoft::Quantum::Simulator::Representation representation)
 {
-    return new sim::SimulatorType(maxlocal);
+    const bool single = precision == Microsoft::Quantum::Simulator::Precision::Single;
+    switch (representation)
+    {
+    case Microsoft::Quantum::Simulator::Representation::Sparse:
+        if (single)
+        {
+            return new sim::SinglePrecisionSparseSimulatorType(maxlocal);
+        }
+        return new sim::SparseSimulatorType(maxlocal);
+    case Microsoft::Quantum::Simulator::Representation::Stabilizer:
+        if (single)
+        {
+            return new sim::SinglePrecisionStabilizerSimulatorType(maxlocal);
+        }
+        return new sim::StabilizerSimulatorType(maxlocal);
+    default:
+        if (single)
+        {
+            return new sim::SinglePrecisionSimulatorType(maxlocal);
+        }
+        return new sim::SimulatorType(maxlocal);
+    }
 }
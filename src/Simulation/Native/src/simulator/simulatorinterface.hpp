@@ -7,6 +7,7 @@
 #include "gates.hpp"
 #include "types.hpp"
 #include "util/openmp.hpp"
+#include <functional>
 #include <vector>
 
 namespace Microsoft
@@ -17,6 +18,25 @@ namespace Simulator
 {
 
 using namespace Microsoft::Quantum::SIMULATOR;
+
+/// Floating point precision of the amplitudes stored by a simulator. Gates, probabilities and the rest of the interface
+/// always use double precision, only the state vector (and thus the memory footprint and bandwidth) is affected.
+enum class Precision : unsigned
+{
+    Double = 0,
+    Single = 1,
+};
+
+/// How a simulator stores its state vector. Sparse simulators keep a hash map of the non-zero amplitudes while they are
+/// few compared to the size of the state, and a dense vector otherwise (see SparseWavefunction). Stabilizer simulators
+/// keep a stabilizer tableau until the first non-Clifford gate (see StabilizerWavefunction).
+enum class Representation : unsigned
+{
+    Dense = 0,
+    Sparse = 1,
+    Stabilizer = 2,
+};
+
 class SimulatorInterface
 {
   public:
@@ -25,12 +45,25 @@ class SimulatorInterface
     {
     }
 
+    // copies (see clone) don't share the lock of the original
+    SimulatorInterface(SimulatorInterface const& other)
+        : mutex_ptr(new recursive_mutex_type())
+        , max_threads(other.max_threads)
+    {
+    }
+
     virtual ~SimulatorInterface() {}
 
     virtual std::size_t random(std::size_t n, double* d) = 0;
 
     virtual double JointEnsembleProbability(std::vector<Gates::Basis> bs, std::vector<unsigned> qs) = 0;
 
+    // expectation value of sum_k coefficients[k] * terms[k], where the Pauli string terms[k] acts on qubits qs[k]
+    virtual double ExpectationPauliSum(
+        std::vector<std::vector<Gates::Basis>> terms,
+        std::vector<double> const& coefficients,
+        std::vector<std::vector<unsigned>> qs) = 0;
+
     virtual bool InjectState(
         const std::vector<logical_qubit_id>& qubits,
         const std::vector<ComplexType>& amplitudes) = 0;
@@ -38,6 +71,8 @@ class SimulatorInterface
     // allocate and release
     virtual void allocateQubit(unsigned q) = 0;
     virtual bool release(unsigned q) = 0;
+    virtual void allocateQubit(std::vector<unsigned> const& qs) = 0;
+    virtual bool release(std::vector<unsigned> const& qs) = 0;
     virtual unsigned num_qubits() const = 0;
 
     // single-qubit gates
@@ -76,11 +111,20 @@ class SimulatorInterface
         CExp(bs, phi, std::vector<unsigned>(), qs);
     }
 
+    // apply the gates described by ops[0..n) in order, see ApplyBatch in capi.hpp; throws before applying any of them
+    // if a record is invalid
+    virtual void applyBatch(GateRecord const* ops, std::size_t n) = 0;
+
     // measurements
 
     virtual bool M(unsigned q) = 0;
+    // measure each of the qubits in the computational basis, jointly rather than one by one
+    virtual std::vector<bool> MultiM(std::vector<unsigned> const& qs) = 0;
     virtual bool Measure(std::vector<Gates::Basis> bs, std::vector<unsigned> qs) = 0;
 
+    // draw `nshots` samples of the joint Z-measurement of qs from the current state without collapsing it
+    virtual std::vector<std::size_t> Sample(std::vector<unsigned> const& qs, std::size_t nshots) = 0;
+
     virtual void seed(unsigned s) = 0;
     virtual void reset() = 0;
     virtual ComplexType const* data() const = 0;
@@ -114,6 +158,35 @@ class SimulatorInterface
         assert(false);
     }
 
+    // Bulk copies of the state, in the basis where bit k of a basis state is the value of qs[k] (qs has to list every
+    // allocated qubit once). exportState copies the amplitudes of the basis states [offset, offset + count) and
+    // returns how many there were; exportNonzero copies up to `capacity` amplitudes with a magnitude above
+    // `threshold`, starting at basis state `cursor`, and advances the cursor past the basis states it examined.
+    virtual std::size_t exportState(
+        std::vector<unsigned> const& qs,
+        std::size_t offset,
+        std::size_t count,
+        double* re,
+        double* im) = 0;
+    virtual std::size_t exportNonzero(
+        std::vector<unsigned> const& qs,
+        double threshold,
+        std::size_t& cursor,
+        std::size_t capacity,
+        std::size_t* indices,
+        double* re,
+        double* im) = 0;
+    // positions of the qubits qs in the state returned by data()
+    virtual std::vector<unsigned> qubitPositions(std::vector<unsigned> const& qs) = 0;
+
+    // quantum Fourier transform of the register qs, with qs[0] as its least significant bit
+    virtual void QFT(std::vector<unsigned> const& qs, bool adjoint) = 0;
+
+    // reflect the register qs about its uniform superposition (the Grover diffusion operator), or about the
+    // normalized state with the given amplitudes (bit k of their index is the value of qs[k])
+    virtual void ReflectAboutUniform(std::vector<unsigned> const& qs) = 0;
+    virtual void ReflectAboutState(std::vector<unsigned> const& qs, std::vector<ComplexType> const& amplitudes) = 0;
+
     // apply permutation of basis states to the wave function
     virtual void permuteBasis(
         std::vector<unsigned> const& qs,
@@ -123,14 +196,70 @@ class SimulatorInterface
     {
         throw std::runtime_error("this simulator does not support permutation oracle emulation");
     };
+    // same, with the image of each basis state of qs computed by `permutation` (from several threads at once)
+    virtual void permuteBasis(
+        std::vector<unsigned> const& qs,
+        std::function<std::size_t(std::size_t)> const& permutation,
+        bool adjoint = false)
+    {
+        throw std::runtime_error("this simulator does not support permutation oracle emulation");
+    }
+
+    // independent copy of the simulator, including its state and random number generator
+    virtual SimulatorInterface* clone() const
+    {
+        throw std::runtime_error("this simulator can't be cloned");
+    }
+
+    // write the state of the simulator to a file, and replace it by the one saved in a file
+    virtual void saveState(std::string const& path)
+    {
+        throw std::runtime_error("this simulator does not support checkpoints");
+    }
+    virtual void loadState(std::string const& path)
+    {
+        throw std::runtime_error("this simulator does not support checkpoints");
+    }
 
     recursive_mutex_type& mutex() const
     {
         return *mutex_ptr;
     }
 
+    // limit the number of threads used by the operations of this simulator (0 for no limit); other simulators in the
+    // same process are not affected
+    void setThreads(unsigned n)
+    {
+        recursive_lock_type l(mutex());
+        max_threads = n;
+    }
+
+  protected:
+    // Held by every operation of a simulator: it serializes the operations and runs their parallel loops with the
+    // number of threads returned by `threads` once the lock is taken (or as many as OpenMP would use if 0).
+    class Session
+    {
+      public:
+        template <class F>
+        Session(recursive_mutex_type& mutex, F&& threads)
+            : lock_(mutex)
+            , threads_(threads())
+        {
+        }
+
+      private:
+        recursive_lock_type lock_;
+        openmp::num_threads_guard threads_;
+    };
+
+    unsigned thread_limit() const
+    {
+        return max_threads;
+    }
+
   private:
     std::shared_ptr<recursive_mutex_type> mutex_ptr;
+    unsigned max_threads = 0;
 };
 
 } // namespace Simulator
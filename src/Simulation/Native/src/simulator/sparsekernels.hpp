@@ -0,0 +1,497 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include "kernels.hpp"
+#include "util/bitops.hpp"
+#include "wavefunction.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <complex>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace Microsoft
+{
+namespace Quantum
+{
+namespace SIMULATOR
+{
+
+///
+/// Open-addressing hash map from the index of a basis state to its amplitude, holding only the amplitudes that aren't
+/// (numerically) zero. Keys and values are kept in two flat arrays probed linearly, which keeps lookups of the partner
+/// amplitudes of a gate cheap. Entries are never erased individually: kernels that drop amplitudes build a new map.
+///
+template <class T>
+class AmplitudeMap
+{
+  public:
+    using key_type = std::uint64_t;
+
+    /// Marks an unused slot. No basis state has this index, since sparse states have at most 63 qubits.
+    static constexpr key_type empty_key = ~key_type(0);
+
+    AmplitudeMap()
+    {
+        reserve(1);
+    }
+
+    std::size_t size() const
+    {
+        return size_;
+    }
+
+    std::size_t capacity() const
+    {
+        return keys_.size();
+    }
+
+    void clear()
+    {
+        std::fill(keys_.begin(), keys_.end(), empty_key);
+        size_ = 0;
+    }
+
+    /// Make room for `n` entries, the table is kept at most half full.
+    void reserve(std::size_t n)
+    {
+        std::size_t slots = 16;
+        while (slots < 2 * n)
+            slots *= 2;
+        if (slots <= keys_.size()) return;
+
+        std::vector<key_type> keys(slots, empty_key);
+        std::vector<T> values(slots);
+        keys.swap(keys_);
+        values.swap(values_);
+        size_ = 0;
+        for (std::size_t i = 0; i < keys.size(); ++i)
+            if (keys[i] != empty_key) insert(keys[i], values[i]);
+    }
+
+    /// The amplitude of basis state `k`, or zero if it isn't stored.
+    T get(key_type k) const
+    {
+        const std::size_t slot = find_slot(k);
+        return keys_[slot] == k ? values_[slot] : T(0.);
+    }
+
+    bool contains(key_type k) const
+    {
+        return keys_[find_slot(k)] == k;
+    }
+
+    /// Insert or overwrite the amplitude of basis state `k`.
+    void insert(key_type k, T v)
+    {
+        assert(k != empty_key);
+        if (2 * (size_ + 1) > keys_.size()) reserve(size_ + 1);
+        const std::size_t slot = find_slot(k);
+        if (keys_[slot] != k)
+        {
+            keys_[slot] = k;
+            ++size_;
+        }
+        values_[slot] = v;
+    }
+
+    /// Call f(key, value) for every stored amplitude, in no particular order.
+    template <class F>
+    void for_each(F&& f) const
+    {
+        for (std::size_t i = 0; i < keys_.size(); ++i)
+            if (keys_[i] != empty_key) f(keys_[i], values_[i]);
+    }
+
+    /// Call f(key, value) for every stored amplitude, which it may modify in place.
+    template <class F>
+    void transform(F&& f)
+    {
+        for (std::size_t i = 0; i < keys_.size(); ++i)
+            if (keys_[i] != empty_key) f(keys_[i], values_[i]);
+    }
+
+    /// The stored entries ordered by basis state.
+    std::vector<std::pair<key_type, T>> sorted() const
+    {
+        std::vector<std::pair<key_type, T>> entries;
+        entries.reserve(size_);
+        for_each([&entries](key_type k, T v) { entries.emplace_back(k, v); });
+        std::sort(entries.begin(), entries.end(), [](auto const& a, auto const& b) { return a.first < b.first; });
+        return entries;
+    }
+
+    void swap(AmplitudeMap& other)
+    {
+        keys_.swap(other.keys_);
+        values_.swap(other.values_);
+        std::swap(size_, other.size_);
+    }
+
+  private:
+    /// The slot holding `k`, or the empty slot where it would be inserted.
+    std::size_t find_slot(key_type k) const
+    {
+        const std::size_t mask = keys_.size() - 1;
+        std::size_t slot = hash(k) & mask;
+        while (keys_[slot] != k && keys_[slot] != empty_key)
+            slot = (slot + 1) & mask;
+        return slot;
+    }
+
+    /// Basis states of interest often differ in a few high bits only, so the bits are mixed before masking.
+    static std::size_t hash(key_type k)
+    {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdull;
+        k ^= k >> 33;
+        return static_cast<std::size_t>(k);
+    }
+
+    std::vector<key_type> keys_;
+    std::vector<T> values_;
+    std::size_t size_ = 0;
+};
+
+namespace kernels
+{
+
+/// Amplitudes of smaller norm are dropped from sparse states; they are rounding noise of amplitudes that cancelled.
+template <class T>
+double sparse_cutoff()
+{
+    const double eps = 100. * std::numeric_limits<T>::epsilon();
+    return eps * eps;
+}
+
+/// Number of amplitudes of a dense state that a sparse representation would have to store.
+template <class T, class A>
+std::size_t count_nonzero(std::vector<std::complex<T>, A> const& wfn)
+{
+    const double cutoff = sparse_cutoff<T>();
+    std::size_t count = 0;
+#pragma omp parallel for schedule(static) reduction(+ : count)
+    for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(wfn.size()); ++i)
+        if (std::norm(wfn[i]) > cutoff) ++count;
+    return count;
+}
+
+/// Apply the 2x2 matrix `m` to qubit `q` of the basis states whose bits in `cmask` are all set.
+template <class T, class M>
+void apply_controlled(AmplitudeMap<std::complex<T>>& psi, M const& m, std::size_t cmask, unsigned q)
+{
+    using C = std::complex<T>;
+    const C m00 = static_cast<C>(m(0, 0)), m01 = static_cast<C>(m(0, 1));
+    const C m10 = static_cast<C>(m(1, 0)), m11 = static_cast<C>(m(1, 1));
+    const std::uint64_t bit = 1ull << q;
+
+    if (m01 == C(0.) && m10 == C(0.))
+    {
+        // diagonal gates only rescale the stored amplitudes
+        psi.transform([&](std::uint64_t k, C& v) {
+            if ((k & cmask) == cmask) v *= (k & bit) ? m11 : m00;
+        });
+        return;
+    }
+
+    const double cutoff = sparse_cutoff<T>();
+    AmplitudeMap<C> out;
+    out.reserve(2 * psi.size());
+    psi.for_each([&](std::uint64_t k, C v) {
+        if ((k & cmask) != cmask)
+        {
+            out.insert(k, v);
+            return;
+        }
+        const std::uint64_t k0 = k & ~bit;
+        const std::uint64_t k1 = k | bit;
+        if (k == k1 && psi.contains(k0)) return; // the pair is handled from its |0> side
+        const C a0 = (k == k0) ? v : C(0.);
+        const C a1 = (k == k1) ? v : psi.get(k1);
+        const C b0 = m00 * a0 + m01 * a1;
+        const C b1 = m10 * a0 + m11 * a1;
+        if (std::norm(b0) > cutoff) out.insert(k0, b0);
+        if (std::norm(b1) > cutoff) out.insert(k1, b1);
+    });
+    psi.swap(out);
+}
+
+template <class T>
+void apply_controlled_exp(
+    AmplitudeMap<std::complex<T>>& psi,
+    std::vector<Gates::Basis> const& b,
+    double phi,
+    std::vector<unsigned> const& cs,
+    std::vector<unsigned> const& qs)
+{
+    using C = std::complex<T>;
+    const std::size_t cmask = make_mask(cs);
+    const PauliMask p = make_pauli_mask(b, qs);
+
+    if (p.xy_bits == 0)
+    {
+        const C phase = static_cast<C>(std::exp(ComplexType(0., -phi)));
+        const std::size_t mask = make_mask(qs);
+        psi.transform([&](std::uint64_t k, C& v) {
+            if ((k & cmask) == cmask) v *= poppar(k & mask) ? phase : std::conj(phase);
+        });
+        return;
+    }
+
+    // same as the dense kernel: pairs x < t = x ^ xy_bits mix as
+    // (a, b) -> (alpha * a +- beta * b, alpha * b +- gamma * a), the signs given by the parity of x & yz_bits
+    const T alpha = static_cast<T>(std::cos(phi));
+    const C beta = static_cast<C>(std::sin(phi) * iExp(3 * p.y_count + 1));
+    const C gamma = static_cast<C>(std::sin(phi) * iExp(p.y_count + 1));
+    const double cutoff = sparse_cutoff<T>();
+
+    AmplitudeMap<C> out;
+    out.reserve(2 * psi.size());
+    psi.for_each([&](std::uint64_t k, C v) {
+        if ((k & cmask) != cmask)
+        {
+            out.insert(k, v);
+            return;
+        }
+        const std::uint64_t t = k ^ p.xy_bits;
+        if (k > t && psi.contains(t)) return; // the pair is handled from its lower side
+        const std::uint64_t x = std::min(k, t), y = std::max(k, t);
+        const C a = (k == x) ? v : C(0.);
+        const C c = (k == y) ? v : psi.get(y);
+        const bool parity = poppar(x & p.yz_bits);
+        const C nx = alpha * a + (parity ? -beta : beta) * c;
+        const C ny = alpha * c + (parity ? -gamma : gamma) * a;
+        if (std::norm(nx) > cutoff) out.insert(x, nx);
+        if (std::norm(ny) > cutoff) out.insert(y, ny);
+    });
+    psi.swap(out);
+}
+
+template <class T>
+double probability(AmplitudeMap<std::complex<T>> const& psi, unsigned q)
+{
+    const std::uint64_t bit = 1ull << q;
+    double prob = 0.;
+    psi.for_each([&](std::uint64_t k, std::complex<T> v) {
+        if (k & bit) prob += std::norm(v);
+    });
+    return prob;
+}
+
+template <class T>
+double jointprobability(AmplitudeMap<std::complex<T>> const& psi, std::vector<unsigned> const& qs)
+{
+    const std::size_t mask = make_mask(qs);
+    double prob = 0.;
+    psi.for_each([&](std::uint64_t k, std::complex<T> v) {
+        if (poppar(k & mask)) prob += std::norm(v);
+    });
+    return prob;
+}
+
+template <class T>
+double expectation_pauli_sum(
+    AmplitudeMap<std::complex<T>> const& psi,
+    std::vector<PauliMask> const& terms,
+    std::vector<double> const& coefficients)
+{
+    double sum = 0.;
+    for (std::size_t n = 0; n < terms.size(); ++n)
+    {
+        // <psi|P|psi> = sum_x conj(psi[x ^ xy]) * i^y_count * (-1)^parity(x & yz) * psi[x]
+        const std::complex<double> w = coefficients[n] * std::complex<double>(iExp(terms[n].y_count));
+        psi.for_each([&](std::uint64_t k, std::complex<T> v) {
+            const std::complex<T> partner = psi.get(k ^ terms[n].xy_bits);
+            if (partner == std::complex<T>(0.)) return;
+            const std::complex<double> prod = std::conj(std::complex<double>(partner)) * std::complex<double>(v);
+            const double contribution = w.real() * prod.real() - w.imag() * prod.imag();
+            sum += poppar(k & terms[n].yz_bits) ? -contribution : contribution;
+        });
+    }
+    return sum;
+}
+
+/// Keep the basis states for which `keep(k)` is true and renormalize.
+template <class T, class F>
+void collapse_if(AmplitudeMap<std::complex<T>>& psi, F&& keep)
+{
+    double norm = 0.;
+    psi.for_each([&](std::uint64_t k, std::complex<T> v) {
+        if (keep(k)) norm += std::norm(v);
+    });
+    const T scale = static_cast<T>(1. / std::sqrt(norm));
+    AmplitudeMap<std::complex<T>> out;
+    out.reserve(psi.size());
+    psi.for_each([&](std::uint64_t k, std::complex<T> v) {
+        if (keep(k)) out.insert(k, v * scale);
+    });
+    psi.swap(out);
+}
+
+template <class T>
+bool isclassical(AmplitudeMap<std::complex<T>> const& psi, unsigned q)
+{
+    const double eps = 100. * std::numeric_limits<T>::epsilon();
+    const std::uint64_t bit = 1ull << q;
+    bool have0 = false, have1 = false;
+    psi.for_each([&](std::uint64_t k, std::complex<T> v) {
+        if (std::norm(v) < eps) return;
+        ((k & bit) ? have1 : have0) = true;
+    });
+    return !(have0 && have1);
+}
+
+/// \pre the qubit is in a classical state
+template <class T>
+bool getvalue(AmplitudeMap<std::complex<T>> const& psi, unsigned q)
+{
+    const double eps = 100. * std::numeric_limits<T>::epsilon();
+    bool value = false;
+    psi.for_each([&](std::uint64_t k, std::complex<T> v) {
+        if (std::abs(v) > eps) value = (k >> q) & 1;
+    });
+    return value;
+}
+
+/// Drop the qubits at `positions` (ascending), which are in the classical state given by the bits of `values`.
+template <class T>
+void remove_qubits(AmplitudeMap<std::complex<T>>& psi, std::vector<unsigned> const& positions, std::size_t values)
+{
+    AmplitudeMap<std::complex<T>> out;
+    out.reserve(psi.size());
+    psi.for_each([&](std::uint64_t k, std::complex<T> v) {
+        if (detail::get_register(positions, k) != values) return;
+        std::uint64_t compacted = 0;
+        unsigned shift = 0;
+        std::size_t p = 0;
+        for (unsigned bit = 0; bit < 64 && (k >> bit) != 0; ++bit)
+        {
+            if (p < positions.size() && positions[p] == bit)
+            {
+                ++p;
+                continue;
+            }
+            compacted |= ((k >> bit) & 1ull) << shift++;
+        }
+        out.insert(compacted, v);
+    });
+    psi.swap(out);
+}
+
+/// Same as the dense kernel: the basis states are walked in ascending order, so both draw the same samples from the
+/// same random numbers.
+template <class T>
+std::vector<std::size_t> sample(AmplitudeMap<std::complex<T>> const& psi, std::vector<double> const& uniforms)
+{
+    const auto entries = psi.sorted();
+    std::vector<double> cumulative(entries.size());
+    double acc = 0.;
+    for (std::size_t i = 0; i < entries.size(); ++i)
+        cumulative[i] = acc += std::norm(entries[i].second);
+
+    std::vector<std::size_t> samples(uniforms.size(), 0);
+    for (std::size_t j = 0; j < uniforms.size(); ++j)
+    {
+        std::size_t i = std::upper_bound(cumulative.begin(), cumulative.end(), uniforms[j] * acc) - cumulative.begin();
+        samples[j] = entries[std::min(i, entries.size() - 1)].first;
+    }
+    return samples;
+}
+
+/// Apply `transform` to the register whose bit k is the qubit at positions[k], for every assignment of the other qubits
+/// that has stored amplitudes: they are gathered into a dense vector of the 2^positions.size() amplitudes of the
+/// register (bit k of its index is register bit k), transformed in place by transform(vector) and scattered back. Only
+/// for small registers, every assignment may take 2^positions.size() amplitudes afterwards.
+template <class T, class F>
+void apply_to_register(AmplitudeMap<std::complex<T>>& psi, std::vector<unsigned> const& positions, F&& transform)
+{
+    using C = std::complex<T>;
+    const std::size_t mask = make_mask(positions);
+    std::unordered_map<std::uint64_t, std::vector<std::pair<std::size_t, C>>> assignments;
+    psi.for_each([&](std::uint64_t k, C v) {
+        assignments[k & ~mask].emplace_back(detail::get_register(positions, k), v);
+    });
+
+    const double cutoff = sparse_cutoff<T>();
+    AmplitudeMap<C> out;
+    out.reserve(psi.size());
+    std::vector<C> slice(std::size_t(1) << positions.size());
+    for (auto const& assignment : assignments)
+    {
+        std::fill(slice.begin(), slice.end(), C(0.));
+        for (auto const& entry : assignment.second)
+            slice[entry.first] = entry.second;
+        transform(slice);
+        for (std::size_t x = 0; x < slice.size(); ++x)
+        {
+            if (std::norm(slice[x]) > cutoff)
+                out.insert(detail::set_register(positions, mask, x, assignment.first), slice[x]);
+        }
+    }
+    psi.swap(out);
+}
+
+/// Extract the state of the qubits at `positions` into `qubitswfn` (bit i of its index is the qubit at positions[i]),
+/// if they are separable from the rest. As in the dense kernel, the amplitudes are read off the slice through the
+/// largest amplitude and normalized; the state is separable iff it is the outer product of that slice and the
+/// complementary one through the same amplitude.
+template <class T, class A>
+bool subsytemwavefunction(
+    AmplitudeMap<std::complex<T>> const& psi,
+    std::vector<unsigned> const& positions,
+    std::vector<std::complex<T>, A>& qubitswfn,
+    double tolerance)
+{
+    using C = std::complex<T>;
+    assert(qubitswfn.size() == (1ull << positions.size()));
+    const std::size_t mask = make_mask(positions);
+
+    std::uint64_t pivot = 0;
+    double largest = -1.;
+    psi.for_each([&](std::uint64_t k, C v) {
+        if (std::norm(v) > largest)
+        {
+            largest = std::norm(v);
+            pivot = k;
+        }
+    });
+    const C pivot_value = psi.get(pivot);
+
+    double norm = 0.;
+    for (std::size_t s = 0; s < qubitswfn.size(); ++s)
+    {
+        qubitswfn[s] = psi.get(detail::set_register(positions, mask, s, pivot));
+        norm += std::norm(qubitswfn[s]);
+    }
+
+    // psi[s, r] == psi[s, r_pivot] * psi[s_pivot, r] / psi[pivot] for all s, r; amplitudes that aren't stored are zero
+    std::size_t row = 0, column = 0;
+    for (std::size_t s = 0; s < qubitswfn.size(); ++s)
+        if (qubitswfn[s] != C(0.)) ++row;
+    bool separable = true;
+    psi.for_each([&](std::uint64_t k, C v) {
+        if (!separable) return;
+        const C left = psi.get((k & mask) | (pivot & ~mask));
+        const C right = psi.get((k & ~mask) | (pivot & mask));
+        if ((k & mask) == (pivot & mask)) ++column;
+        if (std::norm(left * right / pivot_value - v) > tolerance * tolerance) separable = false;
+    });
+    if (!separable || row * column != psi.size()) return false;
+
+    const T scale = static_cast<T>(1. / std::sqrt(norm));
+    for (C& a : qubitswfn)
+        a *= scale;
+    return true;
+}
+
+} // namespace kernels
+} // namespace SIMULATOR
+} // namespace Quantum
+} // namespace Microsoft
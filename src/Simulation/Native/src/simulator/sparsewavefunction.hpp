@@ -0,0 +1,774 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include <cassert>
+#include <complex>
+#include <cstdint>
+#include <limits>
+#include <new>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+#include "gates.hpp"
+#include "sparsekernels.hpp"
+#include "types.hpp"
+#include "wavefunction.hpp"
+
+namespace Microsoft
+{
+namespace Quantum
+{
+namespace SIMULATOR
+{
+
+///
+/// Wave function that is stored densely while most of its amplitudes are non-zero and as a hash map of the non-zero
+/// amplitudes otherwise, which lets states of many more qubits than a dense vector could hold be simulated as long as
+/// they are supported on few basis states (e.g. classical oracles applied to a register in a small superposition).
+///
+/// The dense state is a regular Wavefunction, with all of its gate fusion. It moves to the sparse map when at least
+/// `min_sparse_qubits` are allocated and at most 1/16 of the amplitudes are non-zero, which is checked whenever qubits
+/// are allocated or released and after measurements. Gates are applied to the sparse map one by one, and the state
+/// moves back into a dense vector once more than 1/4 of the amplitudes are non-zero (or fewer than `min_sparse_qubits`
+/// qubits remain). The gap between both thresholds keeps states near the boundary from moving back and forth.
+///
+template <class T = ComplexType>
+class SparseWavefunction
+{
+  public:
+    using value_type = T;
+    using storage_type = typename Wavefunction<T>::storage_type;
+
+    /// Below this size dense vectors are small enough that their streaming kernels beat any hash map.
+    static constexpr unsigned min_sparse_qubits = 20;
+    /// Basis states are indexed by 64-bit keys, one of which marks an empty slot of the map.
+    static constexpr unsigned max_sparse_qubits = 63;
+
+  private:
+    /// The state while it is dense. Otherwise it holds zero qubits, but still owns the random engine.
+    Wavefunction<T> dense_;
+
+    bool sparse_ = false;
+
+    /// Number of qubits and positional ids of the qubits (see Wavefunction) while the state is sparse.
+    unsigned num_qubits_ = 0;
+    std::vector<positional_qubit_id> qubitmap_;
+
+    /// Non-zero amplitudes while the state is sparse.
+    AmplitudeMap<T> amplitudes_;
+
+    /// Dense copy of the sparse state handed out by data().
+    mutable storage_type materialized_;
+
+  public:
+    SparseWavefunction() = default;
+
+    void reset()
+    {
+        dense_.reset();
+        sparse_ = false;
+        num_qubits_ = 0;
+        qubitmap_.clear();
+        amplitudes_ = AmplitudeMap<T>();
+        materialized_ = storage_type();
+    }
+
+    /// true while the state is stored as a map of its non-zero amplitudes
+    bool is_sparse() const
+    {
+        return sparse_;
+    }
+
+    constexpr positional_qubit_id invalid_qubit_position() const
+    {
+        return std::numeric_limits<unsigned>::max();
+    }
+
+    positional_qubit_id get_qubit_position(logical_qubit_id q) const
+    {
+        if (!sparse_) return dense_.get_qubit_position(q);
+        assert(qubitmap_[q] != invalid_qubit_position());
+        return qubitmap_[q];
+    }
+
+    std::vector<positional_qubit_id> get_qubit_positions(const std::vector<logical_qubit_id>& qs) const
+    {
+        std::vector<positional_qubit_id> ps;
+        for (logical_qubit_id q : qs)
+            ps.push_back(get_qubit_position(q));
+        return ps;
+    }
+
+    /// Returns the list of logical ids of all currently allocated qubits.
+    std::vector<logical_qubit_id> get_qubit_ids() const
+    {
+        if (!sparse_) return dense_.get_qubit_ids();
+        std::vector<logical_qubit_id> qs;
+        for (unsigned i = 0; i < qubitmap_.size(); i++)
+            if (qubitmap_[i] != invalid_qubit_position()) qs.push_back(i);
+        return qs;
+    }
+
+    void flush() const
+    {
+        if (!sparse_) dense_.flush();
+    }
+
+    /// Allocate a qubit with implicitly assigned logical qubit id.
+    logical_qubit_id allocate_qubit()
+    {
+        return allocate_qubits(1).front();
+    }
+
+    /// Allocate `n` qubits with implicitly assigned logical qubit ids.
+    std::vector<logical_qubit_id> allocate_qubits(unsigned n)
+    {
+        prepare_allocation(n);
+        if (!sparse_) return dense_.allocate_qubits(n);
+
+        // New qubits are |0> at the highest positions, which leaves the indices of the stored amplitudes unchanged.
+        std::vector<logical_qubit_id> ids;
+        ids.reserve(n);
+        std::size_t free = 0;
+        for (unsigned i = 0; i < n; ++i)
+        {
+            while (free < qubitmap_.size() && qubitmap_[free] != invalid_qubit_position())
+                ++free;
+            if (free == qubitmap_.size()) qubitmap_.push_back(invalid_qubit_position());
+            qubitmap_[free] = num_qubits_++;
+            ids.push_back(static_cast<logical_qubit_id>(free));
+        }
+        return ids;
+    }
+
+    /// Allocate a qubit with explicitly provided logical qubit id.
+    void allocate_qubit(logical_qubit_id id)
+    {
+        allocate_qubits(std::vector<logical_qubit_id>{id});
+    }
+
+    /// Allocate qubits with explicitly provided logical qubit ids.
+    void allocate_qubits(std::vector<logical_qubit_id> const& ids)
+    {
+        prepare_allocation(static_cast<unsigned>(ids.size()));
+        if (!sparse_)
+        {
+            dense_.allocate_qubits(ids);
+            return;
+        }
+
+        for (logical_qubit_id id : ids)
+        {
+            if (id < qubitmap_.size())
+            {
+                assert(qubitmap_[id] == invalid_qubit_position());
+                qubitmap_[id] = num_qubits_++;
+            }
+            else
+            {
+                assert(id == qubitmap_.size());
+                qubitmap_.push_back(num_qubits_++);
+            }
+        }
+    }
+
+    /// release the specified qubit
+    /// \pre the qubit has to be in a classical state in the computational basis
+    void release(logical_qubit_id q)
+    {
+        if (!sparse_)
+        {
+            dense_.release(q);
+            maybe_sparsify();
+            return;
+        }
+        release(std::vector<logical_qubit_id>{q});
+    }
+
+    /// release the specified qubits
+    /// \pre the qubits have to be in a classical state in the computational basis
+    void release(std::vector<logical_qubit_id> const& qs)
+    {
+        if (qs.empty()) return;
+        if (!sparse_)
+        {
+            dense_.release(qs);
+            maybe_sparsify();
+            return;
+        }
+
+        std::vector<std::pair<positional_qubit_id, bool>> released;
+        for (logical_qubit_id q : qs)
+            released.emplace_back(get_qubit_position(q), getvalue(q));
+        std::sort(released.begin(), released.end());
+
+        std::vector<positional_qubit_id> positions;
+        std::size_t values = 0;
+        for (auto const& r : released)
+        {
+            values |= static_cast<std::size_t>(r.second) << positions.size();
+            positions.push_back(r.first);
+        }
+        kernels::remove_qubits(amplitudes_, positions, values);
+
+        for (logical_qubit_id q : qs)
+            qubitmap_[q] = invalid_qubit_position();
+        for (positional_qubit_id& p : qubitmap_)
+        {
+            if (p != invalid_qubit_position())
+                p -= static_cast<unsigned>(std::lower_bound(positions.begin(), positions.end(), p) - positions.begin());
+        }
+        num_qubits_ -= static_cast<unsigned>(qs.size());
+        maybe_densify();
+    }
+
+    /// the number of used qubits
+    unsigned num_qubits() const
+    {
+        return sparse_ ? num_qubits_ : dense_.num_qubits();
+    }
+
+    /// probability of measuring a 1
+    double probability(logical_qubit_id q) const
+    {
+        if (!sparse_) return dense_.probability(q);
+        return kernels::probability(amplitudes_, get_qubit_position(q));
+    }
+
+    /// probability of jointly measuring a 1
+    double jointprobability(std::vector<logical_qubit_id> const& qs) const
+    {
+        if (!sparse_) return dense_.jointprobability(qs);
+        return kernels::jointprobability(amplitudes_, get_qubit_positions(qs));
+    }
+
+    /// expectation value of the weighted sum of Pauli strings, `bs[k]` acting on qubits `qs[k]`
+    /// \pre the terms must not contain PauliI
+    double expectation_pauli_sum(
+        std::vector<std::vector<Gates::Basis>> const& bs,
+        std::vector<double> const& coefficients,
+        std::vector<std::vector<logical_qubit_id>> const& qs) const
+    {
+        if (!sparse_) return dense_.expectation_pauli_sum(bs, coefficients, qs);
+        assert(bs.size() == qs.size() && bs.size() == coefficients.size());
+        std::vector<kernels::PauliMask> terms;
+        terms.reserve(bs.size());
+        for (std::size_t k = 0; k < bs.size(); ++k)
+            terms.push_back(kernels::make_pauli_mask(bs[k], get_qubit_positions(qs[k])));
+        return kernels::expectation_pauli_sum(amplitudes_, terms, coefficients);
+    }
+
+    /// Same as Wavefunction::inject_state.
+    bool inject_state(const std::vector<logical_qubit_id>& qubits, const std::vector<ComplexType>& amplitudes)
+    {
+        if (!sparse_) return dense_.inject_state(qubits, amplitudes);
+        assert((static_cast<size_t>(1) << qubits.size()) == amplitudes.size());
+
+        std::vector<positional_qubit_id> positions = get_qubit_positions(qubits);
+        for (positional_qubit_id p : positions)
+        {
+            if (!kernels::isclassical(amplitudes_, p) || kernels::getvalue(amplitudes_, p))
+            {
+                return false;
+            }
+        }
+
+        // every stored term |i>|0...0> becomes Sum(b_j*|i>|j>)
+        const std::size_t mask = kernels::make_mask(positions);
+        AmplitudeMap<T> injected;
+        amplitudes_.for_each([&](std::uint64_t k, T v) {
+            for (std::size_t j = 0; j < amplitudes.size(); ++j)
+            {
+                if (amplitudes[j] == ComplexType(0.)) continue;
+                injected.insert(
+                    detail::set_register(positions, mask, j, k), static_cast<T>(static_cast<ComplexType>(v) * amplitudes[j]));
+            }
+        });
+        amplitudes_.swap(injected);
+        maybe_densify();
+        return true;
+    }
+
+    /// measure a qubit
+    bool measure(logical_qubit_id q)
+    {
+        if (!sparse_)
+        {
+            const bool result = dense_.measure(q);
+            maybe_sparsify();
+            return result;
+        }
+        std::uniform_real_distribution<double> uniform(0., 1.);
+        const bool result = (uniform(rng()) < probability(q));
+        const std::uint64_t bit = 1ull << get_qubit_position(q);
+        kernels::collapse_if(amplitudes_, [bit, result](std::uint64_t k) { return ((k & bit) != 0) == result; });
+        return result;
+    }
+
+    bool jointmeasure(std::vector<logical_qubit_id> const& qs)
+    {
+        if (!sparse_)
+        {
+            const bool result = dense_.jointmeasure(qs);
+            maybe_sparsify();
+            return result;
+        }
+        std::uniform_real_distribution<double> uniform(0., 1.);
+        const bool result = (uniform(rng()) < jointprobability(qs));
+        const std::size_t mask = kernels::make_mask(get_qubit_positions(qs));
+        kernels::collapse_if(amplitudes_, [mask, result](std::uint64_t k) { return poppar(k & mask) == result; });
+        return result;
+    }
+
+    /// Same as Wavefunction::sample, dense and sparse states draw the same samples for the same seed.
+    std::vector<std::size_t> sample(std::vector<logical_qubit_id> const& qs, std::size_t nshots)
+    {
+        if (!sparse_) return dense_.sample(qs, nshots);
+
+        std::uniform_real_distribution<double> uniform(0., 1.);
+        std::vector<double> uniforms(nshots);
+        for (double& u : uniforms)
+            u = uniform(rng());
+
+        std::vector<std::size_t> samples = kernels::sample(amplitudes_, uniforms);
+
+        std::vector<positional_qubit_id> positions = get_qubit_positions(qs);
+        for (std::size_t& s : samples)
+            s = detail::get_register(positions, s);
+        return samples;
+    }
+
+    void apply_controlled_exp(
+        std::vector<Gates::Basis> const& bs,
+        double phi,
+        std::vector<logical_qubit_id> const& cs,
+        std::vector<logical_qubit_id> const& qs)
+    {
+        if (!sparse_)
+        {
+            dense_.apply_controlled_exp(bs, phi, cs, qs);
+            return;
+        }
+        kernels::apply_controlled_exp(amplitudes_, bs, phi, get_qubit_positions(cs), get_qubit_positions(qs));
+        maybe_densify();
+    }
+
+    /// checks if the qubit is in classical state
+    bool isclassical(logical_qubit_id q) const
+    {
+        if (!sparse_) return dense_.isclassical(q);
+        return kernels::isclassical(amplitudes_, get_qubit_position(q));
+    }
+
+    /// returns the classical value of a qubit (if classical)
+    /// \pre the qubit has to be in a classical state in the computational basis
+    bool getvalue(logical_qubit_id q) const
+    {
+        if (!sparse_) return dense_.getvalue(q);
+        assert(isclassical(q));
+        return kernels::getvalue(amplitudes_, get_qubit_position(q));
+    }
+
+    /// The state as a dense vector. Sparse states are expanded into a copy, which has to fit into memory.
+    storage_type const& data() const
+    {
+        if (!sparse_) return dense_.data();
+        materialized_ = expand();
+        return materialized_;
+    }
+
+    /// Call f(index, amplitude) for the basis states in ascending order until it returns false. Sparse states only
+    /// visit their non-zero amplitudes.
+    template <class F>
+    void for_each_amplitude(F&& f) const
+    {
+        if (!sparse_)
+        {
+            dense_.for_each_amplitude(f);
+            return;
+        }
+        for (auto const& entry : amplitudes_.sorted())
+            if (!f(static_cast<std::size_t>(entry.first), entry.second)) return;
+    }
+
+    /// seed the random number engine for measurements
+    void seed(unsigned s)
+    {
+        dense_.seed(s);
+    }
+
+    int preferred_threads() const
+    {
+        return dense_.preferred_threads();
+    }
+
+    std::vector<bool> multimeasure(std::vector<logical_qubit_id> const& qs)
+    {
+        if (!sparse_)
+        {
+            std::vector<bool> results = dense_.multimeasure(qs);
+            maybe_sparsify();
+            return results;
+        }
+        std::vector<bool> results;
+        for (logical_qubit_id q : qs)
+            results.push_back(measure(q));
+        return results;
+    }
+
+    /// Checkpoints only hold dense states (see Wavefunction::save).
+    void save(std::string const& path) const
+    {
+        if (sparse_) throw std::runtime_error("sparse states can't be checkpointed");
+        dense_.save(path);
+    }
+
+    void load(std::string const& path)
+    {
+        dense_.load(path);
+        sparse_ = false;
+        num_qubits_ = 0;
+        qubitmap_.clear();
+        amplitudes_ = AmplitudeMap<T>();
+        materialized_ = storage_type();
+        maybe_sparsify();
+    }
+
+    /// generic application of a gate
+    template <class Gate>
+    void apply(Gate const& g)
+    {
+        if (!sparse_)
+        {
+            dense_.apply(g);
+            return;
+        }
+        apply_sparse(0, g);
+    }
+
+    /// generic application of a multiply controlled gate
+    template <class Gate>
+    void apply_controlled(std::vector<logical_qubit_id> cs, Gate const& g)
+    {
+        if (!sparse_)
+        {
+            dense_.apply_controlled(cs, g);
+            return;
+        }
+        apply_sparse(kernels::make_mask(get_qubit_positions(cs)), g);
+    }
+
+    /// generic application of a controlled gate
+    template <class Gate>
+    void apply_controlled(logical_qubit_id c, Gate const& g)
+    {
+        apply_controlled(std::vector<logical_qubit_id>{c}, g);
+    }
+
+    /// unoptimized application of a doubly controlled gate
+    template <class Gate>
+    void apply_controlled(logical_qubit_id c1, logical_qubit_id c2, Gate const& g)
+    {
+        apply_controlled(std::vector<logical_qubit_id>{c1, c2}, g);
+    }
+
+    template <class U, class A>
+    bool subsytemwavefunction(std::vector<logical_qubit_id> const& qs, std::vector<U, A>& qubitswfn, double tolerance)
+    {
+        if (!sparse_) return dense_.subsytemwavefunction(qs, qubitswfn, tolerance);
+
+        tolerance = std::max(tolerance, 100. * std::numeric_limits<typename T::value_type>::epsilon());
+        if constexpr (std::is_same<U, T>::value)
+        {
+            return kernels::subsytemwavefunction(amplitudes_, get_qubit_positions(qs), qubitswfn, tolerance);
+        }
+        else
+        {
+            std::vector<T> extracted(qubitswfn.size());
+            bool const separable =
+                kernels::subsytemwavefunction(amplitudes_, get_qubit_positions(qs), extracted, tolerance);
+            std::copy(extracted.begin(), extracted.end(), qubitswfn.begin());
+            return separable;
+        }
+    }
+
+    /// Same as Wavefunction::permute_basis.
+    void permute_basis(
+        std::vector<logical_qubit_id> const& qs,
+        size_t table_size,
+        size_t const* permutation_table,
+        bool adjoint = false)
+    {
+        if (!sparse_)
+        {
+            dense_.permute_basis(qs, table_size, permutation_table, adjoint);
+            return;
+        }
+        if (qs.empty()) return;
+        detail::check_permutation_table(qs.size(), table_size, permutation_table);
+
+        // the adjoint moves the amplitude of permute(i) to i, that is, it applies the inverse table
+        std::vector<size_t> inverse;
+        if (adjoint)
+        {
+            inverse.resize(table_size);
+            for (size_t i = 0; i < table_size; ++i)
+                inverse[permutation_table[i]] = i;
+            permutation_table = inverse.data();
+        }
+
+        std::vector<positional_qubit_id> positions = get_qubit_positions(qs);
+        const size_t qmask = kernels::make_mask(positions);
+        AmplitudeMap<T> permuted;
+        permuted.reserve(amplitudes_.size());
+        amplitudes_.for_each([&](std::uint64_t k, T v) {
+            permuted.insert(
+                detail::set_register(positions, qmask, permutation_table[detail::get_register(positions, k)], k), v);
+        });
+        amplitudes_.swap(permuted);
+    }
+
+    /// The Fourier transform of a register is dense on the register: it is applied to each assignment of the other
+    /// qubits on the sparse map while the register is small (see sparse_register), and to the expanded state otherwise.
+    /// The slices are small, so the bit-reversed result is undone on their amplitudes.
+    void qft(std::vector<logical_qubit_id> const& qs, bool adjoint = false)
+    {
+        if (qs.empty()) return;
+        if (!sparse_register(qs.size()))
+        {
+            if (sparse_) to_dense();
+            dense_.qft(qs, adjoint);
+            return;
+        }
+        const std::vector<unsigned> local = register_positions(qs.size());
+        kernels::apply_to_register(amplitudes_, get_qubit_positions(qs), [&](std::vector<T>& slice) {
+            kernels::qft(slice, local, adjoint);
+            for (std::size_t x = 0; x < slice.size(); ++x)
+            {
+                std::size_t reversed = 0;
+                for (unsigned k = 0; k < local.size(); ++k)
+                    reversed |= ((x >> k) & 1) << (local.size() - 1 - k);
+                if (x < reversed) std::swap(slice[x], slice[reversed]);
+            }
+        });
+        maybe_densify();
+    }
+
+    /// Reflections mix all the basis states of the register, they stay on the sparse map under the same conditions as
+    /// qft.
+    void reflect_about_uniform(std::vector<logical_qubit_id> const& qs)
+    {
+        if (!sparse_register(qs.size()))
+        {
+            if (sparse_) to_dense();
+            dense_.reflect_about_uniform(qs);
+            return;
+        }
+        const std::vector<unsigned> local = register_positions(qs.size());
+        kernels::apply_to_register(amplitudes_, get_qubit_positions(qs), [&](std::vector<T>& slice) {
+            kernels::reflect_about_uniform(slice, local);
+        });
+        maybe_densify();
+    }
+
+    void reflect_about_state(std::vector<logical_qubit_id> const& qs, std::vector<ComplexType> const& amplitudes)
+    {
+        if (!sparse_register(qs.size()))
+        {
+            if (sparse_) to_dense();
+            dense_.reflect_about_state(qs, amplitudes);
+            return;
+        }
+        const std::vector<unsigned> local = register_positions(qs.size());
+        kernels::apply_to_register(amplitudes_, get_qubit_positions(qs), [&](std::vector<T>& slice) {
+            kernels::reflect_about_state(slice, local, [&amplitudes](std::size_t x) { return amplitudes[x]; });
+        });
+        maybe_densify();
+    }
+
+    /// Same as Wavefunction::permute_basis_with. The adjoint of a sparse state needs the preimages of the values of the
+    /// register that are present, which are found by walking each of their cycles once: at most 2^qs.size() calls of
+    /// `f` in total, however many amplitudes share a cycle. Unlike the dense state, the state is left unchanged if `f`
+    /// turns out not to be a permutation.
+    template <class F>
+    void permute_basis_with(std::vector<logical_qubit_id> const& qs, F const& f, bool adjoint = false)
+    {
+        if (!sparse_)
+        {
+            dense_.permute_basis_with(qs, f, adjoint);
+            return;
+        }
+        if (qs.empty()) return;
+
+        std::vector<positional_qubit_id> positions = get_qubit_positions(qs);
+        const size_t qmask = kernels::make_mask(positions);
+        const size_t size = size_t(1) << qs.size();
+        auto next = [&f, size](size_t v) {
+            const size_t u = f(v);
+            if (u >= size) throw std::runtime_error("the function isn't a permutation of the basis states");
+            return u;
+        };
+
+        // image of every value of the register present in the state
+        std::unordered_map<size_t, size_t> image;
+        amplitudes_.for_each([&](std::uint64_t k, T) { image.emplace(detail::get_register(positions, k), size); });
+        if (adjoint)
+        {
+            for (auto& entry : image)
+            {
+                if (entry.second != size) continue;
+                // one walk around the cycle of entry.first sets the preimages of all present values on it
+                size_t u = entry.first;
+                size_t steps = 0;
+                do
+                {
+                    const size_t w = next(u);
+                    auto found = image.find(w);
+                    if (found != image.end()) found->second = u;
+                    u = w;
+                    if (++steps > size) throw std::runtime_error("the function isn't a permutation of the basis states");
+                } while (u != entry.first);
+            }
+        }
+        else
+        {
+            for (auto& entry : image)
+                entry.second = next(entry.first);
+        }
+
+        AmplitudeMap<T> permuted;
+        permuted.reserve(amplitudes_.size());
+        amplitudes_.for_each([&](std::uint64_t k, T v) {
+            permuted.insert(detail::set_register(positions, qmask, image[detail::get_register(positions, k)], k), v);
+        });
+        // two amplitudes moved to the same basis state
+        if (permuted.size() != amplitudes_.size())
+            throw std::runtime_error("the function isn't a permutation of the basis states");
+        amplitudes_.swap(permuted);
+    }
+
+    auto& rng()
+    {
+        return dense_.rng();
+    }
+
+  private:
+    template <class Gate>
+    void apply_sparse(std::size_t cmask, Gate const& g)
+    {
+        kernels::apply_controlled(amplitudes_, g.matrix(), cmask, get_qubit_position(g.qubit()));
+        maybe_densify();
+    }
+
+    /// Sparse maps pay off for large states with few non-zero amplitudes.
+    static bool sparse_worthwhile(std::size_t nonzero, unsigned num_qubits)
+    {
+        if (num_qubits < min_sparse_qubits) return false;
+        return num_qubits >= 8 * sizeof(std::size_t) - 4 || nonzero < (std::size_t(1) << (num_qubits - 4));
+    }
+
+    static bool dense_worthwhile(std::size_t nonzero, unsigned num_qubits)
+    {
+        if (num_qubits < min_sparse_qubits) return true;
+        return num_qubits < 8 * sizeof(std::size_t) - 2 && nonzero > (std::size_t(1) << (num_qubits - 2));
+    }
+
+    /// Move the state into the sparse map before a dense one is grown by `k` qubits if that makes it sparse enough, and
+    /// check that a sparse state can take `k` more qubits.
+    void prepare_allocation(unsigned k)
+    {
+        if (!sparse_)
+        {
+            const unsigned n = dense_.num_qubits() + k;
+            if (n < min_sparse_qubits) return;
+            const std::size_t nonzero = kernels::count_nonzero(dense_.data());
+            if (sparse_worthwhile(nonzero, n)) to_sparse(nonzero);
+        }
+        if (sparse_ && num_qubits_ + k > max_sparse_qubits)
+        {
+            throw std::runtime_error("sparse states are limited to 63 qubits");
+        }
+    }
+
+    void maybe_sparsify()
+    {
+        if (dense_.num_qubits() < min_sparse_qubits) return;
+        const std::size_t nonzero = kernels::count_nonzero(dense_.data());
+        if (sparse_worthwhile(nonzero, dense_.num_qubits())) to_sparse(nonzero);
+    }
+
+    /// Whether an operation that is dense on a register of `k` qubits is applied to the sparse map: the register is
+    /// small, and the state stays sparse even if every stored amplitude spreads over all of its basis states.
+    bool sparse_register(std::size_t k) const
+    {
+        if (!sparse_ || k >= min_sparse_qubits) return false;
+        return !dense_worthwhile(amplitudes_.size() << k, num_qubits_);
+    }
+
+    static std::vector<unsigned> register_positions(std::size_t k)
+    {
+        std::vector<unsigned> positions(k);
+        std::iota(positions.begin(), positions.end(), 0u);
+        return positions;
+    }
+
+    void maybe_densify()
+    {
+        if (dense_worthwhile(amplitudes_.size(), num_qubits_)) to_dense();
+    }
+
+    void to_sparse(std::size_t nonzero)
+    {
+        storage_type const& wfn = dense_.data();
+        const double cutoff = kernels::sparse_cutoff<typename T::value_type>();
+        amplitudes_.clear();
+        amplitudes_.reserve(nonzero);
+        for (std::size_t i = 0; i < wfn.size(); ++i)
+            if (std::norm(wfn[i]) > cutoff) amplitudes_.insert(i, wfn[i]);
+
+        num_qubits_ = dense_.num_qubits();
+        qubitmap_ = dense_.qubit_map();
+        dense_.set_state({}, storage_type(1, T(1.)));
+        sparse_ = true;
+    }
+
+    void to_dense()
+    {
+        dense_.set_state(qubitmap_, expand());
+        sparse_ = false;
+        num_qubits_ = 0;
+        qubitmap_.clear();
+        amplitudes_ = AmplitudeMap<T>();
+    }
+
+    storage_type expand() const
+    {
+        if (num_qubits_ >= 8 * sizeof(std::size_t) - 4)
+        {
+            throw std::runtime_error("the sparse state has too many qubits to be expanded into a state vector");
+        }
+        storage_type wfn;
+        try
+        {
+            wfn.resize(std::size_t(1) << num_qubits_);
+        }
+        catch (const std::bad_alloc&)
+        {
+            throw std::runtime_error("the sparse state has too many qubits to be expanded into a state vector");
+        }
+#pragma omp parallel for schedule(static)
+        for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(wfn.size()); ++i)
+            wfn[i] = T(0.);
+        amplitudes_.for_each([&wfn](std::uint64_t k, T v) { wfn[k] = v; });
+        return wfn;
+    }
+};
+
+} // namespace SIMULATOR
+} // namespace Quantum
+} // namespace Microsoft
@@ -0,0 +1,627 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include <cassert>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include "gates.hpp"
+#include "tableau.hpp"
+#include "types.hpp"
+#include "wavefunction.hpp"
+
+namespace Microsoft
+{
+namespace Quantum
+{
+namespace SIMULATOR
+{
+
+///
+/// Wave function that starts out as a stabilizer tableau and is converted into a dense Wavefunction the first time a
+/// gate arrives that isn't a Clifford gate. Clifford circuits (Paulis, H, S, CNOT, CZ, rotations by multiples of pi/2,
+/// Pauli measurements) thus run in polynomial time on any number of qubits, while other programs behave exactly as on
+/// the dense simulator once the conversion happened (which needs the state to fit into memory).
+///
+/// Gates are recognized as Clifford gates from their matrices: single-qubit gates that map each Pauli matrix to a
+/// signed Pauli matrix by conjugation, singly controlled gates whose target matrix is a Pauli matrix times a power of
+/// i, and Exp of Pauli strings by multiples of pi/4 without controls.
+///
+/// Released qubits are reset to |0> and their tableau columns are reused by later allocations.
+///
+template <class T = ComplexType>
+class StabilizerWavefunction
+{
+  public:
+    using value_type = T;
+    using storage_type = typename Wavefunction<T>::storage_type;
+
+  private:
+    /// The state once it has been converted. Until then it holds zero qubits, but owns the random engine.
+    Wavefunction<T> dense_;
+
+    bool stabilizer_ = true;
+    Tableau tableau_;
+
+    /// Tableau columns of the qubits, indexed by their logical ids, and the columns of released qubits.
+    std::vector<unsigned> qubitmap_;
+    std::vector<unsigned> free_columns_;
+    unsigned num_qubits_ = 0;
+
+    /// Dense copy of the stabilizer state handed out by data().
+    mutable storage_type materialized_;
+
+  public:
+    StabilizerWavefunction() = default;
+
+    void reset()
+    {
+        dense_.reset();
+        stabilizer_ = true;
+        tableau_ = Tableau();
+        qubitmap_.clear();
+        free_columns_.clear();
+        num_qubits_ = 0;
+        materialized_ = storage_type();
+    }
+
+    /// true until the first non-Clifford gate converted the state
+    bool is_stabilizer() const
+    {
+        return stabilizer_;
+    }
+
+    constexpr unsigned invalid_qubit_position() const
+    {
+        return std::numeric_limits<unsigned>::max();
+    }
+
+    /// Returns the list of logical ids of all currently allocated qubits.
+    std::vector<logical_qubit_id> get_qubit_ids() const
+    {
+        if (!stabilizer_) return dense_.get_qubit_ids();
+        std::vector<logical_qubit_id> qs;
+        for (unsigned i = 0; i < qubitmap_.size(); i++)
+            if (qubitmap_[i] != invalid_qubit_position()) qs.push_back(i);
+        return qs;
+    }
+
+    void flush() const
+    {
+        if (!stabilizer_) dense_.flush();
+    }
+
+    /// Allocate a qubit with implicitly assigned logical qubit id.
+    logical_qubit_id allocate_qubit()
+    {
+        return allocate_qubits(1).front();
+    }
+
+    /// Allocate `n` qubits with implicitly assigned logical qubit ids.
+    std::vector<logical_qubit_id> allocate_qubits(unsigned n)
+    {
+        if (!stabilizer_) return dense_.allocate_qubits(n);
+
+        std::vector<unsigned> columns = take_columns(n);
+        std::vector<logical_qubit_id> ids;
+        ids.reserve(n);
+        std::size_t free = 0;
+        for (unsigned column : columns)
+        {
+            while (free < qubitmap_.size() && qubitmap_[free] != invalid_qubit_position())
+                ++free;
+            if (free == qubitmap_.size()) qubitmap_.push_back(invalid_qubit_position());
+            qubitmap_[free] = column;
+            ids.push_back(static_cast<logical_qubit_id>(free));
+        }
+        return ids;
+    }
+
+    /// Allocate a qubit with explicitly provided logical qubit id.
+    void allocate_qubit(logical_qubit_id id)
+    {
+        allocate_qubits(std::vector<logical_qubit_id>{id});
+    }
+
+    /// Allocate qubits with explicitly provided logical qubit ids.
+    void allocate_qubits(std::vector<logical_qubit_id> const& ids)
+    {
+        if (!stabilizer_)
+        {
+            dense_.allocate_qubits(ids);
+            return;
+        }
+
+        std::vector<unsigned> columns = take_columns(static_cast<unsigned>(ids.size()));
+        for (std::size_t i = 0; i < ids.size(); ++i)
+        {
+            if (ids[i] >= qubitmap_.size()) qubitmap_.resize(ids[i] + 1, invalid_qubit_position());
+            assert(qubitmap_[ids[i]] == invalid_qubit_position());
+            qubitmap_[ids[i]] = columns[i];
+        }
+    }
+
+    /// release the specified qubit
+    /// \pre the qubit has to be in a classical state in the computational basis
+    void release(logical_qubit_id q)
+    {
+        release(std::vector<logical_qubit_id>{q});
+    }
+
+    /// release the specified qubits
+    /// \pre the qubits have to be in a classical state in the computational basis
+    void release(std::vector<logical_qubit_id> const& qs)
+    {
+        if (!stabilizer_)
+        {
+            dense_.release(qs);
+            return;
+        }
+        for (logical_qubit_id q : qs)
+        {
+            const unsigned column = column_of(q);
+            if (getvalue(q)) tableau_.apply(pauli_x(), column);
+            free_columns_.push_back(column);
+            qubitmap_[q] = invalid_qubit_position();
+        }
+        num_qubits_ -= static_cast<unsigned>(qs.size());
+    }
+
+    /// the number of used qubits
+    unsigned num_qubits() const
+    {
+        return stabilizer_ ? num_qubits_ : dense_.num_qubits();
+    }
+
+    /// probability of measuring a 1
+    double probability(logical_qubit_id q) const
+    {
+        if (!stabilizer_) return dense_.probability(q);
+        return 0.5 * (1 - tableau_.expectation(z_string({q})));
+    }
+
+    /// probability of jointly measuring a 1
+    double jointprobability(std::vector<logical_qubit_id> const& qs) const
+    {
+        if (!stabilizer_) return dense_.jointprobability(qs);
+        return 0.5 * (1 - tableau_.expectation(z_string(qs)));
+    }
+
+    /// expectation value of the weighted sum of Pauli strings, `bs[k]` acting on qubits `qs[k]`
+    double expectation_pauli_sum(
+        std::vector<std::vector<Gates::Basis>> const& bs,
+        std::vector<double> const& coefficients,
+        std::vector<std::vector<logical_qubit_id>> const& qs) const
+    {
+        if (!stabilizer_) return dense_.expectation_pauli_sum(bs, coefficients, qs);
+        assert(bs.size() == qs.size() && bs.size() == coefficients.size());
+        double sum = 0.;
+        for (std::size_t k = 0; k < bs.size(); ++k)
+            sum += coefficients[k] * tableau_.expectation(pauli_string(bs[k], qs[k]));
+        return sum;
+    }
+
+    /// Arbitrary amplitudes don't describe a stabilizer state, so the state is converted first.
+    bool inject_state(const std::vector<logical_qubit_id>& qubits, const std::vector<ComplexType>& amplitudes)
+    {
+        convert();
+        return dense_.inject_state(qubits, amplitudes);
+    }
+
+    /// measure a qubit
+    bool measure(logical_qubit_id q)
+    {
+        if (!stabilizer_) return dense_.measure(q);
+        return measure_pauli(z_string({q}));
+    }
+
+    bool jointmeasure(std::vector<logical_qubit_id> const& qs)
+    {
+        if (!stabilizer_) return dense_.jointmeasure(qs);
+        return measure_pauli(z_string(qs));
+    }
+
+    ///
+    /// Sample the joint measurement outcomes of qubits `qs` `nshots` times, without collapsing the state. The outcomes
+    /// of a stabilizer state are uniformly distributed over an affine subspace: measuring a copy of the tableau with all
+    /// random outcomes 0 gives its offset, and flipping the i-th random outcome adds the i-th basis vector.
+    ///
+    std::vector<std::size_t> sample(std::vector<logical_qubit_id> const& qs, std::size_t nshots)
+    {
+        if (!stabilizer_) return dense_.sample(qs, nshots);
+        assert(qs.size() <= 8 * sizeof(std::size_t));
+
+        auto outcomes = [this, &qs](std::size_t flipped, std::vector<std::size_t>* random) {
+            Tableau copy = tableau_;
+            std::size_t result = 0;
+            std::size_t count = 0;
+            for (std::size_t i = 0; i < qs.size(); ++i)
+            {
+                Tableau::Pauli z = z_string({qs[i]});
+                const bool random_outcome = copy.expectation(z) == 0;
+                const bool outcome = copy.measure(z, random_outcome && count++ == flipped);
+                if (random_outcome && random != nullptr) random->push_back(i);
+                result |= static_cast<std::size_t>(outcome) << i;
+            }
+            return result;
+        };
+
+        std::vector<std::size_t> random;
+        const std::size_t offset = outcomes(std::numeric_limits<std::size_t>::max(), &random);
+        std::vector<std::size_t> basis;
+        for (std::size_t k = 0; k < random.size(); ++k)
+            basis.push_back(outcomes(k, nullptr) ^ offset);
+
+        std::uniform_real_distribution<double> uniform(0., 1.);
+        std::vector<std::size_t> samples(nshots, offset);
+        for (std::size_t& s : samples)
+            for (std::size_t b : basis)
+                if (uniform(rng()) < 0.5) s ^= b;
+        return samples;
+    }
+
+    void apply_controlled_exp(
+        std::vector<Gates::Basis> const& bs,
+        double phi,
+        std::vector<logical_qubit_id> const& cs,
+        std::vector<logical_qubit_id> const& qs)
+    {
+        if (stabilizer_ && cs.empty())
+        {
+            // exp(i k pi/4 P) is exp(i pi/4 P) for odd k times i^(k/2) P^(k/2)
+            const double quarters = phi / (0.25 * M_PI);
+            const double k = std::round(quarters);
+            if (std::abs(quarters - k) < 1e-12)
+            {
+                const int steps = ((static_cast<int>(std::fmod(k, 8.)) % 8) + 8) % 8;
+                Tableau::Pauli p = pauli_string(bs, qs);
+                if (steps & 1) tableau_.apply_quarter_rotation(p);
+                if ((steps >> 1) & 1) tableau_.apply_pauli(p);
+                return;
+            }
+        }
+        convert();
+        dense_.apply_controlled_exp(bs, phi, cs, qs);
+    }
+
+    /// checks if the qubit is in classical state
+    bool isclassical(logical_qubit_id q) const
+    {
+        if (!stabilizer_) return dense_.isclassical(q);
+        return tableau_.expectation(z_string({q})) != 0;
+    }
+
+    /// returns the classical value of a qubit (if classical)
+    /// \pre the qubit has to be in a classical state in the computational basis
+    bool getvalue(logical_qubit_id q) const
+    {
+        if (!stabilizer_) return dense_.getvalue(q);
+        assert(isclassical(q));
+        return tableau_.expectation(z_string({q})) < 0;
+    }
+
+    /// The state as a dense vector. Stabilizer states are expanded into a copy, which has to fit into memory.
+    storage_type const& data() const
+    {
+        if (!stabilizer_) return dense_.data();
+        materialized_ = expand();
+        return materialized_;
+    }
+
+    /// Positions of the qubits in the state returned by data().
+    std::vector<positional_qubit_id> get_qubit_positions(std::vector<logical_qubit_id> const& qs) const
+    {
+        if (!stabilizer_) return dense_.get_qubit_positions(qs);
+        std::vector<positional_qubit_id> const map = dense_qubitmap();
+        std::vector<positional_qubit_id> ps;
+        for (logical_qubit_id q : qs)
+        {
+            assert(map[q] != invalid_qubit_position());
+            ps.push_back(map[q]);
+        }
+        return ps;
+    }
+
+    /// Call f(index, amplitude) for every basis state, in ascending order, until it returns false.
+    template <class F>
+    void for_each_amplitude(F&& f) const
+    {
+        if (!stabilizer_)
+        {
+            dense_.for_each_amplitude(f);
+            return;
+        }
+        storage_type const& wfn = data();
+        for (std::size_t i = 0; i < wfn.size(); ++i)
+            if (!f(i, wfn[i])) return;
+    }
+
+    /// seed the random number engine for measurements
+    void seed(unsigned s)
+    {
+        dense_.seed(s);
+    }
+
+    int preferred_threads() const
+    {
+        return dense_.preferred_threads();
+    }
+
+    std::vector<bool> multimeasure(std::vector<logical_qubit_id> const& qs)
+    {
+        if (!stabilizer_) return dense_.multimeasure(qs);
+        std::vector<bool> results;
+        for (logical_qubit_id q : qs)
+            results.push_back(measure(q));
+        return results;
+    }
+
+    /// Checkpoints only hold dense states (see Wavefunction::save), a loaded state stays dense.
+    void save(std::string const& path) const
+    {
+        if (stabilizer_) throw std::runtime_error("stabilizer states can't be checkpointed");
+        dense_.save(path);
+    }
+
+    void load(std::string const& path)
+    {
+        dense_.load(path);
+        stabilizer_ = false;
+        tableau_ = Tableau();
+        qubitmap_.clear();
+        free_columns_.clear();
+        num_qubits_ = 0;
+        materialized_ = storage_type();
+    }
+
+    /// generic application of a gate
+    template <class Gate>
+    void apply(Gate const& g)
+    {
+        SingleQubitClifford c;
+        if (stabilizer_ && as_clifford(g.matrix(), c))
+        {
+            tableau_.apply(c, column_of(g.qubit()));
+            return;
+        }
+        convert();
+        dense_.apply(g);
+    }
+
+    /// generic application of a multiply controlled gate
+    template <class Gate>
+    void apply_controlled(std::vector<logical_qubit_id> cs, Gate const& g)
+    {
+        if (stabilizer_ && cs.empty())
+        {
+            apply(g);
+            return;
+        }
+        Gates::Basis pauli;
+        unsigned power;
+        if (stabilizer_ && cs.size() == 1 && as_scaled_pauli(g.matrix(), pauli, power))
+        {
+            // C(i^power P) = (S^power on the control) C(P), and C(P) is CNOT conjugated by the rotation taking X to P
+            const unsigned c = column_of(cs.front());
+            const unsigned t = column_of(g.qubit());
+            if (pauli == Gates::PauliZ) tableau_.apply(hadamard(), t);
+            if (pauli == Gates::PauliY) tableau_.apply(phase(3), t);
+            if (pauli != Gates::PauliI) tableau_.apply_cx(c, t);
+            if (pauli == Gates::PauliZ) tableau_.apply(hadamard(), t);
+            if (pauli == Gates::PauliY) tableau_.apply(phase(1), t);
+            if (power != 0) tableau_.apply(phase(power), c);
+            return;
+        }
+        convert();
+        dense_.apply_controlled(cs, g);
+    }
+
+    /// generic application of a controlled gate
+    template <class Gate>
+    void apply_controlled(logical_qubit_id c, Gate const& g)
+    {
+        apply_controlled(std::vector<logical_qubit_id>{c}, g);
+    }
+
+    /// unoptimized application of a doubly controlled gate
+    template <class Gate>
+    void apply_controlled(logical_qubit_id c1, logical_qubit_id c2, Gate const& g)
+    {
+        apply_controlled(std::vector<logical_qubit_id>{c1, c2}, g);
+    }
+
+    template <class U, class A>
+    bool subsytemwavefunction(std::vector<logical_qubit_id> const& qs, std::vector<U, A>& qubitswfn, double tolerance)
+    {
+        if (!stabilizer_) return dense_.subsytemwavefunction(qs, qubitswfn, tolerance);
+        Wavefunction<T> expanded;
+        expanded.set_state(dense_qubitmap(), expand());
+        return expanded.subsytemwavefunction(qs, qubitswfn, tolerance);
+    }
+
+    /// Basis permutations aren't Clifford operations in general, so the state is converted first.
+    void permute_basis(
+        std::vector<logical_qubit_id> const& qs,
+        size_t table_size,
+        size_t const* permutation_table,
+        bool adjoint = false)
+    {
+        if (qs.empty()) return;
+        detail::check_permutation_table(qs.size(), table_size, permutation_table);
+        convert();
+        dense_.permute_basis(qs, table_size, permutation_table, adjoint);
+    }
+
+    void qft(std::vector<logical_qubit_id> const& qs, bool adjoint = false)
+    {
+        convert();
+        dense_.qft(qs, adjoint);
+    }
+
+    void reflect_about_uniform(std::vector<logical_qubit_id> const& qs)
+    {
+        convert();
+        dense_.reflect_about_uniform(qs);
+    }
+
+    void reflect_about_state(std::vector<logical_qubit_id> const& qs, std::vector<ComplexType> const& amplitudes)
+    {
+        convert();
+        dense_.reflect_about_state(qs, amplitudes);
+    }
+
+    template <class F>
+    void permute_basis_with(std::vector<logical_qubit_id> const& qs, F const& f, bool adjoint = false)
+    {
+        convert();
+        dense_.permute_basis_with(qs, f, adjoint);
+    }
+
+    auto& rng()
+    {
+        return dense_.rng();
+    }
+
+  private:
+    static SingleQubitClifford clifford(TinyMatrix<ComplexType, 2> const& m)
+    {
+        SingleQubitClifford c;
+        const bool ok = as_clifford(m, c);
+        assert(ok);
+        (void)ok;
+        return c;
+    }
+
+    static SingleQubitClifford const& pauli_x()
+    {
+        static const SingleQubitClifford x = clifford(Gates::X(0).matrix());
+        return x;
+    }
+
+    static SingleQubitClifford const& hadamard()
+    {
+        static const SingleQubitClifford h = clifford(Gates::H(0).matrix());
+        return h;
+    }
+
+    /// diag(1, i^power)
+    static SingleQubitClifford const& phase(unsigned power)
+    {
+        static const SingleQubitClifford phases[4] = {
+            clifford(TinyMatrix<ComplexType, 2>({{1., 0.}, {0., 1.}})),
+            clifford(Gates::S(0).matrix()),
+            clifford(Gates::Z(0).matrix()),
+            clifford(Gates::AdjS(0).matrix())};
+        return phases[power & 3u];
+    }
+
+    unsigned column_of(logical_qubit_id q) const
+    {
+        assert(q < qubitmap_.size() && qubitmap_[q] != invalid_qubit_position());
+        return qubitmap_[q];
+    }
+
+    /// Columns for `n` new qubits in |0>, reusing released ones first.
+    std::vector<unsigned> take_columns(unsigned n)
+    {
+        std::vector<unsigned> columns;
+        while (columns.size() < n && !free_columns_.empty())
+        {
+            columns.push_back(free_columns_.back());
+            free_columns_.pop_back();
+        }
+        const unsigned added = n - static_cast<unsigned>(columns.size());
+        for (unsigned i = 0; i < added; ++i)
+            columns.push_back(tableau_.num_qubits() + i);
+        tableau_.add_qubits(added);
+        num_qubits_ += n;
+        return columns;
+    }
+
+    Tableau::Pauli pauli_string(std::vector<Gates::Basis> const& bs, std::vector<logical_qubit_id> const& qs) const
+    {
+        assert(bs.size() == qs.size());
+        Tableau::Pauli p = tableau_.identity();
+        for (std::size_t i = 0; i < qs.size(); ++i)
+            Tableau::add_factor(p, column_of(qs[i]), bs[i]);
+        return p;
+    }
+
+    Tableau::Pauli z_string(std::vector<logical_qubit_id> const& qs) const
+    {
+        return pauli_string(std::vector<Gates::Basis>(qs.size(), Gates::PauliZ), qs);
+    }
+
+    /// Same distribution of outcomes and use of the random engine as Wavefunction::jointmeasure.
+    bool measure_pauli(Tableau::Pauli const& p)
+    {
+        std::uniform_real_distribution<double> uniform(0., 1.);
+        return tableau_.measure(p, uniform(rng()) < 0.5);
+    }
+
+    /// Positional ids of the allocated qubits in a dense state: the order of their tableau columns.
+    std::vector<positional_qubit_id> dense_qubitmap() const
+    {
+        std::vector<unsigned> columns;
+        for (unsigned column : qubitmap_)
+            if (column != invalid_qubit_position()) columns.push_back(column);
+        std::sort(columns.begin(), columns.end());
+
+        std::vector<positional_qubit_id> positions(qubitmap_.size(), invalid_qubit_position());
+        for (std::size_t q = 0; q < qubitmap_.size(); ++q)
+            if (qubitmap_[q] != invalid_qubit_position())
+                positions[q] = static_cast<positional_qubit_id>(
+                    std::lower_bound(columns.begin(), columns.end(), qubitmap_[q]) - columns.begin());
+        return positions;
+    }
+
+    storage_type expand() const
+    {
+        if (num_qubits_ >= 8 * sizeof(std::size_t) - 4)
+        {
+            throw std::runtime_error("the stabilizer state has too many qubits to be expanded into a state vector");
+        }
+        std::vector<unsigned> columns;
+        for (unsigned column : qubitmap_)
+            if (column != invalid_qubit_position()) columns.push_back(column);
+        std::sort(columns.begin(), columns.end());
+
+        storage_type wfn(std::size_t(1) << num_qubits_);
+#pragma omp parallel for schedule(static)
+        for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(wfn.size()); ++i)
+            wfn[i] = T(0.);
+        // released columns are |0> and drop out of the index
+        tableau_.for_each_basis_state([&](std::vector<std::uint64_t> const& xs, ComplexType amplitude) {
+            std::size_t index = 0;
+            for (std::size_t i = 0; i < columns.size(); ++i)
+                index |= static_cast<std::size_t>((xs[columns[i] / 64] >> (columns[i] % 64)) & 1) << i;
+            wfn[index] = static_cast<T>(amplitude);
+            return true;
+        });
+        return wfn;
+    }
+
+    /// Continue on the dense state from here on.
+    void convert()
+    {
+        if (!stabilizer_) return;
+        dense_.set_state(dense_qubitmap(), expand());
+        stabilizer_ = false;
+        tableau_ = Tableau();
+        qubitmap_.clear();
+        free_columns_.clear();
+        num_qubits_ = 0;
+        materialized_ = storage_type();
+    }
+};
+
+} // namespace SIMULATOR
+} // namespace Quantum
+} // namespace Microsoft
@@ -0,0 +1,404 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "gates.hpp"
+#include "types.hpp"
+#include "util/bitops.hpp"
+#include "util/tinymatrix.hpp"
+
+namespace Microsoft
+{
+namespace Quantum
+{
+namespace SIMULATOR
+{
+
+///
+/// Action of a single-qubit Clifford gate U by conjugation, indexed like Gates::Basis (PauliX = 1, PauliZ = 2,
+/// PauliY = 3): U P U^dagger = (-1)^negative[P] image[P].
+///
+struct SingleQubitClifford
+{
+    Gates::Basis image[4];
+    bool negative[4];
+};
+
+/// Decide whether the 2x2 unitary `m` is a Clifford gate (up to a global phase), and if so fill in its action.
+inline bool as_clifford(TinyMatrix<ComplexType, 2> const& m, SingleQubitClifford& c)
+{
+    using namespace std::literals::complex_literals;
+    const ComplexType paulis[4][2][2] = {
+        {{1., 0.}, {0., 1.}}, {{0., 1.}, {1., 0.}}, {{1., 0.}, {0., -1.}}, {{0., -1i}, {1i, 0.}}};
+    const double tolerance = 1e-10;
+
+    c.image[0] = Gates::PauliI;
+    c.negative[0] = false;
+    for (unsigned p = 1; p < 4; ++p)
+    {
+        // conjugated = m * P * m^dagger
+        ComplexType conjugated[2][2];
+        for (unsigned i = 0; i < 2; ++i)
+            for (unsigned j = 0; j < 2; ++j)
+            {
+                conjugated[i][j] = 0.;
+                for (unsigned k = 0; k < 2; ++k)
+                    for (unsigned l = 0; l < 2; ++l)
+                        conjugated[i][j] += m(i, k) * paulis[p][k][l] * std::conj(m(j, l));
+            }
+
+        bool found = false;
+        for (unsigned q = 1; q < 4 && !found; ++q)
+            for (double sign : {1., -1.})
+            {
+                double distance = 0.;
+                for (unsigned i = 0; i < 2; ++i)
+                    for (unsigned j = 0; j < 2; ++j)
+                        distance += std::norm(conjugated[i][j] - sign * paulis[q][i][j]);
+                if (distance < tolerance * tolerance)
+                {
+                    c.image[p] = static_cast<Gates::Basis>(q);
+                    c.negative[p] = sign < 0.;
+                    found = true;
+                    break;
+                }
+            }
+        if (!found) return false;
+    }
+    return true;
+}
+
+/// Decide whether the 2x2 matrix `m` is `phase` times a Pauli matrix with `phase` one of 1, i, -1, -i (the power of i is
+/// returned in `power`). A singly controlled gate of this form is a Clifford gate.
+inline bool as_scaled_pauli(TinyMatrix<ComplexType, 2> const& m, Gates::Basis& pauli, unsigned& power)
+{
+    using namespace std::literals::complex_literals;
+    const ComplexType paulis[4][2][2] = {
+        {{1., 0.}, {0., 1.}}, {{0., 1.}, {1., 0.}}, {{1., 0.}, {0., -1.}}, {{0., -1i}, {1i, 0.}}};
+    const ComplexType phases[4] = {1., 1i, -1., -1i};
+    const double tolerance = 1e-10;
+
+    for (unsigned p = 0; p < 4; ++p)
+        for (unsigned k = 0; k < 4; ++k)
+        {
+            double distance = 0.;
+            for (unsigned i = 0; i < 2; ++i)
+                for (unsigned j = 0; j < 2; ++j)
+                    distance += std::norm(m(i, j) - phases[k] * paulis[p][i][j]);
+            if (distance < tolerance * tolerance)
+            {
+                pauli = static_cast<Gates::Basis>(p);
+                power = k;
+                return true;
+            }
+        }
+    return false;
+}
+
+namespace detail
+{
+/// P2 := P1 * P2 for Pauli strings given by their X and Z bits, where (x, z) = (1, 1) stands for Y. Returns the power of
+/// i picked up by the product. The phase is counted mod 4 in two bit planes over all positions at once.
+inline unsigned multiply_paulis(
+    std::uint64_t const* x1,
+    std::uint64_t const* z1,
+    std::uint64_t* x2,
+    std::uint64_t* z2,
+    std::size_t words)
+{
+    std::uint64_t cnt1 = 0, cnt2 = 0;
+    for (std::size_t w = 0; w < words; ++w)
+    {
+        const std::uint64_t x = x1[w] ^ x2[w];
+        const std::uint64_t z = z1[w] ^ z2[w];
+        const std::uint64_t x1z2 = x1[w] & z2[w];
+        const std::uint64_t anticommutes = (x2[w] & z1[w]) ^ x1z2;
+        cnt2 ^= (cnt1 ^ x ^ z ^ x1z2) & anticommutes;
+        cnt1 ^= anticommutes;
+        x2[w] = x;
+        z2[w] = z;
+    }
+    return (popcnt(cnt1) + 2 * popcnt(cnt2)) & 3u;
+}
+} // namespace detail
+
+///
+/// Stabilizer state of n qubits in the tableau form of Aaronson and Gottesman ("Improved simulation of stabilizer
+/// circuits", 2004): n destabilizer and n stabilizer generators, each a signed Pauli string stored as bit-packed X and Z
+/// rows. Clifford gates update all rows in O(n), measurements take O(n^2 / 64) word operations.
+///
+class Tableau
+{
+  public:
+    /// A Hermitian Pauli string over the qubits of a tableau, (-1)^negative * X^xs * Z^zs with Y at positions set in
+    /// both masks.
+    struct Pauli
+    {
+        std::vector<std::uint64_t> xs, zs;
+        bool negative = false;
+    };
+
+    unsigned num_qubits() const
+    {
+        return n_;
+    }
+
+    /// The identity on all qubits of this tableau.
+    Pauli identity() const
+    {
+        Pauli p;
+        p.xs.assign(words_, 0);
+        p.zs.assign(words_, 0);
+        return p;
+    }
+
+    /// Multiply `p` by the Pauli `b` on qubit `q` (Gates::Basis is laid out as x | z << 1).
+    static void add_factor(Pauli& p, unsigned q, Gates::Basis b)
+    {
+        const std::uint64_t bit = 1ull << (q % 64);
+        if (b & 1) p.xs[q / 64] ^= bit;
+        if (b & 2) p.zs[q / 64] ^= bit;
+    }
+
+    /// Add `k` qubits in state |0> at the highest positions.
+    void add_qubits(unsigned k)
+    {
+        if (k == 0) return;
+        const unsigned n = n_ + k;
+        const std::size_t words = (n + 63) / 64;
+        std::vector<std::uint64_t> x(2 * n * words, 0), z(2 * n * words, 0);
+        std::vector<std::uint8_t> r(2 * n, 0);
+        for (unsigned i = 0; i < n_; ++i)
+            for (unsigned half = 0; half < 2; ++half)
+            {
+                const std::size_t from = half * n_ + i, to = half * n + i;
+                std::copy_n(&x_[from * words_], words_, &x[to * words]);
+                std::copy_n(&z_[from * words_], words_, &z[to * words]);
+                r[to] = r_[from];
+            }
+        for (unsigned i = n_; i < n; ++i)
+        {
+            x[i * words + i / 64] = 1ull << (i % 64);
+            z[(n + i) * words + i / 64] = 1ull << (i % 64);
+        }
+        x_.swap(x);
+        z_.swap(z);
+        r_.swap(r);
+        n_ = n;
+        words_ = words;
+    }
+
+    void apply(SingleQubitClifford const& c, unsigned q)
+    {
+        const std::size_t w = q / 64;
+        const unsigned b = q % 64;
+        for (std::size_t row = 0; row < 2 * n_; ++row)
+        {
+            std::uint64_t& x = x_[row * words_ + w];
+            std::uint64_t& z = z_[row * words_ + w];
+            const unsigned p = static_cast<unsigned>(((x >> b) & 1) | (((z >> b) & 1) << 1));
+            if (p == 0) continue;
+            const unsigned image = c.image[p];
+            x = (x & ~(1ull << b)) | (std::uint64_t(image & 1) << b);
+            z = (z & ~(1ull << b)) | (std::uint64_t(image >> 1) << b);
+            r_[row] ^= c.negative[p];
+        }
+    }
+
+    void apply_cx(unsigned c, unsigned t)
+    {
+        const std::size_t wc = c / 64, wt = t / 64;
+        const unsigned bc = c % 64, bt = t % 64;
+        for (std::size_t row = 0; row < 2 * n_; ++row)
+        {
+            std::uint64_t* x = &x_[row * words_];
+            std::uint64_t* z = &z_[row * words_];
+            const unsigned xc = (x[wc] >> bc) & 1, zc = (z[wc] >> bc) & 1;
+            const unsigned xt = (x[wt] >> bt) & 1, zt = (z[wt] >> bt) & 1;
+            r_[row] ^= xc & zt & (xt ^ zc ^ 1);
+            x[wt] ^= std::uint64_t(xc) << bt;
+            z[wc] ^= std::uint64_t(zt) << bc;
+        }
+    }
+
+    /// Conjugate the state by the Pauli string `p`.
+    void apply_pauli(Pauli const& p)
+    {
+        for (std::size_t row = 0; row < 2 * n_; ++row)
+            if (anticommutes(row, p)) r_[row] ^= 1;
+    }
+
+    /// Apply exp(i pi/4 p), which maps the rows Q that anticommute with `p` to i p Q.
+    void apply_quarter_rotation(Pauli const& p)
+    {
+        for (std::size_t row = 0; row < 2 * n_; ++row)
+        {
+            if (!anticommutes(row, p)) continue;
+            const unsigned power =
+                detail::multiply_paulis(p.xs.data(), p.zs.data(), &x_[row * words_], &z_[row * words_], words_);
+            r_[row] = static_cast<std::uint8_t>(((1 + power + 2 * p.negative + 2 * r_[row]) >> 1) & 1);
+        }
+    }
+
+    /// Expectation value of `p`, one of -1, 0 and 1.
+    int expectation(Pauli const& p) const
+    {
+        for (std::size_t row = n_; row < 2 * n_; ++row)
+            if (anticommutes(row, p)) return 0;
+        return deterministic_outcome(p) ? -1 : 1;
+    }
+
+    /// Measure `p`, returning true for the eigenvalue -1. If the outcome is random it is `coin`.
+    bool measure(Pauli const& p, bool coin)
+    {
+        std::size_t pivot = 2 * n_;
+        for (std::size_t row = n_; row < 2 * n_ && pivot == 2 * n_; ++row)
+            if (anticommutes(row, p)) pivot = row;
+        if (pivot == 2 * n_) return deterministic_outcome(p);
+
+        for (std::size_t row = 0; row < 2 * n_; ++row)
+            if (row != pivot && anticommutes(row, p)) multiply_row(row, pivot);
+        std::copy_n(&x_[pivot * words_], words_, &x_[(pivot - n_) * words_]);
+        std::copy_n(&z_[pivot * words_], words_, &z_[(pivot - n_) * words_]);
+        r_[pivot - n_] = r_[pivot];
+        std::copy(p.xs.begin(), p.xs.end(), &x_[pivot * words_]);
+        std::copy(p.zs.begin(), p.zs.end(), &z_[pivot * words_]);
+        r_[pivot] = p.negative ^ coin;
+        return coin;
+    }
+
+    ///
+    /// Call f(xs, amplitude) for the basis states of non-zero amplitude, where `xs` holds the bits of the basis state.
+    /// The stabilizer generators are brought into row echelon form, first on their X bits and then on the Z bits of the
+    /// remaining Z-type rows. The Z-type rows fix a basis state |b> they stabilize; the state is the sum of |b> under
+    /// all 2^g products of the g X-type rows, which are walked in Gray code order.
+    ///
+    template <class F>
+    void for_each_basis_state(F&& f) const
+    {
+        const std::size_t n = n_, words = words_;
+        std::vector<std::uint64_t> x(x_.begin() + n * words, x_.end());
+        std::vector<std::uint64_t> z(z_.begin() + n * words, z_.end());
+        std::vector<unsigned> e(n);
+        for (std::size_t i = 0; i < n; ++i)
+            e[i] = 2u * r_[n + i];
+
+        auto bit = [words](std::vector<std::uint64_t> const& m, std::size_t row, std::size_t col) {
+            return (m[row * words + col / 64] >> (col % 64)) & 1;
+        };
+        auto swap_rows = [&](std::size_t a, std::size_t b) {
+            std::swap_ranges(&x[a * words], &x[a * words] + words, &x[b * words]);
+            std::swap_ranges(&z[a * words], &z[a * words] + words, &z[b * words]);
+            std::swap(e[a], e[b]);
+        };
+        auto eliminate = [&](std::vector<std::uint64_t> const& m, std::size_t first) {
+            std::size_t row = first;
+            for (std::size_t col = 0; col < n && row < n; ++col)
+            {
+                std::size_t k = row;
+                while (k < n && !bit(m, k, col))
+                    ++k;
+                if (k == n) continue;
+                swap_rows(row, k);
+                for (std::size_t other = 0; other < n; ++other)
+                {
+                    if (other == row || !bit(m, other, col)) continue;
+                    e[other] = (e[other] + e[row] +
+                                detail::multiply_paulis(
+                                    &x[row * words], &z[row * words], &x[other * words], &z[other * words], words)) &
+                               3u;
+                }
+                ++row;
+            }
+            return row;
+        };
+        const std::size_t g = eliminate(x, 0);
+        eliminate(z, g);
+
+        // |b> satisfies the Z-type rows, parity(b & z) = sign, bottom-up each row fixes the bit of its pivot column
+        std::vector<std::uint64_t> sx(words, 0), sz(words, 0);
+        for (std::size_t i = n; i-- > g;)
+        {
+            unsigned f_bit = e[i] >> 1;
+            std::size_t pivot = n;
+            for (std::size_t col = n; col-- > 0;)
+            {
+                if (!bit(z, i, col)) continue;
+                pivot = col;
+                f_bit ^= (sx[col / 64] >> (col % 64)) & 1;
+            }
+            if (f_bit && pivot < n) sx[pivot / 64] ^= 1ull << (pivot % 64);
+        }
+
+        const double scale = std::pow(2., -0.5 * static_cast<double>(g));
+        const ComplexType powers[4] = {{1., 0.}, {0., 1.}, {-1., 0.}, {0., -1.}};
+        unsigned phase = 0;
+        auto emit = [&]() {
+            unsigned ys = 0;
+            for (std::size_t w = 0; w < words; ++w)
+                ys += popcnt(sx[w] & sz[w]);
+            return f(sx, scale * powers[(phase + ys) & 3u]);
+        };
+        if (!emit()) return;
+        for (std::uint64_t t = 0; g < 64 && t + 1 < (1ull << g); ++t)
+        {
+            const std::uint64_t flips = t ^ (t + 1);
+            for (std::size_t i = 0; i < g; ++i)
+            {
+                if (!((flips >> i) & 1)) continue;
+                phase += e[i] + detail::multiply_paulis(&x[i * words], &z[i * words], sx.data(), sz.data(), words);
+            }
+            if (!emit()) return;
+        }
+    }
+
+  private:
+    bool anticommutes(std::size_t row, Pauli const& p) const
+    {
+        unsigned parity = 0;
+        for (std::size_t w = 0; w < words_; ++w)
+            parity ^= popcnt((x_[row * words_ + w] & p.zs[w]) ^ (z_[row * words_ + w] & p.xs[w]));
+        return parity & 1;
+    }
+
+    /// row := pivot * row
+    void multiply_row(std::size_t row, std::size_t pivot)
+    {
+        const unsigned power = detail::multiply_paulis(
+            &x_[pivot * words_], &z_[pivot * words_], &x_[row * words_], &z_[row * words_], words_);
+        r_[row] = static_cast<std::uint8_t>(((power + 2 * r_[pivot] + 2 * r_[row]) >> 1) & 1);
+    }
+
+    /// `p` is a product of the stabilizers whose destabilizers anticommute with it; returns true if that product is -p.
+    bool deterministic_outcome(Pauli const& p) const
+    {
+        std::vector<std::uint64_t> sx(words_, 0), sz(words_, 0);
+        unsigned phase = 0;
+        for (std::size_t i = 0; i < n_; ++i)
+        {
+            if (!anticommutes(i, p)) continue;
+            const std::size_t row = n_ + i;
+            phase += 2 * r_[row] +
+                     detail::multiply_paulis(&x_[row * words_], &z_[row * words_], sx.data(), sz.data(), words_);
+        }
+        return ((phase >> 1) & 1) ^ p.negative;
+    }
+
+    unsigned n_ = 0;
+    std::size_t words_ = 0;
+    std::vector<std::uint64_t> x_, z_; // rows 0..n-1 are destabilizers, n..2n-1 stabilizers
+    std::vector<std::uint8_t> r_;      // sign bits of the rows
+};
+
+} // namespace SIMULATOR
+} // namespace Quantum
+} // namespace Microsoft
@@ -2,7 +2,7 @@
 // Licensed under the MIT License.
 
 #include "config.hpp"
-#include "util/alignedalloc.hpp"
+#include "util/statevectoralloc.hpp"
 #include <vector>
 
 namespace Microsoft
@@ -3,19 +3,29 @@
 
 #pragma once
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <complex>
+#include <cstdint>
+#include <cstdlib>
 #include <ctime>
 #include <iostream>
 #include <iterator>
 #include <limits>
-#include <list>
+#include <numeric>
 #include <random>
+#include <sstream>
+#include <stdexcept>
 #include <string.h>
+#include <string>
 #include <vector>
 
+#include "checkpoint.hpp"
 #include "gates.hpp"
 #include "types.hpp"
+#include "util/bitops.hpp"
+#include "util/environment.hpp"
 
 #include "external/fused.hpp"
 
@@ -61,6 +71,34 @@ inline size_t set_register(
     }
     return result;
 }
+
+/// Moves bit k of `value` to bit rank[k] (`forward`), or bit rank[k] back to bit k.
+inline size_t move_bits(const std::vector<unsigned>& rank, size_t value, bool forward)
+{
+    size_t moved = 0;
+    for (size_t k = 0; k < rank.size(); ++k)
+    {
+        if (forward)
+            moved |= ((value >> k) & 1) << rank[k];
+        else
+            moved |= ((value >> rank[k]) & 1) << k;
+    }
+    return moved;
+}
+
+/// Throws unless `table` is a permutation of [0, 2^nqubits), checked with a bitmap of the images.
+inline void check_permutation_table(std::size_t nqubits, size_t table_size, size_t const* table)
+{
+    if (nqubits >= std::numeric_limits<size_t>::digits || table_size != (size_t(1) << nqubits))
+        throw std::runtime_error("the permutation table doesn't have an entry for every basis state");
+    std::vector<bool> seen(table_size, false);
+    for (size_t i = 0; i < table_size; ++i)
+    {
+        if (table[i] >= table_size || seen[table[i]])
+            throw std::runtime_error("the permutation table isn't a permutation of the basis states");
+        seen[table[i]] = true;
+    }
+}
 } // namespace detail
 
 ///
@@ -96,6 +134,14 @@ class DeferredGate
     {
         return mat_;
     }
+    bool is_diagonal() const
+    {
+        return mat_(0, 1) == 0. && mat_(1, 0) == 0.;
+    }
+    bool is_permutation() const
+    {
+        return mat_(0, 0) == 0. && mat_(1, 1) == 0. && mat_(0, 1) == 1. && mat_(1, 0) == 1.;
+    }
 };
 
 ///
@@ -106,25 +152,6 @@ static bool is_sorted_assending(const std::vector<logical_qubit_id>& x)
     return std::adjacent_find(x.begin(), x.end(), std::greater<logical_qubit_id>()) == x.end();
 }
 
-static bool is_intersection_empty(const std::vector<logical_qubit_id>& x, const std::vector<logical_qubit_id>& y)
-{
-    assert(is_sorted_assending(x));
-    assert(is_sorted_assending(y));
-
-    std::vector<logical_qubit_id> intersection;
-    std::set_intersection(x.begin(), x.end(), y.begin(), y.end(), std::back_inserter(intersection));
-    return intersection.empty();
-}
-
-static bool is_intersection_empty(const std::vector<logical_qubit_id>& x, const std::set<logical_qubit_id>& y)
-{
-    assert(is_sorted_assending(x));
-
-    std::vector<logical_qubit_id> intersection;
-    std::set_intersection(x.begin(), x.end(), y.begin(), y.end(), std::back_inserter(intersection));
-    return intersection.empty();
-}
-
 ///
 /// Cluster represents a group of gates that should be flushed together.
 ///
@@ -191,46 +218,14 @@ class Cluster
         return gates_.empty();
     }
 
-    /// We say that two clusters "commute" if their sets of qubits don't intersect. The list of clusters given to this
-    /// method is assumed to be in temporal order, where this cluster is implicitly the earliest. Our goal is to find a
-    /// cluster that can be commuted to the front of the list and merged with this cluster without increasing its width
-    /// beyond `max_cluster_width`. The algorithm picks first such cluster from the start of the list (with the least
-    /// distance to commute).
-    std::list<Cluster>::const_iterator find_compatible_cluster(
-        const std::list<Cluster>& nextClusters,
-        unsigned max_cluster_width)
+    bool is_diagonal() const
     {
-        // Union of all qubits in clusters that we are skipping as we are searching for the compatible one.
-        std::set<logical_qubit_id> skipped_qids;
-
-        for (auto candidate = nextClusters.begin(); candidate != nextClusters.end(); ++candidate)
-        {
-            const std::vector<logical_qubit_id>& candidate_qids = candidate->get_qids();
-
-            // New qubits the candidate cluster would add into this cluster.
-            std::vector<logical_qubit_id> qids_new;
-            std::set_difference(
-                candidate_qids.begin(), candidate_qids.end(), qids_.begin(), qids_.end(), std::back_inserter(qids_new));
-
-            // If the new qubits from the candidate cluster don't touch any of the clusters we've skipped, the candidate
-            // cluster is compatible with this one. But we also need to check that the new qubits wouldn't increase the
-            // width of the cluster too much.
-            if (is_intersection_empty(qids_new, skipped_qids) && (qids_.size() + qids_new.size() <= max_cluster_width))
-            {
-                return candidate;
-            }
-
-            // If the candidate cluster isn't compatible with this one but shares qubits, we treat it as a barrier no
-            // other cluster can be pulled through (<irinayat> example #5 below shows that this might lead to more
-            // final clusters than necessary -- why this condition and not checking for intersection of candidate_qids
-            // with qids_skipped?).
-            if (!is_intersection_empty(candidate_qids, qids_)) break;
-
-            skipped_qids.insert(candidate_qids.begin(), candidate_qids.end());
-        }
+        return std::all_of(gates_.begin(), gates_.end(), [](const DeferredGate& g) { return g.is_diagonal(); });
+    }
 
-        // Found no compatible cluster.
-        return nextClusters.end();
+    bool is_permutation() const
+    {
+        return std::all_of(gates_.begin(), gates_.end(), [](const DeferredGate& g) { return g.is_permutation(); });
     }
 
     ///
@@ -250,6 +245,14 @@ class Cluster
     /// done in multiple passes that increment the number of allowed qubits per cluster until the maximum of `fuseSpan`
     /// is reached.
     ///
+    /// Complexity: the clusters live in flat arrays with bitmask qubit sets, which makes each step cheap, but the
+    /// algorithm is still the greedy scan. Each search for a cluster to merge walks forward until the first later
+    /// cluster that shares a qubit with the current one, so a pass takes O(clusters * scan) steps of O(qubits / 64)
+    /// each. The scan is short when every qubit is used regularly, but it covers all later clusters that act on other
+    /// qubits, so the worst case (long stretches of gates on disjoint qubits) is quadratic in the number of pending
+    /// gates. A per-qubit dependency DAG that only merges with the last cluster of each qubit would be linear, but it
+    /// would group the gates differently from the examples below.
+    ///
     /// Examples:
     ///
     /// 1. Sequence of gates: {H(q1), X(q2), Y(q2), Z(q1)}
@@ -269,61 +272,119 @@ class Cluster
     ///    For width 2 clustering our algorithm gets:
     ///    {X(q1), X(q2), CNOT(q1, q2)}, {X(q3), CNOT(q1, q3), Y(q1), Y(q3)}, {Y(q2)}
     ///    and not this one: {X(q1), X(q2), CNOT(q1, q2), Y(q2)}, {X(q3), CNOT(q1, q3), Y(q1), Y(q3)} (see the comment
-    ///    in `find_compatible_cluster`)
-    static std::list<Cluster> make_clusters(
+    ///    in `make_clusters`)
+    static std::vector<Cluster> make_clusters(
         unsigned fuseSpan,
         int maxFusedDepth,
         const std::vector<DeferredGate>& gates)
     {
-        if (gates.empty()) return std::list<Cluster>{};
+        if (gates.empty()) return std::vector<Cluster>{};
 
-        // Create initial clusters, containing one gate each.
-        std::list<Cluster> curClusters;
+        // Number the qubits densely (in ascending order of their logical ids), so that the qubit set of a cluster is a
+        // bitmask of `words` 64-bit words.
+        std::vector<logical_qubit_id> qids;
         for (const DeferredGate& gate : gates)
         {
-            std::vector<logical_qubit_id> qids = gate.get_controls();
+            qids.insert(qids.end(), gate.get_controls().begin(), gate.get_controls().end());
             qids.push_back(gate.get_target());
-            std::sort(qids.begin(), qids.end());
-            curClusters.emplace_back(qids, std::vector<DeferredGate>{gate});
         }
+        std::sort(qids.begin(), qids.end());
+        qids.erase(std::unique(qids.begin(), qids.end()), qids.end());
+        const std::size_t words = (qids.size() + 63) / 64;
+
+        // Create initial clusters, containing one gate each. Clusters live in flat arrays: `next`/`prev` link them in
+        // temporal order, `next_gate` chains the gates of each cluster from `first_gate` to `last_gate`, and `masks`
+        // holds their qubit sets.
+        const std::size_t n = gates.size();
+        const std::size_t none = n;
+        std::vector<std::uint64_t> masks(n * words, 0);
+        std::vector<unsigned> width(n, 0);
+        std::vector<int> depth(n, 1);
+        std::vector<std::size_t> next(n), prev(n), first_gate(n), last_gate(n), next_gate(n, none);
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            auto add = [&](logical_qubit_id q) {
+                const std::size_t k = std::lower_bound(qids.begin(), qids.end(), q) - qids.begin();
+                std::uint64_t& w = masks[i * words + k / 64];
+                if (!(w & (1ull << (k % 64)))) ++width[i];
+                w |= 1ull << (k % 64);
+            };
+            for (logical_qubit_id c : gates[i].get_controls())
+                add(c);
+            add(gates[i].get_target());
+            next[i] = i + 1;
+            prev[i] = i == 0 ? none : i - 1;
+            first_gate[i] = last_gate[i] = i;
+        }
+        std::size_t head = 0;
+        std::vector<std::uint64_t> skipped(words);
 
         // Run incremental left-to-right passes over the clusters, increasing the number of allowed qubits on each pass.
-        std::list<Cluster> prevClusters;
         for (unsigned cluster_width = 1; cluster_width < fuseSpan + 1; cluster_width++)
         {
-            assert(prevClusters.empty());
-            prevClusters.swap(curClusters);
-
-            Cluster prevCluster;
-            prevCluster.swap(prevClusters.front());
-            prevClusters.pop_front();
-
-            while (!prevClusters.empty())
+            for (std::size_t cur = head; cur != none; cur = next[cur])
             {
-                std::list<Cluster>::const_iterator clusterFound =
-                    prevCluster.find_compatible_cluster(prevClusters, cluster_width);
-
-                if (clusterFound == prevClusters.end() || prevCluster.size() >= maxFusedDepth)
+                // Keep extending this cluster with the first later cluster that can be commuted next to it without
+                // growing it beyond `cluster_width`. We say that two clusters "commute" if their sets of qubits don't
+                // intersect. Clusters we are skipping while searching for the candidate accumulate in `skipped`: the
+                // candidate may not bring in any of their qubits. A cluster that shares qubits with the current one but
+                // is not compatible is a barrier no other cluster can be pulled through (example #4 above shows that
+                // this might lead to more final clusters than necessary).
+                while (depth[cur] < maxFusedDepth)
                 {
-                    // Cannot extend this cluster anymore, stash it away for the next pass and try to extend the next
-                    // one from the list. Doing swap/move/pop in this order allows us to avoid copying clusters.
-                    prevCluster.swap(prevClusters.front());
-                    curClusters.push_back(std::move(prevClusters.front()));
-                    prevClusters.pop_front();
-                }
-                else
-                {
-                    // Extend this cluster and try again whether it can be extended even further while keeping its
-                    // width <= cluster_width.
-                    prevCluster.append(*clusterFound);
-                    prevClusters.erase(clusterFound);
+                    std::uint64_t* qs = &masks[cur * words];
+                    std::fill(skipped.begin(), skipped.end(), 0);
+                    std::size_t found = none;
+                    for (std::size_t cand = next[cur]; cand != none; cand = next[cand])
+                    {
+                        const std::uint64_t* cs = &masks[cand * words];
+                        bool shares = false, blocked = false;
+                        unsigned added = 0;
+                        for (std::size_t w = 0; w < words; ++w)
+                        {
+                            const std::uint64_t fresh = cs[w] & ~qs[w];
+                            shares |= (cs[w] & qs[w]) != 0;
+                            blocked |= (fresh & skipped[w]) != 0;
+                            added += popcnt(fresh);
+                        }
+                        if (!blocked && width[cur] + added <= cluster_width)
+                        {
+                            found = cand;
+                            break;
+                        }
+                        if (shares) break;
+                        for (std::size_t w = 0; w < words; ++w)
+                            skipped[w] |= cs[w];
+                    }
+                    if (found == none) break;
+
+                    // Append the found cluster to this one and unlink it.
+                    for (std::size_t w = 0; w < words; ++w)
+                    {
+                        width[cur] += popcnt(masks[found * words + w] & ~qs[w]);
+                        qs[w] |= masks[found * words + w];
+                    }
+                    depth[cur] += depth[found];
+                    next_gate[last_gate[cur]] = first_gate[found];
+                    last_gate[cur] = last_gate[found];
+                    next[prev[found]] = next[found];
+                    if (next[found] != none) prev[next[found]] = prev[found];
                 }
             }
-
-            curClusters.push_back(std::move(prevCluster)); // Save the final cluster
         }
 
-        return curClusters;
+        std::vector<Cluster> clusters;
+        for (std::size_t cur = head; cur != none; cur = next[cur])
+        {
+            std::vector<logical_qubit_id> cluster_qids;
+            for (std::size_t k = 0; k < qids.size(); ++k)
+                if (masks[cur * words + k / 64] & (1ull << (k % 64))) cluster_qids.push_back(qids[k]);
+            std::vector<DeferredGate> cluster_gates;
+            for (std::size_t g = first_gate[cur]; g != none; g = next_gate[g])
+                cluster_gates.push_back(gates[g]);
+            clusters.emplace_back(cluster_qids, cluster_gates);
+        }
+        return clusters;
     }
 };
 
@@ -344,13 +405,21 @@ class Wavefunction
     };
 #endif
 
+  public:
+    using value_type = T;
+    /// The amplitudes for the precision of this wave function. Unlike WavefunctionStorage, sizing the storage doesn't
+    /// zero it: every buffer of this type is written in full by the code that sizes it (grow, remove_qubits, expand,
+    /// load...), so large states aren't first zeroed on a single thread.
+    using storage_type = std::vector<T, StateVectorAlloc<T, 64>>;
+
+  private:
     /// Number of currently allocated qubits.
     unsigned num_qubits_;
 
     /// Represents the state of the system with num_qubits_ qubits in little-endian notation (that is, the qubit
     /// with positional id = 0 corresponds to the least significant bit in the index of the standard computational
     /// basic vector of this wave function). Might not reflect the current state if there are pending fused gates.
-    mutable WavefunctionStorage wfn_;
+    mutable storage_type wfn_;
 
     /// Each qubit has a client-facing id, which we call "logical qubit id" or just "logical qubit". However, the order
     /// of qubits in the internal representation of the state, that is, the positions of the qubits in the standard
@@ -359,13 +428,33 @@ class Wavefunction
     /// logical id of the qubit (which means this map might grow rather large if logical qubit ids aren't reused).
     mutable std::vector<positional_qubit_id> qubitmap_;
 
+    /// Position of the qubit at each position of wfn_ in the layout seen by the callers (data(), for_each_amplitude,
+    /// save). They only differ after a blocked flush moved qubits to low positions (see localize) or a qft left its
+    /// register reversed, which restore_layout undoes.
+    mutable std::vector<positional_qubit_id> home_;
+
     /// Cache of the pending gates that haven't been applied (i.e. flushed) to the wave function storage yet.
     static constexpr int MAX_PENDING_GATES = 999;
     mutable std::vector<DeferredGate> pending_gates_;
 
+    /// Pauli rotations (in positional form) that haven't been applied yet. They precede the pending gates, flip the
+    /// same qubits and have the same controls `rotation_cmask_`, so that they are applied in a single sweep.
+    static constexpr std::size_t MAX_PENDING_ROTATIONS = 64;
+    mutable std::vector<kernels::PauliRotation> pending_rotations_;
+    mutable std::size_t rotation_cmask_ = 0;
+
     /// TODO: add comment
     Fused fused_;
 
+    /// States with more qubits are flushed block by block, each block holding 2^block_qubits_ amplitudes. That only
+    /// pays off for states backed by a file, unless block_in_memory_ (QDK_SIM_BLOCK_QUBITS is set).
+    unsigned block_qubits_;
+    bool block_in_memory_;
+
+    /// Runs of kernels on the qubits below tile_qubits_ are applied tile by tile, each tile holding 2^tile_qubits_
+    /// amplitudes (about the size of the L2 cache).
+    unsigned tile_qubits_;
+
     /// TODO: add comment
     using RngEngine = std::mt19937;
     RngEngine rng_;
@@ -375,24 +464,52 @@ class Wavefunction
 #endif
 
   public:
-    using value_type = T;
-
     /// allocate a wave function for zero qubits
     Wavefunction()
         : num_qubits_(0)
         , wfn_(1, 1.)
+        , block_qubits_(default_block_qubits())
+        , block_in_memory_(block_qubits_requested())
+        , tile_qubits_(default_tile_qubits())
     {
         rng_.seed(std::clock());
+        // measure the machine now, rather than in the first flush of a circuit
+        Fused::profile();
+    }
+
+    /// Fork of `other`: its pending gates are flushed first so that they are applied once rather than in both copies,
+    /// then the amplitudes are copied by all threads (which also places the pages of the copy like the kernels expect).
+    /// The copy continues with the same random number sequence.
+    Wavefunction(const Wavefunction& other)
+        : num_qubits_(other.num_qubits_)
+        , wfn_((other.flush(), other.wfn_.size()))
+        , qubitmap_(other.qubitmap_)
+        , home_(other.home_)
+        , fused_(other.fused_)
+        , block_qubits_(other.block_qubits_)
+        , block_in_memory_(other.block_in_memory_)
+        , tile_qubits_(other.tile_qubits_)
+        , rng_(other.rng_)
+#ifndef NDEBUG
+        , usage_(other.usage_)
+#endif
+    {
+        const std::intptr_t size = static_cast<std::intptr_t>(wfn_.size());
+#pragma omp parallel for schedule(static)
+        for (std::intptr_t i = 0; i < size; ++i)
+            wfn_[i] = other.wfn_[i];
     }
 
     void reset()
     {
         fused_.reset();
+        pending_rotations_.clear();
         rng_.seed(std::clock());
         num_qubits_ = 0;
         wfn_.resize(1);
         wfn_[0] = 1.;
         qubitmap_.resize(0);
+        home_.clear();
 
         // what about pending_gates_?
     }
@@ -443,7 +560,8 @@ class Wavefunction
 
     void flush() const
     {
-        std::list<Cluster> clusters = Cluster::make_clusters(fused_.maxSpan(), fused_.maxDepth(), pending_gates_);
+        flush_rotations();
+        std::vector<Cluster> clusters = Cluster::make_clusters(fused_.maxSpan(), fused_.maxDepth(), pending_gates_);
 
         if (clusters.empty())
         {
@@ -451,9 +569,75 @@ class Wavefunction
         }
         else
         {
+            // States backed by a file that are larger than a block are updated one block at a time by runs of kernels
+            // that don't reach above it (see apply_run), with the qubits that are used the most moved into the low
+            // positions (see localize). Other states larger than a tile collect the runs of kernels below the tile,
+            // which are applied one tile at a time.
+            const bool blocked = num_qubits_ > block_qubits_ &&
+                                 (block_in_memory_ || storage_type::allocator_type::file_backed(wfn_.size()));
+            const bool tiled = num_qubits_ > tile_qubits_;
+            const unsigned run_qubits = blocked ? block_qubits_ : tile_qubits_;
+            std::vector<Fused::Kernel> run;
+            std::vector<std::vector<std::size_t>> uses;
+            std::vector<logical_qubit_id> qubit_at;
+            if (blocked)
+            {
+                uses.resize(qubitmap_.size());
+                for (std::size_t i = 0; i < clusters.size(); ++i)
+                {
+                    if (is_dense(clusters[i]))
+                    {
+                        for (logical_qubit_id q : clusters[i].get_qids())
+                            uses[q].push_back(i);
+                    }
+                }
+                qubit_at.resize(num_qubits_);
+                for (logical_qubit_id q = 0; q < qubitmap_.size(); ++q)
+                {
+                    if (qubitmap_[q] != invalid_qubit_position()) qubit_at[qubitmap_[q]] = q;
+                }
+            }
+
             // logic to flush gates in each cluster
-            for (const Cluster& cl : clusters)
+            for (std::size_t i = 0; i < clusters.size(); ++i)
             {
+                const Cluster& cl = clusters[i];
+                // Clusters of phase gates are merged into a single diagonal, and clusters of (multi-)controlled X gates
+                // into a single basis permutation, that are applied before the next cluster of a different kind (or at
+                // the very end), rather than being multiplied out as dense matrices.
+                if (!is_dense(cl)) apply_run(run);
+                if (cl.is_diagonal() && cl.get_qids().size() <= DiagonalFusion::max_qubits)
+                {
+                    fused_.flush_permutation(wfn_);
+                    if (!fused_.can_fuse_diagonal(get_qubit_positions(cl.get_qids())))
+                    {
+                        fused_.flush_diagonal(wfn_);
+                    }
+                    for (const DeferredGate& gate : cl.get_gates())
+                    {
+                        fused_.apply_diagonal(
+                            gate.get_mat(),
+                            get_qubit_positions(gate.get_controls()),
+                            get_qubit_position(gate.get_target()));
+                    }
+                    continue;
+                }
+                if (cl.is_permutation() && cl.get_qids().size() <= PermutationFusion::max_qubits)
+                {
+                    fused_.flush_diagonal(wfn_);
+                    if (!fused_.can_fuse_permutation(get_qubit_positions(cl.get_qids())))
+                    {
+                        fused_.flush_permutation(wfn_);
+                    }
+                    for (const DeferredGate& gate : cl.get_gates())
+                    {
+                        fused_.apply_permutation(
+                            get_qubit_positions(gate.get_controls()), get_qubit_position(gate.get_target()));
+                    }
+                    continue;
+                }
+
+                if (blocked) localize(clusters, i, uses, qubit_at, run);
                 for (const DeferredGate& gate : cl.get_gates())
                 {
                     const std::vector<logical_qubit_id>& cs = gate.get_controls();
@@ -468,14 +652,212 @@ class Wavefunction
                     }
                 }
 
-                fused_.flush(wfn_);
+                if (!tiled)
+                {
+                    fused_.flush(wfn_);
+                    continue;
+                }
+                // Consecutive kernels that stay within a block (or tile) are collected and then applied block by block.
+                Fused::Kernel k = fused_.take(wfn_);
+                if (std::all_of(k.qs.begin(), k.qs.end(), [run_qubits](unsigned p) { return p < run_qubits; }))
+                {
+                    run.push_back(std::move(k));
+                }
+                else
+                {
+                    apply_run(run);
+                    Fused::apply(wfn_, k);
+                }
             }
+            apply_run(run);
+            fused_.flush(wfn_);
         }
         pending_gates_.clear();
     }
 
+  private:
+    void flush_rotations() const
+    {
+        if (pending_rotations_.empty()) return;
+        kernels::apply_pauli_rotations(wfn_, pending_rotations_, rotation_cmask_);
+        pending_rotations_.clear();
+    }
+
+    /// Draw a basis state of the qubits at the (ascending) `positions` and collapse the state onto it, see
+    /// kernels::marginal for the bit order of the result.
+    std::size_t measure_register(std::vector<positional_qubit_id> const& positions)
+    {
+        const std::vector<double> probabilities = kernels::marginal(wfn_, positions);
+        const double total = std::accumulate(probabilities.begin(), probabilities.end(), 0.);
+
+        std::uniform_real_distribution<double> uniform(0., 1.);
+        const double target = uniform(rng_) * total;
+        // Outcomes are taken from the highest one down, so that a single qubit reads 1 for random numbers below its
+        // probability. The last outcome with a non-zero probability takes the ones that rounding puts past the total.
+        std::size_t outcome = 0;
+        double acc = 0.;
+        for (std::size_t t = probabilities.size(); t-- > 0;)
+        {
+            if (probabilities[t] == 0.) continue;
+            outcome = t;
+            acc += probabilities[t];
+            if (target < acc) break;
+        }
+
+        kernels::collapse_scaled(wfn_, positions, outcome, 1. / std::sqrt(probabilities[outcome]));
+        return outcome;
+    }
+
+    /// Clusters that are multiplied out into a dense matrix, rather than merged into a diagonal or a permutation.
+    static bool is_dense(const Cluster& cl)
+    {
+        return !(cl.is_diagonal() && cl.get_qids().size() <= DiagonalFusion::max_qubits) &&
+               !(cl.is_permutation() && cl.get_qids().size() <= PermutationFusion::max_qubits);
+    }
+
+    /// Apply the collected run of kernels, which all target qubits below block_qubits_, in a single pass over the state.
+    /// When they all target qubits below tile_qubits_ as well, the pass goes tile by tile, with one tile per thread. The
+    /// tiles are made smaller to give every thread one, if the kernels still fit; otherwise each kernel is applied on
+    /// its own by all threads.
+    void apply_run(std::vector<Fused::Kernel>& run) const
+    {
+        auto in_tile = [this](Fused::Kernel const& k) {
+            return std::all_of(k.qs.begin(), k.qs.end(), [this](unsigned p) { return p < tile_qubits_; });
+        };
+        if (run.size() == 1)
+        {
+            Fused::apply(wfn_, run.front());
+        }
+        else if (run.size() > 1 && num_qubits_ > tile_qubits_ && std::all_of(run.begin(), run.end(), in_tile))
+        {
+            unsigned highest = 0;
+            for (Fused::Kernel const& k : run)
+                for (unsigned p : k.qs)
+                    highest = std::max(highest, p + 1);
+            const std::size_t threads = static_cast<std::size_t>(omp_get_max_threads());
+            unsigned tile = tile_qubits_;
+            while (tile > highest && (std::size_t(1) << (num_qubits_ - tile)) < threads)
+                --tile;
+
+            if ((std::size_t(1) << (num_qubits_ - tile)) >= threads)
+            {
+                Fused::apply_tiled(wfn_, run, tile);
+            }
+            else
+            {
+                for (Fused::Kernel const& k : run)
+                    Fused::apply(wfn_, k);
+            }
+        }
+        else if (run.size() > 1)
+        {
+            Fused::apply_blocked(wfn_, run, block_qubits_);
+        }
+        run.clear();
+    }
+
+    /// Before flushing clusters[i], swap each of its qubits above the block into a low position, if the qubit is used
+    /// by at least two of the later dense clusters and so would break their runs too. The low qubit that is evicted is
+    /// the one least used by the later clusters. Each swap is a pass over the state, just like an extra kernel.
+    void localize(
+        const std::vector<Cluster>& clusters,
+        std::size_t i,
+        const std::vector<std::vector<std::size_t>>& uses,
+        std::vector<logical_qubit_id>& qubit_at,
+        std::vector<Fused::Kernel>& run) const
+    {
+        const std::vector<logical_qubit_id>& qids = clusters[i].get_qids();
+        if (qids.size() >= block_qubits_) return;
+
+        auto later = [&uses, i](logical_qubit_id q) {
+            return static_cast<std::size_t>(uses[q].end() - std::upper_bound(uses[q].begin(), uses[q].end(), i));
+        };
+        for (logical_qubit_id q : qids)
+        {
+            const positional_qubit_id high = qubitmap_[q];
+            if (high < block_qubits_ || later(q) < 2) continue;
+
+            positional_qubit_id low = block_qubits_;
+            for (positional_qubit_id p = 0; p < block_qubits_; ++p)
+            {
+                if (std::binary_search(qids.begin(), qids.end(), qubit_at[p])) continue;
+                if (low == block_qubits_ || later(qubit_at[p]) < later(qubit_at[low])) low = p;
+            }
+            if (low == block_qubits_) return;
+
+            // the pending kernels, diagonal and permutation refer to the current positions
+            apply_run(run);
+            fused_.flush(wfn_);
+            kernels::swap(wfn_, low, high);
+            std::swap(home_[low], home_[high]);
+            std::swap(qubit_at[low], qubit_at[high]);
+            qubitmap_[qubit_at[low]] = low;
+            qubitmap_[qubit_at[high]] = high;
+        }
+    }
+
+    /// Move the qubits that localize or qft moved back to their positions in the layout seen by the callers, one swap of two
+    /// qubits per pass over the state. The pending gates refer to logical ids and stay pending.
+    void restore_layout() const
+    {
+        flush_rotations();
+        std::vector<logical_qubit_id> qubit_at(num_qubits_);
+        for (logical_qubit_id q = 0; q < qubitmap_.size(); ++q)
+        {
+            if (qubitmap_[q] != invalid_qubit_position()) qubit_at[qubitmap_[q]] = q;
+        }
+        for (positional_qubit_id p = 0; p < num_qubits_; ++p)
+        {
+            while (home_[p] != p)
+            {
+                const positional_qubit_id h = home_[p];
+                kernels::swap(wfn_, p, h);
+                std::swap(home_[p], home_[h]);
+                std::swap(qubit_at[p], qubit_at[h]);
+                qubitmap_[qubit_at[p]] = p;
+                qubitmap_[qubit_at[h]] = h;
+            }
+        }
+    }
+
+    /// Layout of a state whose qubits are where the callers put them.
+    void reset_layout() const
+    {
+        home_.resize(num_qubits_);
+        std::iota(home_.begin(), home_.end(), 0u);
+    }
+
+    /// Whether QDK_SIM_BLOCK_QUBITS asks for blocked flushes of states held in memory as well.
+    static bool block_qubits_requested()
+    {
+        return !env_value("QDK_SIM_BLOCK_QUBITS").empty();
+    }
+
+    /// Number of low qubits in a block of the state, see flush. QDK_SIM_BLOCK_QUBITS overrides the default.
+    static unsigned default_block_qubits()
+    {
+        const std::string env = env_value("QDK_SIM_BLOCK_QUBITS");
+        const int requested = env.empty() ? 20 : std::atoi(env.c_str());
+        return static_cast<unsigned>(std::min(std::max(requested, FusionProfile::max_span + 1), 63));
+    }
+
+    /// Number of low qubits in a tile of the state, see apply_run. QDK_SIM_TILE_QUBITS overrides the default.
+    static unsigned default_tile_qubits()
+    {
+        const std::string env = env_value("QDK_SIM_TILE_QUBITS");
+        const int requested = env.empty() ? 14 : std::atoi(env.c_str());
+        return static_cast<unsigned>(std::min(std::max(requested, FusionProfile::max_span + 1), 63));
+    }
+
+  public:
     /// Allocate a qubit with implicitly assigned logical qubit id.
     logical_qubit_id allocate_qubit()
+    {
+        return allocate_qubits(1).front();
+    }
+
+    /// Allocate `n` qubits with implicitly assigned logical qubit ids. The state is enlarged once for all of them.
+    std::vector<logical_qubit_id> allocate_qubits(unsigned n)
     {
 #ifndef NDEBUG
         assert(usage_ != QubitAllocationPattern::explicitLogicalId);
@@ -483,26 +865,32 @@ class Wavefunction
 #endif
 
         flush();
-        wfn_.resize(2 * wfn_.size());
+        grow(n);
 
-        // Reuse a logical qubit id, if any is available.
-        auto it = std::find(qubitmap_.begin(), qubitmap_.end(), invalid_qubit_position());
-        if (it != qubitmap_.end())
-        {
-            logical_qubit_id num = static_cast<unsigned>(it - qubitmap_.begin());
-            qubitmap_[num] = num_qubits_++;
-            return num;
-        }
-        else
+        // Reuse logical qubit ids, if any are available.
+        std::vector<logical_qubit_id> ids;
+        ids.reserve(n);
+        std::size_t free = 0;
+        for (unsigned i = 0; i < n; ++i)
         {
-            qubitmap_.push_back(num_qubits_++);
-            return static_cast<unsigned>(qubitmap_.size() - 1);
+            while (free < qubitmap_.size() && qubitmap_[free] != invalid_qubit_position())
+                ++free;
+            if (free == qubitmap_.size()) qubitmap_.push_back(invalid_qubit_position());
+            qubitmap_[free] = num_qubits_++;
+            ids.push_back(static_cast<logical_qubit_id>(free));
         }
+        return ids;
     }
 
     /// Allocate a qubit with explicitly provided logical qubit id. The caller is responsible for ensuring the id
     /// doesn't collide with other allocated qubits.
     void allocate_qubit(logical_qubit_id id)
+    {
+        allocate_qubits(std::vector<logical_qubit_id>{id});
+    }
+
+    /// Allocate qubits with explicitly provided logical qubit ids, enlarging the state once for all of them.
+    void allocate_qubits(std::vector<logical_qubit_id> const& ids)
     {
 #ifndef NDEBUG
         assert(usage_ != QubitAllocationPattern::implicitLogicalId);
@@ -510,17 +898,20 @@ class Wavefunction
 #endif
 
         flush();
-        wfn_.resize(2 * wfn_.size());
+        grow(static_cast<unsigned>(ids.size()));
 
-        if (id < qubitmap_.size())
+        for (logical_qubit_id id : ids)
         {
-            assert(qubitmap_[id] == invalid_qubit_position());
-            qubitmap_[id] = num_qubits_++;
-        }
-        else
-        {
-            assert(id == qubitmap_.size()); // we want qubitmap_ to be as small as possible
-            qubitmap_.push_back(num_qubits_++);
+            if (id < qubitmap_.size())
+            {
+                assert(qubitmap_[id] == invalid_qubit_position());
+                qubitmap_[id] = num_qubits_++;
+            }
+            else
+            {
+                assert(id == qubitmap_.size()); // we want qubitmap_ to be as small as possible
+                qubitmap_.push_back(num_qubits_++);
+            }
         }
         assert((wfn_.size() >> num_qubits_) == 1);
     }
@@ -529,15 +920,60 @@ class Wavefunction
     /// \pre the qubit has to be in a classical state in the computational basis
     void release(logical_qubit_id q)
     {
-        positional_qubit_id p = get_qubit_position(q);
+        // the flush can move the qubit
         flush();
+        positional_qubit_id p = get_qubit_position(q);
         kernels::collapse(wfn_, p, getvalue(q), true);
         for (int i = 0; i < qubitmap_.size(); ++i)
             if (qubitmap_[i] > p && qubitmap_[i] != invalid_qubit_position()) qubitmap_[i]--;
         qubitmap_[q] = invalid_qubit_position();
+        const positional_qubit_id h = home_[p];
+        home_.erase(home_.begin() + p);
+        for (positional_qubit_id& x : home_)
+            x -= x > h ? 1 : 0;
         --num_qubits_;
     }
 
+    /// release the specified qubits, shrinking the state once for all of them
+    /// \pre the qubits have to be in a classical state in the computational basis
+    void release(std::vector<logical_qubit_id> const& qs)
+    {
+        if (qs.empty()) return;
+        flush();
+
+        std::vector<std::pair<positional_qubit_id, bool>> released;
+        for (logical_qubit_id q : qs)
+            released.emplace_back(get_qubit_position(q), getvalue(q));
+        std::sort(released.begin(), released.end());
+
+        std::vector<positional_qubit_id> positions;
+        std::size_t values = 0;
+        for (auto const& r : released)
+        {
+            values |= static_cast<std::size_t>(r.second) << positions.size();
+            positions.push_back(r.first);
+        }
+        kernels::remove_qubits(wfn_, positions, values);
+
+        for (logical_qubit_id q : qs)
+            qubitmap_[q] = invalid_qubit_position();
+        for (positional_qubit_id& p : qubitmap_)
+        {
+            if (p != invalid_qubit_position())
+                p -= static_cast<unsigned>(std::lower_bound(positions.begin(), positions.end(), p) - positions.begin());
+        }
+        std::vector<positional_qubit_id> homes;
+        for (auto p = positions.rbegin(); p != positions.rend(); ++p)
+        {
+            homes.push_back(home_[*p]);
+            home_.erase(home_.begin() + *p);
+        }
+        std::sort(homes.begin(), homes.end());
+        for (positional_qubit_id& h : home_)
+            h -= static_cast<unsigned>(std::lower_bound(homes.begin(), homes.end(), h) - homes.begin());
+        num_qubits_ -= static_cast<unsigned>(qs.size());
+    }
+
     /// the number of used qubits
     unsigned num_qubits() const
     {
@@ -565,6 +1001,22 @@ class Wavefunction
         return kernels::jointprobability(wfn_, bs, get_qubit_positions(qs));
     }
 
+    /// expectation value of the weighted sum of Pauli strings, `bs[k]` acting on qubits `qs[k]`
+    /// \pre the terms must not contain PauliI
+    double expectation_pauli_sum(
+        std::vector<std::vector<Gates::Basis>> const& bs,
+        std::vector<double> const& coefficients,
+        std::vector<std::vector<logical_qubit_id>> const& qs) const
+    {
+        assert(bs.size() == qs.size() && bs.size() == coefficients.size());
+        flush();
+        std::vector<kernels::PauliMask> terms;
+        terms.reserve(bs.size());
+        for (std::size_t k = 0; k < bs.size(); ++k)
+            terms.push_back(kernels::make_pauli_mask(bs[k], get_qubit_positions(qs[k])));
+        return kernels::expectation_pauli_sum(wfn_, terms, coefficients);
+    }
+
     /// \pre: Each qubit, listed in `q`, must be unentangled and in state |0>. If the prerequisite isn't satisfied,
     /// the method returns `false` and leaves the state of the system unchanged.
     /// Place qubits, listed in `q` into superposition of basis vectors with provided `amplitudes`, where the order of
@@ -580,7 +1032,7 @@ class Wavefunction
         {
             // Check prerequisites. In the case of total state injection the wave function must consist of a single
             // term |0...0> (so we can avoid checking each qubit individually).
-            double eps = 100. * std::numeric_limits<double>::epsilon();
+            double eps = 100. * std::numeric_limits<typename T::value_type>::epsilon();
             if (std::norm(wfn_[0]) < 1.0 - eps)
             {
                 return false;
@@ -592,6 +1044,7 @@ class Wavefunction
             {
                 qubitmap_[qubits[i]] = i;
             }
+            reset_layout();
             wfn_.assign(amplitudes.begin(), amplitudes.end());
         }
         else
@@ -613,7 +1066,7 @@ class Wavefunction
             // the state might not be injected on adjacently positioned qubits, but get/set_register takes care of that.
             const int64_t num_states = static_cast<int64_t>(wfn_.size());
             const size_t mask = kernels::make_mask(positions);
-            WavefunctionStorage wfn_new(num_states);
+            storage_type wfn_new(num_states);
 
             // For systems with more qubits (>16) the pragma yields x2-x4 performance boost in the micro benchmarks run
             // on a machine with 16 cores. For systems with fewer qubits (<10) the pragma might regress perf somewhat
@@ -625,7 +1078,7 @@ class Wavefunction
             {
                 const size_t injected_index = detail::get_register(positions, basis_index);
                 const size_t original_term = detail::set_register(positions, mask, 0, basis_index);
-                wfn_new[basis_index] = wfn_[original_term] * amplitudes[injected_index];
+                wfn_new[basis_index] = static_cast<ComplexType>(wfn_[original_term]) * amplitudes[injected_index];
             }
             std::swap(wfn_, wfn_new);
         }
@@ -637,11 +1090,34 @@ class Wavefunction
     bool measure(logical_qubit_id q)
     {
         flush();
-        std::uniform_real_distribution<double> uniform(0., 1.);
-        bool result = (uniform(rng_) < probability(q));
-        kernels::collapse(wfn_, get_qubit_position(q), result);
-        kernels::normalize(wfn_);
-        return result;
+        return measure_register({get_qubit_position(q)}) != 0;
+    }
+
+    /// Measure each of the qubits `qs` in the computational basis. Up to kernels::max_marginal_qubits of them at a
+    /// time are measured jointly, in two passes over the state: one for the probabilities of their basis states, the
+    /// other for the collapse and normalization. The results are distributed as if they were measured one by one.
+    std::vector<bool> multimeasure(std::vector<logical_qubit_id> const& qs)
+    {
+        flush();
+        std::vector<bool> results(qs.size());
+        for (std::size_t first = 0; first < qs.size(); first += kernels::max_marginal_qubits)
+        {
+            const std::size_t last = std::min(qs.size(), first + kernels::max_marginal_qubits);
+            std::vector<positional_qubit_id> ps;
+            for (std::size_t i = first; i < last; ++i)
+                ps.push_back(get_qubit_position(qs[i]));
+            std::vector<positional_qubit_id> sorted = ps;
+            std::sort(sorted.begin(), sorted.end());
+            assert(std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end());
+
+            const std::size_t outcome = measure_register(sorted);
+            for (std::size_t i = first; i < last; ++i)
+            {
+                const std::size_t r = std::lower_bound(sorted.begin(), sorted.end(), ps[i - first]) - sorted.begin();
+                results[i] = ((outcome >> r) & 1) != 0;
+            }
+        }
+        return results;
     }
 
     bool jointmeasure(std::vector<logical_qubit_id> const& qs)
@@ -655,14 +1131,46 @@ class Wavefunction
         return result;
     }
 
+    /// Sample the joint measurement outcomes of qubits `qs` `nshots` times, without collapsing the state. Bit i of
+    /// each result is the outcome of qubit qs[i]. The samples are drawn with this wave function's random engine, so
+    /// they are reproducible under `seed`.
+    std::vector<std::size_t> sample(std::vector<logical_qubit_id> const& qs, std::size_t nshots)
+    {
+        assert(qs.size() <= 8 * sizeof(std::size_t));
+        flush();
+
+        std::uniform_real_distribution<double> uniform(0., 1.);
+        std::vector<double> uniforms(nshots);
+        for (double& u : uniforms)
+            u = uniform(rng_);
+
+        std::vector<std::size_t> samples = kernels::sample(wfn_, uniforms);
+
+        std::vector<positional_qubit_id> positions = get_qubit_positions(qs);
+        for (std::size_t& s : samples)
+            s = detail::get_register(positions, s);
+        return samples;
+    }
+
     void apply_controlled_exp(
         std::vector<Gates::Basis> const& bs,
         double phi,
         std::vector<logical_qubit_id> const& cs,
         std::vector<logical_qubit_id> const& qs)
     {
-        flush();
-        kernels::apply_controlled_exp(wfn_, bs, phi, get_qubit_positions(cs), get_qubit_positions(qs));
+        // the rotation is queued behind the pending rotations if it flips the same qubits under the same controls,
+        // which is the common case for the terms of a Trotter step
+        if (!pending_gates_.empty()) flush();
+        const kernels::PauliRotation r{kernels::make_pauli_mask(bs, get_qubit_positions(qs)), phi};
+        const std::size_t cmask = kernels::make_mask(get_qubit_positions(cs));
+        if (!pending_rotations_.empty() &&
+            (pending_rotations_.front().mask.xy_bits != r.mask.xy_bits || rotation_cmask_ != cmask ||
+             pending_rotations_.size() >= MAX_PENDING_ROTATIONS))
+        {
+            flush_rotations();
+        }
+        pending_rotations_.push_back(r);
+        rotation_cmask_ = cmask;
     }
 
     /// checks if the qubit is in classical state
@@ -685,19 +1193,186 @@ class Wavefunction
         return res == 1;
     }
 
-    /// the stored wave function as a vector
-    WavefunctionStorage const& data() const
+    /// Enlarge the state by `k` qubits in state |0> at the highest positions. The current amplitudes keep their indices
+    /// and everything above them is zero, so the new storage is filled in a single parallel pass.
+    void grow(unsigned k)
+    {
+        if (k == 0) return;
+
+        const std::intptr_t size = static_cast<std::intptr_t>(wfn_.size());
+        storage_type grown(wfn_.size() << k);
+#pragma omp parallel for schedule(static)
+        for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(grown.size()); ++i)
+            grown[i] = i < size ? wfn_[i] : T(0.);
+        std::swap(wfn_, grown);
+        for (unsigned i = 0; i < k; ++i)
+            home_.push_back(num_qubits_ + i);
+    }
+
+    /// the stored wave function as a vector, with the qubits at the positions the callers put them
+    storage_type const& data() const
     {
         flush();
+        restore_layout();
         return wfn_;
     }
 
+    /// Call f(index, amplitude) for every basis state, in ascending order, until it returns false.
+    template <class F>
+    void for_each_amplitude(F&& f) const
+    {
+        flush();
+        restore_layout();
+        for (std::size_t i = 0; i < wfn_.size(); ++i)
+            if (!f(i, wfn_[i])) return;
+    }
+
+    /// Positional ids of the qubits, indexed by their logical ids (unallocated ids map to invalid_qubit_position()).
+    std::vector<positional_qubit_id> const& qubit_map() const
+    {
+        return qubitmap_;
+    }
+
+    /// Replace the state by `wfn` with qubit positions `qubitmap`, e.g. when the state is moved in from another
+    /// representation. Pending gates are dropped; the random engine keeps its state.
+    void set_state(std::vector<positional_qubit_id> qubitmap, storage_type&& wfn)
+    {
+        pending_gates_.clear();
+        pending_rotations_.clear();
+        fused_.reset();
+        num_qubits_ = 0;
+        while ((std::size_t(1) << num_qubits_) < wfn.size())
+            ++num_qubits_;
+        assert((std::size_t(1) << num_qubits_) == wfn.size());
+        wfn_ = std::move(wfn);
+        qubitmap_ = std::move(qubitmap);
+        reset_layout();
+    }
+
     /// seed the random number engine for measurements
     void seed(unsigned s)
     {
         rng_.seed(s);
     }
 
+    /// Number of threads the kernels run best with for the current size of the state, or 0 if it isn't known.
+    int preferred_threads() const
+    {
+        return fused_.threads();
+    }
+
+    /// Write a checkpoint of the wave function to `path`: the amplitudes, the qubit map, the gates that haven't been
+    /// flushed yet and the state of the random number generator (see checkpoint.hpp for the layout).
+    void save(std::string const& path) const
+    {
+        // the checkpoint has the qubits where the callers put them
+        restore_layout();
+        checkpoint::Writer meta;
+        meta.put<std::uint32_t>(sizeof(T));
+        meta.put<std::uint32_t>(num_qubits_);
+        meta.put<std::uint64_t>(qubitmap_.size());
+        for (positional_qubit_id p : qubitmap_)
+            meta.put(p);
+
+        meta.put<std::uint64_t>(pending_gates_.size());
+        for (const DeferredGate& gate : pending_gates_)
+        {
+            meta.put(gate.get_target());
+            meta.put<std::uint64_t>(gate.get_controls().size());
+            for (logical_qubit_id c : gate.get_controls())
+                meta.put(c);
+            for (unsigned i = 0; i < 2; ++i)
+                for (unsigned j = 0; j < 2; ++j)
+                    meta.put(gate.get_mat()(i, j));
+        }
+
+        std::ostringstream rng;
+        rng << rng_;
+        meta.put(rng.str());
+
+        checkpoint::save(path, meta.bytes(), wfn_.data(), wfn_.size() * sizeof(T));
+    }
+
+    /// Replace the wave function with the checkpoint at `path`, which must have been saved with the same precision.
+    void load(std::string const& path)
+    {
+        checkpoint::File file(path);
+        checkpoint::Reader meta(file.metadata());
+        if (meta.get<std::uint32_t>() != sizeof(T))
+            throw std::runtime_error("the checkpoint was saved by a simulator with a different precision");
+        const unsigned num_qubits = meta.get<std::uint32_t>();
+        if (num_qubits >= std::numeric_limits<std::size_t>::digits || file.data_size() % sizeof(T) != 0 ||
+            file.data_size() / sizeof(T) != (std::size_t(1) << num_qubits))
+            throw std::runtime_error("the checkpoint is corrupt");
+        // a count can't exceed the metadata it is read from, checked before anything is allocated for it
+        auto count = [&]() {
+            const std::uint64_t n = meta.get<std::uint64_t>();
+            if (n > file.metadata().size()) throw std::runtime_error("the checkpoint is corrupt");
+            return static_cast<std::size_t>(n);
+        };
+
+        // every allocated qubit has its own position in the state, and all positions are taken
+        std::vector<positional_qubit_id> qubitmap(count());
+        std::vector<bool> taken(num_qubits, false);
+        std::size_t allocated = 0;
+        for (positional_qubit_id& p : qubitmap)
+        {
+            p = meta.get<positional_qubit_id>();
+            if (p == invalid_qubit_position()) continue;
+            if (p >= num_qubits || taken[p]) throw std::runtime_error("the checkpoint has an invalid qubit map");
+            taken[p] = true;
+            ++allocated;
+        }
+        if (allocated != num_qubits) throw std::runtime_error("the checkpoint has an invalid qubit map");
+        auto allocated_id = [&](logical_qubit_id q) {
+            return q < qubitmap.size() && qubitmap[q] != invalid_qubit_position();
+        };
+
+        std::vector<DeferredGate> pending;
+        for (std::size_t g = count(); g > 0; --g)
+        {
+            const logical_qubit_id target = meta.get<logical_qubit_id>();
+            std::vector<logical_qubit_id> controls(count());
+            for (logical_qubit_id& c : controls)
+                c = meta.get<logical_qubit_id>();
+            if (!allocated_id(target)) throw std::runtime_error("the checkpoint has a gate on an unallocated qubit");
+            std::vector<bool> used(qubitmap.size(), false);
+            used[target] = true;
+            for (logical_qubit_id c : controls)
+            {
+                if (!allocated_id(c) || used[c])
+                    throw std::runtime_error("the checkpoint has a gate with invalid controls");
+                used[c] = true;
+            }
+            TinyMatrix<ComplexType, 2> mat;
+            for (unsigned i = 0; i < 2; ++i)
+                for (unsigned j = 0; j < 2; ++j)
+                    mat(i, j) = meta.get<ComplexType>();
+            pending.emplace_back(controls, target, mat);
+        }
+
+        RngEngine rng;
+        std::istringstream(meta.get_string()) >> rng;
+
+        storage_type wfn(std::size_t(1) << num_qubits);
+        file.read_data(wfn.data());
+
+        // nothing is changed unless the whole checkpoint could be read
+        fused_.reset();
+        std::swap(wfn_, wfn);
+        qubitmap_.swap(qubitmap);
+        pending_gates_.swap(pending);
+        pending_rotations_.clear();
+        num_qubits_ = num_qubits;
+        reset_layout();
+        rng_ = rng;
+#ifndef NDEBUG
+        usage_ = QubitAllocationPattern::any;
+#endif
+        // pick the fusion settings for the size of the loaded state, the pending gates are flushed with them
+        fused_.shouldFlush(wfn_, {}, 0);
+    }
+
     /// generic application of a gate
     template <class Gate>
     void apply(Gate const& g)
@@ -739,11 +1414,24 @@ class Wavefunction
         apply_controlled(std::vector<logical_qubit_id>{c1, c2}, g);
     }
 
-    template <class A>
-    bool subsytemwavefunction(std::vector<logical_qubit_id> const& qs, std::vector<T, A>& qubitswfn, double tolerance)
+    template <class U, class A>
+    bool subsytemwavefunction(std::vector<logical_qubit_id> const& qs, std::vector<U, A>& qubitswfn, double tolerance)
     {
         flush(); // we have to flush before we can extract the state
-        return kernels::subsytemwavefunction(wfn_, get_qubit_positions(qs), qubitswfn, tolerance);
+
+        // the comparison can't be tighter than the rounding of the stored amplitudes
+        tolerance = std::max(tolerance, 100. * std::numeric_limits<typename T::value_type>::epsilon());
+        if constexpr (std::is_same<U, T>::value)
+        {
+            return kernels::subsytemwavefunction(wfn_, get_qubit_positions(qs), qubitswfn, tolerance);
+        }
+        else
+        {
+            storage_type extracted(qubitswfn.size(), T(0.));
+            bool const separable = kernels::subsytemwavefunction(wfn_, get_qubit_positions(qs), extracted, tolerance);
+            std::copy(extracted.begin(), extracted.end(), qubitswfn.begin());
+            return separable;
+        }
     }
 
     /// Apply the unitary operator that permutes the standard computational basis of the subsystem, defined by the
@@ -764,63 +1452,110 @@ class Wavefunction
         bool adjoint = false)
     {
         if (qs.empty()) return;
-
-#ifndef NDEBUG
-        assert(table_size == (1ull << qs.size()));
-        // permutation_table should describe a permutation of {0, 1, 2, ..., table_size - 1}
-        std::set<size_t> permutations(permutation_table, permutation_table + table_size);
-        assert(permutations.size() == table_size);         // no duplicates
-        assert(*permutations.begin() == 0);                // min element in ordered set
-        assert(*(--permutations.end()) == table_size - 1); // max element in ordered set
-#endif
-
+        // the amplitudes are moved along the cycles of the table, which only end if it is a permutation
+        detail::check_permutation_table(qs.size(), table_size, permutation_table);
         flush();
 
-        std::vector<positional_qubit_id> positions = get_qubit_positions(qs);
-
-        const size_t num_states = wfn_.size();
-        WavefunctionStorage psi_new(num_states);
-        const size_t qmask = kernels::make_mask(positions);
-
-        auto permute = [&positions, qmask, table_size, permutation_table](size_t basis_vector) {
-            size_t qstate = detail::get_register(positions, basis_vector);
-            return detail::set_register(positions, qmask, permutation_table[qstate], basis_vector);
-        };
+        // The kernel permutes the qubits in ascending positions, so the bits of the table indices are reordered from
+        // the order of qs. It moves the amplitudes in place, cycle by cycle, for all values of the other qubits.
+        std::vector<positional_qubit_id> sorted;
+        std::vector<unsigned> rank = register_ranks(qs, sorted);
+        auto reorder = [&rank](size_t t) { return detail::move_bits(rank, t, true); };
 
-#ifndef NDEBUG
-        std::set<size_t> permuted;
-#endif
-        if (!adjoint)
+        // the adjoint moves the amplitude of permute(i) to i, that is, it applies the inverse table
+        std::vector<size_t> table(table_size);
+#pragma omp parallel for schedule(static)
+        for (std::intptr_t t = 0; t < static_cast<std::intptr_t>(table_size); ++t)
         {
-            for (size_t i = 0; i < num_states; ++i)
-            {
-                const size_t target = permute(i);
-                assert(permuted.insert(target).second); // should see no duplicates
-                psi_new[target] = wfn_[i];
-            }
+            const size_t from = reorder(t);
+            const size_t to = reorder(permutation_table[t]);
+            if (adjoint)
+                table[to] = from;
+            else
+                table[from] = to;
         }
-        else
+        kernels::apply_permutation(wfn_, sorted, table);
+    }
+
+    /// Quantum Fourier transform of the register qs (little-endian: qs[0] is the least significant bit), see
+    /// kernels::qft. The kernel leaves the register bit-reversed, which is undone by swapping the positions of the
+    /// qubits rather than the amplitudes. The amplitudes are only swapped when the state is handed out, see
+    /// restore_layout.
+    void qft(std::vector<logical_qubit_id> const& qs, bool adjoint = false)
+    {
+        if (qs.empty()) return;
+        flush();
+        kernels::qft(wfn_, get_qubit_positions(qs), adjoint);
+        for (std::size_t k = 0; k < qs.size() / 2; ++k)
         {
-            for (size_t i = 0; i < num_states; ++i)
-            {
-                const size_t source = permute(i);
-                assert(permuted.insert(source).second); // should see no duplicates
-                psi_new[i] = wfn_[source];
-            }
+            positional_qubit_id& low = qubitmap_[qs[k]];
+            positional_qubit_id& high = qubitmap_[qs[qs.size() - 1 - k]];
+            std::swap(home_[low], home_[high]);
+            std::swap(low, high);
         }
+    }
 
-        // check that this was, indeed, a permutation of the basis
-        assert(permuted.size() == num_states);         // would follow if no duplicates encountered above
-        assert(*permuted.begin() == 0);                // min element in ordered set
-        assert(*(--permuted.end()) == num_states - 1); // max element in ordered set
+    /// Reflect the register qs about its uniform superposition (the Grover diffusion operator), see
+    /// kernels::reflect_about_uniform.
+    void reflect_about_uniform(std::vector<logical_qubit_id> const& qs)
+    {
+        flush();
+        kernels::reflect_about_uniform(wfn_, get_qubit_positions(qs));
+    }
 
-        std::swap(wfn_, psi_new);
+    /// Reflect the register qs about the normalized state with the given amplitudes, where bit k of the index of an
+    /// amplitude is the value of qs[k] (as for inject_state), see kernels::reflect_about_state.
+    void reflect_about_state(std::vector<logical_qubit_id> const& qs, std::vector<ComplexType> const& amplitudes)
+    {
+        assert((static_cast<std::size_t>(1) << qs.size()) == amplitudes.size());
+        flush();
+        kernels::reflect_about_state(
+            wfn_, get_qubit_positions(qs), [&amplitudes](std::size_t x) { return amplitudes[x]; });
+    }
+
+    /// Same as permute_basis, but the image of each value of the register qs is computed by `f` instead of read from a
+    /// table. `f` is called from several threads at once. Throws if `f` isn't a permutation, which is only found out
+    /// while the cycles are applied, so the cycles found before are already permuted.
+    template <class F>
+    void permute_basis_with(std::vector<logical_qubit_id> const& qs, F const& f, bool adjoint = false)
+    {
+        if (qs.empty()) return;
+        flush();
+
+        std::vector<positional_qubit_id> sorted;
+        std::vector<unsigned> rank = register_ranks(qs, sorted);
+        // images out of range are passed on as they are, for the kernel to reject
+        const size_t size = size_t(1) << qs.size();
+        auto image = [&rank, &f, size](size_t t) {
+            const size_t u = f(detail::move_bits(rank, t, false));
+            return u < size ? detail::move_bits(rank, u, true) : u;
+        };
+        if (!kernels::apply_permutation(wfn_, sorted, image, adjoint))
+            throw std::runtime_error("the function isn't a permutation of the basis states");
     }
 
     RngEngine& rng()
     {
         return rng_;
     }
+
+  private:
+    /// Rank of the position of each qubit of qs among the positions of qs, which are returned in `sorted`.
+    std::vector<unsigned> register_ranks(
+        std::vector<logical_qubit_id> const& qs,
+        std::vector<positional_qubit_id>& sorted) const
+    {
+        std::vector<positional_qubit_id> positions = get_qubit_positions(qs);
+        sorted = positions;
+        std::sort(sorted.begin(), sorted.end());
+        std::vector<unsigned> rank(qs.size());
+        for (size_t k = 0; k < qs.size(); ++k)
+        {
+            auto const at = std::lower_bound(sorted.begin(), sorted.end(), positions[k]);
+            rank[k] = static_cast<unsigned>(at - sorted.begin());
+        }
+        return rank;
+    }
 };
 
 /// print information about the wave function
@@ -112,6 +112,43 @@ class AlignedAlloc
     }
 };
 
+/// An aligned allocator that leaves value-initialized elements uninitialized, so that buffers which are completely
+/// written right after being sized (for example, by a parallel loop) aren't first zeroed on a single thread.
+
+template <typename T, unsigned Align = 64>
+class UninitializedAlignedAlloc : public AlignedAlloc<T, Align>
+{
+  public:
+    template <typename U>
+    struct rebind
+    {
+        using other = UninitializedAlignedAlloc<U, Align>;
+    };
+
+    UninitializedAlignedAlloc() noexcept {}
+
+    UninitializedAlignedAlloc(UninitializedAlignedAlloc const&) noexcept
+        : AlignedAlloc<T, Align>()
+    {
+    }
+
+    template <typename U>
+    UninitializedAlignedAlloc(UninitializedAlignedAlloc<U, Align> const&) noexcept
+    {
+    }
+
+    template <typename C>
+    void construct(C*) noexcept
+    {
+    }
+
+    template <typename C, class Arg, class... Args>
+    void construct(C* c, Arg&& arg, Args&&... args)
+    {
+        new ((void*)c) C(std::forward<Arg>(arg), std::forward<Args>(args)...);
+    }
+};
+
 } // namespace SIMULATOR
 } // namespace Quantum
 } // namespace Microsoft
\ No newline at end of file
@@ -46,11 +46,30 @@ void bititerator_test_with_chuncks(const std::vector<unsigned>& bits_to_iterate)
     }
 }
 
+// the subspace with fixed bits is the one the naive map spreads over the remaining bits
+void subspace_index_test(const std::vector<unsigned>& fixed_bits, std::uint64_t values)
+{
+    using namespace Microsoft::Quantum;
+    std::uint64_t fixed = 0;
+    for (unsigned i : fixed_bits)
+        fixed |= std::uint64_t(1) << i;
+
+    subspace_index index(fixed, values);
+    std::vector<unsigned> free_bits = complement(fixed_bits, 64);
+    for (std::uint64_t v = 0; v < 1000; ++v)
+    {
+        std::uint64_t res = sparse_map(free_bits, v, values & fixed);
+        assert(res == index(v));
+    }
+}
+
 int main()
 {
     bititerator_test_with_chuncks(std::vector<unsigned>{0, 1, 2, 3});
     bititerator_test(std::vector<unsigned>{0, 3, 4, 8});
     bititerator_test(std::vector<unsigned>{0, 1, 4, 7, 25, 63});
+    subspace_index_test(std::vector<unsigned>{0, 3, 4, 8}, ~std::uint64_t(0));
+    subspace_index_test(std::vector<unsigned>{1, 2, 30, 63}, 0x40000006);
 
     return 0;
 }
@@ -0,0 +1,34 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdlib>
+#include <string>
+
+namespace Microsoft
+{
+namespace Quantum
+{
+namespace SIMULATOR
+{
+/// The value of the environment variable `name`, or an empty string if it isn't set. MSVC deprecates getenv, there the
+/// value is read with _dupenv_s instead, which hands out a copy for the caller to free.
+inline std::string env_value(const char* name)
+{
+#ifdef _MSC_VER
+    char* value = nullptr;
+    std::size_t len = 0;
+    if (_dupenv_s(&value, &len, name) != 0 || value == nullptr) return std::string();
+    std::string copy(value);
+    std::free(value);
+    return copy;
+#else
+    const char* value = std::getenv(name);
+    return value != nullptr ? std::string(value) : std::string();
+#endif
+}
+} // namespace SIMULATOR
+} // namespace Quantum
+} // namespace Microsoft
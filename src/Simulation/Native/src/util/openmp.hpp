@@ -97,6 +97,37 @@ using mutex_type = std::mutex;
 using recursive_mutex_type = std::recursive_mutex;
 #endif
 
+/// Sets the number of threads of the parallel regions started by the calling thread for as long as it lives, and
+/// restores the previous setting afterwards. Zero threads leave the setting alone.
+class num_threads_guard
+{
+  public:
+    explicit num_threads_guard(int threads)
+        : previous_(0)
+    {
+#ifdef _OPENMP
+        if (threads > 0)
+        {
+            previous_ = omp_get_max_threads();
+            omp_set_num_threads(threads);
+        }
+#endif
+    }
+
+    ~num_threads_guard()
+    {
+#ifdef _OPENMP
+        if (previous_ > 0) omp_set_num_threads(previous_);
+#endif
+    }
+
+    num_threads_guard(num_threads_guard const&) = delete;
+    num_threads_guard& operator=(num_threads_guard const&) = delete;
+
+  private:
+    int previous_;
+};
+
 } // namespace openmp
 using openmp::mutex_type;
 using openmp::recursive_mutex_type;
@@ -17,6 +17,23 @@ int main()
 #ifdef _OPENMP
     omp_mutex mutex;
     std::lock_guard<omp_mutex> guard(mutex);
+
+    // the guard only changes the number of threads while it lives
+    omp_set_num_threads(4);
+    {
+        num_threads_guard three(3);
+        assert(omp_get_max_threads() == 3);
+        int team = 0;
+#pragma omp parallel
+        {
+#pragma omp single
+            team = omp_get_num_threads();
+        }
+        assert(team <= 3);
+        num_threads_guard unchanged(0);
+        assert(omp_get_max_threads() == 3);
+    }
+    assert(omp_get_max_threads() == 4);
 #endif
 
     return 0;
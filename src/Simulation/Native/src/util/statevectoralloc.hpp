@@ -0,0 +1,220 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <string>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "util/alignedalloc.hpp"
+#include "util/environment.hpp"
+
+namespace Microsoft
+{
+namespace Quantum
+{
+namespace SIMULATOR
+{
+
+namespace detail
+{
+/// Allocations of at least this many bytes are state vectors worth backing by huge pages and spreading over threads.
+constexpr std::size_t large_allocation = std::size_t(1) << 21;
+/// Granularity of the parallel first touch, one write per (small) page is enough to fault it in.
+constexpr std::size_t touch_stride = std::size_t(1) << 12;
+
+#if defined(__linux__)
+/// Interleave the pages of [ptr, ptr+size) over all online NUMA nodes. Any failure (no NUMA support, a single node,
+/// restricted cpusets) leaves the default first-touch policy in place.
+inline void interleave_pages(void* ptr, std::size_t size)
+{
+#ifdef SYS_mbind
+    std::ifstream online("/sys/devices/system/node/online");
+    std::string ranges;
+    if (!(online >> ranges)) return;
+
+    unsigned long mask = 0;
+    for (std::size_t pos = 0; pos < ranges.size();)
+    {
+        char* end = nullptr;
+        unsigned long first = std::strtoul(ranges.c_str() + pos, &end, 10);
+        unsigned long last = first;
+        if (*end == '-') last = std::strtoul(end + 1, &end, 10);
+        for (unsigned long node = first; node <= last && node < 8 * sizeof(mask); ++node)
+            mask |= 1ul << node;
+        pos = static_cast<std::size_t>(end - ranges.c_str());
+        if (pos < ranges.size() && ranges[pos] == ',') ++pos;
+        else break;
+    }
+    if ((mask & (mask - 1)) == 0) return;
+
+    constexpr int mpol_interleave = 3; // MPOL_INTERLEAVE from <linux/mempolicy.h>
+    syscall(SYS_mbind, ptr, size, mpol_interleave, &mask, 8 * sizeof(mask) + 1, 0u);
+#endif
+}
+
+/// Interleaving is opt-in: it trades the locality of first-touch placement for the aggregate bandwidth of all nodes.
+inline bool interleave_requested()
+{
+    static const bool requested = [] {
+        const std::string env = env_value("QDK_SIM_NUMA_INTERLEAVE");
+        return !env.empty() && std::atoi(env.c_str()) != 0;
+    }();
+    return requested;
+}
+
+/// Directory for state vectors that are too large to be kept in memory (QDK_SIM_STATE_DIR), or empty if there is none.
+/// It should be on a fast local drive: the blocked flush in Wavefunction streams the state through memory in chunks.
+inline std::string state_file_dir(std::size_t size)
+{
+    std::string dir = env_value("QDK_SIM_STATE_DIR");
+    if (dir.empty()) return dir;
+
+    // By default only the states that would take more than a quarter of the physical memory go to a file (growing a
+    // state needs the old and the new buffer at the same time), QDK_SIM_STATE_FILE_MIN sets the threshold in bytes.
+    std::size_t threshold = static_cast<std::size_t>(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGE_SIZE) / 4;
+    if (const std::string min = env_value("QDK_SIM_STATE_FILE_MIN"); !min.empty())
+        threshold = std::strtoull(min.c_str(), nullptr, 10);
+    return size >= threshold ? dir : std::string();
+}
+
+/// Map an anonymous temporary file of `size` bytes in `dir`, the file is gone as soon as the mapping is.
+inline void* map_state_file(std::string const& dir, std::size_t size)
+{
+    int fd = -1;
+#ifdef O_TMPFILE
+    fd = open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR);
+#endif
+    if (fd < 0)
+    {
+        std::string name = dir + "/qdk-sim-state-XXXXXX";
+        fd = mkstemp(&name[0]);
+        if (fd < 0) throw std::bad_alloc();
+        unlink(name.c_str());
+    }
+
+    void* p = MAP_FAILED;
+    if (ftruncate(fd, static_cast<off_t>(size)) == 0)
+        p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) throw std::bad_alloc();
+    return p;
+}
+#endif
+} // namespace detail
+
+///
+/// Allocator for state vectors. Small buffers are served by UninitializedAlignedAlloc. Large ones are mapped directly
+/// (on Linux), backed by transparent huge pages when available and optionally interleaved across NUMA nodes
+/// (QDK_SIM_NUMA_INTERLEAVE=1). Their pages are then faulted in by a parallel loop with the same static partitioning
+/// as the kernels, so that each page lands on the node of the thread that will stream it. The largest ones can be
+/// backed by a file instead, to simulate more qubits than fit into memory (QDK_SIM_STATE_DIR).
+///
+template <typename T, unsigned Align = 64>
+class StateVectorAlloc : public UninitializedAlignedAlloc<T, Align>
+{
+  public:
+    using pointer = T*;
+    using size_type = std::size_t;
+
+    template <typename U>
+    struct rebind
+    {
+        using other = StateVectorAlloc<U, Align>;
+    };
+
+    StateVectorAlloc() noexcept {}
+
+    StateVectorAlloc(StateVectorAlloc const&) noexcept
+        : UninitializedAlignedAlloc<T, Align>()
+    {
+    }
+
+    template <typename U>
+    StateVectorAlloc(StateVectorAlloc<U, Align> const&) noexcept
+    {
+    }
+
+    pointer allocate(size_type n)
+    {
+        SafeInt<size_type> checked(n);
+        checked *= sizeof(T);
+        const size_type sz = checked;
+        if (sz < detail::large_allocation) return AlignedAlloc<T, Align>::allocate(n);
+
+        pointer ptr;
+#if defined(__linux__)
+        const size_type mapped = mapped_size(sz);
+        if (const std::string dir = detail::state_file_dir(mapped); !dir.empty())
+        {
+            // the file is written in full by the code that sizes the buffer, there is nothing to fault in
+            return reinterpret_cast<pointer>(detail::map_state_file(dir, mapped));
+        }
+        void* p = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+        madvise(p, mapped, MADV_HUGEPAGE);
+#endif
+        if (detail::interleave_requested()) detail::interleave_pages(p, mapped);
+        ptr = reinterpret_cast<pointer>(p);
+#else
+        ptr = AlignedAlloc<T, Align>::allocate(n);
+#endif
+        first_touch(reinterpret_cast<char*>(ptr), sz);
+        return ptr;
+    }
+
+    void deallocate(pointer ptr, size_type n) noexcept
+    {
+#if defined(__linux__)
+        const size_type sz = n * sizeof(T);
+        if (sz >= detail::large_allocation)
+        {
+            munmap(ptr, mapped_size(sz));
+            return;
+        }
+#endif
+        AlignedAlloc<T, Align>::deallocate(ptr, n);
+    }
+
+    /// Whether a buffer of `n` elements would be backed by a file (see QDK_SIM_STATE_DIR).
+    static bool file_backed(size_type n)
+    {
+#if defined(__linux__)
+        const size_type sz = n * sizeof(T);
+        return sz >= detail::large_allocation && !detail::state_file_dir(mapped_size(sz)).empty();
+#else
+        return false;
+#endif
+    }
+
+  private:
+    static size_type mapped_size(size_type sz)
+    {
+        return (sz + detail::large_allocation - 1) & ~(detail::large_allocation - 1);
+    }
+
+    static void first_touch(char* ptr, size_type sz)
+    {
+        const std::intptr_t pages = static_cast<std::intptr_t>((sz + detail::touch_stride - 1) / detail::touch_stride);
+#pragma omp parallel for schedule(static)
+        for (std::intptr_t i = 0; i < pages; ++i)
+            ptr[i * detail::touch_stride] = 0;
+    }
+};
+
+} // namespace SIMULATOR
+} // namespace Quantum
+} // namespace Microsoft
@@ -0,0 +1,63 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include <cassert>
+#include <cinttypes>
+#include <complex>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "statevectoralloc.hpp"
+
+int main()
+{
+    using namespace Microsoft::Quantum::SIMULATOR;
+    using storage = std::vector<std::complex<double>, StateVectorAlloc<std::complex<double>, 64>>;
+
+    // small and large (mapped) buffers are both aligned and writable
+    for (std::size_t n : {std::size_t(16), std::size_t(1) << 20})
+    {
+        storage v(n);
+        assert(reinterpret_cast<std::uintptr_t>(v.data()) % 64 == 0);
+        for (std::size_t i = 0; i < n; ++i)
+            v[i] = std::complex<double>(double(i), 0.);
+        assert(v[n - 1].real() == double(n - 1));
+
+        // growing across the threshold moves the elements into the new buffer
+        v.resize(4 * n, std::complex<double>(0., 1.));
+        assert(v[n - 1].real() == double(n - 1));
+        assert(v[4 * n - 1].imag() == 1.);
+    }
+
+#if defined(__linux__)
+    // above QDK_SIM_STATE_FILE_MIN bytes the state is kept in an (already deleted) file in QDK_SIM_STATE_DIR
+    setenv("QDK_SIM_STATE_DIR", ".", 1);
+    setenv("QDK_SIM_STATE_FILE_MIN", "4194304", 1);
+    {
+        storage v(std::size_t(1) << 20, std::complex<double>(0., 1.));
+        v[12345] = 2.;
+        assert(v[12345].real() == 2. && v[(std::size_t(1) << 20) - 1].imag() == 1.);
+
+        const std::uintptr_t address = reinterpret_cast<std::uintptr_t>(v.data());
+        std::ifstream maps("/proc/self/maps");
+        bool file_backed = false;
+        for (std::string line; std::getline(maps, line);)
+        {
+            std::uintptr_t first = 0, last = 0;
+            if (std::sscanf(line.c_str(), "%" SCNxPTR "-%" SCNxPTR, &first, &last) == 2 && first <= address &&
+                address < last)
+                file_backed = line.find("(deleted)") != std::string::npos;
+        }
+        assert(file_backed);
+
+        storage small(16);
+        assert(reinterpret_cast<std::uintptr_t>(small.data()) % 64 == 0);
+    }
+    unsetenv("QDK_SIM_STATE_DIR");
+#endif
+
+    return 0;
+}